@@ -0,0 +1,71 @@
+/* mirror - a tool to make mirrors of files or directories and to check consistency of the existing mirrors.
+Copyright (C) 2017-2019 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#ifndef MIRROR_BENCH_BENCHRESULTS_HPP_
+#define MIRROR_BENCH_BENCHRESULTS_HPP_
+
+#include <cstdio>
+#include <cstdlib>
+
+namespace mirror
+{
+	namespace bench
+	{
+		/*
+		 * Appends the measurements of a benchmark to the file MIRROR_BENCH_RESULTS refers to, one JSON
+		 * object per line, so that the results of different builds can be collected and compared by
+		 * scripts. Nothing is written if the variable is not set. Names are written as is, so they must
+		 * not contain characters that need escaping in JSON.
+		 */
+		class BenchResults
+		{
+		public:
+			explicit BenchResults(const char * const benchName) : m_benchName(benchName), m_file(nullptr)
+			{
+				const char * const fileName = std::getenv("MIRROR_BENCH_RESULTS");
+				if (fileName != nullptr && fileName[0] != '\0') {
+					m_file = std::fopen(fileName, "a");
+					if (m_file == nullptr) {
+						std::fprintf(stderr, "Unable to open the results file '%s'.\n", fileName);
+					}
+				}
+			}
+
+			~BenchResults()
+			{
+				if (m_file != nullptr) {
+					std::fclose(m_file);
+				}
+			}
+
+			BenchResults(const BenchResults &) = delete;
+			BenchResults &operator=(const BenchResults &) = delete;
+
+			void add(const char * const caseName, const char * const metric, const double value, const char * const unit)
+			{
+				if (m_file == nullptr) {
+					return;
+				}
+				std::fprintf(m_file, "{\"bench\":\"%s\",\"case\":\"%s\",\"metric\":\"%s\",\"value\":%.6g,\"unit\":\"%s\"}\n",
+						m_benchName, caseName, metric, value, unit);
+			}
+		private:
+			const char * const m_benchName;
+			std::FILE *m_file;
+		};
+	}
+}
+
+#endif // MIRROR_BENCH_BENCHRESULTS_HPP_
@@ -0,0 +1,98 @@
+/* mirror - a tool to make mirrors of files or directories and to check consistency of the existing mirrors.
+Copyright (C) 2017-2019 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+// Measures the throughput of all the CRC64 implementations available on this CPU against the afc one.
+#include "BenchResults.hpp"
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include "mirror/crc64.hpp"
+#include <vector>
+
+namespace
+{
+	void printUsage(const char * const programName)
+	{
+		std::cerr << "Usage: " << programName << " [BUFFER SIZE IN KiB] [TOTAL MiB PER IMPLEMENTATION]" << std::endl;
+	}
+}
+
+int main(const int argc, char * const argv[])
+{
+	using std::operator<<;
+
+	std::size_t bufSizeKiB = 1024;
+	std::size_t totalMiB = 2048;
+	if (argc > 3) {
+		printUsage(argv[0]);
+		return 1;
+	}
+	if (argc > 1) {
+		bufSizeKiB = std::strtoul(argv[1], nullptr, 10);
+	}
+	if (argc > 2) {
+		totalMiB = std::strtoul(argv[2], nullptr, 10);
+	}
+	if (bufSizeKiB == 0 || totalMiB == 0) {
+		printUsage(argv[0]);
+		return 1;
+	}
+
+	mirror::initCRC64();
+
+	std::vector<unsigned char> buf(bufSizeKiB * 1024);
+	std::uint32_t seed = 2019;
+	for (unsigned char &c : buf) {
+		seed = seed * 1103515245 + 12345;
+		c = static_cast<unsigned char>(seed >> 16);
+	}
+	const std::size_t rounds = (totalMiB * 1024 + bufSizeKiB - 1) / bufSizeKiB;
+
+	mirror::CRC64Implementation impls[8];
+	const std::size_t implCount = mirror::crc64Implementations(impls);
+
+	std::cout << "Selected implementation: " << mirror::crc64ImplementationName() << '\n';
+	std::cout << "Buffer: " << bufSizeKiB << " KiB, data per implementation: " << rounds * bufSizeKiB / 1024 <<
+			" MiB\n\n";
+
+	mirror::bench::BenchResults results("crc64");
+	double afcThroughput = 0;
+	std::uint_fast64_t afcDigest = 0;
+	for (std::size_t i = 0; i < implCount; ++i) {
+		const mirror::CRC64Implementation &impl = impls[i];
+
+		std::uint_fast64_t crc = 0;
+		const auto start = std::chrono::steady_clock::now();
+		for (std::size_t r = 0; r < rounds; ++r) {
+			crc = impl.update(crc, buf.data(), buf.size());
+		}
+		const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+		const double throughput = static_cast<double>(rounds) * buf.size() / (1024 * 1024) / elapsed.count();
+		if (i == 0) {
+			afcThroughput = throughput;
+			afcDigest = crc;
+		}
+
+		std::printf("%-12s %10.1f MiB/s %7.2fx  %016llx%s\n", impl.name, throughput, throughput / afcThroughput,
+				static_cast<unsigned long long>(crc), crc == afcDigest ? "" : "  DIGEST MISMATCH");
+		results.add(impl.name, "throughput", throughput, "MiB/s");
+	}
+
+	return 0;
+}
@@ -0,0 +1,186 @@
+/* mirror - a tool to make mirrors of files or directories and to check consistency of the existing mirrors.
+Copyright (C) 2017-2019 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+/*
+ * Measures the rate at which FileDB adds file records, both in a bulk load (the way create-db adds them)
+ * and in a single plain transaction (the way update-db does), and the rate at which the records of
+ * directories are read back into the containers checkFileSystem() uses.
+ */
+#include "BenchResults.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "mirror/encoding.hpp"
+#include "mirror/FileDB.hpp"
+#include <iostream>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+namespace
+{
+	using Clock = std::chrono::steady_clock;
+
+	void printUsage(const char * const programName)
+	{
+		std::cerr << "Usage: " << programName << " DB_FILE [DIRS] [FILES PER DIR]\n\n"
+				"DB_FILE is overwritten." << std::endl;
+	}
+
+	struct Names
+	{
+		std::vector<std::string> dirs;
+		std::vector<std::string> files;
+	};
+
+	double addFiles(const char * const dbFile, const Names &names, const bool bulk)
+	{
+		unlink(dbFile);
+		mirror::FileDB db = mirror::FileDB::open(dbFile, true);
+
+		mirror::FileRecord record;
+		record.type = mirror::FileType::file;
+		std::memset(record.crc64, 0xa5, sizeof(record.crc64));
+		record.lastModifiedTS.setMillis(1500000000000);
+
+		const auto start = Clock::now();
+		try {
+			if (bulk) {
+				db.beginBulkLoad();
+			} else {
+				db.beginTransaction();
+			}
+			for (const std::string &dir : names.dirs) {
+				for (const std::string &file : names.files) {
+					record.fileSize = static_cast<off_t>(file.size());
+					db.addFile(file.data(), file.size(), dir.data(), dir.size(), record);
+				}
+			}
+			if (bulk) {
+				db.endBulkLoad();
+			} else {
+				db.commit();
+			}
+		}
+		catch (...) {
+			db.close();
+			throw;
+		}
+		const std::chrono::duration<double> elapsed = Clock::now() - start;
+		db.close();
+		return elapsed.count();
+	}
+
+	template<typename Container, typename Clear>
+	double readFiles(const char * const dbFile, const Names &names, Clear clear, std::size_t &checksum)
+	{
+		mirror::FileDB db = mirror::FileDB::open(dbFile);
+
+		Container files;
+		const auto start = Clock::now();
+		try {
+			for (const std::string &dir : names.dirs) {
+				clear(files);
+				db.getFiles(dir.data(), dir.size(), files);
+				checksum += files.size();
+			}
+		}
+		catch (...) {
+			db.close();
+			throw;
+		}
+		const std::chrono::duration<double> elapsed = Clock::now() - start;
+		db.close();
+		return elapsed.count();
+	}
+
+	struct SortedFiles : mirror::SortedDirFiles
+	{
+		std::size_t size() const noexcept { return entries.size(); }
+	};
+}
+
+int main(const int argc, char * const argv[])
+try {
+	using std::operator<<;
+
+	std::size_t dirCount = 1000;
+	std::size_t filesPerDir = 200;
+	if (argc < 2 || argc > 4) {
+		printUsage(argv[0]);
+		return 1;
+	}
+	const char * const dbFile = argv[1];
+	if (argc > 2) {
+		dirCount = std::strtoul(argv[2], nullptr, 10);
+	}
+	if (argc > 3) {
+		filesPerDir = std::strtoul(argv[3], nullptr, 10);
+	}
+	if (dirCount == 0 || filesPerDir == 0) {
+		printUsage(argv[0]);
+		return 1;
+	}
+
+	mirror::initConverters();
+
+	Names names;
+	for (std::size_t i = 0; i < dirCount; ++i) {
+		names.dirs.push_back("some/nested/dir/" + std::to_string(i));
+	}
+	for (std::size_t i = 0; i < filesPerDir; ++i) {
+		names.files.push_back("file-name-" + std::to_string(i) + ".dat");
+	}
+	const double rows = static_cast<double>(dirCount) * filesPerDir;
+
+	std::cout << "Directories: " << dirCount << ", files per directory: " << filesPerDir << "\n\n";
+
+	mirror::bench::BenchResults results("filedb");
+	auto report = [&results, rows](const char * const name, const double seconds)
+	{
+		std::printf("%-28s %10.0f rows/s\n", name, rows / seconds);
+		results.add(name, "rate", rows / seconds, "rows/s");
+	};
+
+	report("addFile, transaction", addFiles(dbFile, names, false));
+	// The bulk load DB is the one read from below.
+	report("addFile, bulk load", addFiles(dbFile, names, true));
+
+	std::size_t checksum = 0;
+	report("getFiles, DirFileMap", readFiles<mirror::DirFileMap>(dbFile, names, [](mirror::DirFileMap &files)
+	{
+		files.clear();
+		files.names.clear();
+	}, checksum));
+	report("getFiles, SortedDirFiles", readFiles<SortedFiles>(dbFile, names, [](SortedFiles &files)
+	{
+		files.entries.clear();
+		files.names.clear();
+	}, checksum));
+
+	if (checksum != 2 * dirCount * filesPerDir) {
+		std::cerr << "Unexpected number of records read." << std::endl;
+		return 1;
+	}
+	return 0;
+}
+catch (std::exception &ex) {
+	using std::operator<<;
+
+	std::cerr << ex.what() << std::endl;
+	return 1;
+}
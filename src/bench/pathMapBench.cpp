@@ -0,0 +1,198 @@
+/* mirror - a tool to make mirrors of files or directories and to check consistency of the existing mirrors.
+Copyright (C) 2017-2019 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+/*
+ * Measures the containers checkFileSystem() keeps the DB records of a directory in. The listings of all
+ * the directories under the root given are read into memory, and then for each directory a map is built
+ * from its names and each name is looked up and erased, the way the file system entries are matched
+ * with the DB ones. The flat table is compared against std::unordered_map with the old and new hashes.
+ */
+#include "BenchResults.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <dirent.h>
+#include <fcntl.h>
+#include "mirror/DirReader.hpp"
+#include "mirror/FileDB.hpp"
+#include <iostream>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace
+{
+	void printUsage(const char * const programName)
+	{
+		std::cerr << "Usage: " << programName << " DIR [ROUNDS]" << std::endl;
+	}
+
+	// The names of a single directory, null-terminated one after another.
+	struct Listing
+	{
+		std::string names;
+		std::vector<std::pair<std::size_t, std::size_t>> entries;
+	};
+
+	// Reads the listings of the directory and all its subdirectories. Takes ownership of dirFd.
+	void readTree(const int dirFd, std::vector<Listing> &dest)
+	{
+		mirror::_helper::DirListing listing;
+		const int result = mirror::_helper::readDir(dirFd, listing, mirror::_helper::DirOrder::fileSystem);
+		if (result != 0) {
+			close(dirFd);
+			return;
+		}
+
+		Listing dir;
+		for (const auto &entry : listing) {
+			dir.entries.emplace_back(dir.names.size(), entry.nameSize);
+			dir.names.append(listing.name(entry), entry.nameSize + 1);
+		}
+		dest.push_back(std::move(dir));
+
+		for (const auto &entry : listing) {
+			const char * const name = listing.name(entry);
+			struct stat fileStat;
+			if (entry.type == DT_DIR || (entry.type == DT_UNKNOWN &&
+					fstatat(dirFd, name, &fileStat, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(fileStat.st_mode))) {
+				const int fd = openat(dirFd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+				if (fd != -1) {
+					readTree(fd, dest);
+				}
+			}
+		}
+		close(dirFd);
+	}
+
+	// The hash PathKey used before the flat table.
+	std::size_t shiftHash(const char *p, std::size_t n) noexcept
+	{
+		std::size_t hash = 0;
+		for (; n > 0; --n) {
+			hash = (hash << 7) + *p++;
+		}
+		return hash;
+	}
+
+	using UnorderedMap = std::unordered_map<mirror::PathKey, mirror::FileRecord, mirror::PathHash, mirror::PathEquals>;
+
+	template<typename Map, bool oldHash>
+	std::pair<double, double> run(const std::vector<Listing> &tree, const std::size_t rounds, std::size_t &checksum)
+	{
+		using Clock = std::chrono::steady_clock;
+
+		Clock::duration build(0), lookup(0);
+		mirror::PathArena arena;
+		for (std::size_t r = 0; r < rounds; ++r) {
+			for (const Listing &dir : tree) {
+				Map files;
+				arena.clear();
+
+				const auto start = Clock::now();
+				for (const auto &entry : dir.entries) {
+					mirror::PathKey key(dir.names.data() + entry.first, entry.second, arena);
+					if (oldHash) {
+						key.hash = shiftHash(key.data, key.size);
+					}
+					files[std::move(key)].fileSize = static_cast<off_t>(entry.second);
+				}
+				const auto middle = Clock::now();
+				for (const auto &entry : dir.entries) {
+					mirror::PathKey key(dir.names.data() + entry.first, entry.second, true);
+					if (oldHash) {
+						key.hash = shiftHash(key.data, key.size);
+					}
+					const auto found = files.find(key);
+					if (found != files.end()) {
+						checksum += static_cast<std::size_t>(found->second.fileSize);
+						files.erase(found);
+					}
+				}
+				const auto finish = Clock::now();
+
+				build += middle - start;
+				lookup += finish - middle;
+			}
+		}
+		return std::make_pair(std::chrono::duration<double>(build).count(), std::chrono::duration<double>(lookup).count());
+	}
+}
+
+int main(const int argc, char * const argv[])
+{
+	using std::operator<<;
+
+	std::size_t rounds = 10;
+	if (argc < 2 || argc > 3) {
+		printUsage(argv[0]);
+		return 1;
+	}
+	if (argc > 2) {
+		rounds = std::strtoul(argv[2], nullptr, 10);
+	}
+	if (rounds == 0) {
+		printUsage(argv[0]);
+		return 1;
+	}
+
+	const int rootFd = open(argv[1], O_RDONLY | O_DIRECTORY);
+	if (rootFd == -1) {
+		std::cerr << "Unable to open the directory '" << argv[1] << "'." << std::endl;
+		return 1;
+	}
+	std::vector<Listing> tree;
+	readTree(rootFd, tree);
+
+	std::size_t entryCount = 0;
+	for (const Listing &dir : tree) {
+		entryCount += dir.entries.size();
+	}
+	if (entryCount == 0) {
+		std::cerr << "No entries found." << std::endl;
+		return 1;
+	}
+
+	std::cout << "Directories: " << tree.size() << ", entries: " << entryCount << ", rounds: " << rounds << "\n\n";
+
+	const double ops = static_cast<double>(entryCount) * rounds;
+	mirror::bench::BenchResults results("pathmap");
+	auto report = [ops, &results](const char * const name, const std::pair<double, double> &times,
+			const std::size_t checksum)
+	{
+		std::printf("%-28s build %7.1f ns/entry  lookup %7.1f ns/entry  (%zx)\n", name, times.first * 1e9 / ops,
+				times.second * 1e9 / ops, checksum);
+		results.add(name, "build", times.first * 1e9 / ops, "ns/entry");
+		results.add(name, "lookup", times.second * 1e9 / ops, "ns/entry");
+	};
+
+	std::size_t checksum = 0;
+	std::pair<double, double> times = run<UnorderedMap, true>(tree, rounds, checksum);
+	report("unordered_map, shift hash", times, checksum);
+
+	checksum = 0;
+	times = run<UnorderedMap, false>(tree, rounds, checksum);
+	report("unordered_map, wyhash", times, checksum);
+
+	checksum = 0;
+	times = run<mirror::DirFileMap, false>(tree, rounds, checksum);
+	report("DirFileMap (flat, wyhash)", times, checksum);
+
+	return 0;
+}
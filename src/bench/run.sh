@@ -0,0 +1,136 @@
+#!/bin/sh
+# mirror - a tool to make mirrors of files or directories and to check consistency of the existing mirrors.
+# Copyright (C) 2017-2019 Dźmitry Laŭčuk
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+# Runs the benchmark suite: create-db, verify-dir and merge-dir are timed with a cold and a warm cache on
+# the synthetic trees tree-gen generates, and then the micro-benchmarks are run. The results are appended
+# to RESULTS_FILE, one JSON object per line, after a line that describes the run.
+#
+# Usage: run.sh BUILD_DIR WORK_DIR RESULTS_FILE
+#
+# The environment variables MIRROR_BENCH_PROFILES (tiny deep wide huge by default), MIRROR_BENCH_SCALE
+# (1 by default) and MIRROR_BENCH_ARGS (extra options for each mirror run) tune the runs. WORK_DIR is
+# removed and created anew.
+#
+# A cold cache is obtained by writing to /proc/sys/vm/drop_caches, which needs root. Otherwise the case is
+# reported as cold-fadvise: the file data is evicted by a run with the default options (mirror drops the
+# cache of each file it reads), but the cached directory entries and inodes stay.
+
+set -e
+
+if [ $# -ne 3 ]; then
+	echo "Usage: $0 BUILD_DIR WORK_DIR RESULTS_FILE" >&2
+	exit 1
+fi
+
+buildDir=$1
+workDir=$2
+results=$3
+profiles=${MIRROR_BENCH_PROFILES:-tiny deep wide huge}
+scale=${MIRROR_BENCH_SCALE:-1}
+mirror=$buildDir/mirror
+
+rm -rf "$workDir"
+mkdir -p "$workDir"
+
+if [ -w /proc/sys/vm/drop_caches ]; then
+	coldCase=cold
+else
+	coldCase=cold-fadvise
+fi
+
+dropCaches()
+{
+	if [ $coldCase = cold ]; then
+		sync
+		echo 3 > /proc/sys/vm/drop_caches
+	else
+		"$mirror" --tool=verify-dir --db="$1" --jobs=1 $MIRROR_BENCH_ARGS "$2" > /dev/null || true
+	fi
+}
+
+now()
+{
+	date +%s.%N
+}
+
+# record BENCH CASE METRIC VALUE UNIT
+record()
+{
+	printf '{"bench":"%s","case":"%s","metric":"%s","value":%s,"unit":"%s"}\n' "$1" "$2" "$3" "$4" "$5" >> "$results"
+	printf '%-24s %-16s %-8s %12s %s\n' "$1" "$2" "$3" "$4" "$5"
+}
+
+# timeRun BENCH CASE COMMAND... The command output is discarded since mismatches are expected.
+timeRun()
+{
+	bench=$1
+	benchCase=$2
+	shift 2
+	start=$(now)
+	"$@" > /dev/null 2>&1 || true
+	finish=$(now)
+	record "$bench" "$benchCase" time "$(awk "BEGIN { printf \"%.3f\", $finish - $start }")" s
+}
+
+revision=$(git -C "$(dirname "$0")" rev-parse --short HEAD 2> /dev/null || echo unknown)
+printf '{"bench":"run","revision":"%s","date":"%s","host":"%s","scale":%s,"cache":"%s"}\n' "$revision" \
+		"$(date -u +%Y-%m-%dT%H:%M:%SZ)" "$(uname -n)" "$scale" "$coldCase" >> "$results"
+
+for profile in $profiles; do
+	tree=$workDir/$profile
+	db=$workDir/$profile.sqlite
+	dest=$workDir/$profile-dest
+
+	"$buildDir/tree-gen" "$tree" "$profile" "$scale"
+
+	# The warm runs are preceded by a run that fills the cache.
+	rm -f "$db"
+	"$mirror" --tool=create-db --db="$db" $MIRROR_BENCH_ARGS "$tree" > /dev/null 2>&1
+	dropCaches "$db" "$tree"
+	rm -f "$db"
+	timeRun "create-db/$profile" $coldCase "$mirror" --tool=create-db --db="$db" $MIRROR_BENCH_ARGS "$tree"
+	rm -f "$db"
+	"$mirror" --tool=create-db --db="$db" --keep-cache $MIRROR_BENCH_ARGS "$tree" > /dev/null 2>&1
+	rm -f "$db"
+	timeRun "create-db/$profile" warm "$mirror" --tool=create-db --db="$db" --keep-cache $MIRROR_BENCH_ARGS "$tree"
+
+	dropCaches "$db" "$tree"
+	timeRun "verify-dir/$profile" $coldCase "$mirror" --tool=verify-dir --db="$db" $MIRROR_BENCH_ARGS "$tree"
+	"$mirror" --tool=verify-dir --db="$db" --keep-cache $MIRROR_BENCH_ARGS "$tree" > /dev/null 2>&1 || true
+	timeRun "verify-dir/$profile" warm "$mirror" --tool=verify-dir --db="$db" --keep-cache $MIRROR_BENCH_ARGS "$tree"
+	timeRun "verify-dir/$profile" quick "$mirror" --tool=verify-dir --db="$db" --quick $MIRROR_BENCH_ARGS "$tree"
+
+	# Everything is copied to an empty destination.
+	dropCaches "$db" "$tree"
+	rm -rf "$dest"
+	mkdir "$dest"
+	timeRun "merge-dir/$profile" $coldCase "$mirror" --tool=merge-dir --db="$db" $MIRROR_BENCH_ARGS "$tree" "$dest"
+	rm -rf "$dest"
+	mkdir "$dest"
+	timeRun "merge-dir/$profile" warm "$mirror" --tool=merge-dir --db="$db" --keep-cache $MIRROR_BENCH_ARGS \
+			"$tree" "$dest"
+	rm -rf "$dest"
+done
+
+export MIRROR_BENCH_RESULTS=$results
+"$buildDir/crc64-bench" 1024 1024
+mapTree=$workDir/pathmap
+"$buildDir/tree-gen" "$mapTree" mixed "$scale" > /dev/null
+"$buildDir/pathmap-bench" "$mapTree"
+"$buildDir/filedb-bench" "$workDir/filedb.sqlite"
+
+rm -rf "$workDir"
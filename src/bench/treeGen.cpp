@@ -0,0 +1,267 @@
+/* mirror - a tool to make mirrors of files or directories and to check consistency of the existing mirrors.
+Copyright (C) 2017-2019 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+/*
+ * Generates a synthetic directory tree for benchmarking mirror tools. Each profile stresses a different
+ * part of them: many tiny files (per-file overhead of scanning and the DB), deep nesting (directory
+ * handling), wide directories (the per-directory maps) and a few huge files (read and hash throughput).
+ * The contents and names depend only on the profile, scale and seed, so trees are reproducible.
+ */
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+namespace
+{
+	void printUsage(const char * const programName)
+	{
+		std::cerr << "Usage: " << programName << " DIR tiny|deep|wide|huge|mixed [SCALE] [SEED]\n\n"
+				"DIR must not exist. SCALE (1 by default) multiplies the number of files, or the sizes of\n"
+				"the files for the huge profile." << std::endl;
+	}
+
+	class Generator
+	{
+	public:
+		Generator(const std::uint64_t seed) : m_state(seed == 0 ? 1 : seed), m_buf(1024 * 1024), m_fileCount(0),
+				m_dirCount(0), m_byteCount(0) {}
+
+		bool makeDir(const std::string &path)
+		{
+			if (mkdir(path.c_str(), 0755) != 0) {
+				std::cerr << "Unable to create the directory '" << path << "': " << std::strerror(errno) << std::endl;
+				return false;
+			}
+			++m_dirCount;
+			return true;
+		}
+
+		bool makeFile(const std::string &path, std::uint64_t size)
+		{
+			const int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+			if (fd == -1) {
+				std::cerr << "Unable to create the file '" << path << "': " << std::strerror(errno) << std::endl;
+				return false;
+			}
+			while (size > 0) {
+				const std::size_t chunk = size < m_buf.size() ? static_cast<std::size_t>(size) : m_buf.size();
+				fill(chunk);
+				const ssize_t written = write(fd, m_buf.data(), chunk);
+				if (written <= 0) {
+					std::cerr << "Unable to write the file '" << path << "': " << std::strerror(errno) << std::endl;
+					close(fd);
+					return false;
+				}
+				size -= static_cast<std::uint64_t>(written);
+				m_byteCount += static_cast<std::uint64_t>(written);
+			}
+			if (close(fd) != 0) {
+				std::cerr << "Unable to close the file '" << path << "': " << std::strerror(errno) << std::endl;
+				return false;
+			}
+			++m_fileCount;
+			return true;
+		}
+
+		std::uint64_t next() noexcept
+		{
+			// xorshift64*
+			m_state ^= m_state >> 12;
+			m_state ^= m_state << 25;
+			m_state ^= m_state >> 27;
+			return m_state * UINT64_C(2685821657736338717);
+		}
+
+		std::uint64_t nextBelow(const std::uint64_t bound) noexcept { return bound == 0 ? 0 : next() % bound; }
+
+		/*
+		 * A file name of varying length. Every seventh name has non-ASCII letters so that the encoding
+		 * conversions of the tools are exercised as well.
+		 */
+		std::string fileName(const std::size_t i)
+		{
+			char num[32];
+			std::snprintf(num, sizeof(num), "%zu", i);
+			std::string name(1 + nextBelow(24), 'f');
+			if (i % 7 == 0) {
+				name += u8"žŭ";
+			}
+			name += num;
+			name += ".dat";
+			return name;
+		}
+
+		std::uint64_t fileCount() const noexcept { return m_fileCount; }
+		std::uint64_t dirCount() const noexcept { return m_dirCount; }
+		std::uint64_t byteCount() const noexcept { return m_byteCount; }
+	private:
+		void fill(const std::size_t n) noexcept
+		{
+			for (std::size_t i = 0; i < n; i += 8) {
+				const std::uint64_t r = next();
+				std::memcpy(m_buf.data() + i, &r, n - i < 8 ? n - i : 8);
+			}
+		}
+
+		std::uint64_t m_state;
+		std::vector<unsigned char> m_buf;
+		std::uint64_t m_fileCount;
+		std::uint64_t m_dirCount;
+		std::uint64_t m_byteCount;
+	};
+
+	std::size_t scaled(const std::size_t count, const double scale) noexcept
+	{
+		const double result = count * scale;
+		return result < 1 ? 1 : static_cast<std::size_t>(result);
+	}
+
+	// Directories with 500 files of up to 4 KiB each.
+	bool genTiny(Generator &gen, const std::string &root, const double scale)
+	{
+		const std::size_t dirCount = scaled(200, scale);
+		for (std::size_t d = 0; d < dirCount; ++d) {
+			const std::string dir = root + "/d" + std::to_string(d);
+			if (!gen.makeDir(dir)) {
+				return false;
+			}
+			for (std::size_t f = 0; f < 500; ++f) {
+				if (!gen.makeFile(dir + '/' + gen.fileName(f), gen.nextBelow(4097))) {
+					return false;
+				}
+			}
+		}
+		return true;
+	}
+
+	// Chains of directories 64 levels deep with a few small files at each level.
+	bool genDeep(Generator &gen, const std::string &root, const double scale)
+	{
+		const std::size_t chainCount = scaled(16, scale);
+		for (std::size_t c = 0; c < chainCount; ++c) {
+			std::string dir = root + "/c" + std::to_string(c);
+			for (std::size_t level = 0; level < 64; ++level) {
+				if (!gen.makeDir(dir)) {
+					return false;
+				}
+				for (std::size_t f = 0; f < 4; ++f) {
+					if (!gen.makeFile(dir + '/' + gen.fileName(f), 1 + gen.nextBelow(16 * 1024))) {
+						return false;
+					}
+				}
+				dir += "/l" + std::to_string(level);
+			}
+		}
+		return true;
+	}
+
+	// A few directories with tens of thousands of files each.
+	bool genWide(Generator &gen, const std::string &root, const double scale)
+	{
+		const std::size_t filesPerDir = scaled(25000, scale);
+		for (std::size_t d = 0; d < 4; ++d) {
+			const std::string dir = root + "/w" + std::to_string(d);
+			if (!gen.makeDir(dir)) {
+				return false;
+			}
+			for (std::size_t f = 0; f < filesPerDir; ++f) {
+				if (!gen.makeFile(dir + '/' + gen.fileName(f), gen.nextBelow(1025))) {
+					return false;
+				}
+			}
+		}
+		return true;
+	}
+
+	// Four files of 256 MiB each.
+	bool genHuge(Generator &gen, const std::string &root, const double scale)
+	{
+		const std::uint64_t size = static_cast<std::uint64_t>(256 * 1024 * 1024 * scale);
+		for (std::size_t f = 0; f < 4; ++f) {
+			if (!gen.makeFile(root + "/huge" + std::to_string(f) + ".bin", size)) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// All the profiles above, each in its own subdirectory, at a tenth of their size.
+	bool genMixed(Generator &gen, const std::string &root, const double scale)
+	{
+		const double subScale = scale / 10;
+		return gen.makeDir(root + "/tiny") && genTiny(gen, root + "/tiny", subScale) &&
+				gen.makeDir(root + "/deep") && genDeep(gen, root + "/deep", subScale) &&
+				gen.makeDir(root + "/wide") && genWide(gen, root + "/wide", subScale) &&
+				gen.makeDir(root + "/huge") && genHuge(gen, root + "/huge", subScale);
+	}
+}
+
+int main(const int argc, char * const argv[])
+{
+	using std::operator<<;
+
+	if (argc < 3 || argc > 5) {
+		printUsage(argv[0]);
+		return 1;
+	}
+	const std::string root(argv[1]);
+	const char * const profile = argv[2];
+	double scale = 1;
+	std::uint64_t seed = 2019;
+	if (argc > 3) {
+		scale = std::strtod(argv[3], nullptr);
+	}
+	if (argc > 4) {
+		seed = std::strtoull(argv[4], nullptr, 10);
+	}
+	if (!(scale > 0)) {
+		printUsage(argv[0]);
+		return 1;
+	}
+
+	bool (*generate)(Generator &, const std::string &, double);
+	if (std::strcmp(profile, "tiny") == 0) {
+		generate = genTiny;
+	} else if (std::strcmp(profile, "deep") == 0) {
+		generate = genDeep;
+	} else if (std::strcmp(profile, "wide") == 0) {
+		generate = genWide;
+	} else if (std::strcmp(profile, "huge") == 0) {
+		generate = genHuge;
+	} else if (std::strcmp(profile, "mixed") == 0) {
+		generate = genMixed;
+	} else {
+		printUsage(argv[0]);
+		return 1;
+	}
+
+	Generator gen(seed);
+	if (!gen.makeDir(root) || !generate(gen, root, scale)) {
+		return 1;
+	}
+
+	std::cout << "Directories: " << gen.dirCount() << ", files: " << gen.fileCount() << ", bytes: " <<
+			gen.byteCount() << std::endl;
+	return 0;
+}
@@ -16,17 +16,30 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>. */
 #include <afc/dateutil.hpp>
 #include <afc/logger.hpp>
 #include <afc/utils.h>
+#include <algorithm>
 #include <cassert>
+#include <cerrno>
+#include <climits>
 #include <clocale>
+#include <cstdint>
+#include <cstdlib>
 #include <cstring>
 #include <exception>
+#include <fcntl.h>
 #include <getopt.h>
 #include <iostream>
+#include <memory>
+#include "mirror/crc64.hpp"
 #include "mirror/encoding.hpp"
 #include "mirror/FileDB.hpp"
+#include "mirror/ReportWriter.hpp"
+#include "mirror/stats.hpp"
 #include "mirror/utils.hpp"
 #include "mirror/version.hpp"
+#include <stdexcept>
 #include <string>
+#include <sys/stat.h>
+#include <unistd.h>
 
 using afc::operator"" _s;
 
@@ -41,12 +54,37 @@ static const struct option options[] = {
 	{"help", no_argument, nullptr, 'h'},
 	{"version", no_argument, nullptr, 'v'},
 	{"db", required_argument, nullptr, 'd'},
+	{"jobs", required_argument, nullptr, 'j'},
+	{"quick", no_argument, nullptr, 'q'},
+	{"sample", required_argument, nullptr, 's'},
+	{"block-size", required_argument, nullptr, 'b'},
+	{"keep-cache", no_argument, nullptr, 'k'},
+	{"verify-copies", no_argument, nullptr, 'c'},
+	{"sort-inodes", no_argument, nullptr, 'i'},
+	{"walkers", required_argument, nullptr, 'w'},
+	{"queue-depth", required_argument, nullptr, 'Q'},
+	{"merge-join", no_argument, nullptr, 'm'},
+	{"stats", no_argument, nullptr, 'S'},
+	{"progress", optional_argument, nullptr, 'P'},
+	{"copy-jobs", required_argument, nullptr, 'C'},
+	{"split-threshold", required_argument, nullptr, 'T'},
+	{"range-size", required_argument, nullptr, 'R'},
+	{"checkpoint-interval", required_argument, nullptr, 'I'},
+	{"resume", no_argument, nullptr, 'r'},
+	{"report", required_argument, nullptr, 'o'},
+	{"report-thread", no_argument, nullptr, 'O'},
+	{"watch-delay", required_argument, nullptr, 'W'},
+	{"rehash-rate", required_argument, nullptr, 'H'},
+	{"inotify", no_argument, nullptr, 'N'},
+	{"hardlinks", no_argument, nullptr, 'L'},
+	{"reuse-local", no_argument, nullptr, 'U'},
+	{"subtree", required_argument, nullptr, 'B'},
 	{0}
 };
 
 enum class tool
 {
-	undefined, createDB, verifyDir, mergeDir
+	undefined, createDB, updateDB, verifyDir, mergeDir, watchDB, compareDB
 };
 
 void printUsage(bool success, const char * const programName = ::programName)
@@ -63,6 +101,93 @@ Report " << programName << " bugs to dzidzitop@vfemail.net" << std::endl;
 	}
 }
 
+bool parseUnsigned(const char * const str, unsigned &dest)
+{
+	char *end;
+	errno = 0;
+	const unsigned long val = std::strtoul(str, &end, 10);
+	if (errno != 0 || end == str || *end != '\0' || str[0] == '-' || val > UINT_MAX) {
+		return false;
+	}
+	dest = static_cast<unsigned>(val);
+	return true;
+}
+
+// Parses a positive size in bytes with an optional K, M or G suffix.
+bool parseSize(const char * const str, std::size_t &dest)
+{
+	char *end;
+	errno = 0;
+	const unsigned long long val = std::strtoull(str, &end, 10);
+	if (errno != 0 || end == str || str[0] == '-' || val == 0) {
+		return false;
+	}
+	unsigned shift;
+	switch (*end) {
+	case '\0':
+		shift = 0;
+		break;
+	case 'K':
+		shift = 10;
+		break;
+	case 'M':
+		shift = 20;
+		break;
+	case 'G':
+		shift = 30;
+		break;
+	default:
+		return false;
+	}
+	if (shift != 0 && end[1] != '\0') {
+		return false;
+	}
+	if (val > (static_cast<unsigned long long>(SIZE_MAX) >> shift)) {
+		return false;
+	}
+	dest = static_cast<std::size_t>(val << shift);
+	return true;
+}
+
+bool parsePercent(const char * const str, double &dest)
+{
+	char *end;
+	errno = 0;
+	const double val = std::strtod(str, &end);
+	if (errno != 0 || end == str || *end != '\0' || !(val >= 0 && val <= 100)) {
+		return false;
+	}
+	dest = val;
+	return true;
+}
+
+/*
+ * Strips the leading and trailing slashes off the path. Fails if it has empty, '.' or '..' components
+ * since the paths in the DB have none. The result is empty if the path refers to the root itself.
+ */
+bool parseSubtree(const char * const str, const char *&dest, std::size_t &destSize)
+{
+	const char *start = str;
+	while (*start == '/') {
+		++start;
+	}
+	const char *end = start + std::strlen(start);
+	while (end != start && end[-1] == '/') {
+		--end;
+	}
+	for (const char *name = start; name != end;) {
+		const char *nameEnd = std::find(name, end, '/');
+		const std::size_t nameSize = nameEnd - name;
+		if (nameSize == 0 || (nameSize == 1 && name[0] == '.') || (nameSize == 2 && name[0] == '.' && name[1] == '.')) {
+			return false;
+		}
+		name = nameEnd == end ? end : nameEnd + 1;
+	}
+	dest = start;
+	destSize = end - start;
+	return true;
+}
+
 void printVersion()
 {
 	using std::operator<<;
@@ -94,6 +219,7 @@ try {
 
 	std::setlocale(LC_ALL, "");
 	mirror::initConverters();
+	mirror::initCRC64();
 
 	tool t = tool::undefined;
 	bool toolDefined = false;
@@ -101,6 +227,24 @@ try {
 	int optionIndex = -1;
 	const char *dbPath;
 	bool dbDefined = false;
+	mirror::ScanOptions scanOptions;
+	bool sampleDefined = false;
+	bool verifyCopies = false;
+	unsigned copyJobs = 1;
+	bool copyJobsDefined = false;
+	bool hardLinks = false;
+	bool reuseLocal = false;
+	bool subtreeDefined = false;
+	bool printStats = false;
+	// Zero if no progress is printed.
+	unsigned progressInterval = 0;
+	unsigned checkpointInterval = 60;
+	bool checkpointIntervalDefined = false;
+	// Null if mismatches are logged rather than reported.
+	const char *reportPath = nullptr;
+	bool reportThread = false;
+	mirror::WatchOptions watchOptions;
+	bool watchOptionsDefined = false;
 	while ((c = ::getopt_long(argc, argv, "h", options, &optionIndex)) != -1) {
 		switch (c) {
 		case 'd':
@@ -110,19 +254,180 @@ try {
 		case 'h':
 			printUsage(true);
 			return 0;
+		case 'j':
+			if (!parseUnsigned(::optarg, scanOptions.jobs) || scanOptions.jobs == 0) {
+				std::cerr << "Invalid number of jobs: '" << ::optarg << "'." << std::endl;
+				printUsage(false);
+				return 1;
+			}
+			break;
 		case 't':
 			if (std::strcmp(::optarg, "create-db") == 0) {
 				t = tool::createDB;
+			} else if (std::strcmp(::optarg, "update-db") == 0) {
+				t = tool::updateDB;
 			} else if (std::strcmp(::optarg, "verify-dir") == 0) {
 				t = tool::verifyDir;
 			} else if (std::strcmp(::optarg, "merge-dir") == 0) {
 				t = tool::mergeDir;
+			} else if (std::strcmp(::optarg, "watch-db") == 0) {
+				t = tool::watchDB;
+			} else if (std::strcmp(::optarg, "compare-db") == 0) {
+				t = tool::compareDB;
 			} else {
 				printUsage(false, mirror::PROGRAM_NAME);
 				return 1;
 			}
 			toolDefined = true;
 			break;
+		case 'q':
+			scanOptions.quick = true;
+			break;
+		case 's':
+			if (!parsePercent(::optarg, scanOptions.samplePercent)) {
+				std::cerr << "Invalid sample percentage: '" << ::optarg << "'." << std::endl;
+				printUsage(false);
+				return 1;
+			}
+			sampleDefined = true;
+			break;
+		case 'b': {
+			std::size_t blockSize;
+			if (!parseSize(::optarg, blockSize)) {
+				std::cerr << "Invalid block size: '" << ::optarg << "'." << std::endl;
+				printUsage(false);
+				return 1;
+			}
+			// Rounding up to the page size so that reads stay aligned to the page-aligned buffer.
+			const std::size_t pageSize = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+			scanOptions.read.blockSize = (blockSize + pageSize - 1) / pageSize * pageSize;
+			break;
+		}
+		case 'T': {
+			// Zero disables splitting.
+			std::size_t threshold = 0;
+			if (std::strcmp(::optarg, "0") != 0 && !parseSize(::optarg, threshold)) {
+				std::cerr << "Invalid split threshold: '" << ::optarg << "'." << std::endl;
+				printUsage(false);
+				return 1;
+			}
+			scanOptions.read.splitThreshold = threshold;
+			break;
+		}
+		case 'R': {
+			std::size_t rangeSize;
+			if (!parseSize(::optarg, rangeSize)) {
+				std::cerr << "Invalid range size: '" << ::optarg << "'." << std::endl;
+				printUsage(false);
+				return 1;
+			}
+			scanOptions.read.rangeSize = rangeSize;
+			break;
+		}
+		case 'k':
+			scanOptions.read.dropCache = false;
+			break;
+		case 'c':
+			verifyCopies = true;
+			break;
+		case 'L':
+			hardLinks = true;
+			break;
+		case 'U':
+			reuseLocal = true;
+			break;
+		case 'B':
+			if (!parseSubtree(::optarg, scanOptions.walk.subtree, scanOptions.walk.subtreeSize)) {
+				std::cerr << "Invalid subtree: '" << ::optarg << "'." << std::endl;
+				printUsage(false);
+				return 1;
+			}
+			subtreeDefined = true;
+			break;
+		case 'i':
+			scanOptions.walk.sortByInode = true;
+			break;
+		case 'm':
+			scanOptions.mergeJoin = true;
+			break;
+		case 'S':
+			printStats = true;
+			break;
+		case 'C':
+			if (!parseUnsigned(::optarg, copyJobs) || copyJobs == 0) {
+				std::cerr << "Invalid number of copy jobs: '" << ::optarg << "'." << std::endl;
+				printUsage(false);
+				return 1;
+			}
+			copyJobsDefined = true;
+			break;
+		case 'P':
+			progressInterval = 10;
+			if (::optarg != nullptr && (!parseUnsigned(::optarg, progressInterval) || progressInterval == 0)) {
+				std::cerr << "Invalid progress interval: '" << ::optarg << "'." << std::endl;
+				printUsage(false);
+				return 1;
+			}
+			break;
+		case 'I':
+			// Zero disables checkpoints.
+			if (!parseUnsigned(::optarg, checkpointInterval)) {
+				std::cerr << "Invalid checkpoint interval: '" << ::optarg << "'." << std::endl;
+				printUsage(false);
+				return 1;
+			}
+			checkpointIntervalDefined = true;
+			break;
+		case 'r':
+			scanOptions.resume = true;
+			break;
+		case 'o':
+			reportPath = ::optarg;
+			break;
+		case 'O':
+			reportThread = true;
+			break;
+		case 'W':
+			if (!parseUnsigned(::optarg, watchOptions.delay)) {
+				std::cerr << "Invalid watch delay: '" << ::optarg << "'." << std::endl;
+				printUsage(false);
+				return 1;
+			}
+			watchOptionsDefined = true;
+			break;
+		case 'H': {
+			// Zero means no limit.
+			std::size_t rehashRate = 0;
+			if (std::strcmp(::optarg, "0") != 0 && !parseSize(::optarg, rehashRate)) {
+				std::cerr << "Invalid rehash rate: '" << ::optarg << "'." << std::endl;
+				printUsage(false);
+				return 1;
+			}
+			watchOptions.rehashRate = rehashRate;
+			watchOptionsDefined = true;
+			break;
+		}
+		case 'N':
+			watchOptions.fanotify = false;
+			watchOptionsDefined = true;
+			break;
+		case 'Q': {
+			unsigned queueDepth;
+			if (!parseUnsigned(::optarg, queueDepth) || queueDepth == 0) {
+				std::cerr << "Invalid queue depth: '" << ::optarg << "'." << std::endl;
+				printUsage(false);
+				return 1;
+			}
+			scanOptions.read.queueDepth = queueDepth;
+			break;
+		}
+		case 'w':
+			if (!parseUnsigned(::optarg, scanOptions.walk.walkers) || scanOptions.walk.walkers == 0) {
+				std::cerr << "Invalid number of walkers: '" << ::optarg << "'." << std::endl;
+				printUsage(false);
+				return 1;
+			}
+			break;
 		case 'v':
 			printVersion();
 			return 0;
@@ -162,12 +467,87 @@ try {
 		printUsage(false);
 		return 1;
 	}
+	if (t == tool::compareDB && optind < argc - 1) {
+		std::cerr << "Only the DB to compare with must be specified for compare-db." << std::endl;
+		printUsage(false);
+		return 1;
+	}
 
 	if (!toolDefined) {
 		std::cerr << "No tool specified." << std::endl;
 		printUsage(false);
 		return 1;
 	}
+	if (scanOptions.quick && (t == tool::createDB || t == tool::updateDB || t == tool::watchDB ||
+			t == tool::compareDB)) {
+		std::cerr << "--quick is only supported by verify-dir and merge-dir." << std::endl;
+		printUsage(false);
+		return 1;
+	}
+	if (sampleDefined && !scanOptions.quick) {
+		std::cerr << "--sample can only be used together with --quick." << std::endl;
+		printUsage(false);
+		return 1;
+	}
+	if (scanOptions.mergeJoin && t != tool::verifyDir && t != tool::mergeDir) {
+		std::cerr << "--merge-join is only supported by verify-dir and merge-dir." << std::endl;
+		printUsage(false);
+		return 1;
+	}
+	if (verifyCopies && t != tool::mergeDir) {
+		std::cerr << "--verify-copies is only supported by merge-dir." << std::endl;
+		printUsage(false);
+		return 1;
+	}
+	if (copyJobsDefined && t != tool::mergeDir) {
+		std::cerr << "--copy-jobs is only supported by merge-dir." << std::endl;
+		printUsage(false);
+		return 1;
+	}
+	if (hardLinks && t != tool::mergeDir) {
+		std::cerr << "--hardlinks is only supported by merge-dir." << std::endl;
+		printUsage(false);
+		return 1;
+	}
+	if (reuseLocal && t != tool::mergeDir) {
+		std::cerr << "--reuse-local is only supported by merge-dir." << std::endl;
+		printUsage(false);
+		return 1;
+	}
+	if (subtreeDefined && t != tool::verifyDir && t != tool::mergeDir && t != tool::updateDB) {
+		std::cerr << "--subtree is only supported by verify-dir, merge-dir and update-db." << std::endl;
+		printUsage(false);
+		return 1;
+	}
+	if ((checkpointIntervalDefined || scanOptions.resume) && t != tool::createDB && t != tool::verifyDir) {
+		std::cerr << "--checkpoint-interval and --resume are only supported by create-db and verify-dir." << std::endl;
+		printUsage(false);
+		return 1;
+	}
+	if (scanOptions.resume && checkpointInterval == 0) {
+		std::cerr << "--resume cannot be used with checkpoints disabled." << std::endl;
+		printUsage(false);
+		return 1;
+	}
+	if (reportPath != nullptr && t != tool::verifyDir && t != tool::compareDB) {
+		std::cerr << "--report is only supported by verify-dir and compare-db." << std::endl;
+		printUsage(false);
+		return 1;
+	}
+	if (watchOptionsDefined && t != tool::watchDB) {
+		std::cerr << "--watch-delay, --rehash-rate and --inotify are only supported by watch-db." << std::endl;
+		printUsage(false);
+		return 1;
+	}
+	if (reportThread && reportPath == nullptr) {
+		std::cerr << "--report-thread can only be used together with --report." << std::endl;
+		printUsage(false);
+		return 1;
+	}
+	// verify-dir does not write to the DB unless it is asked to.
+	if (t == tool::createDB || checkpointIntervalDefined || scanOptions.resume) {
+		scanOptions.checkpointInterval = checkpointInterval;
+	}
 	if (!dbDefined) {
 		std::cerr << "No DB specified." << std::endl;
 		printUsage(false);
@@ -176,28 +556,135 @@ try {
 
 	const char * const src = argv[optind];
 	const char * const dest = argv[optind + 1];
-	mirror::FileDB db = mirror::FileDB::open(dbPath, true);
+	// A missing DB to compare with is reported together with its path.
+	if (t == tool::compareDB && access(src, F_OK) != 0) {
+		std::cerr << "Unable to open the DB '" << src << "': " << std::strerror(errno) << std::endl;
+		return 1;
+	}
+	if (scanOptions.walk.subtreeSize != 0) {
+		// The tree that is walked is the one the DB describes.
+		const char * const root = t == tool::mergeDir ? dest : src;
+		std::string subtreePath(root);
+		subtreePath += '/';
+		subtreePath.append(scanOptions.walk.subtree, scanOptions.walk.subtreeSize);
+		struct stat subtreeStat;
+		if (stat(subtreePath.c_str(), &subtreeStat) != 0 || !S_ISDIR(subtreeStat.st_mode)) {
+			std::cerr << "The subtree '" << subtreePath << "' is not a directory." << std::endl;
+			return 1;
+		}
+	}
+	if (printStats || progressInterval != 0) {
+		mirror::stats::enable();
+	}
+	std::unique_ptr<mirror::stats::ProgressPrinter> progressPrinter;
+	if (progressInterval != 0) {
+		progressPrinter.reset(new mirror::stats::ProgressPrinter(progressInterval, std::cerr));
+	}
+
+	int reportFd = -1;
+	if (reportPath != nullptr) {
+		if (std::strcmp(reportPath, "-") == 0) {
+			reportFd = STDOUT_FILENO;
+		} else {
+			reportFd = open(reportPath, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+			if (reportFd == -1) {
+				std::cerr << "Unable to open the report file '" << reportPath << "': " << std::strerror(errno) <<
+						std::endl;
+				return 1;
+			}
+		}
+	}
+
+	// compare-db only reads the DBs.
+	mirror::FileDB db = mirror::FileDB::open(dbPath, true, t == tool::compareDB);
+
+	if (t == tool::createDB || t == tool::verifyDir || t == tool::watchDB) {
+		mirror::handleInterruptions();
+	}
 
+	int exitCode = 0;
 	try {
 		switch (t) {
 		case tool::createDB:
-			mirror::createDB(src, std::strlen(src), db);
+			mirror::createDB(src, std::strlen(src), db, scanOptions);
+			break;
+		case tool::updateDB:
+			mirror::updateDB(src, std::strlen(src), db, scanOptions);
 			break;
 		case tool::verifyDir: {
-			mirror::VerifyDirMismatchHandler mismatchHandler;
-			mirror::checkFileSystem(src, std::strlen(src), db, mismatchHandler);
+			if (reportFd == -1) {
+				mirror::VerifyDirMismatchHandler mismatchHandler;
+				mirror::checkFileSystem(src, std::strlen(src), db, mismatchHandler, scanOptions);
+				break;
+			}
+
+			mirror::ReportWriter reportWriter(reportFd, reportThread);
+			mirror::ReportMismatchHandler mismatchHandler(reportWriter);
+			try {
+				mirror::checkFileSystem(src, std::strlen(src), db, mismatchHandler, scanOptions);
+			}
+			catch (const mirror::Interrupted &) {
+				// The report is kept up to the point the check is stopped at.
+				reportWriter.close();
+				throw;
+			}
+			reportWriter.close();
+			if (reportFd != STDOUT_FILENO && close(reportFd) == -1) {
+				throw std::runtime_error(std::string("Unable to write the report: ") + std::strerror(errno));
+			}
 			break;
 		}
 		case tool::mergeDir: {
 			const std::size_t destSize = std::strlen(dest);
-			mirror::MergeDirMismatchHandler mismatchHandler(src, std::strlen(src), dest, destSize);
-			mirror::checkFileSystem(dest, destSize, db, mismatchHandler);
+			mirror::MergeDirMismatchHandler mismatchHandler(src, std::strlen(src), dest, destSize, verifyCopies,
+					copyJobs, hardLinks, reuseLocal ? &db : nullptr);
+			mirror::checkFileSystem(dest, destSize, db, mismatchHandler, scanOptions);
+			if (!mismatchHandler.finish()) {
+				exitCode = 1;
+			}
+			break;
+		}
+		case tool::watchDB:
+			// Returns once the watcher is interrupted, which is the normal way to stop it.
+			watchOptions.scan = scanOptions;
+			mirror::watchDB(src, std::strlen(src), db, watchOptions);
+			break;
+		case tool::compareDB: {
+			mirror::FileDB otherDB = mirror::FileDB::open(src, false, true);
+			try {
+				if (reportFd == -1) {
+					mirror::VerifyDirMismatchHandler mismatchHandler;
+					mirror::compareDBs(db, otherDB, mismatchHandler);
+				} else {
+					mirror::ReportWriter reportWriter(reportFd, reportThread);
+					mirror::ReportMismatchHandler mismatchHandler(reportWriter);
+					mirror::compareDBs(db, otherDB, mismatchHandler);
+					reportWriter.close();
+					if (reportFd != STDOUT_FILENO && close(reportFd) == -1) {
+						throw std::runtime_error(std::string("Unable to write the report: ") + std::strerror(errno));
+					}
+				}
+			}
+			catch (...) {
+				otherDB.close();
+				throw;
+			}
+			otherDB.close();
 			break;
 		}
 		default:
 			assert(false);
 		}
 	}
+	catch (const mirror::Interrupted &ex) {
+		db.close();
+		std::cerr << ex.what();
+		if (scanOptions.checkpointInterval != 0) {
+			std::cerr << " Run the same command with --resume to continue.";
+		}
+		std::cerr << std::endl;
+		return 1;
+	}
 	catch (...) {
 		db.close();
 		throw;
@@ -206,7 +693,12 @@ try {
 
 	db.close();
 
-	return 0;
+	progressPrinter.reset();
+	if (printStats) {
+		mirror::stats::printSummary(std::cerr);
+	}
+
+	return exitCode;
 }
 catch (std::exception &ex) {
 	using std::operator<<;
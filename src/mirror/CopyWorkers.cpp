@@ -0,0 +1,134 @@
+/* mirror - a tool to make mirrors of files or directories and to check consistency of the existing mirrors.
+Copyright (C) 2017-2019 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#include "CopyWorkers.hpp"
+#include <cassert>
+#include <utility>
+#include "utils.hpp"
+
+mirror::CopyWorkers::CopyWorkers(const int srcDirFd, const int destDirFd, const unsigned threadCount,
+		ResultHandler resultHandler, const std::uint64_t maxPendingBytes)
+		: m_srcDirFd(srcDirFd), m_destDirFd(destDirFd), m_resultHandler(std::move(resultHandler)),
+		  m_maxPendingFiles(threadCount * pendingFilesPerWorker), m_maxPendingBytes(maxPendingBytes), m_mutex(),
+		  m_taskAvailable(), m_taskDone(), m_queue(), m_done(), m_pendingFiles(0), m_pendingBytes(0), m_stop(false),
+		  m_workers()
+{
+	assert(threadCount > 0);
+
+	m_workers.reserve(threadCount);
+	try {
+		for (unsigned i = 0; i < threadCount; ++i) {
+			m_workers.emplace_back(&CopyWorkers::work, this);
+		}
+	}
+	catch (...) {
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_stop = true;
+		}
+		m_taskAvailable.notify_all();
+		for (std::thread &worker : m_workers) {
+			worker.join();
+		}
+		throw;
+	}
+}
+
+mirror::CopyWorkers::~CopyWorkers()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+	}
+	m_taskAvailable.notify_all();
+	for (std::thread &worker : m_workers) {
+		worker.join();
+	}
+}
+
+void mirror::CopyWorkers::submit(std::unique_ptr<CopyTask> task)
+{
+	std::vector<std::unique_ptr<CopyTask>> done;
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		while (m_pendingFiles > 0 && (m_pendingFiles >= m_maxPendingFiles ||
+				m_pendingBytes + task->size > m_maxPendingBytes)) {
+			m_taskDone.wait(lock);
+		}
+		++m_pendingFiles;
+		m_pendingBytes += task->size;
+		m_queue.push(std::move(task));
+		done.swap(m_done);
+	}
+	m_taskAvailable.notify_one();
+
+	deliver(done);
+}
+
+void mirror::CopyWorkers::finish()
+{
+	std::vector<std::unique_ptr<CopyTask>> done;
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		while (m_pendingFiles > 0) {
+			m_taskDone.wait(lock);
+		}
+		done.swap(m_done);
+	}
+
+	deliver(done);
+}
+
+void mirror::CopyWorkers::deliver(std::vector<std::unique_ptr<CopyTask>> &done)
+{
+	for (std::unique_ptr<CopyTask> &task : done) {
+		m_resultHandler(*task);
+	}
+}
+
+void mirror::CopyWorkers::work()
+{
+	for (;;) {
+		std::unique_ptr<CopyTask> task;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			// Queued copies are completed even if the workers are stopped, so that no file is left half-done.
+			while (!m_stop && m_queue.empty()) {
+				m_taskAvailable.wait(lock);
+			}
+			if (m_queue.empty()) {
+				return;
+			}
+			task = std::move(m_queue.front());
+			m_queue.pop();
+		}
+
+		try {
+			task->success = mirror::copyFile(m_srcDirFd, m_destDirFd, task->relPath.c_str(),
+					task->verify ? &task->copiedFileRecord : nullptr);
+		}
+		catch (...) {
+			task->success = false;
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			--m_pendingFiles;
+			m_pendingBytes -= task->size;
+			m_done.push_back(std::move(task));
+		}
+		m_taskDone.notify_one();
+	}
+}
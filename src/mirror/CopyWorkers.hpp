@@ -0,0 +1,120 @@
+/* mirror - a tool to make mirrors of files or directories and to check consistency of the existing mirrors.
+Copyright (C) 2017-2019 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#ifndef MIRROR_COPYWORKERS_HPP_
+#define MIRROR_COPYWORKERS_HPP_
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include "FileDB.hpp"
+#include <functional>
+#include "HardLinks.hpp"
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace mirror
+{
+	// A regular file to be copied by CopyWorkers, and the outcome of the copy once it is done.
+	struct CopyTask
+	{
+		CopyTask(const char * const relPath, const std::size_t relPathSize, const std::uint64_t size)
+				: relPath(relPath, relPathSize), size(size), verify(false), expectedFileRecord(),
+				  copiedFileRecord(), srcInode(), success(false) {}
+
+		// Relative to both the source and the destination directories of the workers.
+		std::string relPath;
+		// The expected size. Used to limit the number of bytes in flight only.
+		std::uint64_t size;
+		/*
+		 * If true then the file is copied through memory and copiedFileRecord is filled in with the digest
+		 * of the data copied (see copyFile()).
+		 */
+		bool verify;
+		mirror::FileRecord expectedFileRecord;
+		mirror::FileRecord copiedFileRecord;
+		// Valid if other links to the source file are made once it is copied (see HardLinker).
+		mirror::InodeKey srcInode;
+		bool success;
+	};
+
+	/*
+	 * Thread pool that copies regular files from one directory to another in the background, so that
+	 * the thread which finds the files to copy can go on meanwhile. The number of files and bytes queued
+	 * or being copied is capped; submit() waits until there is room.
+	 *
+	 * Completed tasks are handed over to the result handler in the thread that calls submit() or finish(),
+	 * so the handler need not be thread-safe. They are handed over in the order the copies complete.
+	 */
+	class CopyWorkers
+	{
+	public:
+		typedef std::function<void (CopyTask &)> ResultHandler;
+
+		static constexpr std::size_t pendingFilesPerWorker = 64;
+		static constexpr std::uint64_t defaultMaxPendingBytes = std::uint64_t(1) << 30;
+
+		/*
+		 * The directories are referred to by the tasks' paths. Their descriptors are not owned and must
+		 * remain open while the workers exist.
+		 */
+		CopyWorkers(int srcDirFd, int destDirFd, unsigned threadCount, ResultHandler resultHandler,
+				std::uint64_t maxPendingBytes = defaultMaxPendingBytes);
+		// Waits for the copies started or queued to complete. Their results are dropped.
+		~CopyWorkers();
+
+		CopyWorkers(const CopyWorkers &) = delete;
+		CopyWorkers(CopyWorkers &&) = delete;
+		CopyWorkers &operator=(const CopyWorkers &) = delete;
+		CopyWorkers &operator=(CopyWorkers &&) = delete;
+
+		/*
+		 * Queues the copy. Results that are already available are handed to the result handler before
+		 * this function returns. A file larger than the byte cap is queued once nothing else is pending.
+		 */
+		void submit(std::unique_ptr<CopyTask> task);
+
+		// Waits for all the copies submitted to complete and hands their results to the result handler.
+		void finish();
+	private:
+		void work();
+		void deliver(std::vector<std::unique_ptr<CopyTask>> &done);
+
+		const int m_srcDirFd;
+		const int m_destDirFd;
+		const ResultHandler m_resultHandler;
+		const std::size_t m_maxPendingFiles;
+		const std::uint64_t m_maxPendingBytes;
+
+		std::mutex m_mutex;
+		std::condition_variable m_taskAvailable;
+		std::condition_variable m_taskDone;
+		// Tasks not yet taken by any worker.
+		std::queue<std::unique_ptr<CopyTask>> m_queue;
+		// Tasks completed but not handed over to the result handler yet.
+		std::vector<std::unique_ptr<CopyTask>> m_done;
+		// Both queued and being copied.
+		std::size_t m_pendingFiles;
+		std::uint64_t m_pendingBytes;
+		bool m_stop;
+		std::vector<std::thread> m_workers;
+	};
+}
+
+#endif // MIRROR_COPYWORKERS_HPP_
@@ -0,0 +1,125 @@
+/* mirror - a tool to make mirrors of files or directories and to check consistency of the existing mirrors.
+Copyright (C) 2017-2019 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#include "DirReader.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace
+{
+	// The layout of records returned by getdents64(). glibc got its own declaration only in 2.30.
+	struct LinuxDirent64
+	{
+		std::uint64_t d_ino;
+		std::int64_t d_off;
+		unsigned short d_reclen;
+		unsigned char d_type;
+		char d_name[1];
+	};
+
+	// Large enough to read directories with thousands of entries in a single call.
+	constexpr std::size_t dirBufferSize = 256 * 1024;
+
+	char *threadDirBuffer()
+	{
+		struct DirBuffer
+		{
+			DirBuffer() noexcept : data(nullptr) {}
+			~DirBuffer() { std::free(data); }
+
+			char *data;
+		};
+
+		static thread_local DirBuffer buf;
+
+		if (buf.data == nullptr) {
+			buf.data = static_cast<char *>(std::malloc(dirBufferSize));
+			if (buf.data == nullptr) {
+				throw std::bad_alloc();
+			}
+		}
+		return buf.data;
+	}
+}
+
+int mirror::_helper::readDir(const int dirFd, DirListing &dest, const DirOrder order)
+{
+	dest.m_entries.clear();
+	dest.m_names.clear();
+
+	char * const buf = threadDirBuffer();
+	for (;;) {
+		const long n = syscall(SYS_getdents64, dirFd, buf, dirBufferSize);
+		if (n == 0) {
+			break;
+		} else if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+
+		for (long pos = 0; pos < n;) {
+			const LinuxDirent64 &record = *reinterpret_cast<const LinuxDirent64 *>(buf + pos);
+			pos += record.d_reclen;
+
+			const char * const name = record.d_name;
+			if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+				// Either the current dir or the parent dir. Skipping it.
+				continue;
+			}
+
+			/* Records are aligned to eight bytes so the terminator of the name is within the last eight
+			 * bytes of the record (the padding after it is not guaranteed to be zeroed).
+			 */
+			const std::size_t maxNameSize = record.d_reclen - offsetof(LinuxDirent64, d_name) - 1;
+			const std::size_t minNameSize = maxNameSize < 7 ? 0 : maxNameSize - 7;
+			const std::size_t nameSize = static_cast<const char *>(
+					std::memchr(name + minNameSize, '\0', maxNameSize - minNameSize + 1)) - name;
+
+			dest.m_entries.push_back(DirListing::Entry{static_cast<ino_t>(record.d_ino), dest.m_names.size(),
+					nameSize, record.d_type});
+			dest.m_names.insert(dest.m_names.end(), name, name + nameSize + 1);
+		}
+	}
+
+	switch (order) {
+	case DirOrder::fileSystem:
+		break;
+	case DirOrder::inode:
+		std::sort(dest.m_entries.begin(), dest.m_entries.end(),
+				[](const DirListing::Entry &a, const DirListing::Entry &b) { return a.inode < b.inode; });
+		break;
+	case DirOrder::name: {
+		const char * const names = dest.m_names.data();
+		std::sort(dest.m_entries.begin(), dest.m_entries.end(),
+				[names](const DirListing::Entry &a, const DirListing::Entry &b)
+				{
+					// The terminators are compared as well so that a name goes before the names it prefixes.
+					return std::memcmp(names + a.nameOffset, names + b.nameOffset,
+							std::min(a.nameSize, b.nameSize) + 1) < 0;
+				});
+		break;
+	}
+	}
+	return 0;
+}
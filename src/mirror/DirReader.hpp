@@ -0,0 +1,84 @@
+/* mirror - a tool to make mirrors of files or directories and to check consistency of the existing mirrors.
+Copyright (C) 2017-2019 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#ifndef MIRROR_DIRREADER_HPP_
+#define MIRROR_DIRREADER_HPP_
+
+#include <cstddef>
+#include <sys/types.h>
+#include <vector>
+
+namespace mirror
+{
+	namespace _helper
+	{
+		// The order of the entries of a DirListing.
+		enum class DirOrder
+		{
+			// As returned by the file system.
+			fileSystem,
+			// By inode number, which roughly follows the order of inodes on disk.
+			inode,
+			// By name, bytewise. It is the order sqlite sorts UTF-8 text columns in by default.
+			name
+		};
+
+		/*
+		 * All the entries of a single directory but "." and "..". Names are kept null-terminated one
+		 * after another in a single buffer so that a listing can be refilled without allocating memory
+		 * once it has grown to the size of the largest directory it is used for.
+		 */
+		class DirListing
+		{
+		public:
+			struct Entry
+			{
+				ino_t inode;
+				std::size_t nameOffset;
+				std::size_t nameSize;
+				// One of DT_* constants as reported by the file system. DT_UNKNOWN if not reported.
+				unsigned char type;
+			};
+
+			DirListing() : m_entries(), m_names() {}
+
+			const Entry *begin() const noexcept { return m_entries.data(); }
+			const Entry *end() const noexcept { return m_entries.data() + m_entries.size(); }
+			std::size_t size() const noexcept { return m_entries.size(); }
+			const Entry &operator[](const std::size_t i) const noexcept { return m_entries[i]; }
+
+			const char *name(const Entry &entry) const noexcept { return m_names.data() + entry.nameOffset; }
+		private:
+			friend int readDir(int dirFd, DirListing &dest, DirOrder order);
+
+			std::vector<Entry> m_entries;
+			std::vector<char> m_names;
+		};
+
+		/*
+		 * Replaces the contents of dest with the listing of the directory. The entries are read with
+		 * getdents64() through a large buffer that belongs to the calling thread, and the name lengths
+		 * are derived from the record lengths so only the tail of each name is scanned for its terminator.
+		 *
+		 * Sorting by inode makes stat'ing and opening the entries in order not to make rotational disks seek
+		 * back and forth. Sorting by name lets the listing be merged with other sequences ordered by name.
+		 *
+		 * Returns zero on success and -1 on error with errno set.
+		 */
+		int readDir(int dirFd, DirListing &dest, DirOrder order);
+	}
+}
+
+#endif // MIRROR_DIRREADER_HPP_
@@ -0,0 +1,272 @@
+/* mirror - a tool to make mirrors of files or directories and to check consistency of the existing mirrors.
+Copyright (C) 2017-2019 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#include "DirWatcher.hpp"
+#include <afc/logger.hpp>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include "log.hpp"
+#include <poll.h>
+#include <stdexcept>
+#include <sys/fanotify.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#include "utils.hpp"
+
+using afc::operator"" _s;
+using mirror::logger::logDebug;
+using mirror::logger::logTrace;
+
+namespace
+{
+	constexpr std::size_t eventBufferSize = 64 * 1024;
+
+	constexpr std::uint32_t inotifyMask = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY |
+			IN_CLOSE_WRITE | IN_ATTRIB | IN_ONLYDIR | IN_EXCL_UNLINK;
+
+#ifdef FAN_REPORT_DFID_NAME
+	constexpr std::uint64_t fanotifyMask = FAN_CREATE | FAN_DELETE | FAN_MOVED_FROM | FAN_MOVED_TO | FAN_MODIFY |
+			FAN_CLOSE_WRITE | FAN_ATTRIB | FAN_ONDIR;
+#endif
+
+	[[noreturn]]
+	void throwWatchError(const int errorCode)
+	{
+		throw std::runtime_error(std::string("Unable to watch the directory: ") + std::strerror(errorCode));
+	}
+}
+
+mirror::DirWatcher::DirWatcher(const char * const rootDir, const bool useFanotify)
+		: m_fd(-1), m_fanotify(false), m_rootFd(-1), m_rootPath(), m_dirs(), m_buf(eventBufferSize)
+{
+	m_rootFd = open(rootDir, O_RDONLY | O_DIRECTORY);
+	if (m_rootFd == -1) {
+		mirror::_helper::handleOpenFileError(errno);
+	}
+
+#ifdef FAN_REPORT_DFID_NAME
+	if (useFanotify) {
+		char * const rootPath = realpath(rootDir, nullptr);
+		const int fd = rootPath == nullptr ? -1 :
+				fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_NONBLOCK | FAN_REPORT_DFID_NAME, O_RDONLY);
+		if (fd != -1 && fanotify_mark(fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, fanotifyMask, m_rootFd, nullptr) == 0) {
+			m_fd = fd;
+			m_fanotify = true;
+			m_rootPath = rootPath;
+			std::free(rootPath);
+			return;
+		}
+		const int errorCode = errno;
+		if (fd != -1) {
+			close(fd);
+		}
+		std::free(rootPath);
+		logDebug("Unable to use fanotify ("_s, std::strerror(errorCode), "), falling back to inotify..."_s);
+	}
+#endif
+
+	m_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (m_fd == -1) {
+		const int errorCode = errno;
+		close(m_rootFd);
+		throwWatchError(errorCode);
+	}
+	const int wd = inotify_add_watch(m_fd, rootDir, inotifyMask);
+	if (wd == -1) {
+		const int errorCode = errno;
+		close(m_fd);
+		close(m_rootFd);
+		throwWatchError(errorCode);
+	}
+	m_dirs.emplace(wd, std::string());
+}
+
+mirror::DirWatcher::~DirWatcher()
+{
+	// TODO handle error.
+	close(m_fd);
+	close(m_rootFd);
+}
+
+void mirror::DirWatcher::addDir(const char * const path, const char * const relDir, const std::size_t relDirSize)
+{
+	if (m_fanotify) {
+		return;
+	}
+
+	const int wd = inotify_add_watch(m_fd, path, inotifyMask);
+	if (wd == -1) {
+		logDebug("Unable to watch the directory '"_s, path, "': "_s, std::strerror(errno));
+		return;
+	}
+	// A directory that is moved keeps its watch descriptor, so its path is updated.
+	m_dirs[wd].assign(relDir, relDirSize);
+}
+
+bool mirror::DirWatcher::readEvents(const int timeoutMillis, std::set<std::string> &dest)
+{
+	struct pollfd pollFd;
+	pollFd.fd = m_fd;
+	pollFd.events = POLLIN;
+	const int ready = poll(&pollFd, 1, timeoutMillis);
+	if (ready == -1 && errno != EINTR) {
+		throwWatchError(errno);
+	}
+	if (ready <= 0) {
+		return true;
+	}
+
+	bool complete = true;
+	for (;;) {
+		const ssize_t n = read(m_fd, m_buf.data(), m_buf.size());
+		if (n == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				break;
+			}
+			if (errno == EINTR) {
+				continue;
+			}
+			throwWatchError(errno);
+		}
+		if (n == 0) {
+			break;
+		}
+
+		const std::size_t size = static_cast<std::size_t>(n);
+		if (m_fanotify) {
+			complete = readFanotifyEvents(m_buf.data(), size, dest) && complete;
+		} else {
+			complete = readInotifyEvents(m_buf.data(), size, dest) && complete;
+		}
+	}
+	return complete;
+}
+
+bool mirror::DirWatcher::readInotifyEvents(const char * const events, const std::size_t size,
+		std::set<std::string> &dest)
+{
+	bool complete = true;
+	for (const char *p = events; p < events + size;) {
+		const struct inotify_event &event = *reinterpret_cast<const struct inotify_event *>(p);
+		p += sizeof(struct inotify_event) + event.len;
+
+		if (event.mask & IN_Q_OVERFLOW) {
+			complete = false;
+			continue;
+		}
+		if (event.mask & IN_IGNORED) {
+			m_dirs.erase(event.wd);
+			continue;
+		}
+
+		const auto dir = m_dirs.find(event.wd);
+		if (dir != m_dirs.end()) {
+			logTrace("Change in '"_s, dir->second.c_str(), "'."_s);
+			dest.insert(dir->second);
+		}
+	}
+	return complete;
+}
+
+bool mirror::DirWatcher::readFanotifyEvents(const char * const events, const std::size_t size,
+		std::set<std::string> &dest)
+{
+#ifdef FAN_REPORT_DFID_NAME
+	bool complete = true;
+	// Consecutive events are often about the same directory so its path is not resolved again.
+	std::string lastHandle;
+	std::string lastRelDir;
+	bool lastInTree = false;
+	char linkPath[sizeof("/proc/self/fd/") + 3 * sizeof(int)];
+	char dirPath[PATH_MAX];
+
+	const struct fanotify_event_metadata *event = reinterpret_cast<const struct fanotify_event_metadata *>(events);
+	std::size_t left = size;
+	for (; FAN_EVENT_OK(event, left); event = FAN_EVENT_NEXT(event, left)) {
+		if (event->vers != FANOTIFY_METADATA_VERSION) {
+			throw std::runtime_error("Unsupported version of fanotify events.");
+		}
+		if (event->mask & FAN_Q_OVERFLOW) {
+			complete = false;
+			continue;
+		}
+
+		const char *info = reinterpret_cast<const char *>(event) + event->metadata_len;
+		const char * const end = reinterpret_cast<const char *>(event) + event->event_len;
+		while (info < end) {
+			const struct fanotify_event_info_header &header =
+					*reinterpret_cast<const struct fanotify_event_info_header *>(info);
+			if (header.len == 0) {
+				break;
+			}
+			if (header.info_type == FAN_EVENT_INFO_TYPE_DFID_NAME || header.info_type == FAN_EVENT_INFO_TYPE_DFID) {
+				const struct fanotify_event_info_fid &fid =
+						*reinterpret_cast<const struct fanotify_event_info_fid *>(info);
+				struct file_handle * const handle = reinterpret_cast<struct file_handle *>(
+						const_cast<unsigned char *>(fid.handle));
+				const std::size_t handleSize = sizeof(struct file_handle) + handle->handle_bytes;
+				const char * const handleBytes = reinterpret_cast<const char *>(handle);
+
+				if (lastHandle.size() != handleSize ||
+						lastHandle.compare(0, handleSize, handleBytes, handleSize) != 0) {
+					lastHandle.assign(handleBytes, handleSize);
+					lastInTree = false;
+
+					const int dirFd = open_by_handle_at(m_rootFd, handle, O_PATH);
+					if (dirFd != -1) {
+						std::snprintf(linkPath, sizeof(linkPath), "/proc/self/fd/%d", dirFd);
+						const ssize_t pathSize = readlink(linkPath, dirPath, sizeof(dirPath));
+						// TODO handle error.
+						close(dirFd);
+
+						const std::size_t rootSize = m_rootPath.size();
+						if (pathSize > 0 && static_cast<std::size_t>(pathSize) < sizeof(dirPath) &&
+								static_cast<std::size_t>(pathSize) >= rootSize &&
+								m_rootPath.compare(0, rootSize, dirPath, rootSize) == 0) {
+							if (static_cast<std::size_t>(pathSize) == rootSize) {
+								lastRelDir.clear();
+								lastInTree = true;
+							} else if (rootSize == 1 || dirPath[rootSize] == '/') {
+								// The root of the file system has the trailing slash already.
+								const std::size_t relOffset = rootSize == 1 ? 1 : rootSize + 1;
+								lastRelDir.assign(dirPath + relOffset, pathSize - relOffset);
+								lastInTree = true;
+							}
+						}
+					}
+				}
+
+				if (lastInTree) {
+					logTrace("Change in '"_s, lastRelDir.c_str(), "'."_s);
+					dest.insert(lastRelDir);
+				}
+			}
+			info += header.len;
+		}
+
+		if (event->fd >= 0) {
+			close(event->fd);
+		}
+	}
+	return complete;
+#else
+	// The watcher never uses fanotify.
+	return true;
+#endif
+}
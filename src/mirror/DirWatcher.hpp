@@ -0,0 +1,81 @@
+/* mirror - a tool to make mirrors of files or directories and to check consistency of the existing mirrors.
+Copyright (C) 2017-2019 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#ifndef MIRROR_DIRWATCHER_HPP_
+#define MIRROR_DIRWATCHER_HPP_
+
+#include <cstddef>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace mirror
+{
+	/*
+	 * Reports which directories of a tree have their entries created, removed, renamed or modified. Events
+	 * are not reported per file: the watcher only tells which directories are to be rescanned.
+	 *
+	 * fanotify is used if it is available (Linux 5.9+ with CAP_SYS_ADMIN), since a single mark of the whole
+	 * file system covers all the directories of the tree, including the ones created later. Otherwise each
+	 * directory is watched with inotify after it is added by addDir().
+	 */
+	class DirWatcher
+	{
+	public:
+		// If useFanotify is false then inotify is used even if fanotify is available.
+		DirWatcher(const char *rootDir, bool useFanotify);
+		~DirWatcher();
+
+		DirWatcher(const DirWatcher &) = delete;
+		DirWatcher(DirWatcher &&) = delete;
+		DirWatcher &operator=(const DirWatcher &) = delete;
+		DirWatcher &operator=(DirWatcher &&) = delete;
+
+		// If true then the directories of the tree are watched without being added.
+		bool recursive() const noexcept { return m_fanotify; }
+
+		const char *backendName() const noexcept { return m_fanotify ? "fanotify" : "inotify"; }
+
+		/*
+		 * Watches the directory given by its path and by its path relative to the root, both in the system
+		 * charset. Does nothing if the watcher is recursive. Errors are ignored since the directory could be
+		 * gone already, which its parent is notified of anyway.
+		 */
+		void addDir(const char *path, const char *relDir, std::size_t relDirSize);
+
+		/*
+		 * Waits up to timeoutMillis for events and adds to dest the directories they are about, by their
+		 * paths relative to the root in the system charset. Returns early if a signal is caught. Returns
+		 * false if events are lost due to a queue overflow, in which case the whole tree must be rescanned.
+		 */
+		bool readEvents(int timeoutMillis, std::set<std::string> &dest);
+	private:
+		bool readFanotifyEvents(const char *events, std::size_t size, std::set<std::string> &dest);
+		bool readInotifyEvents(const char *events, std::size_t size, std::set<std::string> &dest);
+
+		int m_fd;
+		bool m_fanotify;
+		// The descriptor of the root that file handles reported by fanotify are opened with.
+		int m_rootFd;
+		// The canonical path of the root that paths reported by fanotify are matched against.
+		std::string m_rootPath;
+		// The paths relative to the root of the directories watched with inotify, by watch descriptor.
+		std::unordered_map<int, std::string> m_dirs;
+		std::vector<char> m_buf;
+	};
+}
+
+#endif // MIRROR_DIRWATCHER_HPP_
@@ -18,47 +18,199 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>. */
 #include <afc/logger.hpp>
 #include <afc/StringRef.hpp>
 #include <cassert>
+#include <cstring>
 #include "encoding.hpp"
+#include "log.hpp"
+#include "stats.hpp"
 #include <utility>
 
 using afc::operator"" _s;
-using afc::logger::logTrace;
+using mirror::logger::logDebug;
+using afc::logger::logError;
+using mirror::logger::logTrace;
 
-mirror::FileDB::FileDB(const char * const dbPathInUtf8)
+namespace
 {
+	/*
+	 * Schema v3 adds the table dir_digests (see FileDB::getDirDigest()). It is a separate version since
+	 * the older versions of mirror would change files without dropping the digests of their directories.
+	 * Schema v2 stores each directory path once in the table dirs and refers to it from files by an
+	 * integer id, so that all the files of a directory are a range of the primary key of files.
+	 * Schema v1 (user_version = 0) stored the full directory path in each row of files.
+	 */
+	constexpr int schemaVersion = 3;
+
+	constexpr auto createDirTableQuery = u8"create table if not exists dirs "
+			"(id integer primary key, path text not null unique)"_s;
 	constexpr auto createFileTableQuery = u8"create table if not exists files "
-			"(file text not null, dir text not null, type integer not null, size integer, last_modified integer,"
-			"crc64 blob, primary key (file, dir))"_s;
-	constexpr auto createDirIndexQuery = u8"create index if not exists dir_idx on files (dir)"_s;
-	constexpr auto addFileQuery = u8"insert or replace into files (file, dir, type, size, last_modified, crc64) values (?, ?, ?, ?, ?, ?)"_s;
-	constexpr auto getFileQuery = u8"select * from files where file = ? and dir = ?"_s;
-	constexpr auto getDirFilesQuery = u8"select file, type, size, last_modified, crc64 from files where dir = ?"_s;
-	constexpr auto getDirsQuery = u8"select distinct dir from files"_s;
+			"(dir_id integer not null references dirs (id), file text not null, type integer not null, size integer,"
+			"last_modified integer, crc64 blob, primary key (dir_id, file)) without rowid"_s;
+	constexpr auto createDirDigestTableQuery = u8"create table if not exists dir_digests "
+			"(path text primary key, crc64 blob not null) without rowid"_s;
+	constexpr auto setSchemaVersionQuery = u8"pragma user_version = 3"_s;
+	// The digests are calculated when they are needed for the first time.
+	constexpr auto migrateFromV2Query = u8"create table dir_digests (path text primary key, crc64 blob not null) "
+			"without rowid;"
+			"pragma user_version = 3"_s;
+	constexpr auto migrateFromV1Query = u8"alter table files rename to files_v1;"
+			"create table dirs (id integer primary key, path text not null unique);"
+			"create table files (dir_id integer not null references dirs (id), file text not null,"
+			"type integer not null, size integer, last_modified integer, crc64 blob,"
+			"primary key (dir_id, file)) without rowid;"
+			"insert into dirs (path) select distinct dir from files_v1 order by dir;"
+			"insert into files (dir_id, file, type, size, last_modified, crc64) "
+			"select d.id, f.file, f.type, f.size, f.last_modified, f.crc64 from files_v1 f "
+			"join dirs d on d.path = f.dir;"
+			// The v1 directory index is dropped together with the table.
+			"drop table files_v1;"
+			"pragma user_version = 2"_s;
 
-	int result;
+	// Returns the value of the first column of the first row of the result set (or zero if it is empty).
+	int queryInt(sqlite3 * const conn, const char * const queryU8, int &dest)
+	{
+		sqlite3_stmt *stmt;
+		int result = sqlite3_prepare_v2(conn, queryU8, -1, &stmt, nullptr);
+		if (result != SQLITE_OK) {
+			return result;
+		}
 
-	logTrace("Opening connection to the DB "_s, dbPathInUtf8);
-	result = sqlite3_open(dbPathInUtf8, &m_conn);
-	logTrace("Result code: "_s, result);
+		result = sqlite3_step(stmt);
+		if (result == SQLITE_ROW) {
+			dest = sqlite3_column_int(stmt, 0);
+			result = SQLITE_OK;
+		} else if (result == SQLITE_DONE) {
+			dest = 0;
+			result = SQLITE_OK;
+		}
 
-	if (result != SQLITE_OK) {
-		goto error_openConn;
+		// TODO handle sqlite3_finalize error code.
+		sqlite3_finalize(stmt);
+		return result;
+	}
+
+	int initSchema(sqlite3 * const conn, const bool readOnly)
+	{
+		int result;
+		int version;
+
+		result = queryInt(conn, u8"pragma user_version", version);
+		if (result != SQLITE_OK) {
+			return result;
+		}
+		logTrace("DB schema version: "_s, version);
+
+		if (version == schemaVersion) {
+			return SQLITE_OK;
+		}
+		if (version > schemaVersion) {
+			logError("The DB is created by a newer version of mirror (schema version "_s, version, ")."_s);
+			return SQLITE_NOTADB;
+		}
+		if (readOnly) {
+			logError("The DB has the schema version "_s, version, ", which is to be upgraded by update-db "
+					"before the DB can be opened read-only."_s);
+			return SQLITE_READONLY;
+		}
+
+		int hasV1Files;
+		result = queryInt(conn, u8"select count(*) from sqlite_master where type = 'table' and name = 'files'",
+				hasV1Files);
+		if (result != SQLITE_OK) {
+			return result;
+		}
+
+		if (hasV1Files == 0) {
+			logTrace("Creating the dir table: "_s, createDirTableQuery);
+			result = sqlite3_exec(conn, createDirTableQuery.value(), nullptr, nullptr, nullptr);
+			if (result != SQLITE_OK) {
+				return result;
+			}
+
+			logTrace("Creating the file table: "_s, createFileTableQuery);
+			result = sqlite3_exec(conn, createFileTableQuery.value(), nullptr, nullptr, nullptr);
+			if (result != SQLITE_OK) {
+				return result;
+			}
+
+			logTrace("Creating the dir digest table: "_s, createDirDigestTableQuery);
+			result = sqlite3_exec(conn, createDirDigestTableQuery.value(), nullptr, nullptr, nullptr);
+			if (result != SQLITE_OK) {
+				return result;
+			}
+
+			return sqlite3_exec(conn, setSchemaVersionQuery.value(), nullptr, nullptr, nullptr);
+		}
+
+		logDebug("Migrating the DB to the schema version "_s, schemaVersion, "..."_s);
+		result = sqlite3_exec(conn, u8"begin transaction", nullptr, nullptr, nullptr);
+		if (result != SQLITE_OK) {
+			return result;
+		}
+		if (version == 0) {
+			result = sqlite3_exec(conn, migrateFromV1Query.value(), nullptr, nullptr, nullptr);
+		}
+		if (result == SQLITE_OK) {
+			result = sqlite3_exec(conn, migrateFromV2Query.value(), nullptr, nullptr, nullptr);
+		}
+		if (result != SQLITE_OK) {
+			// TODO handle sqlite3_exec error code.
+			sqlite3_exec(conn, u8"rollback", nullptr, nullptr, nullptr);
+			return result;
+		}
+		result = sqlite3_exec(conn, u8"commit", nullptr, nullptr, nullptr);
+		if (result != SQLITE_OK || version != 0) {
+			return result;
+		}
+
+		// Giving the space of the directory strings that are not repeated any more back to the file system.
+		logDebug("Compacting the DB..."_s);
+		return sqlite3_exec(conn, u8"vacuum", nullptr, nullptr, nullptr);
 	}
+}
+
+mirror::FileDB::FileDB(const char * const dbPathInUtf8, const bool readOnly)
+		: m_markDirVisitedStmt(nullptr), m_getUnvisitedDirsStmt(nullptr), m_markDirDoneStmt(nullptr),
+		  m_getDirProgressStmt(nullptr), m_findByContentStmt(nullptr), m_checkpointInterval(0), m_lastCheckpoint(),
+		  m_lastDirU8(), m_lastDirId(0), m_bulkBatchSize(0), m_bulkBatchRows(0), m_trackedSubtreeU8(),
+		  m_hasDirDigests(false), m_changedDirsU8()
+{
+	constexpr auto addFileQuery = u8"insert or replace into files (dir_id, file, type, size, last_modified, crc64) "
+			"values (?, ?, ?, ?, ?, ?)"_s;
+	constexpr auto getFileQuery = u8"select f.type, f.size, f.last_modified, f.crc64 from files f "
+			"join dirs d on d.id = f.dir_id where f.file = ? and d.path = ?"_s;
+	constexpr auto getDirFilesQuery = u8"select f.file, f.type, f.size, f.last_modified, f.crc64 from files f "
+			"join dirs d on d.id = f.dir_id where d.path = ? order by f.file"_s;
+	constexpr auto getDirIdQuery = u8"select id from dirs where path = ?"_s;
+	constexpr auto addDirQuery = u8"insert into dirs (path) values (?)"_s;
+	constexpr auto removeFileQuery = u8"delete from files where file = ?1 and "
+			"dir_id = (select id from dirs where path = ?2)"_s;
+	constexpr auto removeDirQuery = u8"delete from files where dir_id = (select id from dirs where path = ?1)"_s;
+	constexpr auto removeDirEntryQuery = u8"delete from dirs where path = ?1"_s;
+	constexpr auto getDirDigestQuery = u8"select crc64 from dir_digests where path = ?"_s;
+	constexpr auto setDirDigestQuery = u8"insert or replace into dir_digests (path, crc64) values (?, ?)"_s;
+	constexpr auto dropDirDigestQuery = u8"delete from dir_digests where path = ?"_s;
+	// A path is less than the paths of its subdirectories, which start with it.
+	constexpr auto getDirsWithoutDigestQuery = u8"select path from dirs d "
+			"where not exists (select 1 from dir_digests g where g.path = d.path) order by path desc"_s;
+
+	int result;
+	int hasDirDigests;
 
-	logTrace("Creating the file table (if missing): "_s, createFileTableQuery);
-	result = sqlite3_exec(m_conn, createFileTableQuery.value(), nullptr, nullptr, nullptr);
+	logTrace("Opening connection to the DB "_s, dbPathInUtf8);
+	result = sqlite3_open_v2(dbPathInUtf8, &m_conn,
+			readOnly ? SQLITE_OPEN_READONLY : SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, nullptr);
 	logTrace("Result code: "_s, result);
 
 	if (result != SQLITE_OK) {
-		goto error_initFileTable;
+		goto error_openConn;
 	}
 
-	logTrace("Creating the directory index (if missing): "_s, createDirIndexQuery);
-	result = sqlite3_exec(m_conn, createDirIndexQuery.value(), nullptr, nullptr, nullptr);
+	logTrace("Initialising the DB schema..."_s);
+	result = initSchema(m_conn, readOnly);
 	logTrace("Result code: "_s, result);
 
 	if (result != SQLITE_OK) {
-		goto error_initDirIndex;
+		goto error_initSchema;
 	}
 
 	logTrace("Preparing statement to add a file: "_s, addFileQuery);
@@ -85,25 +237,117 @@ mirror::FileDB::FileDB(const char * const dbPathInUtf8)
 		goto error_getDirFilesStmt;
 	}
 
-	logTrace("Preparing statement to get all dirs: "_s, getDirFilesQuery);
-	result = sqlite3_prepare_v2(m_conn, getDirsQuery.value(), getDirsQuery.size(), &m_getDirsStmt, nullptr);
+	logTrace("Preparing statement to get a dir id: "_s, getDirIdQuery);
+	result = sqlite3_prepare_v2(m_conn, getDirIdQuery.value(), getDirIdQuery.size(), &m_getDirIdStmt, nullptr);
+	logTrace("Result code: "_s, result);
+
+	if (result != SQLITE_OK) {
+		goto error_getDirIdStmt;
+	}
+
+	logTrace("Preparing statement to add a dir: "_s, addDirQuery);
+	result = sqlite3_prepare_v2(m_conn, addDirQuery.value(), addDirQuery.size(), &m_addDirStmt, nullptr);
+	logTrace("Result code: "_s, result);
+
+	if (result != SQLITE_OK) {
+		goto error_addDirStmt;
+	}
+
+	logTrace("Preparing statement to remove a file: "_s, removeFileQuery);
+	result = sqlite3_prepare_v2(m_conn, removeFileQuery.value(), removeFileQuery.size(), &m_removeFileStmt, nullptr);
+	logTrace("Result code: "_s, result);
+
+	if (result != SQLITE_OK) {
+		goto error_removeFileStmt;
+	}
+
+	logTrace("Preparing statement to remove files from a directory: "_s, removeDirQuery);
+	result = sqlite3_prepare_v2(m_conn, removeDirQuery.value(), removeDirQuery.size(), &m_removeDirStmt, nullptr);
+	logTrace("Result code: "_s, result);
+
+	if (result != SQLITE_OK) {
+		goto error_removeDirStmt;
+	}
+
+	logTrace("Preparing statement to remove a dir: "_s, removeDirEntryQuery);
+	result = sqlite3_prepare_v2(m_conn, removeDirEntryQuery.value(), removeDirEntryQuery.size(),
+			&m_removeDirEntryStmt, nullptr);
+	logTrace("Result code: "_s, result);
+
+	if (result != SQLITE_OK) {
+		goto error_removeDirEntryStmt;
+	}
+
+	logTrace("Preparing statement to get a dir digest: "_s, getDirDigestQuery);
+	result = sqlite3_prepare_v2(m_conn, getDirDigestQuery.value(), getDirDigestQuery.size(),
+			&m_getDirDigestStmt, nullptr);
+	logTrace("Result code: "_s, result);
+
+	if (result != SQLITE_OK) {
+		goto error_getDirDigestStmt;
+	}
+
+	logTrace("Preparing statement to set a dir digest: "_s, setDirDigestQuery);
+	result = sqlite3_prepare_v2(m_conn, setDirDigestQuery.value(), setDirDigestQuery.size(),
+			&m_setDirDigestStmt, nullptr);
+	logTrace("Result code: "_s, result);
+
+	if (result != SQLITE_OK) {
+		goto error_setDirDigestStmt;
+	}
+
+	logTrace("Preparing statement to drop a dir digest: "_s, dropDirDigestQuery);
+	result = sqlite3_prepare_v2(m_conn, dropDirDigestQuery.value(), dropDirDigestQuery.size(),
+			&m_dropDirDigestStmt, nullptr);
+	logTrace("Result code: "_s, result);
+
+	if (result != SQLITE_OK) {
+		goto error_dropDirDigestStmt;
+	}
+
+	logTrace("Preparing statement to get dirs without digests: "_s, getDirsWithoutDigestQuery);
+	result = sqlite3_prepare_v2(m_conn, getDirsWithoutDigestQuery.value(), getDirsWithoutDigestQuery.size(),
+			&m_getDirsWithoutDigestStmt, nullptr);
 	logTrace("Result code: "_s, result);
 
 	if (result != SQLITE_OK) {
-		goto error_getDirsStmt;
+		goto error_getDirsWithoutDigestStmt;
+	}
+
+	result = queryInt(m_conn, u8"select exists (select 1 from dir_digests)", hasDirDigests);
+	if (result != SQLITE_OK) {
+		goto error_hasDirDigests;
 	}
+	m_hasDirDigests = hasDirDigests != 0;
 
 	return;
 
-error_getDirsStmt:
+error_hasDirDigests:
+	sqlite3_finalize(m_getDirsWithoutDigestStmt);
+error_getDirsWithoutDigestStmt:
+	sqlite3_finalize(m_dropDirDigestStmt);
+error_dropDirDigestStmt:
+	sqlite3_finalize(m_setDirDigestStmt);
+error_setDirDigestStmt:
+	sqlite3_finalize(m_getDirDigestStmt);
+error_getDirDigestStmt:
+	sqlite3_finalize(m_removeDirEntryStmt);
+error_removeDirEntryStmt:
+	sqlite3_finalize(m_removeDirStmt);
+error_removeDirStmt:
+	sqlite3_finalize(m_removeFileStmt);
+error_removeFileStmt:
+	sqlite3_finalize(m_addDirStmt);
+error_addDirStmt:
+	sqlite3_finalize(m_getDirIdStmt);
+error_getDirIdStmt:
 	sqlite3_finalize(m_getDirFilesStmt);
 error_getDirFilesStmt:
 	sqlite3_finalize(m_getFileStmt);
 error_getFileStmt:
 	sqlite3_finalize(m_addFileStmt);
 error_addFileStmt:
-error_initFileTable:
-error_initDirIndex:
+error_initSchema:
 	sqlite3_close(m_conn);
 error_openConn:
 	// TODO handle error.
@@ -116,62 +360,59 @@ void mirror::FileDB::addFile(const char * const fileNameU8, const std::size_t fi
 	assert(m_conn != nullptr);
 	assert(data.type == FileType::file || data.type == FileType::dir);
 
+	const mirror::stats::PhaseTimer timer(mirror::stats::Phase::dbWrite);
 	int result;
 
-	logTrace("Binding statement param 1..."_s);
-	result = sqlite3_bind_text(m_addFileStmt, 1, fileNameU8, fileNameSize, SQLITE_STATIC);
-	if (result != SQLITE_OK) {
-		goto handle_error;
-	}
+	// This is on the hot path of createDB() so there is only one trace message per file.
+	logTrace("Adding the file: {'"_s, Utf8ToSystemView(fileNameU8, fileNameSize), "', '"_s,
+			Utf8ToSystemView(dirNameU8, dirNameSize), "'}..."_s);
 
-	logTrace("Binding statement param 2..."_s);
-	result = sqlite3_bind_text(m_addFileStmt, 2, dirNameU8, dirNameSize, SQLITE_STATIC);
-	if (result != SQLITE_OK) {
-		goto handle_error;
+	// Files are added directory by directory so the id of the previous directory is usually the one needed.
+	if (m_lastDirId == 0 || m_lastDirU8.size() != dirNameSize ||
+			!std::equal(dirNameU8, dirNameU8 + dirNameSize, m_lastDirU8.data())) {
+		m_lastDirId = 0;
+		m_lastDirU8.assign(dirNameU8, dirNameSize);
+		m_lastDirId = getOrAddDirId(dirNameU8, dirNameSize);
+		// The same directory is not dropped again for each file since setDirDigest() resets the cache.
+		dropDirDigests(dirNameU8, dirNameSize);
 	}
 
-	logTrace("Binding statement param 3..."_s);
-	result = sqlite3_bind_int(m_addFileStmt, 3, static_cast<int>(data.type));
+	result = sqlite3_bind_int64(m_addFileStmt, 1, m_lastDirId);
 	if (result != SQLITE_OK) {
 		goto handle_error;
 	}
 
-	logTrace("Binding statement param 4..."_s);
-	switch (data.type) {
-	case FileType::file:
-		result = sqlite3_bind_int64(m_addFileStmt, 4, static_cast<sqlite_int64>(data.fileSize));
-		break;
-	case FileType::dir:
-		result = sqlite3_bind_null(m_addFileStmt, 4);
-		break;
-	default:
-		assert(false);
-	}
+	result = sqlite3_bind_text(m_addFileStmt, 2, fileNameU8, fileNameSize, SQLITE_STATIC);
 	if (result != SQLITE_OK) {
 		goto handle_error;
 	}
 
-	logTrace("Binding statement param 5..."_s);
-	switch (data.type) {
-	case FileType::file:
-		result = sqlite3_bind_int64(m_addFileStmt, 5, static_cast<sqlite_int64>(data.lastModifiedTS.millis() / 1000));
-		break;
-	case FileType::dir:
-		result = sqlite3_bind_null(m_addFileStmt, 5);
-		break;
-	default:
-		assert(false);
-	}
+	result = sqlite3_bind_int(m_addFileStmt, 3, static_cast<int>(data.type));
 	if (result != SQLITE_OK) {
 		goto handle_error;
 	}
 
-	logTrace("Binding statement param 6..."_s);
 	switch (data.type) {
 	case FileType::file:
+		result = sqlite3_bind_int64(m_addFileStmt, 4, static_cast<sqlite_int64>(data.fileSize));
+		if (result != SQLITE_OK) {
+			goto handle_error;
+		}
+		result = sqlite3_bind_int64(m_addFileStmt, 5, static_cast<sqlite_int64>(data.lastModifiedTS.millis() / 1000));
+		if (result != SQLITE_OK) {
+			goto handle_error;
+		}
 		result = sqlite3_bind_blob(m_addFileStmt, 6, data.crc64, sizeof(data.crc64), SQLITE_STATIC);
 		break;
 	case FileType::dir:
+		result = sqlite3_bind_null(m_addFileStmt, 4);
+		if (result != SQLITE_OK) {
+			goto handle_error;
+		}
+		result = sqlite3_bind_null(m_addFileStmt, 5);
+		if (result != SQLITE_OK) {
+			goto handle_error;
+		}
 		result = sqlite3_bind_null(m_addFileStmt, 6);
 		break;
 	default:
@@ -181,18 +422,23 @@ void mirror::FileDB::addFile(const char * const fileNameU8, const std::size_t fi
 		goto handle_error;
 	}
 
-	logTrace("Executing statement..."_s);
 	result = sqlite3_step(m_addFileStmt);
 	if (result != SQLITE_DONE) {
 		goto handle_error;
 	}
 
-	logTrace("Reseting statement..."_s);
 	result = sqlite3_reset(m_addFileStmt);
 	if (result != SQLITE_OK) {
 		goto handle_reset_error;
 	}
 
+	if (m_bulkBatchSize != 0 && ++m_bulkBatchRows == m_bulkBatchSize) {
+		logTrace("Committing the batch..."_s);
+		commit();
+		beginTransaction();
+		m_bulkBatchRows = 0;
+	}
+
 	return;
 
 handle_error:
@@ -204,12 +450,133 @@ handle_reset_error:
 	throw sqlite3_errstr(result);
 }
 
-void mirror::FileDB::getFiles(const char * const dirNameU8, const std::size_t dirNameSize, mirror::DirFileMap &dest)
+sqlite3_int64 mirror::FileDB::getDirId(const char * const dirNameU8, const std::size_t dirNameSize)
+{
+	int result;
+	sqlite3_int64 dirId;
+
+	result = sqlite3_bind_text(m_getDirIdStmt, 1, dirNameU8, dirNameSize, SQLITE_STATIC);
+	if (result != SQLITE_OK) {
+		goto handle_error;
+	}
+
+	result = sqlite3_step(m_getDirIdStmt);
+	if (result == SQLITE_ROW) {
+		dirId = sqlite3_column_int64(m_getDirIdStmt, 0);
+	} else if (result == SQLITE_DONE) {
+		dirId = 0;
+	} else {
+		goto handle_error;
+	}
+
+	result = sqlite3_reset(m_getDirIdStmt);
+	if (result != SQLITE_OK) {
+		goto handle_reset_error;
+	}
+	return dirId;
+
+handle_error:
+	// Attempting to reset the statement without overwriting the error code.
+	// TODO handle sqlite3_reset error code.
+	sqlite3_reset(m_getDirIdStmt);
+handle_reset_error:
+	throw sqlite3_errstr(result);
+}
+
+sqlite3_int64 mirror::FileDB::getOrAddDirId(const char * const dirNameU8, const std::size_t dirNameSize)
+{
+	int result;
+
+	const sqlite3_int64 dirId = getDirId(dirNameU8, dirNameSize);
+	if (dirId != 0) {
+		return dirId;
+	}
+
+	logTrace("Adding the dir: '"_s, Utf8ToSystemView(dirNameU8, dirNameSize), "'..."_s);
+
+	result = sqlite3_bind_text(m_addDirStmt, 1, dirNameU8, dirNameSize, SQLITE_STATIC);
+	if (result != SQLITE_OK) {
+		goto handle_addDir_error;
+	}
+
+	result = sqlite3_step(m_addDirStmt);
+	if (result != SQLITE_DONE) {
+		goto handle_addDir_error;
+	}
+
+	result = sqlite3_reset(m_addDirStmt);
+	if (result != SQLITE_OK) {
+		goto handle_reset_error;
+	}
+
+	return sqlite3_last_insert_rowid(m_conn);
+
+handle_addDir_error:
+	// TODO handle sqlite3_reset error code.
+	sqlite3_reset(m_addDirStmt);
+handle_reset_error:
+	throw sqlite3_errstr(result);
+}
+
+void mirror::FileDB::beginBulkLoad(const std::size_t batchSize)
+{
+	assert(m_bulkBatchSize == 0);
+	assert(batchSize > 0);
+
+	logTrace("Starting bulk load..."_s);
+	execute(u8"pragma journal_mode = wal");
+	/*
+	 * A crash of the OS could lose or corrupt the batches committed without syncing, which is no matter if
+	 * the load is simply started again, but not if it is to be resumed from its checkpoints. WAL keeps
+	 * the DB consistent with the normal mode, which syncs only when the WAL is checkpointed.
+	 */
+	execute(m_markDirDoneStmt != nullptr ? u8"pragma synchronous = normal" : u8"pragma synchronous = off");
+	// Negative values are in KiB.
+	execute(u8"pragma cache_size = -262144");
+	beginTransaction();
+
+	m_bulkBatchSize = batchSize;
+	m_bulkBatchRows = 0;
+}
+
+void mirror::FileDB::endBulkLoad(void)
+{
+	finishBulkLoad(u8"commit");
+}
+
+void mirror::FileDB::abortBulkLoad(void)
+{
+	assert(m_conn != nullptr);
+	// Rolling back with no transaction open fails, which would hide the error the load is aborted for.
+	finishBulkLoad(sqlite3_get_autocommit(m_conn) != 0 ? nullptr : u8"rollback");
+}
+
+void mirror::FileDB::finishBulkLoad(const char * const lastBatchQueryU8)
+{
+	assert(m_bulkBatchSize != 0);
+
+	m_bulkBatchSize = 0;
+	// The id cached could belong to a directory that is rolled back.
+	m_lastDirId = 0;
+
+	logTrace("Finishing bulk load..."_s);
+	if (lastBatchQueryU8 != nullptr) {
+		execute(lastBatchQueryU8);
+	}
+	execute(u8"pragma synchronous = full");
+	// Going back to the rollback journal keeps the DB self-contained in a single file.
+	execute(u8"pragma journal_mode = delete");
+}
+
+template<typename RecordAllocator>
+void mirror::FileDB::readDirFiles(const char * const dirNameU8, const std::size_t dirNameSize,
+		RecordAllocator &&allocate)
 {
 	using CRC64View = afc::logger::HexEncodedN<sizeof(mirror::FileRecord::crc64)>;
 
 	assert(m_conn != nullptr);
 
+	const mirror::stats::PhaseTimer timer(mirror::stats::Phase::dbRead);
 	int result;
 
 	logTrace("Binding statement param 1..."_s);
@@ -228,7 +595,7 @@ void mirror::FileDB::getFiles(const char * const dirNameU8, const std::size_t di
 
 			const char * const fileNameU8 = reinterpret_cast<const char *>(sqlite3_column_text(m_getDirFilesStmt, 0));
 			std::size_t fileNameU8Size = sqlite3_column_bytes(m_getDirFilesStmt, 0);
-			FileRecord &fileRec = dest[PathKey(fileNameU8, fileNameU8Size)];
+			FileRecord &fileRec = allocate(fileNameU8, fileNameU8Size);
 			fileRec.type = static_cast<FileType>(sqlite3_column_int(m_getDirFilesStmt, 1));
 
 			switch (fileRec.type) {
@@ -236,7 +603,8 @@ void mirror::FileDB::getFiles(const char * const dirNameU8, const std::size_t di
 				fileRec.fileSize = sqlite3_column_int64(m_getDirFilesStmt, 2);
 				fileRec.lastModifiedTS.setMillis(sqlite3_column_int64(m_getDirFilesStmt, 3) * 1000);
 
-				const unsigned char *crc64 = reinterpret_cast<const unsigned char *>(sqlite3_column_blob(m_getDirFilesStmt, 4));
+				const unsigned char *crc64 = reinterpret_cast<const unsigned char *>(
+						sqlite3_column_blob(m_getDirFilesStmt, 4));
 				assert(sqlite3_column_bytes(m_getDirFilesStmt, 4) == sizeof(mirror::FileRecord::crc64));
 				std::copy_n(crc64, sizeof(mirror::FileRecord::crc64), fileRec.crc64);
 
@@ -276,33 +644,102 @@ handle_reset_error:
 	throw sqlite3_errstr(result);
 }
 
-void mirror::FileDB::getDirs(mirror::DirSet &dest)
+bool mirror::FileDB::getFile(const char * const fileNameU8, const std::size_t fileNameSize,
+		const char * const dirNameU8, const std::size_t dirNameSize, FileRecord &dest)
 {
 	assert(m_conn != nullptr);
 
+	const mirror::stats::PhaseTimer timer(mirror::stats::Phase::dbRead);
+	bool found = false;
 	int result;
 
-	// TODO make this code exception-safe.
-	logTrace("Executing statement..."_s);
-	for (;;) {
-		result = sqlite3_step(m_getDirsStmt);
-		if (result == SQLITE_ROW) {
-			const char * const dirNameU8 = reinterpret_cast<const char *>(sqlite3_column_text(m_getDirsStmt, 0));
-			PathKey key(dirNameU8, false);
+	result = sqlite3_bind_text(m_getFileStmt, 1, fileNameU8, fileNameSize, SQLITE_STATIC);
+	if (result != SQLITE_OK) {
+		goto handle_error;
+	}
+	result = sqlite3_bind_text(m_getFileStmt, 2, dirNameU8, dirNameSize, SQLITE_STATIC);
+	if (result != SQLITE_OK) {
+		goto handle_error;
+	}
 
-			logTrace("Dir found: '"_s, Utf8ToSystemView(key.data, key.size), "'..."_s);
+	result = sqlite3_step(m_getFileStmt);
+	if (result == SQLITE_ROW) {
+		found = true;
+		dest.type = static_cast<FileType>(sqlite3_column_int(m_getFileStmt, 0));
+		if (dest.type == FileType::file) {
+			dest.fileSize = sqlite3_column_int64(m_getFileStmt, 1);
+			dest.lastModifiedTS.setMillis(sqlite3_column_int64(m_getFileStmt, 2) * 1000);
 
-			dest.emplace(std::move(key));
-		} else if (result == SQLITE_DONE) {
-			logTrace("Reading result set done."_s);
-			break;
-		} else {
-			goto handle_error;
+			const unsigned char *crc64 = reinterpret_cast<const unsigned char *>(sqlite3_column_blob(m_getFileStmt, 3));
+			assert(sqlite3_column_bytes(m_getFileStmt, 3) == sizeof(mirror::FileRecord::crc64));
+			std::copy_n(crc64, sizeof(mirror::FileRecord::crc64), dest.crc64);
 		}
+	} else if (result != SQLITE_DONE) {
+		goto handle_error;
+	}
+
+	result = sqlite3_reset(m_getFileStmt);
+	if (result != SQLITE_OK) {
+		goto handle_reset_error;
+	}
+
+	return found;
+
+handle_error:
+	// Attempting to reset the statement without overwriting the error code.
+	// TODO handle sqlite3_reset error code.
+	sqlite3_reset(m_getFileStmt);
+handle_reset_error:
+	throw sqlite3_errstr(result);
+}
+
+void mirror::FileDB::getFiles(const char * const dirNameU8, const std::size_t dirNameSize, mirror::DirFileMap &dest)
+{
+	readDirFiles(dirNameU8, dirNameSize, [&dest](const char * const fileNameU8, const std::size_t fileNameSize)
+			-> FileRecord & { return dest[PathKey(fileNameU8, fileNameSize, dest.names)]; });
+}
+
+void mirror::FileDB::getFiles(const char * const dirNameU8, const std::size_t dirNameSize,
+		mirror::SortedDirFiles &dest)
+{
+	readDirFiles(dirNameU8, dirNameSize, [&dest](const char * const fileNameU8, const std::size_t fileNameSize)
+			-> FileRecord &
+	{
+		dest.entries.push_back(SortedDirFiles::Entry{dest.names.copy(fileNameU8, fileNameSize), fileNameSize,
+				FileRecord()});
+		return dest.entries.back().record;
+	});
+}
+
+void mirror::FileDB::removeFile(const char * const fileNameU8, const std::size_t fileNameSize,
+		const char * const dirNameU8, const std::size_t dirNameSize)
+{
+	assert(m_conn != nullptr);
+
+	int result;
+
+	dropDirDigests(dirNameU8, dirNameSize);
+
+	logTrace("Binding statement param 1..."_s);
+	result = sqlite3_bind_text(m_removeFileStmt, 1, fileNameU8, fileNameSize, SQLITE_STATIC);
+	if (result != SQLITE_OK) {
+		goto handle_error;
+	}
+
+	logTrace("Binding statement param 2..."_s);
+	result = sqlite3_bind_text(m_removeFileStmt, 2, dirNameU8, dirNameSize, SQLITE_STATIC);
+	if (result != SQLITE_OK) {
+		goto handle_error;
+	}
+
+	logTrace("Executing statement..."_s);
+	result = sqlite3_step(m_removeFileStmt);
+	if (result != SQLITE_DONE) {
+		goto handle_error;
 	}
 
 	logTrace("Reseting statement..."_s);
-	result = sqlite3_reset(m_getDirsStmt);
+	result = sqlite3_reset(m_removeFileStmt);
 	if (result != SQLITE_OK) {
 		goto handle_reset_error;
 	}
@@ -313,7 +750,810 @@ handle_error:
 	// Attempting to reset the statement without overwriting the error code.
 	logTrace("Reseting statement..."_s);
 	// TODO handle sqlite3_reset error code.
-	sqlite3_reset(m_getDirsStmt);
+	sqlite3_reset(m_removeFileStmt);
 handle_reset_error:
 	throw sqlite3_errstr(result);
 }
+
+void mirror::FileDB::removeDir(const char * const dirNameU8, const std::size_t dirNameSize)
+{
+	assert(m_conn != nullptr);
+
+	int result;
+
+	dropDirDigests(dirNameU8, dirNameSize);
+
+	logTrace("Binding statement param 1..."_s);
+	result = sqlite3_bind_text(m_removeDirStmt, 1, dirNameU8, dirNameSize, SQLITE_STATIC);
+	if (result != SQLITE_OK) {
+		goto handle_error;
+	}
+
+	logTrace("Executing statement..."_s);
+	result = sqlite3_step(m_removeDirStmt);
+	if (result != SQLITE_DONE) {
+		goto handle_error;
+	}
+
+	logTrace("Reseting statement..."_s);
+	result = sqlite3_reset(m_removeDirStmt);
+	if (result != SQLITE_OK) {
+		goto handle_reset_error;
+	}
+
+	m_lastDirId = 0;
+
+	logTrace("Binding statement param 1..."_s);
+	result = sqlite3_bind_text(m_removeDirEntryStmt, 1, dirNameU8, dirNameSize, SQLITE_STATIC);
+	if (result != SQLITE_OK) {
+		goto handle_entry_error;
+	}
+
+	logTrace("Executing statement..."_s);
+	result = sqlite3_step(m_removeDirEntryStmt);
+	if (result != SQLITE_DONE) {
+		goto handle_entry_error;
+	}
+
+	logTrace("Reseting statement..."_s);
+	result = sqlite3_reset(m_removeDirEntryStmt);
+	if (result != SQLITE_OK) {
+		goto handle_reset_error;
+	}
+
+	return;
+
+handle_error:
+	// Attempting to reset the statement without overwriting the error code.
+	logTrace("Reseting statement..."_s);
+	// TODO handle sqlite3_reset error code.
+	sqlite3_reset(m_removeDirStmt);
+	throw sqlite3_errstr(result);
+handle_entry_error:
+	logTrace("Reseting statement..."_s);
+	// TODO handle sqlite3_reset error code.
+	sqlite3_reset(m_removeDirEntryStmt);
+handle_reset_error:
+	throw sqlite3_errstr(result);
+}
+
+void mirror::FileDB::removeSubtree(const char * const dirNameU8, const std::size_t dirNameSize)
+{
+	// The subdirectories are the paths that start with the directory and slash, which is followed by '0'.
+	constexpr const char *removeSubtreeQueries[] = {
+		u8"delete from files where dir_id in (select id from dirs "
+				"where path = ?1 or (path > ?1 || '/' and path < ?1 || '0'))",
+		u8"delete from dirs where path = ?1 or (path > ?1 || '/' and path < ?1 || '0')",
+		u8"delete from dir_digests where path > ?1 || '/' and path < ?1 || '0'"
+	};
+
+	assert(m_conn != nullptr);
+	assert(dirNameSize > 0);
+
+	logTrace("Removing the subtree '"_s, Utf8ToSystemView(dirNameU8, dirNameSize), "'..."_s);
+
+	// The directory itself is dropped together with its ancestors.
+	dropDirDigests(dirNameU8, dirNameSize);
+
+	for (const char * const query : removeSubtreeQueries) {
+		execute(query, dirNameU8, dirNameSize);
+	}
+
+	m_lastDirId = 0;
+}
+
+void mirror::FileDB::execute(const char * const queryU8, const char * const paramU8, const std::size_t paramSize)
+{
+	assert(m_conn != nullptr);
+
+	sqlite3_stmt *stmt;
+	int result = sqlite3_prepare_v2(m_conn, queryU8, -1, &stmt, nullptr);
+	if (result != SQLITE_OK) {
+		throw sqlite3_errstr(result);
+	}
+
+	result = sqlite3_bind_text(stmt, 1, paramU8, paramSize, SQLITE_STATIC);
+	if (result == SQLITE_OK) {
+		result = sqlite3_step(stmt);
+	}
+	// TODO handle sqlite3_finalize error code.
+	sqlite3_finalize(stmt);
+	if (result != SQLITE_DONE) {
+		throw sqlite3_errstr(result);
+	}
+}
+
+void mirror::FileDB::beginDirTracking(const char * const subtreeU8, const std::size_t subtreeSize)
+{
+	// Directories whose files are all removed are left in dirs by removeFile() so they are filtered out here.
+	constexpr auto markDirVisitedQuery = u8"insert or ignore into temp.visited_dirs (path) values (?)"_s;
+	constexpr auto getUnvisitedDirsQuery = u8"select path from dirs d "
+			"where exists (select 1 from files where dir_id = d.id) "
+			"and not exists (select 1 from temp.visited_dirs v where v.path = d.path)"_s;
+	// The same as removeSubtree() does, so that only the range of the subtree is read from the index on path.
+	constexpr auto getUnvisitedSubtreeDirsQuery = u8"select path from dirs d "
+			"where (path = ?1 or (path > ?1 || '/' and path < ?1 || '0')) "
+			"and exists (select 1 from files where dir_id = d.id) "
+			"and not exists (select 1 from temp.visited_dirs v where v.path = d.path)"_s;
+
+	assert(m_conn != nullptr);
+
+	int result;
+
+	endDirTracking();
+	m_trackedSubtreeU8.assign(subtreeU8, subtreeSize);
+
+	/* Visited directories are identified by path rather than by id since the ones new to the DB get their
+	 * ids only when their first files are added, which is after they are visited.
+	 */
+	execute(u8"create temp table visited_dirs (path text primary key) without rowid");
+	// The table is dropped at the end anyway, so its changes need not be journalled.
+	execute(u8"pragma temp.journal_mode = off");
+
+	logTrace("Preparing statement to mark a dir visited: "_s, markDirVisitedQuery);
+	result = sqlite3_prepare_v2(m_conn, markDirVisitedQuery.value(), markDirVisitedQuery.size(),
+			&m_markDirVisitedStmt, nullptr);
+	logTrace("Result code: "_s, result);
+
+	if (result != SQLITE_OK) {
+		goto handle_error;
+	}
+
+	if (m_trackedSubtreeU8.empty()) {
+		logTrace("Preparing statement to get unvisited dirs: "_s, getUnvisitedDirsQuery);
+		result = sqlite3_prepare_v2(m_conn, getUnvisitedDirsQuery.value(), getUnvisitedDirsQuery.size(),
+				&m_getUnvisitedDirsStmt, nullptr);
+	} else {
+		logTrace("Preparing statement to get unvisited dirs: "_s, getUnvisitedSubtreeDirsQuery);
+		result = sqlite3_prepare_v2(m_conn, getUnvisitedSubtreeDirsQuery.value(), getUnvisitedSubtreeDirsQuery.size(),
+				&m_getUnvisitedDirsStmt, nullptr);
+		if (result == SQLITE_OK) {
+			// The binding is kept when the statement is reset.
+			result = sqlite3_bind_text(m_getUnvisitedDirsStmt, 1, m_trackedSubtreeU8.data(), m_trackedSubtreeU8.size(),
+					SQLITE_STATIC);
+		}
+	}
+	logTrace("Result code: "_s, result);
+
+	if (result != SQLITE_OK) {
+		goto handle_error;
+	}
+
+	return;
+
+handle_error:
+	// TODO handle endDirTracking error.
+	endDirTracking();
+	throw sqlite3_errstr(result);
+}
+
+void mirror::FileDB::markDirVisited(const char * const dirNameU8, const std::size_t dirNameSize)
+{
+	assert(m_conn != nullptr);
+	assert(m_markDirVisitedStmt != nullptr);
+
+	int result;
+
+	logTrace("Binding statement param 1..."_s);
+	result = sqlite3_bind_text(m_markDirVisitedStmt, 1, dirNameU8, dirNameSize, SQLITE_STATIC);
+	if (result != SQLITE_OK) {
+		goto handle_error;
+	}
+
+	logTrace("Executing statement..."_s);
+	result = sqlite3_step(m_markDirVisitedStmt);
+	if (result != SQLITE_DONE) {
+		goto handle_error;
+	}
+
+	logTrace("Reseting statement..."_s);
+	result = sqlite3_reset(m_markDirVisitedStmt);
+	if (result != SQLITE_OK) {
+		goto handle_reset_error;
+	}
+
+	return;
+
+handle_error:
+	// Attempting to reset the statement without overwriting the error code.
+	logTrace("Reseting statement..."_s);
+	// TODO handle sqlite3_reset error code.
+	sqlite3_reset(m_markDirVisitedStmt);
+handle_reset_error:
+	throw sqlite3_errstr(result);
+}
+
+bool mirror::FileDB::nextUnvisitedDir(const char *&dirNameU8, std::size_t &dirNameSize)
+{
+	assert(m_conn != nullptr);
+	assert(m_getUnvisitedDirsStmt != nullptr);
+
+	int result;
+
+	result = sqlite3_step(m_getUnvisitedDirsStmt);
+	if (result == SQLITE_ROW) {
+		dirNameU8 = reinterpret_cast<const char *>(sqlite3_column_text(m_getUnvisitedDirsStmt, 0));
+		dirNameSize = sqlite3_column_bytes(m_getUnvisitedDirsStmt, 0);
+
+		logTrace("Unvisited dir found: '"_s, Utf8ToSystemView(dirNameU8, dirNameSize), "'..."_s);
+		return true;
+	} else if (result != SQLITE_DONE) {
+		goto handle_error;
+	}
+
+	logTrace("Reading result set done."_s);
+	logTrace("Reseting statement..."_s);
+	result = sqlite3_reset(m_getUnvisitedDirsStmt);
+	if (result != SQLITE_OK) {
+		goto handle_reset_error;
+	}
+
+	return false;
+
+handle_error:
+	// Attempting to reset the statement without overwriting the error code.
+	logTrace("Reseting statement..."_s);
+	// TODO handle sqlite3_reset error code.
+	sqlite3_reset(m_getUnvisitedDirsStmt);
+handle_reset_error:
+	throw sqlite3_errstr(result);
+}
+
+void mirror::FileDB::removeUnvisitedDirs(void)
+{
+	assert(m_conn != nullptr);
+	assert(m_markDirVisitedStmt != nullptr);
+
+	// The cursor could be left in the middle of the result set.
+	// TODO handle sqlite3_reset error code.
+	sqlite3_reset(m_getUnvisitedDirsStmt);
+
+	logTrace("Removing unvisited dirs..."_s);
+	// The parents of the directories removed are visited, so their digests are dropped as their entries are.
+	if (m_trackedSubtreeU8.empty()) {
+		execute(u8"delete from files where dir_id in (select id from dirs d "
+				"where not exists (select 1 from temp.visited_dirs v where v.path = d.path))");
+		execute(u8"delete from dirs where not exists (select 1 from temp.visited_dirs v where v.path = dirs.path)");
+		execute(u8"delete from dir_digests "
+				"where not exists (select 1 from temp.visited_dirs v where v.path = dir_digests.path)");
+	} else {
+		execute(u8"delete from files where dir_id in (select id from dirs d "
+				"where (path = ?1 or (path > ?1 || '/' and path < ?1 || '0')) "
+				"and not exists (select 1 from temp.visited_dirs v where v.path = d.path))",
+				m_trackedSubtreeU8.data(), m_trackedSubtreeU8.size());
+		execute(u8"delete from dirs where (path = ?1 or (path > ?1 || '/' and path < ?1 || '0')) "
+				"and not exists (select 1 from temp.visited_dirs v where v.path = dirs.path)",
+				m_trackedSubtreeU8.data(), m_trackedSubtreeU8.size());
+		execute(u8"delete from dir_digests where (path = ?1 or (path > ?1 || '/' and path < ?1 || '0')) "
+				"and not exists (select 1 from temp.visited_dirs v where v.path = dir_digests.path)",
+				m_trackedSubtreeU8.data(), m_trackedSubtreeU8.size());
+	}
+
+	m_lastDirId = 0;
+}
+
+void mirror::FileDB::endDirTracking(void)
+{
+	assert(m_conn != nullptr);
+
+	// TODO handle result codes.
+	sqlite3_finalize(m_getUnvisitedDirsStmt);
+	sqlite3_finalize(m_markDirVisitedStmt);
+	m_getUnvisitedDirsStmt = nullptr;
+	m_markDirVisitedStmt = nullptr;
+	m_trackedSubtreeU8.clear();
+
+	execute(u8"drop table if exists temp.visited_dirs");
+}
+
+bool mirror::FileDB::beginCheckpoints(const char * const toolU8, const char * const rootDirU8,
+		const std::size_t rootDirSize, const std::chrono::seconds interval, const bool resume)
+{
+	constexpr auto getCheckpointQuery = u8"select count(*) from checkpoint where tool = ?1 and root = ?2"_s;
+	constexpr auto addCheckpointQuery = u8"insert into checkpoint (tool, root) values (?1, ?2)"_s;
+	constexpr auto markDirDoneQuery = u8"insert or replace into checkpoint_dirs (path, subtree) values (?, ?)"_s;
+	constexpr auto getDirProgressQuery = u8"select subtree from checkpoint_dirs where path = ?"_s;
+
+	assert(m_conn != nullptr);
+	assert(interval.count() >= 0);
+
+	int result;
+	sqlite3_stmt *stmt;
+	bool resumed;
+
+	endCheckpoints(false);
+
+	if (resume) {
+		int hasCheckpoint;
+		result = queryInt(m_conn, u8"select count(*) from sqlite_master where type = 'table' and name = 'checkpoint'",
+				hasCheckpoint);
+		if (result != SQLITE_OK) {
+			throw sqlite3_errstr(result);
+		}
+		if (hasCheckpoint == 0) {
+			return false;
+		}
+	}
+
+	execute(u8"create table if not exists checkpoint (tool text not null, root text not null)");
+	execute(u8"create table if not exists checkpoint_dirs (path text primary key, subtree integer not null) "
+			"without rowid");
+
+	logTrace("Preparing statement to get a checkpoint: "_s, getCheckpointQuery);
+	result = sqlite3_prepare_v2(m_conn, getCheckpointQuery.value(), getCheckpointQuery.size(), &stmt, nullptr);
+	logTrace("Result code: "_s, result);
+
+	if (result != SQLITE_OK) {
+		throw sqlite3_errstr(result);
+	}
+
+	result = sqlite3_bind_text(stmt, 1, toolU8, -1, SQLITE_STATIC);
+	if (result != SQLITE_OK) {
+		goto handle_stmt_error;
+	}
+	result = sqlite3_bind_text(stmt, 2, rootDirU8, rootDirSize, SQLITE_STATIC);
+	if (result != SQLITE_OK) {
+		goto handle_stmt_error;
+	}
+
+	result = sqlite3_step(stmt);
+	if (result != SQLITE_ROW) {
+		goto handle_stmt_error;
+	}
+	resumed = resume && sqlite3_column_int(stmt, 0) != 0;
+
+	// TODO handle sqlite3_finalize error code.
+	sqlite3_finalize(stmt);
+	stmt = nullptr;
+
+	if (resume && !resumed) {
+		return false;
+	}
+
+	if (!resumed) {
+		logDebug("Starting a new checkpointed walk..."_s);
+		beginTransaction();
+		try {
+			execute(u8"delete from checkpoint_dirs");
+			execute(u8"delete from checkpoint");
+
+			result = sqlite3_prepare_v2(m_conn, addCheckpointQuery.value(), addCheckpointQuery.size(), &stmt, nullptr);
+			if (result != SQLITE_OK) {
+				throw sqlite3_errstr(result);
+			}
+			result = sqlite3_bind_text(stmt, 1, toolU8, -1, SQLITE_STATIC);
+			if (result == SQLITE_OK) {
+				result = sqlite3_bind_text(stmt, 2, rootDirU8, rootDirSize, SQLITE_STATIC);
+			}
+			if (result == SQLITE_OK) {
+				result = sqlite3_step(stmt);
+			}
+			// TODO handle sqlite3_finalize error code.
+			sqlite3_finalize(stmt);
+			stmt = nullptr;
+			if (result != SQLITE_DONE) {
+				throw sqlite3_errstr(result);
+			}
+
+			commit();
+		}
+		catch (...) {
+			// TODO handle rollback error.
+			rollback();
+			throw;
+		}
+	} else {
+		logDebug("Resuming the walk from the last checkpoint..."_s);
+	}
+
+	logTrace("Preparing statement to mark a dir done: "_s, markDirDoneQuery);
+	result = sqlite3_prepare_v2(m_conn, markDirDoneQuery.value(), markDirDoneQuery.size(),
+			&m_markDirDoneStmt, nullptr);
+	logTrace("Result code: "_s, result);
+
+	if (result != SQLITE_OK) {
+		goto handle_error;
+	}
+
+	logTrace("Preparing statement to get the progress of a dir: "_s, getDirProgressQuery);
+	result = sqlite3_prepare_v2(m_conn, getDirProgressQuery.value(), getDirProgressQuery.size(),
+			&m_getDirProgressStmt, nullptr);
+	logTrace("Result code: "_s, result);
+
+	if (result != SQLITE_OK) {
+		goto handle_error;
+	}
+
+	m_checkpointInterval = interval;
+	m_lastCheckpoint = std::chrono::steady_clock::now();
+
+	return resumed;
+
+handle_stmt_error:
+	// TODO handle sqlite3_finalize error code.
+	sqlite3_finalize(stmt);
+	throw sqlite3_errstr(result);
+handle_error:
+	// TODO handle endCheckpoints error.
+	endCheckpoints(false);
+	throw sqlite3_errstr(result);
+}
+
+void mirror::FileDB::markDirDone(const char * const dirNameU8, const std::size_t dirNameSize, const bool subtree)
+{
+	assert(m_conn != nullptr);
+	assert(m_markDirDoneStmt != nullptr);
+
+	int result;
+
+	{
+		const mirror::stats::PhaseTimer timer(mirror::stats::Phase::dbWrite);
+
+		logTrace("Marking the dir '"_s, Utf8ToSystemView(dirNameU8, dirNameSize), "' done..."_s);
+		result = sqlite3_bind_text(m_markDirDoneStmt, 1, dirNameU8, dirNameSize, SQLITE_STATIC);
+		if (result != SQLITE_OK) {
+			goto handle_error;
+		}
+		result = sqlite3_bind_int(m_markDirDoneStmt, 2, subtree ? 1 : 0);
+		if (result != SQLITE_OK) {
+			goto handle_error;
+		}
+
+		result = sqlite3_step(m_markDirDoneStmt);
+		if (result != SQLITE_DONE) {
+			goto handle_error;
+		}
+
+		result = sqlite3_reset(m_markDirDoneStmt);
+		if (result != SQLITE_OK) {
+			goto handle_reset_error;
+		}
+	}
+
+	{
+		const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		if (now - m_lastCheckpoint >= m_checkpointInterval) {
+			logTrace("Committing the checkpoint..."_s);
+			const mirror::stats::PhaseTimer timer(mirror::stats::Phase::dbWrite);
+			commit();
+			beginTransaction();
+			// The batch of a bulk load is committed too.
+			m_bulkBatchRows = 0;
+			m_lastCheckpoint = now;
+		}
+	}
+
+	return;
+
+handle_error:
+	// Attempting to reset the statement without overwriting the error code.
+	logTrace("Reseting statement..."_s);
+	// TODO handle sqlite3_reset error code.
+	sqlite3_reset(m_markDirDoneStmt);
+handle_reset_error:
+	throw sqlite3_errstr(result);
+}
+
+mirror::FileDB::DirProgress mirror::FileDB::getDirProgress(const char * const dirNameU8, const std::size_t dirNameSize)
+{
+	assert(m_conn != nullptr);
+	assert(m_getDirProgressStmt != nullptr);
+
+	const mirror::stats::PhaseTimer timer(mirror::stats::Phase::dbRead);
+
+	int result;
+	DirProgress progress;
+
+	result = sqlite3_bind_text(m_getDirProgressStmt, 1, dirNameU8, dirNameSize, SQLITE_STATIC);
+	if (result != SQLITE_OK) {
+		goto handle_error;
+	}
+
+	result = sqlite3_step(m_getDirProgressStmt);
+	if (result == SQLITE_ROW) {
+		progress = sqlite3_column_int(m_getDirProgressStmt, 0) != 0 ? DirProgress::subtree : DirProgress::dir;
+	} else if (result == SQLITE_DONE) {
+		progress = DirProgress::none;
+	} else {
+		goto handle_error;
+	}
+
+	result = sqlite3_reset(m_getDirProgressStmt);
+	if (result != SQLITE_OK) {
+		goto handle_reset_error;
+	}
+
+	return progress;
+
+handle_error:
+	// Attempting to reset the statement without overwriting the error code.
+	// TODO handle sqlite3_reset error code.
+	sqlite3_reset(m_getDirProgressStmt);
+handle_reset_error:
+	throw sqlite3_errstr(result);
+}
+
+void mirror::FileDB::markDoneDirsVisited(void)
+{
+	assert(m_conn != nullptr);
+	assert(m_markDirVisitedStmt != nullptr);
+	assert(m_markDirDoneStmt != nullptr);
+
+	execute(u8"insert or ignore into temp.visited_dirs (path) select path from checkpoint_dirs");
+}
+
+void mirror::FileDB::endCheckpoints(const bool completed)
+{
+	assert(m_conn != nullptr);
+
+	// TODO handle result codes.
+	sqlite3_finalize(m_getDirProgressStmt);
+	sqlite3_finalize(m_markDirDoneStmt);
+	m_getDirProgressStmt = nullptr;
+	m_markDirDoneStmt = nullptr;
+
+	if (completed) {
+		logDebug("The walk is completed, dropping the checkpoints..."_s);
+		execute(u8"drop table if exists checkpoint_dirs");
+		execute(u8"drop table if exists checkpoint");
+	}
+}
+
+void mirror::FileDB::beginContentLookups(void)
+{
+	// The root directory is stored as an empty path, so its files are joined with no slash.
+	constexpr auto findByContentQuery = u8"select case when d.path = '' then f.file else d.path || '/' || f.file end "
+			"from files f join dirs d on d.id = f.dir_id where f.size = ? and f.crc64 = ? and f.type = 0 limit ?"_s;
+
+	assert(m_conn != nullptr);
+	assert(m_findByContentStmt == nullptr);
+
+	logDebug("Indexing the files by their contents..."_s);
+	execute(u8"create index if not exists files_content on files (size, crc64)");
+
+	int result = sqlite3_prepare_v2(m_conn, findByContentQuery.value(), findByContentQuery.size(),
+			&m_findByContentStmt, nullptr);
+	if (result != SQLITE_OK) {
+		m_findByContentStmt = nullptr;
+		throw sqlite3_errstr(result);
+	}
+}
+
+void mirror::FileDB::findFilesByContent(const off_t size, const unsigned char (&crc64)[sizeof(FileRecord::crc64)],
+		const std::size_t maxCount, std::vector<std::string> &dest)
+{
+	assert(m_conn != nullptr);
+	assert(m_findByContentStmt != nullptr);
+
+	const mirror::stats::PhaseTimer timer(mirror::stats::Phase::dbRead);
+	int result;
+
+	result = sqlite3_bind_int64(m_findByContentStmt, 1, static_cast<sqlite_int64>(size));
+	if (result != SQLITE_OK) {
+		goto handle_error;
+	}
+	result = sqlite3_bind_blob(m_findByContentStmt, 2, crc64, sizeof(crc64), SQLITE_STATIC);
+	if (result != SQLITE_OK) {
+		goto handle_error;
+	}
+	result = sqlite3_bind_int64(m_findByContentStmt, 3, static_cast<sqlite_int64>(maxCount));
+	if (result != SQLITE_OK) {
+		goto handle_error;
+	}
+
+	for (;;) {
+		result = sqlite3_step(m_findByContentStmt);
+		if (result == SQLITE_ROW) {
+			dest.emplace_back(reinterpret_cast<const char *>(sqlite3_column_text(m_findByContentStmt, 0)),
+					static_cast<std::size_t>(sqlite3_column_bytes(m_findByContentStmt, 0)));
+		} else if (result == SQLITE_DONE) {
+			break;
+		} else {
+			goto handle_error;
+		}
+	}
+
+	result = sqlite3_reset(m_findByContentStmt);
+	if (result != SQLITE_OK) {
+		goto handle_reset_error;
+	}
+	return;
+
+handle_error:
+	// Attempting to reset the statement without overwriting the error code.
+	// TODO handle sqlite3_reset error code.
+	sqlite3_reset(m_findByContentStmt);
+handle_reset_error:
+	throw sqlite3_errstr(result);
+}
+
+bool mirror::FileDB::getDirDigest(const char * const dirNameU8, const std::size_t dirNameSize,
+		unsigned char (&dest)[sizeof(FileRecord::crc64)])
+{
+	assert(m_conn != nullptr);
+
+	const mirror::stats::PhaseTimer timer(mirror::stats::Phase::dbRead);
+	int result;
+	bool found = false;
+
+	result = sqlite3_bind_text(m_getDirDigestStmt, 1, dirNameU8, dirNameSize, SQLITE_STATIC);
+	if (result != SQLITE_OK) {
+		goto handle_error;
+	}
+
+	result = sqlite3_step(m_getDirDigestStmt);
+	if (result == SQLITE_ROW) {
+		const void * const crc64 = sqlite3_column_blob(m_getDirDigestStmt, 0);
+		// Digests of some other size cannot be produced by mirror so they are treated as missing.
+		found = crc64 != nullptr && sqlite3_column_bytes(m_getDirDigestStmt, 0) == sizeof(dest);
+		if (found) {
+			std::memcpy(dest, crc64, sizeof(dest));
+		}
+	} else if (result != SQLITE_DONE) {
+		goto handle_error;
+	}
+
+	result = sqlite3_reset(m_getDirDigestStmt);
+	if (result != SQLITE_OK) {
+		goto handle_reset_error;
+	}
+	return found;
+
+handle_error:
+	// Attempting to reset the statement without overwriting the error code.
+	// TODO handle sqlite3_reset error code.
+	sqlite3_reset(m_getDirDigestStmt);
+handle_reset_error:
+	throw sqlite3_errstr(result);
+}
+
+void mirror::FileDB::setDirDigest(const char * const dirNameU8, const std::size_t dirNameSize,
+		const unsigned char (&crc64)[sizeof(FileRecord::crc64)])
+{
+	assert(m_conn != nullptr);
+
+	const mirror::stats::PhaseTimer timer(mirror::stats::Phase::dbWrite);
+	int result;
+
+	logTrace("Setting the digest of the dir '"_s, Utf8ToSystemView(dirNameU8, dirNameSize), "'..."_s);
+
+	result = sqlite3_bind_text(m_setDirDigestStmt, 1, dirNameU8, dirNameSize, SQLITE_STATIC);
+	if (result != SQLITE_OK) {
+		goto handle_error;
+	}
+	result = sqlite3_bind_blob(m_setDirDigestStmt, 2, crc64, sizeof(crc64), SQLITE_STATIC);
+	if (result != SQLITE_OK) {
+		goto handle_error;
+	}
+
+	result = sqlite3_step(m_setDirDigestStmt);
+	if (result != SQLITE_DONE) {
+		goto handle_error;
+	}
+
+	result = sqlite3_reset(m_setDirDigestStmt);
+	if (result != SQLITE_OK) {
+		goto handle_reset_error;
+	}
+
+	m_hasDirDigests = true;
+	// The next file added drops the digests of its directory even if it is the directory cached.
+	m_lastDirId = 0;
+	return;
+
+handle_error:
+	// Attempting to reset the statement without overwriting the error code.
+	// TODO handle sqlite3_reset error code.
+	sqlite3_reset(m_setDirDigestStmt);
+handle_reset_error:
+	throw sqlite3_errstr(result);
+}
+
+void mirror::FileDB::getDirsWithoutDigest(std::vector<std::string> &dest)
+{
+	assert(m_conn != nullptr);
+
+	const mirror::stats::PhaseTimer timer(mirror::stats::Phase::dbRead);
+	int result;
+	int hasDirDigests;
+
+	// None of the directories have digests in the DBs created before they are calculated for the first time.
+	result = queryInt(m_conn, u8"select exists (select 1 from dir_digests)", hasDirDigests);
+	if (result != SQLITE_OK) {
+		throw sqlite3_errstr(result);
+	}
+
+	if (hasDirDigests != 0) {
+		// A path is less than the paths of its subdirectories, which start with it.
+		for (auto it = m_changedDirsU8.rbegin(); it != m_changedDirsU8.rend(); ++it) {
+			// The directories removed from the DB have no digests to calculate.
+			if (getDirId(it->data(), it->size()) != 0) {
+				dest.push_back(*it);
+			}
+		}
+		m_changedDirsU8.clear();
+		return;
+	}
+	m_changedDirsU8.clear();
+
+	for (;;) {
+		result = sqlite3_step(m_getDirsWithoutDigestStmt);
+		if (result == SQLITE_DONE) {
+			break;
+		}
+		if (result != SQLITE_ROW) {
+			goto handle_error;
+		}
+		dest.emplace_back(reinterpret_cast<const char *>(sqlite3_column_text(m_getDirsWithoutDigestStmt, 0)),
+				sqlite3_column_bytes(m_getDirsWithoutDigestStmt, 0));
+	}
+
+	result = sqlite3_reset(m_getDirsWithoutDigestStmt);
+	if (result != SQLITE_OK) {
+		goto handle_reset_error;
+	}
+	return;
+
+handle_error:
+	// Attempting to reset the statement without overwriting the error code.
+	// TODO handle sqlite3_reset error code.
+	sqlite3_reset(m_getDirsWithoutDigestStmt);
+handle_reset_error:
+	throw sqlite3_errstr(result);
+}
+
+bool mirror::FileDB::hasDirDigests(void)
+{
+	assert(m_conn != nullptr);
+
+	int result;
+	int hasDigests;
+
+	// The digests are calculated for all the directories at once, so those of a DB are either all there or none.
+	result = queryInt(m_conn, u8"select not exists (select 1 from dirs) or exists (select 1 from dir_digests)",
+			hasDigests);
+	if (result != SQLITE_OK) {
+		throw sqlite3_errstr(result);
+	}
+	return hasDigests != 0;
+}
+
+void mirror::FileDB::dropDirDigests(const char * const dirNameU8, const std::size_t dirNameSize)
+{
+	assert(m_conn != nullptr);
+
+	// Nothing to drop in the DBs created before the digests are calculated for the first time.
+	if (!m_hasDirDigests) {
+		return;
+	}
+
+	// The directory itself, then each of its ancestors up to the root, which is the empty path.
+	std::size_t size = dirNameSize;
+	for (;;) {
+		// The ancestors of a directory recorded are recorded too.
+		if (!m_changedDirsU8.emplace(dirNameU8, size).second) {
+			return;
+		}
+
+		int result = sqlite3_bind_text(m_dropDirDigestStmt, 1, dirNameU8, size, SQLITE_STATIC);
+		if (result == SQLITE_OK) {
+			result = sqlite3_step(m_dropDirDigestStmt);
+		}
+		// TODO handle sqlite3_reset error code.
+		sqlite3_reset(m_dropDirDigestStmt);
+		if (result != SQLITE_OK && result != SQLITE_DONE) {
+			throw sqlite3_errstr(result);
+		}
+
+		if (size == 0) {
+			return;
+		}
+		while (size != 0 && dirNameU8[size - 1] != '/') {
+			--size;
+		}
+		// The slash itself is not a part of the parent path.
+		if (size != 0) {
+			--size;
+		}
+	}
+}
@@ -22,60 +22,55 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>. */
 #include <afc/SimpleString.hpp>
 #include <algorithm>
 #include <cassert>
+#include <chrono>
 #include <cstddef>
 #include <cstdio>
+#include <cstring>
+#include "FlatHashTable.hpp"
+#include "hash.hpp"
 #include <numeric>
+#include "PathArena.hpp"
+#include <set>
+#include <string>
 #include <afc/string_util.hpp>
 #include <afc/utils.h>
 #include <sqlite3.h>
 #include <sys/types.h>
-#include <unordered_map>
-#include <unordered_set>
+#include <utility>
+#include <vector>
 
 namespace mirror
 {
 	struct PathKey
 	{
-		explicit PathKey(const char * const valU8, const bool tmp = false) : hash(0), owner(!tmp)
+		explicit PathKey(const char * const valU8, const bool tmp = false) : owner(!tmp)
 		{
-			// TODO check how memory reads/writes are issued by the compiler, optimise if needed.
 			if (tmp) {
 				data = valU8;
-				size = 0;
-
-				for (const char *p = valU8; *p != 0; ++p, ++size) {
-					hash = (hash << 7) + *p;
-				}
+				size = std::strlen(valU8);
 			} else {
 				afc::U8String str(valU8);
 				data = str.data();
 				size = str.size();
-
-				const char *p = valU8;
-				for (std::size_t i = size; i > 0; --i) {
-					hash = (hash << 7) + *p++;
-				}
-
 				str.detach();
 			}
+			hash = mirror::hashBytes(data, size);
 		}
 
 		PathKey(const char * const valU8, const std::size_t n, const bool tmp = false)
-				: size(n), hash(0), owner(!tmp)
+				: size(n), hash(mirror::hashBytes(valU8, n)), owner(!tmp)
 		{
-			// TODO check how memory reads/writes are issued by the compiler, optimise if needed.
 			if (tmp) {
 				data = valU8;
 			} else {
 				data = afc::U8String(valU8, n).detach();
 			}
-
-			const char *p = valU8;
-			for (std::size_t i = n; i > 0; --i) {
-				hash = (hash << 7) + *p++;
-			}
 		}
 
+		// The key refers to a copy of the string that is made in the arena.
+		PathKey(const char * const valU8, const std::size_t n, PathArena &arena)
+				: data(arena.copy(valU8, n)), size(n), hash(mirror::hashBytes(valU8, n)), owner(false) {}
+
 		PathKey(const PathKey &) = delete;
 		PathKey(PathKey &&o) noexcept : data(o.data), size(o.size), hash(o.hash), owner(o.owner) { o.owner = false; }
 
@@ -127,8 +122,26 @@ namespace mirror
 		off_t fileSize;
 	};
 
-	using DirFileMap = std::unordered_map<PathKey, FileRecord, PathHash, PathEquals>;
-	using DirSet = std::unordered_set<PathKey, PathHash, PathEquals>;
+	// The keys that are added by FileDB refer to the strings in the arena of the container.
+	struct DirFileMap : FlatHashMap<PathKey, FileRecord, PathHash, PathEquals>
+	{
+		PathArena names;
+	};
+
+	// The DB records of the files of a directory in the bytewise order of their names.
+	struct SortedDirFiles
+	{
+		struct Entry
+		{
+			const char *nameU8;
+			std::size_t nameSize;
+			FileRecord record;
+		};
+
+		// The names refer to the strings in the arena.
+		std::vector<Entry> entries;
+		PathArena names;
+	};
 
 	class FileDB
 	{
@@ -137,25 +150,55 @@ namespace mirror
 		FileDB &operator=(const FileDB &) = delete;
 		FileDB &operator=(FileDB &&) = delete;
 
-		FileDB(const char * const dbPathInUtf8);
+		FileDB(const char * const dbPathInUtf8, bool readOnly);
 	public:
 		FileDB(FileDB &&src) : m_conn(src.m_conn), m_addFileStmt(src.m_addFileStmt), m_getFileStmt(src.m_getFileStmt),
-				m_getDirFilesStmt(src.m_getDirFilesStmt), m_getDirsStmt(src.m_getDirsStmt) { src.m_conn = nullptr; }
+				m_getDirFilesStmt(src.m_getDirFilesStmt), m_getDirIdStmt(src.m_getDirIdStmt),
+				m_addDirStmt(src.m_addDirStmt), m_removeFileStmt(src.m_removeFileStmt),
+				m_removeDirStmt(src.m_removeDirStmt), m_removeDirEntryStmt(src.m_removeDirEntryStmt),
+				m_getDirDigestStmt(src.m_getDirDigestStmt), m_setDirDigestStmt(src.m_setDirDigestStmt),
+				m_dropDirDigestStmt(src.m_dropDirDigestStmt),
+				m_getDirsWithoutDigestStmt(src.m_getDirsWithoutDigestStmt),
+				m_markDirVisitedStmt(src.m_markDirVisitedStmt), m_getUnvisitedDirsStmt(src.m_getUnvisitedDirsStmt),
+				m_markDirDoneStmt(src.m_markDirDoneStmt), m_getDirProgressStmt(src.m_getDirProgressStmt),
+				m_findByContentStmt(src.m_findByContentStmt), m_checkpointInterval(src.m_checkpointInterval),
+				m_lastCheckpoint(src.m_lastCheckpoint), m_lastDirU8(std::move(src.m_lastDirU8)),
+				m_lastDirId(src.m_lastDirId), m_bulkBatchSize(src.m_bulkBatchSize),
+				m_bulkBatchRows(src.m_bulkBatchRows), m_trackedSubtreeU8(std::move(src.m_trackedSubtreeU8)),
+				m_hasDirDigests(src.m_hasDirDigests),
+				m_changedDirsU8(std::move(src.m_changedDirsU8)) { src.m_conn = nullptr; }
 
 		~FileDB()
 		{
 			assert(m_conn == nullptr);
 		}
 
-		static FileDB open(const char * const fileName, const bool create = false)
+		/*
+		 * A DB opened read-only is neither created nor migrated to the current schema, so that it can be
+		 * a read-only file or be on a read-only mount.
+		 */
+		static FileDB open(const char * const fileName, const bool create = false, const bool readOnly = false)
 		{
-			return FileDB(afc::convertToUtf8(fileName, afc::systemCharset().c_str()).c_str());
+			return FileDB(afc::convertToUtf8(fileName, afc::systemCharset().c_str()).c_str(), readOnly);
 		}
 
 		void close()
 		{
 			// TODO handle result codes.
-			sqlite3_finalize(m_getDirsStmt);
+			sqlite3_finalize(m_findByContentStmt);
+			sqlite3_finalize(m_getDirsWithoutDigestStmt);
+			sqlite3_finalize(m_dropDirDigestStmt);
+			sqlite3_finalize(m_setDirDigestStmt);
+			sqlite3_finalize(m_getDirDigestStmt);
+			sqlite3_finalize(m_getDirProgressStmt);
+			sqlite3_finalize(m_markDirDoneStmt);
+			sqlite3_finalize(m_getUnvisitedDirsStmt);
+			sqlite3_finalize(m_markDirVisitedStmt);
+			sqlite3_finalize(m_removeDirEntryStmt);
+			sqlite3_finalize(m_removeDirStmt);
+			sqlite3_finalize(m_removeFileStmt);
+			sqlite3_finalize(m_addDirStmt);
+			sqlite3_finalize(m_getDirIdStmt);
 			sqlite3_finalize(m_getDirFilesStmt);
 			sqlite3_finalize(m_getFileStmt);
 			sqlite3_finalize(m_addFileStmt);
@@ -168,18 +211,194 @@ namespace mirror
 		void commit(void);
 		void rollback(void);
 
+		// The number of rows written within each transaction of a bulk load by default.
+		static constexpr std::size_t defaultBulkBatchSize = 100000;
+
+		/*
+		 * Starts a session that is optimised for adding lots of files: the DB is switched to WAL with
+		 * synchronous writes off and a large page cache, and the data is committed each time batchSize
+		 * rows are added so that neither memory nor the WAL file grow unbounded. Batches that are committed
+		 * stay in the DB even if the session is aborted, so the caller is to record that the DB is incomplete
+		 * until the session ends (createDB() keeps a checkpoint of its walk for this).
+		 *
+		 * If it follows beginCheckpoints() then the writes are synchronous in the normal mode instead, so that
+		 * the checkpoints committed survive a crash of the OS or a power loss, not only an interruption.
+		 *
+		 * Must not be called within a transaction.
+		 */
+		void beginBulkLoad(std::size_t batchSize = defaultBulkBatchSize);
+		// Commits the last batch and restores the usual DB settings.
+		void endBulkLoad(void);
+		/*
+		 * Rolls the last batch back and restores the usual DB settings. Nothing is rolled back if there is
+		 * no transaction open, which is the case if starting the next batch has failed.
+		 */
+		void abortBulkLoad(void);
+
 		void addFile(const char *fileNameU8, std::size_t fileNameSize,
 				const char *dirNameU8, std::size_t dirNameSize, const FileRecord &data);
-		void getFile(const char *fileNameU8, std::size_t fileNameSize,
+		// Returns false if there is no such file in the DB.
+		bool getFile(const char *fileNameU8, std::size_t fileNameSize,
 				const char *dirNameU8, std::size_t dirNameSize, FileRecord &dest);
 		void getFiles(const char *dirNameU8, std::size_t dirNameSize, DirFileMap &dest);
-		void getDirs(DirSet &dest);
+		// Appends the records ordered by name, so that they can be merged with a listing sorted by DirOrder::name.
+		void getFiles(const char *dirNameU8, std::size_t dirNameSize, SortedDirFiles &dest);
+		void removeFile(const char *fileNameU8, std::size_t fileNameSize,
+				const char *dirNameU8, std::size_t dirNameSize);
+		// Removes the directory and all the files that belong directly to it.
+		void removeDir(const char *dirNameU8, std::size_t dirNameSize);
+		// Removes the directory together with all its subdirectories and their files. Not for the root.
+		void removeSubtree(const char *dirNameU8, std::size_t dirNameSize);
+
+		/*
+		 * Tracking of the directories a walk visits, so that the DB directories which are gone from the file
+		 * system are found by a single query rather than by keeping all of them in memory. The directories
+		 * visited are kept in a temporary table which sqlite spills to a file once it outgrows the page cache.
+		 *
+		 * If the subtree is not empty then the directories outside it are neither reported nor removed, so
+		 * that a walk of the subtree alone leaves the rest of the DB intact.
+		 */
+		void beginDirTracking(const char *subtreeU8 = u8"", std::size_t subtreeSize = 0);
+		void markDirVisited(const char *dirNameU8, std::size_t dirNameSize);
+		/*
+		 * Reads the next directory that has files but is not marked visited. Returns false if there are no
+		 * more of them. The name returned is valid until the next call.
+		 */
+		bool nextUnvisitedDir(const char *&dirNameU8, std::size_t &dirNameSize);
+		// Removes the directories that are not marked visited together with their files.
+		void removeUnvisitedDirs(void);
+		void endDirTracking(void);
+
+		// How much of a directory a walk is done with, as recorded by markDirDone().
+		enum class DirProgress
+		{
+			none, dir, subtree
+		};
+
+		/*
+		 * Checkpoints of a long walk, so that the walk can be resumed after it is interrupted. The directories
+		 * the walk is done with are recorded in the table checkpoint_dirs, which is committed together with
+		 * their files, and the walk itself (the tool and the root directory) in the table checkpoint. Both
+		 * tables are dropped once the walk is completed.
+		 *
+		 * If resume is true then the checkpoints of the same walk left in the DB are kept. Otherwise, or if
+		 * there are none, the checkpoints of any other walk are discarded and the walk is started anew. Returns
+		 * true if the walk is resumed. If resume is true and there is no walk to resume then nothing is changed.
+		 *
+		 * If interval is zero then only the walk itself is recorded, to tell that it is not completed yet;
+		 * markDirDone() must not be called then.
+		 *
+		 * Must not be called within a transaction.
+		 */
+		bool beginCheckpoints(const char *toolU8, const char *rootDirU8, std::size_t rootDirSize,
+				std::chrono::seconds interval, bool resume);
+		/*
+		 * Records that all the files of the directory are processed, and also all its subdirectories if subtree
+		 * is true. If the interval passed to beginCheckpoints() has elapsed since the last checkpoint then
+		 * the current transaction is committed and a new one is started. Must be called within a transaction.
+		 */
+		void markDirDone(const char *dirNameU8, std::size_t dirNameSize, bool subtree);
+		DirProgress getDirProgress(const char *dirNameU8, std::size_t dirNameSize);
+		/*
+		 * Marks the directories the walk resumed is done with visited, since the walk does not descend into
+		 * the subtrees that are completed. Must follow both beginDirTracking() and beginCheckpoints().
+		 */
+		void markDoneDirsVisited(void);
+		// Drops the checkpoints if the walk is completed; otherwise they are left for the walk to be resumed.
+		void endCheckpoints(bool completed);
+
+		/*
+		 * Lookups of the regular files by their contents. The index on (size, crc64) the lookups need is
+		 * created on the first call and stays in the DB, so that it is maintained by all the tools afterwards.
+		 * It is not a part of the schema since it slows adding files down and only merge-dir needs it.
+		 */
+		void beginContentLookups(void);
+		/*
+		 * Appends the paths (relative to the root and in UTF-8) of at most maxCount regular files with
+		 * the given size and digest. Must follow beginContentLookups().
+		 */
+		void findFilesByContent(off_t size, const unsigned char (&crc64)[sizeof(FileRecord::crc64)],
+				std::size_t maxCount, std::vector<std::string> &dest);
+
+		/*
+		 * Digests of the directories, each of which is calculated from the entries of the directory and
+		 * the digests of its subdirectories (see mirror::updateDirDigests()), so that the subtrees of two
+		 * DBs that have the same digests need not be compared. Adding or removing a file drops the
+		 * digests of its directory and all the ancestors of it.
+		 *
+		 * Returns false if the directory has no digest, either because it is changed since the digests
+		 * are calculated or because it has no files.
+		 */
+		bool getDirDigest(const char *dirNameU8, std::size_t dirNameSize,
+				unsigned char (&dest)[sizeof(FileRecord::crc64)]);
+		void setDirDigest(const char *dirNameU8, std::size_t dirNameSize,
+				const unsigned char (&crc64)[sizeof(FileRecord::crc64)]);
+		/*
+		 * Appends the directories of the DB that have no digest, each after all its subdirectories, so that
+		 * their digests can be set in this order. These are the directories whose digests are dropped since
+		 * the previous call, unless the DB has no digests at all, in which case all its directories are
+		 * appended. They are all read before the caller sets any digest.
+		 */
+		void getDirsWithoutDigest(std::vector<std::string> &dest);
+		// Returns false if the digests of the directories are not calculated yet.
+		bool hasDirDigests(void);
 	private:
 		sqlite3 *m_conn;
 		sqlite3_stmt *m_addFileStmt;
 		sqlite3_stmt *m_getFileStmt;
 		sqlite3_stmt *m_getDirFilesStmt;
-		sqlite3_stmt *m_getDirsStmt;
+		sqlite3_stmt *m_getDirIdStmt;
+		sqlite3_stmt *m_addDirStmt;
+		sqlite3_stmt *m_removeFileStmt;
+		sqlite3_stmt *m_removeDirStmt;
+		sqlite3_stmt *m_removeDirEntryStmt;
+		sqlite3_stmt *m_getDirDigestStmt;
+		sqlite3_stmt *m_setDirDigestStmt;
+		sqlite3_stmt *m_dropDirDigestStmt;
+		sqlite3_stmt *m_getDirsWithoutDigestStmt;
+		// Prepared by beginDirTracking() since they refer to the temporary table.
+		sqlite3_stmt *m_markDirVisitedStmt;
+		sqlite3_stmt *m_getUnvisitedDirsStmt;
+		// Prepared by beginCheckpoints() since the tables they refer to are created there.
+		sqlite3_stmt *m_markDirDoneStmt;
+		sqlite3_stmt *m_getDirProgressStmt;
+		// Prepared by beginContentLookups() since the index it relies on is created there.
+		sqlite3_stmt *m_findByContentStmt;
+		std::chrono::seconds m_checkpointInterval;
+		std::chrono::steady_clock::time_point m_lastCheckpoint;
+		// The directory the last file is added to, so that its id is not looked up for each file.
+		std::string m_lastDirU8;
+		// Zero if not known.
+		sqlite3_int64 m_lastDirId;
+		// Zero if there is no bulk load in progress.
+		std::size_t m_bulkBatchSize;
+		std::size_t m_bulkBatchRows;
+		// Empty if all the directories are tracked.
+		std::string m_trackedSubtreeU8;
+		// False if there are no digests to drop.
+		bool m_hasDirDigests;
+		/*
+		 * The directories whose digests are dropped, with all their ancestors. They are kept if their digests
+		 * are restored by a rollback, which only makes them recalculated.
+		 */
+		std::set<std::string> m_changedDirsU8;
+
+		// Returns zero if there is no such directory.
+		sqlite3_int64 getDirId(const char *dirNameU8, std::size_t dirNameSize);
+		sqlite3_int64 getOrAddDirId(const char *dirNameU8, std::size_t dirNameSize);
+		// Drops the digests of the directory and all its ancestors.
+		void dropDirDigests(const char *dirNameU8, std::size_t dirNameSize);
+		void execute(const char *queryU8);
+		// Executes the query with the only parameter ?1 bound to the text given.
+		void execute(const char *queryU8, const char *paramU8, std::size_t paramSize);
+		/*
+		 * Reads the records of the files of the directory in the order of their names. The storage of each
+		 * record is obtained with FileRecord &allocate(const char *fileNameU8, std::size_t fileNameSize).
+		 */
+		template<typename RecordAllocator>
+		void readDirFiles(const char *dirNameU8, std::size_t dirNameSize, RecordAllocator &&allocate);
+		// Nothing is executed to end the last batch if lastBatchQueryU8 is null.
+		void finishBulkLoad(const char *lastBatchQueryU8);
 	};
 }
 
@@ -201,6 +420,15 @@ namespace afc
 	}
 }
 
+inline void mirror::FileDB::execute(const char * const queryU8)
+{
+	assert(m_conn != nullptr);
+	const int result = sqlite3_exec(m_conn, queryU8, nullptr, nullptr, nullptr);
+	if (result != SQLITE_OK) {
+		throw sqlite3_errstr(result);
+	}
+}
+
 inline void mirror::FileDB::beginTransaction(void)
 {
 	assert(m_conn != nullptr);
@@ -222,6 +450,8 @@ inline void mirror::FileDB::commit(void)
 inline void mirror::FileDB::rollback(void)
 {
 	assert(m_conn != nullptr);
+	// The id cached could belong to a directory that is rolled back.
+	m_lastDirId = 0;
 	const int result = sqlite3_exec(m_conn, u8"rollback", nullptr, nullptr, nullptr);
 	if (result != SQLITE_OK) {
 		throw sqlite3_errstr(result);
@@ -0,0 +1,417 @@
+/* mirror - a tool to make mirrors of files or directories and to check consistency of the existing mirrors.
+Copyright (C) 2017-2019 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#ifndef MIRROR_FLATHASHTABLE_HPP_
+#define MIRROR_FLATHASHTABLE_HPP_
+
+#include <afc/builtin.hpp>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <tuple>
+#include <utility>
+
+#ifdef __SSE2__
+	#include <emmintrin.h>
+#endif
+
+namespace mirror
+{
+	namespace _helper
+	{
+		/*
+		 * Control bytes of a FlatHashTable. A full slot has the low 7 bits of its hash stored (a non-negative
+		 * value); the other states are negative.
+		 */
+		enum : signed char
+		{
+			ctrlEmpty = -128,
+			ctrlDeleted = -2,
+			ctrlSentinel = -1
+		};
+
+		constexpr std::size_t flatGroupSize = 16;
+
+		// A group of control bytes that are probed at once. Bit i of a match corresponds to the i-th byte.
+		class FlatGroup
+		{
+		public:
+			explicit FlatGroup(const signed char * const ctrl) noexcept
+#ifdef __SSE2__
+					: m_ctrl(_mm_loadu_si128(reinterpret_cast<const __m128i *>(ctrl))) {}
+#else
+			{
+				std::memcpy(m_ctrl, ctrl, flatGroupSize);
+			}
+#endif
+
+			std::uint32_t match(const signed char h2) const noexcept
+			{
+#ifdef __SSE2__
+				return static_cast<std::uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(h2), m_ctrl)));
+#else
+				std::uint32_t result = 0;
+				for (std::size_t i = 0; i < flatGroupSize; ++i) {
+					result |= std::uint32_t(m_ctrl[i] == h2) << i;
+				}
+				return result;
+#endif
+			}
+
+			std::uint32_t matchEmpty() const noexcept { return match(ctrlEmpty); }
+
+			// Empty and deleted slots are the ones the control byte of which is less than the sentinel.
+			std::uint32_t matchEmptyOrDeleted() const noexcept
+			{
+#ifdef __SSE2__
+				return static_cast<std::uint32_t>(
+						_mm_movemask_epi8(_mm_cmpgt_epi8(_mm_set1_epi8(ctrlSentinel), m_ctrl)));
+#else
+				std::uint32_t result = 0;
+				for (std::size_t i = 0; i < flatGroupSize; ++i) {
+					result |= std::uint32_t(m_ctrl[i] < ctrlSentinel) << i;
+				}
+				return result;
+#endif
+			}
+		private:
+#ifdef __SSE2__
+			__m128i m_ctrl;
+#else
+			signed char m_ctrl[flatGroupSize];
+#endif
+		};
+
+		inline unsigned lowestBit(const std::uint32_t mask) noexcept
+		{
+			assert(mask != 0);
+			return static_cast<unsigned>(__builtin_ctz(mask));
+		}
+	}
+
+	/*
+	 * An open-addressing hash table that keeps its slots in a single flat array (the SwissTable layout).
+	 * Each slot has a control byte with 7 bits of the hash of its key so that a lookup probes 16 slots
+	 * at a time with a couple of SIMD instructions, and compares keys only when these bits match.
+	 *
+	 * KeyOf is a type with the static function const Key &key(const Slot &). Pointers to slots are
+	 * invalidated by insertions; erasures leave the other slots intact.
+	 */
+	template<typename Key, typename Slot, typename KeyOf, typename Hash, typename Equals>
+	class FlatHashTable
+	{
+	public:
+		class iterator
+		{
+			friend class FlatHashTable;
+		public:
+			iterator() noexcept : m_ctrl(nullptr), m_slot(nullptr) {}
+
+			Slot &operator*() const noexcept { return *m_slot; }
+			Slot *operator->() const noexcept { return m_slot; }
+
+			iterator &operator++() noexcept
+			{
+				++m_ctrl;
+				++m_slot;
+				skipFree();
+				return *this;
+			}
+
+			bool operator==(const iterator &other) const noexcept { return m_ctrl == other.m_ctrl; }
+			bool operator!=(const iterator &other) const noexcept { return m_ctrl != other.m_ctrl; }
+		private:
+			iterator(const signed char * const ctrl, Slot * const slot) noexcept : m_ctrl(ctrl), m_slot(slot) {}
+
+			// Stops at a full slot or at the sentinel that follows the last slot.
+			void skipFree() noexcept
+			{
+				while (*m_ctrl < mirror::_helper::ctrlSentinel) {
+					++m_ctrl;
+					++m_slot;
+				}
+			}
+
+			const signed char *m_ctrl;
+			Slot *m_slot;
+		};
+
+		FlatHashTable() noexcept : m_ctrl(nullptr), m_slots(nullptr), m_capacity(0), m_size(0), m_growthLeft(0) {}
+
+		~FlatHashTable() { destroy(); }
+
+		FlatHashTable(const FlatHashTable &) = delete;
+		FlatHashTable &operator=(const FlatHashTable &) = delete;
+
+		FlatHashTable(FlatHashTable &&other) noexcept
+				: m_ctrl(other.m_ctrl), m_slots(other.m_slots), m_capacity(other.m_capacity), m_size(other.m_size),
+				  m_growthLeft(other.m_growthLeft)
+		{
+			other.reset();
+		}
+
+		FlatHashTable &operator=(FlatHashTable &&other) noexcept
+		{
+			if (this != &other) {
+				destroy();
+				m_ctrl = other.m_ctrl;
+				m_slots = other.m_slots;
+				m_capacity = other.m_capacity;
+				m_size = other.m_size;
+				m_growthLeft = other.m_growthLeft;
+				other.reset();
+			}
+			return *this;
+		}
+
+		iterator begin() noexcept
+		{
+			if (m_capacity == 0) {
+				return end();
+			}
+			iterator result(m_ctrl, m_slots);
+			result.skipFree();
+			return result;
+		}
+
+		iterator end() noexcept { return iterator(m_ctrl + m_capacity, m_slots + m_capacity); }
+
+		std::size_t size() const noexcept { return m_size; }
+		bool empty() const noexcept { return m_size == 0; }
+
+		iterator find(const Key &key) noexcept
+		{
+			if (m_capacity == 0) {
+				return end();
+			}
+			const std::size_t hash = Hash()(key);
+			const signed char h2 = hash2(hash);
+			std::size_t pos = hash1(hash) & m_capacity;
+			for (std::size_t step = mirror::_helper::flatGroupSize;; step += mirror::_helper::flatGroupSize) {
+				const mirror::_helper::FlatGroup group(m_ctrl + pos);
+				for (std::uint32_t match = group.match(h2); match != 0; match &= match - 1) {
+					const std::size_t i = (pos + mirror::_helper::lowestBit(match)) & m_capacity;
+					if (likely(Equals()(KeyOf::key(m_slots[i]), key))) {
+						return iterator(m_ctrl + i, m_slots + i);
+					}
+				}
+				if (group.matchEmpty() != 0) {
+					return end();
+				}
+				pos = (pos + step) & m_capacity;
+			}
+		}
+
+		void erase(const iterator pos) noexcept
+		{
+			assert(pos != end());
+
+			const std::size_t i = static_cast<std::size_t>(pos.m_slot - m_slots);
+			pos.m_slot->~Slot();
+			setCtrl(i, mirror::_helper::ctrlDeleted);
+			--m_size;
+		}
+
+		std::size_t erase(const Key &key) noexcept
+		{
+			const iterator pos = find(key);
+			if (pos == end()) {
+				return 0;
+			}
+			erase(pos);
+			return 1;
+		}
+
+		void clear() noexcept
+		{
+			destroy();
+			reset();
+		}
+	protected:
+		/*
+		 * Finds the slot with the key given, or constructs a new one from args if there is no such slot.
+		 * The key is used for lookup only, so args can refer to it.
+		 */
+		template<typename... Args>
+		std::pair<iterator, bool> emplaceKey(const Key &key, Args &&...args)
+		{
+			const iterator existing = find(key);
+			if (existing != end()) {
+				return std::make_pair(existing, false);
+			}
+
+			const std::size_t hash = Hash()(key);
+			if (m_growthLeft == 0) {
+				// Tombstones are purged without growing if the table is at most half full.
+				rehash(m_size * 2 <= maxLoad(m_capacity) && m_capacity != 0 ? m_capacity : m_capacity * 2 + 1);
+			}
+			const std::size_t i = findFreeSlot(hash);
+			::new (static_cast<void *>(m_slots + i)) Slot(std::forward<Args>(args)...);
+			if (m_ctrl[i] == mirror::_helper::ctrlEmpty) {
+				--m_growthLeft;
+			}
+			setCtrl(i, hash2(hash));
+			++m_size;
+			return std::make_pair(iterator(m_ctrl + i, m_slots + i), true);
+		}
+	private:
+		static constexpr std::size_t minCapacity = mirror::_helper::flatGroupSize - 1;
+
+		static std::size_t hash1(const std::size_t hash) noexcept { return hash >> 7; }
+		static signed char hash2(const std::size_t hash) noexcept { return static_cast<signed char>(hash & 0x7f); }
+
+		// Up to 7/8 of the slots can be used.
+		static std::size_t maxLoad(const std::size_t capacity) noexcept { return capacity - capacity / 8; }
+
+		static std::size_t ctrlBytes(const std::size_t capacity) noexcept
+		{
+			// The sentinel plus the clones of the first bytes so that a group can be loaded at any position.
+			const std::size_t n = capacity + mirror::_helper::flatGroupSize;
+			return (n + alignof(Slot) - 1) / alignof(Slot) * alignof(Slot);
+		}
+
+		/*
+		 * Capacity is always 2^n-1, so that it is the mask of slot indices. The control byte at index capacity
+		 * is the sentinel which is never a match; the bytes that follow it mirror the first ones.
+		 */
+		void setCtrl(const std::size_t i, const signed char value) noexcept
+		{
+			m_ctrl[i] = value;
+			m_ctrl[((i - (mirror::_helper::flatGroupSize - 1)) & m_capacity) + (mirror::_helper::flatGroupSize - 1)] =
+					value;
+		}
+
+		std::size_t findFreeSlot(const std::size_t hash) const noexcept
+		{
+			std::size_t pos = hash1(hash) & m_capacity;
+			for (std::size_t step = mirror::_helper::flatGroupSize;; step += mirror::_helper::flatGroupSize) {
+				const std::uint32_t match = mirror::_helper::FlatGroup(m_ctrl + pos).matchEmptyOrDeleted();
+				if (match != 0) {
+					return (pos + mirror::_helper::lowestBit(match)) & m_capacity;
+				}
+				pos = (pos + step) & m_capacity;
+			}
+		}
+
+		void rehash(std::size_t newCapacity)
+		{
+			if (newCapacity < minCapacity) {
+				newCapacity = minCapacity;
+			}
+			assert(((newCapacity + 1) & newCapacity) == 0);
+
+			const std::size_t ctrlSize = ctrlBytes(newCapacity);
+			char * const mem = static_cast<char *>(::operator new(ctrlSize + newCapacity * sizeof(Slot)));
+
+			signed char * const oldCtrl = m_ctrl;
+			Slot * const oldSlots = m_slots;
+			const std::size_t oldCapacity = m_capacity;
+
+			m_ctrl = reinterpret_cast<signed char *>(mem);
+			m_slots = reinterpret_cast<Slot *>(mem + ctrlSize);
+			m_capacity = newCapacity;
+			std::memset(m_ctrl, mirror::_helper::ctrlEmpty, newCapacity + mirror::_helper::flatGroupSize);
+			m_ctrl[newCapacity] = mirror::_helper::ctrlSentinel;
+
+			for (std::size_t i = 0; i < oldCapacity; ++i) {
+				if (oldCtrl[i] >= 0) {
+					Slot &slot = oldSlots[i];
+					const std::size_t hash = Hash()(KeyOf::key(slot));
+					const std::size_t j = findFreeSlot(hash);
+					::new (static_cast<void *>(m_slots + j)) Slot(std::move(slot));
+					setCtrl(j, hash2(hash));
+					slot.~Slot();
+				}
+			}
+			m_growthLeft = maxLoad(newCapacity) - m_size;
+
+			// The old control bytes and slots share a single allocation.
+			::operator delete(oldCtrl);
+		}
+
+		void destroy() noexcept
+		{
+			if (m_capacity == 0) {
+				return;
+			}
+			for (std::size_t i = 0; i < m_capacity; ++i) {
+				if (m_ctrl[i] >= 0) {
+					m_slots[i].~Slot();
+				}
+			}
+			::operator delete(m_ctrl);
+		}
+
+		void reset() noexcept
+		{
+			m_ctrl = nullptr;
+			m_slots = nullptr;
+			m_capacity = 0;
+			m_size = 0;
+			m_growthLeft = 0;
+		}
+
+		signed char *m_ctrl;
+		Slot *m_slots;
+		std::size_t m_capacity;
+		std::size_t m_size;
+		std::size_t m_growthLeft;
+	};
+
+	namespace _helper
+	{
+		template<typename Key, typename Value>
+		struct FlatMapKeyOf
+		{
+			static const Key &key(const std::pair<Key, Value> &slot) noexcept { return slot.first; }
+		};
+
+		template<typename Key>
+		struct FlatSetKeyOf
+		{
+			static const Key &key(const Key &slot) noexcept { return slot; }
+		};
+	}
+
+	// An unordered map on top of FlatHashTable. Slots are pairs of the key and the value mapped to it.
+	template<typename Key, typename Value, typename Hash, typename Equals>
+	class FlatHashMap : public FlatHashTable<Key, std::pair<Key, Value>, mirror::_helper::FlatMapKeyOf<Key, Value>,
+			Hash, Equals>
+	{
+	public:
+		// Value-initialises the value if there is no key given in the map.
+		Value &operator[](Key &&key)
+		{
+			return this->emplaceKey(key, std::piecewise_construct, std::forward_as_tuple(std::move(key)),
+					std::tuple<>()).first->second;
+		}
+	};
+
+	// An unordered set on top of FlatHashTable.
+	template<typename Key, typename Hash, typename Equals>
+	class FlatHashSet : public FlatHashTable<Key, Key, mirror::_helper::FlatSetKeyOf<Key>, Hash, Equals>
+	{
+		using Base = FlatHashTable<Key, Key, mirror::_helper::FlatSetKeyOf<Key>, Hash, Equals>;
+	public:
+		std::pair<typename Base::iterator, bool> emplace(Key &&key)
+		{
+			return this->emplaceKey(key, std::move(key));
+		}
+	};
+}
+
+#endif // MIRROR_FLATHASHTABLE_HPP_
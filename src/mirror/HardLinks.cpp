@@ -0,0 +1,211 @@
+/* mirror - a tool to make mirrors of files or directories and to check consistency of the existing mirrors.
+Copyright (C) 2017-2019 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#include <afc/logger.hpp>
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include "HardLinks.hpp"
+#include "log.hpp"
+#include <unistd.h>
+
+using afc::operator"" _s;
+using mirror::logger::logDebug;
+using afc::logger::logError;
+
+bool mirror::DigestCache::find(const struct stat &fileStat, unsigned char (&dest)[sizeof(mirror::FileRecord::crc64)])
+{
+	if (fileStat.st_nlink < 2) {
+		return false;
+	}
+
+	const auto it = m_entries.find(InodeKey(fileStat));
+	if (it == m_entries.end() || !it->second.known || !matches(it->second, fileStat)) {
+		return false;
+	}
+	Entry &entry = it->second;
+	std::copy_n(entry.crc64, sizeof(dest), dest);
+	if (entry.linksLeft <= 1) {
+		erase(it);
+	} else {
+		--entry.linksLeft;
+		m_lru.splice(m_lru.begin(), m_lru, entry.lruPos);
+	}
+	return true;
+}
+
+bool mirror::DigestCache::reserve(const struct stat &fileStat)
+{
+	if (fileStat.st_nlink < 2) {
+		return false;
+	}
+
+	bool added;
+	Entry &entry = use(fileStat, added);
+	if (added) {
+		reset(entry, fileStat);
+		return false;
+	}
+	if (matches(entry, fileStat)) {
+		return true;
+	}
+	if (entry.known) {
+		// The file is modified since its digest is calculated.
+		reset(entry, fileStat);
+	}
+	// Otherwise the entry is left to the link being hashed, and this one is hashed on its own.
+	return false;
+}
+
+void mirror::DigestCache::add(const struct stat &fileStat,
+		const unsigned char (&crc64)[sizeof(mirror::FileRecord::crc64)])
+{
+	if (fileStat.st_nlink < 2) {
+		return;
+	}
+
+	bool added;
+	Entry &entry = use(fileStat, added);
+	if (added || !matches(entry, fileStat)) {
+		reset(entry, fileStat);
+	}
+	std::copy_n(crc64, sizeof(crc64), entry.crc64);
+	entry.known = true;
+}
+
+mirror::DigestCache::Entry &mirror::DigestCache::use(const struct stat &fileStat, bool &added)
+{
+	const InodeKey key(fileStat);
+	const auto it = m_entries.find(key);
+	if (it != m_entries.end()) {
+		m_lru.splice(m_lru.begin(), m_lru, it->second.lruPos);
+		added = false;
+		return it->second;
+	}
+
+	// Room is made before the entry is added, so that the new entry itself is never dropped.
+	if (m_entries.size() >= m_maxEntries && !m_lru.empty()) {
+		erase(m_entries.find(m_lru.back()));
+	}
+	m_lru.push_front(key);
+	try {
+		Entry &entry = m_entries[key];
+		entry.lruPos = m_lru.begin();
+		added = true;
+		return entry;
+	}
+	catch (...) {
+		m_lru.pop_front();
+		throw;
+	}
+}
+
+void mirror::DigestCache::erase(const std::unordered_map<InodeKey, Entry, InodeKeyHash>::iterator pos)
+{
+	m_lru.erase(pos->second.lruPos);
+	m_entries.erase(pos);
+}
+
+void mirror::DigestCache::reset(Entry &entry, const struct stat &fileStat) noexcept
+{
+	entry.size = fileStat.st_size;
+	entry.lastModified = fileStat.st_mtim;
+	entry.known = false;
+	// The link that is hashed is seen already.
+	entry.linksLeft = fileStat.st_nlink - 1;
+}
+
+mirror::HardLinker::LinkResult mirror::HardLinker::link(const struct stat &srcStat, const char * const relPath,
+		const std::size_t relPathSize)
+{
+	if (srcStat.st_nlink < 2) {
+		return LinkResult::notLinked;
+	}
+
+	const auto result = m_files.emplace(InodeKey(srcStat), File());
+	File &file = result.first->second;
+	if (result.second) {
+		file.destPath.assign(relPath, relPathSize);
+		file.copied = false;
+		file.linksLeft = srcStat.st_nlink - 1;
+		return LinkResult::firstLink;
+	}
+
+	if (!file.copied) {
+		file.pendingLinks.emplace_back(relPath, relPathSize);
+		return LinkResult::linked;
+	}
+
+	const bool linked = makeLink(file.destPath, relPath);
+	if (file.linksLeft <= 1) {
+		m_copies.erase(file.lruPos);
+		m_files.erase(result.first);
+	} else {
+		--file.linksLeft;
+		m_copies.splice(m_copies.begin(), m_copies, file.lruPos);
+	}
+	// The file is copied at worst, as it would be without the linker.
+	return linked ? LinkResult::linked : LinkResult::notLinked;
+}
+
+std::size_t mirror::HardLinker::copyDone(const InodeKey &srcFile, const bool success)
+{
+	const auto it = m_files.find(srcFile);
+	assert(it != m_files.end());
+	File &file = it->second;
+
+	std::size_t failures = 0;
+	for (const std::string &link : file.pendingLinks) {
+		if (!success) {
+			logError("Unable to link the file '"_s, link.c_str(), "' to '"_s, file.destPath.c_str(),
+					"' since the latter is not copied correctly!"_s);
+			++failures;
+		} else if (!makeLink(file.destPath, link.c_str())) {
+			++failures;
+		}
+	}
+
+	const std::size_t linksSeen = file.pendingLinks.size();
+	if (!success || file.linksLeft <= linksSeen) {
+		// If the copy fails then the links found later are copied on their own.
+		m_files.erase(it);
+	} else {
+		// Room is made before the file is remembered, so that the file itself is never forgotten.
+		if (m_copies.size() >= m_maxCopies && !m_copies.empty()) {
+			m_files.erase(m_copies.back());
+			m_copies.pop_back();
+		}
+		m_copies.push_front(srcFile);
+		file.lruPos = m_copies.begin();
+		file.linksLeft -= linksSeen;
+		file.copied = true;
+		file.pendingLinks.clear();
+		file.pendingLinks.shrink_to_fit();
+	}
+	return failures;
+}
+
+bool mirror::HardLinker::makeLink(const std::string &target, const char * const relPath) const
+{
+	logDebug("Linking '"_s, relPath, "' to '"_s, target.c_str(), "'..."_s);
+
+	if (linkat(m_destDirFd, target.c_str(), m_destDirFd, relPath, 0) != 0) {
+		logError("Unable to link the file '"_s, relPath, "' to '"_s, target.c_str(), "': "_s,
+				std::strerror(errno));
+		return false;
+	}
+	return true;
+}
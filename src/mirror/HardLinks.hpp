@@ -0,0 +1,183 @@
+/* mirror - a tool to make mirrors of files or directories and to check consistency of the existing mirrors.
+Copyright (C) 2017-2019 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#ifndef MIRROR_HARDLINKS_HPP_
+#define MIRROR_HARDLINKS_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include "FileDB.hpp"
+#include <functional>
+#include <list>
+#include <string>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unordered_map>
+#include <vector>
+
+namespace mirror
+{
+	// Identifies a file regardless of the number of hard links to it.
+	struct InodeKey
+	{
+		InodeKey() noexcept : dev(0), ino(0) {}
+		explicit InodeKey(const struct stat &fileStat) noexcept : dev(fileStat.st_dev), ino(fileStat.st_ino) {}
+
+		// No file has the inode number zero, so the default key refers to no file.
+		bool valid() const noexcept { return ino != 0; }
+
+		bool operator==(const InodeKey &o) const noexcept { return ino == o.ino && dev == o.dev; }
+
+		dev_t dev;
+		ino_t ino;
+	};
+
+	struct InodeKeyHash
+	{
+		std::size_t operator()(const InodeKey &key) const noexcept
+		{
+			return std::hash<std::uint64_t>()(static_cast<std::uint64_t>(key.ino) ^
+					(static_cast<std::uint64_t>(key.dev) << 32));
+		}
+	};
+
+	/*
+	 * Digests of the files with several hard links, so that each of them is read once no matter how many
+	 * links to it are found. A digest is reused only if the size and the last modification time of the file
+	 * are the same. An entry is dropped once all the links to the file are seen.
+	 *
+	 * Files with a single link are never cached, so the cache takes no memory for trees without hard links.
+	 * Most links can be outside the tree walked though, so at most maxEntries digests are kept and the least
+	 * recently used one is dropped to make room for a new one. The links found afterwards are hashed again.
+	 */
+	class DigestCache
+	{
+	public:
+		// About 128 MiB of entries.
+		static constexpr std::size_t defaultMaxEntries = std::size_t(1) << 20;
+
+		explicit DigestCache(const std::size_t maxEntries = defaultMaxEntries)
+				: m_entries(), m_lru(), m_maxEntries(maxEntries) {}
+
+		// Returns true and copies the digest to dest if it is known.
+		bool find(const struct stat &fileStat, unsigned char (&dest)[sizeof(mirror::FileRecord::crc64)]);
+
+		/*
+		 * Returns true if the digest of the file is known or is being calculated. Otherwise the file is
+		 * remembered as being hashed, so that the other links to it wait for the digest rather than read
+		 * the file again.
+		 */
+		bool reserve(const struct stat &fileStat);
+
+		void add(const struct stat &fileStat, const unsigned char (&crc64)[sizeof(mirror::FileRecord::crc64)]);
+	private:
+		struct Entry
+		{
+			off_t size;
+			struct timespec lastModified;
+			unsigned char crc64[sizeof(mirror::FileRecord::crc64)];
+			bool known;
+			// The number of links not seen yet.
+			nlink_t linksLeft;
+			std::list<InodeKey>::iterator lruPos;
+		};
+
+		/*
+		 * Returns the entry of the file, adding a new one (which is to be reset) if there is none. The entry
+		 * becomes the most recently used one.
+		 */
+		Entry &use(const struct stat &fileStat, bool &added);
+		void erase(std::unordered_map<InodeKey, Entry, InodeKeyHash>::iterator pos);
+
+		static bool matches(const Entry &entry, const struct stat &fileStat) noexcept
+		{
+			return entry.size == fileStat.st_size && entry.lastModified.tv_sec == fileStat.st_mtim.tv_sec &&
+					entry.lastModified.tv_nsec == fileStat.st_mtim.tv_nsec;
+		}
+
+		static void reset(Entry &entry, const struct stat &fileStat) noexcept;
+
+		std::unordered_map<InodeKey, Entry, InodeKeyHash> m_entries;
+		// The keys of m_entries, the most recently used first.
+		std::list<InodeKey> m_lru;
+		const std::size_t m_maxEntries;
+	};
+
+	/*
+	 * Recreates the hard links among the files copied, so that each file of the source is copied once
+	 * and the other links to it are made with linkat(). Paths are relative to the destination directory.
+	 *
+	 * Copies may complete in the background. The links to a file found while it is being copied are made
+	 * once copyDone() is called for it.
+	 *
+	 * At most maxCopies files that are copied already are remembered, the least recently linked one being
+	 * forgotten to make room for a new one. The links to a file forgotten are copied on their own.
+	 */
+	class HardLinker
+	{
+	public:
+		enum class LinkResult
+		{
+			// The file is to be copied.
+			notLinked,
+			// The file is to be copied, and copyDone() is to be called for it once it is.
+			firstLink,
+			// The link is made or queued until the first link to the file is copied.
+			linked
+		};
+
+		// About 100 MiB of entries with paths of typical lengths.
+		static constexpr std::size_t defaultMaxCopies = std::size_t(1) << 19;
+
+		// The directory descriptor is not owned and must remain open while the linker exists.
+		explicit HardLinker(const int destDirFd, const std::size_t maxCopies = defaultMaxCopies)
+				: m_destDirFd(destDirFd), m_files(), m_copies(), m_maxCopies(maxCopies) {}
+
+		LinkResult link(const struct stat &srcStat, const char *relPath, std::size_t relPathSize);
+
+		/*
+		 * Makes the links queued for the file. Returns the number of links that are not made, either
+		 * because the file failed to be copied or because linkat() failed. success is also false for
+		 * a copy that does not match the DB, so that no links are made to it.
+		 */
+		std::size_t copyDone(const InodeKey &srcFile, bool success);
+	private:
+		struct File
+		{
+			// The copy the other links refer to.
+			std::string destPath;
+			bool copied;
+			std::vector<std::string> pendingLinks;
+			// The number of links not seen yet.
+			nlink_t linksLeft;
+			// Valid only if copied is true.
+			std::list<InodeKey>::iterator lruPos;
+		};
+
+		// Returns false if the link cannot be made.
+		bool makeLink(const std::string &target, const char *relPath) const;
+
+		const int m_destDirFd;
+		std::unordered_map<InodeKey, File, InodeKeyHash> m_files;
+		/*
+		 * The keys of the files of m_files that are copied, the most recently linked first. The ones being
+		 * copied are never forgotten since the links queued for them are still to be made.
+		 */
+		std::list<InodeKey> m_copies;
+		const std::size_t m_maxCopies;
+	};
+}
+
+#endif // MIRROR_HARDLINKS_HPP_
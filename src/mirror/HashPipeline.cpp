@@ -0,0 +1,445 @@
+/* mirror - a tool to make mirrors of files or directories and to check consistency of the existing mirrors.
+Copyright (C) 2017-2019 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#include "HashPipeline.hpp"
+#include <afc/logger.hpp>
+#include <algorithm>
+#include <cassert>
+#include "crc64.hpp"
+#include <cstdint>
+#include <fcntl.h>
+#include "IoUring.hpp"
+#include <limits>
+#include "log.hpp"
+#include <stdexcept>
+#include "stats.hpp"
+#include <sys/uio.h>
+#include <unistd.h>
+#include "utils.hpp"
+#include <vector>
+
+mirror::_helper::HashWorkers::HashWorkers(const unsigned threadCount, const std::size_t maxPending,
+		const mirror::ReadOptions &readOptions)
+		: m_tasks(), m_mutex(), m_maxPending(maxPending), m_digests(), m_queue(), m_taskAvailable(), m_taskDone(),
+		  m_workers(), m_readOptions(readOptions), m_stop(false)
+{
+	assert(threadCount > 0);
+	assert(maxPending > 0);
+
+	m_workers.reserve(threadCount);
+	try {
+		for (unsigned i = 0; i < threadCount; ++i) {
+			m_workers.emplace_back(&HashWorkers::work, this);
+		}
+	}
+	catch (...) {
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_stop = true;
+		}
+		m_taskAvailable.notify_all();
+		for (std::thread &worker : m_workers) {
+			worker.join();
+		}
+		throw;
+	}
+}
+
+mirror::_helper::HashWorkers::~HashWorkers()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+	}
+	m_taskAvailable.notify_all();
+	for (std::thread &worker : m_workers) {
+		worker.join();
+	}
+
+	/*
+	 * Tasks that are not completed still own their file descriptors. These are the tasks never taken
+	 * by workers, the split ones some ranges of which are never taken and the linked ones.
+	 */
+	for (const std::unique_ptr<Task> &task : m_tasks) {
+		if (!task->done || task->linked) {
+			// TODO handle error.
+			close(task->fd);
+		}
+	}
+}
+
+void mirror::_helper::HashWorkers::waitForOldest(std::unique_lock<std::mutex> &lock)
+{
+	assert(!m_tasks.empty());
+
+	while (!m_tasks.front()->done) {
+		m_taskDone.wait(lock);
+	}
+}
+
+void mirror::_helper::HashWorkers::schedule(Task &task)
+{
+	const std::uint64_t size = static_cast<std::uint64_t>(task.fileStat.st_size);
+	const std::uint64_t splitThreshold = m_readOptions.splitThreshold;
+	if (m_workers.size() < 2 || splitThreshold == 0 || size < splitThreshold || !mirror::crc64CombineSupported()) {
+		m_queue.push(Work{&task, 0});
+		m_taskAvailable.notify_one();
+		return;
+	}
+
+	const std::uint64_t rangeSize = m_readOptions.rangeSize;
+	const std::size_t rangeCount = static_cast<std::size_t>((size + rangeSize - 1) / rangeSize);
+	task.ranges.resize(rangeCount);
+	task.rangesLeft = rangeCount;
+	for (std::size_t i = 0; i < rangeCount; ++i) {
+		m_queue.push(Work{&task, i});
+	}
+	m_taskAvailable.notify_all();
+}
+
+void mirror::_helper::HashWorkers::settle(Task &task)
+{
+	if (task.posted) {
+		return;
+	}
+	if (!task.linked) {
+		if (!task.error) {
+			m_digests.add(task.fileStat, task.record.crc64);
+		}
+		return;
+	}
+
+	try {
+		// The file is read only if the link hashed earlier fails.
+		mirror::_helper::fillRegularFileRecord(task.fileStat, task.fd, task.path.c_str(), task.record,
+				m_readOptions, &m_digests);
+	}
+	catch (...) {
+		task.error = std::current_exception();
+	}
+	// TODO handle error.
+	close(task.fd);
+}
+
+void mirror::_helper::HashWorkers::work()
+{
+#ifdef MIRROR_IO_URING
+	if (workWithRing()) {
+		return;
+	}
+#endif
+	for (;;) {
+		Work work;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			while (!m_stop && m_queue.empty()) {
+				m_taskAvailable.wait(lock);
+			}
+			if (m_stop) {
+				return;
+			}
+			work = m_queue.front();
+			m_queue.pop();
+		}
+
+		Task * const task = work.task;
+		if (!task->ranges.empty()) {
+			hashRange(*task, work.range);
+			continue;
+		}
+		try {
+			mirror::_helper::fillRegularFileRecord(task->fileStat, task->fd, task->path.c_str(), task->record,
+					m_readOptions);
+		}
+		catch (...) {
+			task->error = std::current_exception();
+		}
+		complete(*task);
+	}
+}
+
+off_t mirror::_helper::HashWorkers::rangeOffset(const std::size_t range) const noexcept
+{
+	return static_cast<off_t>(range * m_readOptions.rangeSize);
+}
+
+void mirror::_helper::HashWorkers::hashRange(Task &task, const std::size_t range)
+{
+	Task::Range &dest = task.ranges[range];
+	dest.crc64 = 0;
+	dest.size = 0;
+	auto calcCRC64 = [&dest](const unsigned char buf[], const std::size_t n)
+	{
+		const mirror::stats::PhaseTimer timer(mirror::stats::Phase::crc64);
+		dest.crc64 = mirror::crc64Update(dest.crc64, buf, n);
+		dest.size += n;
+	};
+
+	// The last range is read up to the end of the file, as if the file was read as a whole.
+	const std::uint64_t size = range + 1 == task.ranges.size() ? UINT64_MAX : m_readOptions.rangeSize;
+	try {
+		mirror::_helper::processFileRange(task.fd, rangeOffset(range), size, calcCRC64, m_readOptions);
+	}
+	catch (...) {
+		dest.error = std::current_exception();
+	}
+	rangeDone(task);
+}
+
+void mirror::_helper::HashWorkers::rangeDone(Task &task)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		assert(task.rangesLeft > 0);
+		if (--task.rangesLeft != 0) {
+			return;
+		}
+	}
+
+	std::uint_fast64_t crc64 = 0;
+	for (const Task::Range &range : task.ranges) {
+		if (range.error) {
+			task.error = range.error;
+			break;
+		}
+		crc64 = mirror::crc64Combine(crc64, range.crc64, range.size);
+		// The file is shorter than it was when stat'ed. The data after the gap is not the file's any longer.
+		if (range.size < m_readOptions.rangeSize) {
+			break;
+		}
+	}
+	if (!task.error) {
+		mirror::_helper::fillRegularFileMetadata(task.fileStat, task.record);
+		mirror::_helper::storeCRC64(crc64, task.record.crc64);
+	}
+	complete(task);
+}
+
+void mirror::_helper::HashWorkers::complete(Task &task)
+{
+	if (close(task.fd) != 0 && !task.error) {
+		// TODO report the cause of the error (errno).
+		task.error = std::make_exception_ptr(std::runtime_error("Unable to close the file."));
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		task.done = true;
+	}
+	m_taskDone.notify_one();
+}
+
+#ifdef MIRROR_IO_URING
+bool mirror::_helper::HashWorkers::workWithRing()
+{
+	using afc::operator"" _s;
+	using mirror::logger::logDebug;
+
+	/*
+	 * A file or a range of a split file being hashed. Each of them has a single read in flight at a time
+	 * so its chunks are hashed in order.
+	 */
+	struct Read
+	{
+		Task *task;
+		std::size_t range;
+		struct iovec buf;
+		off_t start;
+		off_t offset;
+		// The offset the range ends at, or the maximum value if the file is read up to its end.
+		off_t end;
+		std::uint_fast64_t crc64;
+	};
+
+	const std::size_t depth = m_readOptions.queueDepth;
+	const std::size_t blockSize = m_readOptions.blockSize;
+
+	IoUring ring;
+	const int initResult = ring.init(static_cast<unsigned>(depth));
+	if (initResult != 0) {
+		logDebug("Unable to set up io_uring (error "_s, initResult, "), falling back to blocking reads..."_s);
+		return false;
+	}
+
+	unsigned char * const buffers = threadReadBuffer(depth * blockSize);
+	std::vector<Read> reads(depth);
+	std::vector<std::size_t> freeSlots;
+	freeSlots.reserve(depth);
+	for (std::size_t i = depth; i > 0; --i) {
+		freeSlots.push_back(i - 1);
+	}
+	std::vector<std::size_t> started;
+	started.reserve(depth);
+	std::size_t inFlight = 0;
+
+	auto finish = [&](const std::size_t slot)
+	{
+		Read &read = reads[slot];
+		Task &task = *read.task;
+		if (m_readOptions.dropCache) {
+			posix_fadvise(task.fd, read.start, read.offset - read.start, POSIX_FADV_DONTNEED);
+		}
+		if (task.ranges.empty()) {
+			if (!task.error) {
+				mirror::_helper::fillRegularFileMetadata(task.fileStat, task.record);
+				mirror::_helper::storeCRC64(read.crc64, task.record.crc64);
+			}
+			complete(task);
+		} else {
+			Task::Range &range = task.ranges[read.range];
+			range.crc64 = read.crc64;
+			range.size = static_cast<std::uint64_t>(read.offset - read.start);
+			rangeDone(task);
+		}
+
+		freeSlots.push_back(slot);
+		--inFlight;
+	};
+
+	auto fail = [&](const std::size_t slot, const int errorCode)
+	{
+		Read &read = reads[slot];
+		try {
+			mirror::_helper::handleReadFileError(errorCode);
+		}
+		catch (...) {
+			if (read.task->ranges.empty()) {
+				read.task->error = std::current_exception();
+			} else {
+				read.task->ranges[read.range].error = std::current_exception();
+			}
+		}
+		finish(slot);
+	};
+
+	// Reads the next chunk of the file or the range, which must not be over yet.
+	auto queueNext = [&](const std::size_t slot)
+	{
+		Read &read = reads[slot];
+		const off_t left = read.end - read.offset;
+		read.buf.iov_len = left < static_cast<off_t>(blockSize) ? static_cast<std::size_t>(left) : blockSize;
+		ring.queueRead(read.task->fd, read.buf, read.offset, slot);
+	};
+
+	for (;;) {
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			while (inFlight == 0 && !m_stop && m_queue.empty()) {
+				m_taskAvailable.wait(lock);
+			}
+			if (m_stop && inFlight == 0) {
+				return true;
+			}
+			// Files are started while there are free slots; the rest are left to other workers.
+			while (!m_stop && !freeSlots.empty() && !m_queue.empty()) {
+				const std::size_t slot = freeSlots.back();
+				freeSlots.pop_back();
+
+				const Work &work = m_queue.front();
+				Read &read = reads[slot];
+				read.task = work.task;
+				read.range = work.range;
+				read.buf.iov_base = buffers + slot * blockSize;
+				read.start = read.task->ranges.empty() ? 0 : rangeOffset(work.range);
+				read.offset = read.start;
+				// The last range is read up to the end of the file, as if the file was read as a whole.
+				read.end = read.task->ranges.empty() || work.range + 1 == read.task->ranges.size() ?
+						std::numeric_limits<off_t>::max() : rangeOffset(work.range + 1);
+				read.crc64 = 0;
+				m_queue.pop();
+
+				started.push_back(slot);
+				++inFlight;
+			}
+		}
+
+		for (const std::size_t slot : started) {
+			// Hints are advisory so their failures are ignored.
+			posix_fadvise(reads[slot].task->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+			queueNext(slot);
+		}
+		started.clear();
+
+		int submitResult;
+		{
+			const mirror::stats::PhaseTimer timer(mirror::stats::Phase::read);
+			submitResult = ring.submitAndWait();
+		}
+		if (submitResult != 0) {
+			/*
+			 * The reads already passed to the kernel could still write to their buffers, which the blocking
+			 * reads reuse, so they are waited for before the ring is abandoned. The tasks they belong to
+			 * are failed since their reads are not all made.
+			 */
+			std::size_t submitted = inFlight - ring.queued();
+			int drainResult = 0;
+			while (submitted != 0) {
+				std::uint64_t userData;
+				int result;
+				while (submitted != 0 && ring.nextCompletion(userData, result)) {
+					--submitted;
+				}
+				if (submitted != 0) {
+					drainResult = ring.waitForCompletions(static_cast<unsigned>(submitted));
+					if (drainResult != 0) {
+						break;
+					}
+				}
+			}
+			if (drainResult != 0) {
+				// The reads that are left are given the buffers for good.
+				logDebug("Unable to wait for io_uring reads (error "_s, drainResult, ')');
+				abandonThreadReadBuffer();
+			}
+
+			for (std::size_t slot = 0; slot < depth; ++slot) {
+				if (std::find(freeSlots.begin(), freeSlots.end(), slot) == freeSlots.end()) {
+					fail(slot, submitResult);
+				}
+			}
+			logDebug("io_uring submission failed (error "_s, submitResult, "), falling back to blocking reads..."_s);
+			return false;
+		}
+
+		std::uint64_t userData;
+		int result;
+		while (ring.nextCompletion(userData, result)) {
+			const std::size_t slot = static_cast<std::size_t>(userData);
+			Read &read = reads[slot];
+
+			if (result == -EINTR || result == -EAGAIN) {
+				queueNext(slot);
+			} else if (result < 0) {
+				fail(slot, -result);
+			} else if (result == 0) {
+				finish(slot);
+			} else {
+				mirror::stats::countBytes(static_cast<std::uint64_t>(result));
+				{
+					const mirror::stats::PhaseTimer timer(mirror::stats::Phase::crc64);
+					read.crc64 = mirror::crc64Update(read.crc64,
+							static_cast<const unsigned char *>(read.buf.iov_base), static_cast<std::size_t>(result));
+				}
+				read.offset += result;
+				if (read.offset < read.end) {
+					queueNext(slot);
+				} else {
+					finish(slot);
+				}
+			}
+		}
+	}
+}
+#endif // MIRROR_IO_URING
@@ -0,0 +1,300 @@
+/* mirror - a tool to make mirrors of files or directories and to check consistency of the existing mirrors.
+Copyright (C) 2017-2019 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#ifndef MIRROR_HASHPIPELINE_HPP_
+#define MIRROR_HASHPIPELINE_HPP_
+
+#include <cassert>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include "FileDB.hpp"
+#include "HardLinks.hpp"
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace mirror
+{
+	struct ReadOptions;
+
+	namespace _helper
+	{
+		/*
+		 * Thread pool that calculates digests of regular files. The pool itself knows nothing
+		 * about what is done with the digests; this is the responsibility of HashPipeline.
+		 */
+		class HashWorkers
+		{
+		protected:
+			struct Task
+			{
+				// A part of a file that is hashed on its own (see ReadOptions::splitThreshold).
+				struct Range
+				{
+					std::uint_fast64_t crc64;
+					// The number of bytes actually read.
+					std::uint64_t size;
+					std::exception_ptr error;
+				};
+
+				Task(const int fd, const struct stat &fileStat, const char * const path, const std::size_t pathSize)
+						: fd(fd), fileStat(fileStat), path(path, pathSize), error(), done(false), linked(false),
+						  posted(false), ranges(), rangesLeft(0) {}
+				virtual ~Task() = default;
+
+				int fd;
+				struct stat fileStat;
+				std::string path;
+				mirror::FileRecord record;
+				std::exception_ptr error;
+				bool done;
+				/*
+				 * If true then the task is not given to the workers since another link to the same file is
+				 * submitted earlier. The digest is taken from m_digests when the task is delivered.
+				 */
+				bool linked;
+				// If true then the task carries no file but the record it is posted with (see HashPipeline::post()).
+				bool posted;
+				// Empty unless the file is hashed in ranges by several workers at once.
+				std::vector<Range> ranges;
+				// The number of ranges that are not hashed yet. Guarded by m_mutex.
+				std::size_t rangesLeft;
+			};
+
+			// The options are referred to, not copied, so they must outlive the workers.
+			HashWorkers(unsigned threadCount, std::size_t maxPending, const mirror::ReadOptions &readOptions);
+			~HashWorkers();
+
+			HashWorkers(const HashWorkers &) = delete;
+			HashWorkers(HashWorkers &&) = delete;
+			HashWorkers &operator=(const HashWorkers &) = delete;
+			HashWorkers &operator=(HashWorkers &&) = delete;
+
+			// Blocks until the oldest task is hashed. Must be called with m_mutex held.
+			void waitForOldest(std::unique_lock<std::mutex> &lock);
+			/*
+			 * Enqueues a task that the caller has already put to m_tasks. Large files are split into ranges
+			 * that are enqueued one after another, so that idle workers pick them up at once. Must be called
+			 * with m_mutex held.
+			 */
+			void schedule(Task &task);
+			/*
+			 * Prepares the task to be handed over to the consumer: takes the digest of a linked task from
+			 * m_digests, or remembers the digest of a hashed one there.
+			 */
+			void settle(Task &task);
+
+			// All the tasks in submission order, both completed and pending.
+			std::deque<std::unique_ptr<Task>> m_tasks;
+			std::mutex m_mutex;
+			const std::size_t m_maxPending;
+			// Used by the thread that submits tasks only.
+			mirror::DigestCache m_digests;
+		private:
+			// A task or a range of it that is waiting for a worker.
+			struct Work
+			{
+				Task *task;
+				// Zero for tasks that are not split.
+				std::size_t range;
+			};
+
+			void work();
+			// Hashes a range of the file with blocking reads.
+			void hashRange(Task &task, std::size_t range);
+			/*
+			 * Called once a range of the task is hashed. The worker that hashes the last range combines
+			 * the digests of the ranges and completes the task.
+			 */
+			void rangeDone(Task &task);
+			// The offset the range of the task starts at.
+			off_t rangeOffset(std::size_t range) const noexcept;
+#ifdef MIRROR_IO_URING
+			/*
+			 * Hashes the tasks with many reads in flight in an io_uring instance. Returns false if io_uring
+			 * cannot be used, and the worker must fall back to blocking reads.
+			 */
+			bool workWithRing();
+#endif
+			// Closes the file of the task hashed and hands the task over to the thread that waits for it.
+			void complete(Task &task);
+
+			// Tasks and ranges not yet taken by any worker.
+			std::queue<Work> m_queue;
+			std::condition_variable m_taskAvailable;
+			std::condition_variable m_taskDone;
+			std::vector<std::thread> m_workers;
+			const mirror::ReadOptions &m_readOptions;
+			bool m_stop;
+		};
+	}
+
+	/*
+	 * Calculates digests of regular files in a pool of worker threads. Results are handed over
+	 * to the consumer in the thread that submits tasks and in the order these tasks are submitted.
+	 *
+	 * Each task carries a Payload which is passed to the consumer together with the file record
+	 * calculated. The consumer is any callable of the form void (Payload &, const FileRecord &).
+	 */
+	template<typename Payload>
+	class HashPipeline : private mirror::_helper::HashWorkers
+	{
+		struct PayloadTask : Task
+		{
+			PayloadTask(const int fd, const struct stat &fileStat, const char * const path, const std::size_t pathSize,
+					Payload &&payload) : Task(fd, fileStat, path, pathSize), payload(std::move(payload)) {}
+
+			Payload payload;
+		};
+	public:
+		HashPipeline(const unsigned threadCount, const std::size_t maxPending, const mirror::ReadOptions &readOptions)
+				: HashWorkers(threadCount, maxPending, readOptions) {}
+		~HashPipeline() = default;
+
+		/*
+		 * Schedules the file to be hashed. The pipeline takes ownership of fd. Results that are already
+		 * available are delivered to the consumer before this function returns. If there are too many
+		 * pending tasks then the oldest ones are waited for and delivered first.
+		 *
+		 * A file another link to which is submitted earlier is not read again, its digest is reused.
+		 */
+		template<typename Consumer>
+		void submit(const int fd, const struct stat &fileStat, const char * const path, const std::size_t pathSize,
+				Payload &&payload, Consumer &consumer)
+		{
+			deliverReady(consumer);
+
+			const bool linked = m_digests.reserve(fileStat);
+			for (;;) {
+				std::unique_ptr<Task> task;
+				{
+					std::unique_lock<std::mutex> lock(m_mutex);
+					if (m_tasks.size() < m_maxPending) {
+						m_tasks.emplace_back(new PayloadTask(fd, fileStat, path, pathSize, std::move(payload)));
+						Task &newTask = *m_tasks.back();
+						if (linked) {
+							newTask.linked = true;
+							newTask.done = true;
+						} else {
+							schedule(newTask);
+						}
+						return;
+					}
+					waitForOldest(lock);
+					task = std::move(m_tasks.front());
+					m_tasks.pop_front();
+				}
+				deliver(*task, consumer);
+			}
+		}
+
+		/*
+		 * Hands the payload over to the consumer together with the record given once the results of the tasks
+		 * submitted earlier are delivered, so that the consumer sees the results of files that need no hashing
+		 * in the submission order, too. If there are no tasks pending then the payload is delivered before
+		 * this function returns.
+		 */
+		template<typename Consumer>
+		void post(Payload &&payload, const mirror::FileRecord &record, Consumer &consumer)
+		{
+			deliverReady(consumer);
+
+			for (;;) {
+				std::unique_ptr<Task> task;
+				{
+					std::unique_lock<std::mutex> lock(m_mutex);
+					if (m_tasks.empty()) {
+						break;
+					}
+					if (m_tasks.size() < m_maxPending) {
+						struct stat noStat;
+						std::memset(&noStat, 0, sizeof(noStat));
+						m_tasks.emplace_back(new PayloadTask(-1, noStat, "", 0, std::move(payload)));
+						Task &newTask = *m_tasks.back();
+						newTask.record = record;
+						newTask.posted = true;
+						newTask.done = true;
+						return;
+					}
+					waitForOldest(lock);
+					task = std::move(m_tasks.front());
+					m_tasks.pop_front();
+				}
+				deliver(*task, consumer);
+			}
+			consumer(payload, record);
+		}
+
+		// Delivers all the results that are ready without breaking the submission order.
+		template<typename Consumer>
+		void deliverReady(Consumer &consumer)
+		{
+			for (;;) {
+				std::unique_ptr<Task> task;
+				{
+					std::lock_guard<std::mutex> lock(m_mutex);
+					if (m_tasks.empty() || !m_tasks.front()->done) {
+						return;
+					}
+					task = std::move(m_tasks.front());
+					m_tasks.pop_front();
+				}
+				deliver(*task, consumer);
+			}
+		}
+
+		// Waits for all the tasks submitted to be hashed and delivers their results.
+		template<typename Consumer>
+		void finish(Consumer &consumer)
+		{
+			for (;;) {
+				std::unique_ptr<Task> task;
+				{
+					std::unique_lock<std::mutex> lock(m_mutex);
+					if (m_tasks.empty()) {
+						return;
+					}
+					waitForOldest(lock);
+					task = std::move(m_tasks.front());
+					m_tasks.pop_front();
+				}
+				deliver(*task, consumer);
+			}
+		}
+	private:
+		template<typename Consumer>
+		void deliver(Task &task, Consumer &consumer)
+		{
+			assert(task.done);
+
+			settle(task);
+			if (task.error) {
+				std::rethrow_exception(task.error);
+			}
+			consumer(static_cast<PayloadTask &>(task).payload, task.record);
+		}
+	};
+}
+
+#endif // MIRROR_HASHPIPELINE_HPP_
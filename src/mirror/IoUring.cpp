@@ -0,0 +1,192 @@
+/* mirror - a tool to make mirrors of files or directories and to check consistency of the existing mirrors.
+Copyright (C) 2017-2019 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#include "IoUring.hpp"
+
+#ifdef MIRROR_IO_URING
+
+#include <cerrno>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace
+{
+	template<typename T>
+	inline T *ringField(void * const ring, const std::uint32_t offset) noexcept
+	{
+		return reinterpret_cast<T *>(static_cast<unsigned char *>(ring) + offset);
+	}
+}
+
+mirror::_helper::IoUring::~IoUring()
+{
+	if (m_fd == -1) {
+		return;
+	}
+	munmap(m_sqes, m_sqesSize);
+	if (m_cqRing != m_sqRing) {
+		munmap(m_cqRing, m_cqRingSize);
+	}
+	munmap(m_sqRing, m_sqRingSize);
+	// TODO handle error.
+	close(m_fd);
+}
+
+int mirror::_helper::IoUring::init(const unsigned entries)
+{
+	io_uring_params params;
+	std::memset(&params, 0, sizeof(params));
+
+	const int fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+	if (fd == -1) {
+		return errno;
+	}
+
+	m_sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	m_cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+	const bool singleMmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if (singleMmap && m_cqRingSize > m_sqRingSize) {
+		m_sqRingSize = m_cqRingSize;
+	}
+
+	m_sqRing = mmap(nullptr, m_sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (m_sqRing == MAP_FAILED) {
+		goto error_sqRing;
+	}
+	if (singleMmap) {
+		m_cqRing = m_sqRing;
+	} else {
+		m_cqRing = mmap(nullptr, m_cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+				fd, IORING_OFF_CQ_RING);
+		if (m_cqRing == MAP_FAILED) {
+			goto error_cqRing;
+		}
+	}
+	m_sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+	m_sqes = static_cast<io_uring_sqe *>(mmap(nullptr, m_sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			fd, IORING_OFF_SQES));
+	if (m_sqes == MAP_FAILED) {
+		goto error_sqes;
+	}
+
+	m_sqHead = ringField<unsigned>(m_sqRing, params.sq_off.head);
+	m_sqTail = ringField<unsigned>(m_sqRing, params.sq_off.tail);
+	m_sqMask = ringField<unsigned>(m_sqRing, params.sq_off.ring_mask);
+	m_sqArray = ringField<unsigned>(m_sqRing, params.sq_off.array);
+	m_cqHead = ringField<unsigned>(m_cqRing, params.cq_off.head);
+	m_cqTail = ringField<unsigned>(m_cqRing, params.cq_off.tail);
+	m_cqMask = ringField<unsigned>(m_cqRing, params.cq_off.ring_mask);
+	m_cqes = ringField<io_uring_cqe>(m_cqRing, params.cq_off.cqes);
+
+	m_fd = fd;
+	m_toSubmit = 0;
+	return 0;
+
+	int errorCode;
+error_sqes:
+	errorCode = errno;
+	if (!singleMmap) {
+		munmap(m_cqRing, m_cqRingSize);
+	}
+	goto unmap_sqRing;
+error_cqRing:
+	errorCode = errno;
+unmap_sqRing:
+	munmap(m_sqRing, m_sqRingSize);
+	goto close_fd;
+error_sqRing:
+	errorCode = errno;
+close_fd:
+	close(fd);
+	return errorCode;
+}
+
+void mirror::_helper::IoUring::queueRead(const int fd, const struct iovec &buf, const off_t offset,
+		const std::uint64_t userData) noexcept
+{
+	// Only this thread writes the tail so it is read without synchronisation.
+	const unsigned tail = *m_sqTail;
+	const unsigned index = tail & *m_sqMask;
+
+	io_uring_sqe &sqe = m_sqes[index];
+	std::memset(&sqe, 0, sizeof(sqe));
+	sqe.opcode = IORING_OP_READV;
+	sqe.fd = fd;
+	sqe.off = static_cast<std::uint64_t>(offset);
+	sqe.addr = reinterpret_cast<std::uint64_t>(&buf);
+	sqe.len = 1;
+	sqe.user_data = userData;
+
+	m_sqArray[index] = index;
+	// Publishes the entry to the kernel.
+	__atomic_store_n(m_sqTail, tail + 1, __ATOMIC_RELEASE);
+	++m_toSubmit;
+}
+
+int mirror::_helper::IoUring::submitAndWait() noexcept
+{
+	for (;;) {
+		const long result = syscall(__NR_io_uring_enter, m_fd, m_toSubmit, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+		if (result >= 0) {
+			m_toSubmit -= static_cast<unsigned>(result);
+			return 0;
+		}
+		if (errno != EINTR) {
+			return errno;
+		}
+	}
+}
+
+int mirror::_helper::IoUring::waitForCompletions(const unsigned count) noexcept
+{
+	for (;;) {
+		const long result = syscall(__NR_io_uring_enter, m_fd, 0, count, IORING_ENTER_GETEVENTS, nullptr, 0);
+		if (result >= 0) {
+			return 0;
+		}
+		if (errno != EINTR) {
+			return errno;
+		}
+	}
+}
+
+bool mirror::_helper::IoUring::nextCompletion(std::uint64_t &userData, int &result) noexcept
+{
+	const unsigned head = *m_cqHead;
+	if (head == __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE)) {
+		return false;
+	}
+
+	const io_uring_cqe &cqe = m_cqes[head & *m_cqMask];
+	userData = cqe.user_data;
+	result = cqe.res;
+
+	__atomic_store_n(m_cqHead, head + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+bool mirror::_helper::ioUringSupported() noexcept
+{
+	static const bool supported = []() noexcept
+	{
+		IoUring ring;
+		return ring.init(1) == 0;
+	}();
+	return supported;
+}
+
+#endif // MIRROR_IO_URING
@@ -0,0 +1,103 @@
+/* mirror - a tool to make mirrors of files or directories and to check consistency of the existing mirrors.
+Copyright (C) 2017-2019 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#ifndef MIRROR_IOURING_HPP_
+#define MIRROR_IOURING_HPP_
+
+#ifdef MIRROR_IO_URING
+
+#include <cstddef>
+#include <cstdint>
+#include <linux/io_uring.h>
+#include <sys/uio.h>
+
+namespace mirror
+{
+	namespace _helper
+	{
+		/*
+		 * A minimal io_uring instance driven by raw system calls (so that liburing is not needed).
+		 * Only a single thread may use an instance.
+		 */
+		class IoUring
+		{
+		public:
+			IoUring() noexcept : m_fd(-1) {}
+			~IoUring();
+
+			IoUring(const IoUring &) = delete;
+			IoUring(IoUring &&) = delete;
+			IoUring &operator=(const IoUring &) = delete;
+			IoUring &operator=(IoUring &&) = delete;
+
+			// Returns zero on success and the error code on failure (e.g. if the kernel does not support io_uring).
+			int init(unsigned entries);
+
+			/*
+			 * Queues a read into a single buffer at the given offset. The request is passed to the kernel
+			 * by the next call to submitAndWait(). The submission queue must have room for it, which holds
+			 * as long as there are no more requests in flight than the number of entries of the ring.
+			 */
+			void queueRead(int fd, const struct iovec &buf, off_t offset, std::uint64_t userData) noexcept;
+
+			/*
+			 * Submits the requests queued and waits until at least one completion is available.
+			 * Returns zero on success and the error code on failure.
+			 */
+			int submitAndWait() noexcept;
+
+			/*
+			 * Waits without submitting anything until at least count completions are available.
+			 * Returns zero on success and the error code on failure.
+			 */
+			int waitForCompletions(unsigned count) noexcept;
+
+			// The number of the requests queued that are not passed to the kernel yet.
+			unsigned queued() const noexcept { return m_toSubmit; }
+
+			/*
+			 * Takes the next completion if there is one. Returns false if the completion queue is empty.
+			 * result is the same as the return value of the corresponding system call or -errno.
+			 */
+			bool nextCompletion(std::uint64_t &userData, int &result) noexcept;
+		private:
+			int m_fd;
+			unsigned m_toSubmit;
+
+			void *m_sqRing;
+			std::size_t m_sqRingSize;
+			void *m_cqRing;
+			std::size_t m_cqRingSize;
+			io_uring_sqe *m_sqes;
+			std::size_t m_sqesSize;
+
+			unsigned *m_sqHead;
+			unsigned *m_sqTail;
+			unsigned *m_sqMask;
+			unsigned *m_sqArray;
+			unsigned *m_cqHead;
+			unsigned *m_cqTail;
+			unsigned *m_cqMask;
+			io_uring_cqe *m_cqes;
+		};
+
+		// Checks once whether the kernel lets this process use io_uring.
+		bool ioUringSupported() noexcept;
+	}
+}
+
+#endif // MIRROR_IO_URING
+
+#endif // MIRROR_IOURING_HPP_
@@ -0,0 +1,202 @@
+/* mirror - a tool to make mirrors of files or directories and to check consistency of the existing mirrors.
+Copyright (C) 2017-2019 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#include <afc/FastStringBuffer.hpp>
+#include <afc/logger.hpp>
+#include <algorithm>
+#include "encoding.hpp"
+#include <exception>
+#include <fcntl.h>
+#include "LocalSource.hpp"
+#include "log.hpp"
+#include <sys/stat.h>
+#include <unistd.h>
+#include "utils.hpp"
+
+using afc::operator"" _s;
+using mirror::logger::logDebug;
+
+namespace
+{
+	// Reports the regular files of a directory with their paths relative to the directory scanned from.
+	template<typename Callback>
+	struct CandidateDirHandler
+	{
+		struct DirCtx {};
+
+		void dirStart(DirCtx &, afc::FastStringBuffer<char> &, std::size_t) {}
+		void dirEnd(DirCtx &, afc::FastStringBuffer<char> &, std::size_t) {}
+
+		bool file(DirCtx &, const struct stat &fileStat, mirror::_helper::FileRef &,
+				const afc::FastStringBuffer<char> &path, std::size_t, std::size_t)
+		{
+			if (S_ISREG(fileStat.st_mode)) {
+				callback(fileStat, path.begin(), path.size());
+			}
+			return true;
+		}
+
+		Callback &callback;
+	};
+}
+
+void mirror::LocalSource::addCandidate(const char * const relPath, const std::size_t relPathSize)
+{
+	std::string path(relPath, relPathSize);
+	struct stat fileStat;
+	// Empty files are not worth looking for.
+	if (mirror::_helper::statFile(m_destDirFd, path.c_str(), fileStat) != 0 || !S_ISREG(fileStat.st_mode) ||
+			fileStat.st_size == 0) {
+		return;
+	}
+	m_candidates.emplace(fileStat.st_size, Candidate{std::move(path), false, false, {}});
+}
+
+void mirror::LocalSource::addCandidateDir(const char * const relPath, const std::size_t relPathSize)
+{
+	m_pathBuf.assign(relPath, relPathSize);
+	const int dirFd = openat(m_destDirFd, m_pathBuf.c_str(), O_RDONLY | O_NOFOLLOW | O_DIRECTORY);
+	if (dirFd == -1) {
+		return;
+	}
+
+	auto add = [this](const struct stat &fileStat, const char * const path, const std::size_t pathSize)
+	{
+		if (fileStat.st_size != 0) {
+			m_candidates.emplace(fileStat.st_size, Candidate{std::string(path, pathSize), false, false, {}});
+		}
+	};
+	CandidateDirHandler<decltype(add)> handler{add};
+	// The paths reported are relative to the destination directory since the scan starts with relPath.
+	afc::FastStringBuffer<char> path(relPathSize);
+	path.append(relPath, relPathSize);
+	try {
+		mirror::_helper::scanFiles(path, dirFd, handler); // dirFd is closed here.
+	}
+	catch (const int) {
+		// The files found so far are still usable.
+	}
+}
+
+bool mirror::LocalSource::copy(const char * const relPath, const std::size_t relPathSize,
+		const mirror::FileRecord &expected)
+{
+	if (expected.type != mirror::FileType::file || expected.fileSize == 0) {
+		return false;
+	}
+
+	m_pathBuf.assign(relPath, relPathSize);
+	mirror::assignUtf8(m_relPathU8, relPath, relPathSize);
+	unsigned char crc64[sizeof(mirror::FileRecord::crc64)];
+	auto matches = [&expected](const unsigned char (&crc64)[sizeof(mirror::FileRecord::crc64)])
+	{
+		return std::equal(crc64, crc64 + sizeof(crc64), expected.crc64);
+	};
+
+	// The files that are to have the same contents according to the DB, if they are there already.
+	m_dbMatches.clear();
+	m_db.findFilesByContent(expected.fileSize, expected.crc64, maxCandidates + 1, m_dbMatches);
+	for (const std::string &matchU8 : m_dbMatches) {
+		if (matchU8 == m_relPathU8) {
+			continue;
+		}
+		const mirror::TextView match = mirror::fromUtf8(matchU8.data(), matchU8.size(), m_fileBuf);
+		const std::string candidate(match.value, match.size);
+		if (hash(candidate.c_str(), expected.fileSize, crc64) && matches(crc64) &&
+				copyFrom(candidate.c_str(), m_pathBuf.c_str())) {
+			return true;
+		}
+	}
+
+	// The files that are not in the DB, which are likely to be moved in the source.
+	const auto range = m_candidates.equal_range(expected.fileSize);
+	std::size_t hashed = 0;
+	for (auto it = range.first; it != range.second; ++it) {
+		Candidate &candidate = it->second;
+		if (!candidate.hashed) {
+			if (hashed == maxCandidates) {
+				break;
+			}
+			candidate.valid = hash(candidate.path.c_str(), expected.fileSize, candidate.crc64);
+			candidate.hashed = true;
+			++hashed;
+		}
+		if (candidate.valid && matches(candidate.crc64) && copyFrom(candidate.path.c_str(), m_pathBuf.c_str())) {
+			return true;
+		}
+	}
+	return false;
+}
+
+bool mirror::LocalSource::copy(const char * const relPath, const std::size_t relPathSize, const struct stat &srcStat)
+{
+	const char * const end = relPath + relPathSize;
+	const char *fileName = end;
+	while (fileName != relPath && fileName[-1] != '/') {
+		--fileName;
+	}
+	const std::size_t dirSize = fileName == relPath ? 0 : fileName - 1 - relPath;
+
+	const mirror::TextView dirU8 = mirror::toUtf8(relPath, dirSize, m_dirBuf);
+	const mirror::TextView fileU8 = mirror::toUtf8(fileName, end - fileName, m_fileBuf);
+	mirror::FileRecord record;
+	if (!m_db.getFile(fileU8.value, fileU8.size, dirU8.value, dirU8.size, record)) {
+		return false;
+	}
+
+	// The contents the DB expects are the ones of the source file only if the latter is not modified since.
+	if (record.type != mirror::FileType::file || record.fileSize != srcStat.st_size ||
+			record.lastModifiedTS.millis() != static_cast<afc::Timestamp::time_type>(srcStat.st_mtime) * 1000) {
+		return false;
+	}
+	return copy(relPath, relPathSize, record);
+}
+
+bool mirror::LocalSource::hash(const char * const relPath, const off_t size,
+		unsigned char (&dest)[sizeof(mirror::FileRecord::crc64)])
+{
+	const int fd = openat(m_destDirFd, relPath, O_RDONLY | O_NOFOLLOW);
+	if (fd == -1) {
+		return false;
+	}
+
+	struct stat fileStat;
+	bool result = fstat(fd, &fileStat) == 0 && S_ISREG(fileStat.st_mode) && fileStat.st_size == size;
+	if (result) {
+		mirror::ReadOptions options;
+		// The file is read again if it is copied rather than reflinked.
+		options.dropCache = false;
+		mirror::FileRecord record;
+		try {
+			mirror::_helper::fillRegularFileRecord(fileStat, fd, relPath, record, options);
+			std::copy_n(record.crc64, sizeof(dest), dest);
+		}
+		catch (const std::exception &) {
+			result = false;
+		}
+		catch (const int) {
+			result = false;
+		}
+	}
+	// TODO handle error.
+	close(fd);
+	return result;
+}
+
+bool mirror::LocalSource::copyFrom(const char * const candidate, const char * const relPath)
+{
+	logDebug("Copying '"_s, relPath, "' from '"_s, candidate, "' in the destination..."_s);
+	return mirror::copyFile(m_destDirFd, candidate, m_destDirFd, relPath);
+}
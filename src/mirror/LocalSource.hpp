@@ -0,0 +1,92 @@
+/* mirror - a tool to make mirrors of files or directories and to check consistency of the existing mirrors.
+Copyright (C) 2017-2019 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#ifndef MIRROR_LOCALSOURCE_HPP_
+#define MIRROR_LOCALSOURCE_HPP_
+
+#include <cstddef>
+#include "FileDB.hpp"
+#include <string>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unordered_map>
+#include <vector>
+
+namespace mirror
+{
+	/*
+	 * Files of the destination of merge-dir that missing files are copied from instead of the source, so
+	 * that the files moved or renamed in the source are not pulled over the source link again. Candidates
+	 * are the files the DB expects to have the same contents (found by FileDB::findFilesByContent()) and
+	 * the files found in the destination that are not in the DB. A candidate is used only if its digest
+	 * matches the DB; the copy is reflinked where the file system supports it.
+	 *
+	 * Paths are relative to the destination directory and in the system charset.
+	 */
+	class LocalSource
+	{
+	public:
+		// The number of candidates of each kind tried for a file at most.
+		static constexpr std::size_t maxCandidates = 8;
+
+		// Must follow FileDB::beginContentLookups(). The directory descriptor is not owned.
+		LocalSource(mirror::FileDB &db, const int destDirFd)
+				: m_db(db), m_destDirFd(destDirFd), m_candidates(), m_dbMatches(), m_relPathU8(), m_dirBuf(),
+				  m_fileBuf(), m_pathBuf() {}
+
+		LocalSource(const LocalSource &) = delete;
+		LocalSource &operator=(const LocalSource &) = delete;
+
+		// Remembers the regular file of the destination that is not in the DB.
+		void addCandidate(const char *relPath, std::size_t relPathSize);
+		// Remembers all the regular files in the directory of the destination that is not in the DB.
+		void addCandidateDir(const char *relPath, std::size_t relPathSize);
+
+		// Makes the missing file from a local one with the same contents. Returns false if there is none.
+		bool copy(const char *relPath, std::size_t relPathSize, const mirror::FileRecord &expected);
+		/*
+		 * The same as above, with the record of the file taken from the DB. The DB record is trusted only if
+		 * it matches the size and the last modification time of the source file.
+		 */
+		bool copy(const char *relPath, std::size_t relPathSize, const struct stat &srcStat);
+	private:
+		struct Candidate
+		{
+			std::string path;
+			// False until the digest is needed.
+			bool hashed;
+			// False if the file cannot be read.
+			bool valid;
+			unsigned char crc64[sizeof(mirror::FileRecord::crc64)];
+		};
+
+		// Returns false if the file is not a regular one of the given size or cannot be read.
+		bool hash(const char *relPath, off_t size, unsigned char (&dest)[sizeof(mirror::FileRecord::crc64)]);
+		bool copyFrom(const char *candidate, const char *relPath);
+
+		mirror::FileDB &m_db;
+		const int m_destDirFd;
+		// The files not in the DB by their sizes.
+		std::unordered_multimap<off_t, Candidate> m_candidates;
+		std::vector<std::string> m_dbMatches;
+		// Shared by all the files since the source is never called concurrently.
+		std::string m_relPathU8;
+		std::string m_dirBuf;
+		std::string m_fileBuf;
+		std::string m_pathBuf;
+	};
+}
+
+#endif // MIRROR_LOCALSOURCE_HPP_
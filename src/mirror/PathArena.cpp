@@ -0,0 +1,72 @@
+/* mirror - a tool to make mirrors of files or directories and to check consistency of the existing mirrors.
+Copyright (C) 2017-2019 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#include "PathArena.hpp"
+#include <cstdlib>
+#include <new>
+
+namespace
+{
+	// Small enough not to waste memory on directories with a few files.
+	constexpr std::size_t minChunkSize = 4 * 1024;
+	constexpr std::size_t maxChunkSize = 1024 * 1024;
+}
+
+void mirror::PathArena::allocateChunk(const std::size_t minSize)
+{
+	// Each chunk is twice as large as the previous one so that the number of chunks grows logarithmically.
+	std::size_t size = m_chunks == nullptr ? minChunkSize : std::min(m_chunks->size * 2, maxChunkSize);
+	size = std::max(size, minSize + sizeof(Chunk));
+
+	Chunk * const chunk = static_cast<Chunk *>(std::malloc(size));
+	if (chunk == nullptr) {
+		throw std::bad_alloc();
+	}
+	chunk->prev = m_chunks;
+	chunk->size = size;
+
+	m_chunks = chunk;
+	m_next = reinterpret_cast<char *>(chunk + 1);
+	m_left = size - sizeof(Chunk);
+}
+
+void mirror::PathArena::clear() noexcept
+{
+	if (m_chunks == nullptr) {
+		return;
+	}
+
+	Chunk * const last = m_chunks;
+	m_chunks = last->prev;
+	releaseChunks();
+
+	last->prev = nullptr;
+	m_chunks = last;
+	m_next = reinterpret_cast<char *>(last + 1);
+	m_left = last->size - sizeof(Chunk);
+}
+
+void mirror::PathArena::releaseChunks() noexcept
+{
+	Chunk *chunk = m_chunks;
+	while (chunk != nullptr) {
+		Chunk * const prev = chunk->prev;
+		std::free(chunk);
+		chunk = prev;
+	}
+	m_chunks = nullptr;
+	m_next = nullptr;
+	m_left = 0;
+}
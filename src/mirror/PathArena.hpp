@@ -0,0 +1,93 @@
+/* mirror - a tool to make mirrors of files or directories and to check consistency of the existing mirrors.
+Copyright (C) 2017-2019 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#ifndef MIRROR_PATHARENA_HPP_
+#define MIRROR_PATHARENA_HPP_
+
+#include <algorithm>
+#include <cstddef>
+
+namespace mirror
+{
+	/*
+	 * Bump allocator for path strings. Strings are copied one after another into chunks that are
+	 * allocated with growing sizes, and they are all released at once when the arena is cleared or
+	 * destroyed. Making a container own the arena its keys point to replaces an allocation per key
+	 * with a few allocations per container.
+	 */
+	class PathArena
+	{
+	public:
+		PathArena() noexcept : m_chunks(nullptr), m_next(nullptr), m_left(0) {}
+		~PathArena() { releaseChunks(); }
+
+		PathArena(const PathArena &) = delete;
+		PathArena &operator=(const PathArena &) = delete;
+
+		PathArena(PathArena &&o) noexcept : m_chunks(o.m_chunks), m_next(o.m_next), m_left(o.m_left)
+		{
+			o.m_chunks = nullptr;
+			o.m_next = nullptr;
+			o.m_left = 0;
+		}
+
+		PathArena &operator=(PathArena &&o) noexcept
+		{
+			if (this != &o) {
+				releaseChunks();
+				m_chunks = o.m_chunks;
+				m_next = o.m_next;
+				m_left = o.m_left;
+				o.m_chunks = nullptr;
+				o.m_next = nullptr;
+				o.m_left = 0;
+			}
+			return *this;
+		}
+
+		// Returns a null-terminated copy of n characters of str that lives as long as the arena is not cleared.
+		const char *copy(const char * const str, const std::size_t n)
+		{
+			if (m_left <= n) {
+				allocateChunk(n + 1);
+			}
+			char * const result = m_next;
+			std::copy_n(str, n, result);
+			result[n] = '\0';
+			m_next += n + 1;
+			m_left -= n + 1;
+			return result;
+		}
+
+		// Releases all the strings but keeps the last chunk allocated for reuse.
+		void clear() noexcept;
+	private:
+		struct Chunk
+		{
+			Chunk *prev;
+			std::size_t size;
+		};
+
+		void allocateChunk(std::size_t minSize);
+		void releaseChunks() noexcept;
+
+		// The most recent chunk; earlier chunks are linked through Chunk::prev.
+		Chunk *m_chunks;
+		char *m_next;
+		std::size_t m_left;
+	};
+}
+
+#endif // MIRROR_PATHARENA_HPP_
@@ -0,0 +1,227 @@
+/* mirror - a tool to make mirrors of files or directories and to check consistency of the existing mirrors.
+Copyright (C) 2017-2019 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#include "ReportWriter.hpp"
+#include <afc/number.h>
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <unistd.h>
+#include <utility>
+
+namespace
+{
+	// Whether the byte can be written as is within a JSON string.
+	inline bool isPlainJsonChar(const unsigned char c) noexcept
+	{
+		return c >= 0x20 && c != '"' && c != '\\';
+	}
+}
+
+mirror::ReportWriter::ReportWriter(const int fd, const bool threaded, const std::size_t bufferSize)
+		: m_fd(fd), m_buf(bufferSize), m_size(0), m_pending(threaded ? bufferSize : 0), m_pendingSize(0),
+		  m_mutex(), m_pendingChanged(), m_error(), m_stop(false), m_thread()
+{
+	assert(bufferSize > 0);
+
+	if (threaded) {
+		m_thread = std::thread(&ReportWriter::work, this);
+	}
+}
+
+mirror::ReportWriter::~ReportWriter()
+{
+	if (m_thread.joinable()) {
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_stop = true;
+		}
+		m_pendingChanged.notify_all();
+		m_thread.join();
+	}
+}
+
+void mirror::ReportWriter::append(const char *data, std::size_t n)
+{
+	while (n > 0) {
+		if (m_size == m_buf.size()) {
+			flush();
+		}
+		const std::size_t chunkSize = std::min(n, m_buf.size() - m_size);
+		std::memcpy(m_buf.data() + m_size, data, chunkSize);
+		m_size += chunkSize;
+		data += chunkSize;
+		n -= chunkSize;
+	}
+}
+
+void mirror::ReportWriter::appendJsonString(const char * const text, const std::size_t n)
+{
+	static const char hexDigits[] = "0123456789abcdef";
+
+	append('"');
+
+	const char * const end = text + n;
+	const char *p = text;
+	while (p != end) {
+		const char * const plainEnd = std::find_if(p, end,
+				[](const char c) { return !isPlainJsonChar(static_cast<unsigned char>(c)); });
+		append(p, plainEnd - p);
+		if (plainEnd == end) {
+			break;
+		}
+
+		const unsigned char c = static_cast<unsigned char>(*plainEnd);
+		char * const dest = reserve(6);
+		char *q = dest;
+		*q++ = '\\';
+		switch (c) {
+		case '"':
+		case '\\':
+			*q++ = static_cast<char>(c);
+			break;
+		case '\n':
+			*q++ = 'n';
+			break;
+		case '\t':
+			*q++ = 't';
+			break;
+		default:
+			*q++ = 'u';
+			*q++ = '0';
+			*q++ = '0';
+			*q++ = hexDigits[c >> 4];
+			*q++ = hexDigits[c & 0xf];
+			break;
+		}
+		commit(q);
+		p = plainEnd + 1;
+	}
+
+	append('"');
+}
+
+void mirror::ReportWriter::appendNumber(const std::int64_t val)
+{
+	char * const dest = reserve(afc::maxPrintedSize<std::int64_t, 10>());
+	commit(afc::printNumber<10>(val, dest));
+}
+
+void mirror::ReportWriter::flush()
+{
+	if (m_size == 0) {
+		return;
+	}
+
+	if (!m_thread.joinable()) {
+		writeBuffer(m_buf, m_size);
+		m_size = 0;
+		return;
+	}
+
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		while (m_pendingSize != 0 && !m_error) {
+			m_pendingChanged.wait(lock);
+		}
+		if (m_error) {
+			std::rethrow_exception(m_error);
+		}
+		m_buf.swap(m_pending);
+		m_pendingSize = m_size;
+	}
+	m_pendingChanged.notify_all();
+	m_size = 0;
+}
+
+void mirror::ReportWriter::close()
+{
+	flush();
+
+	if (!m_thread.joinable()) {
+		return;
+	}
+
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		while (m_pendingSize != 0 && !m_error) {
+			m_pendingChanged.wait(lock);
+		}
+		m_stop = true;
+	}
+	m_pendingChanged.notify_all();
+	m_thread.join();
+
+	if (m_error) {
+		std::rethrow_exception(m_error);
+	}
+}
+
+void mirror::ReportWriter::writeBuffer(const std::vector<char> &buf, const std::size_t size)
+{
+	const char *p = buf.data();
+	std::size_t left = size;
+	while (left > 0) {
+		const ssize_t n = write(m_fd, p, left);
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			throw std::runtime_error(std::string("Unable to write the report: ") + std::strerror(errno));
+		}
+		p += n;
+		left -= static_cast<std::size_t>(n);
+	}
+}
+
+void mirror::ReportWriter::work()
+{
+	for (;;) {
+		std::size_t size;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			while (m_pendingSize == 0 && !m_stop) {
+				m_pendingChanged.wait(lock);
+			}
+			if (m_pendingSize == 0) {
+				return;
+			}
+			size = m_pendingSize;
+		}
+
+		// The buffer is not touched by the other thread until it is handed back.
+		std::exception_ptr error;
+		try {
+			writeBuffer(m_pending, size);
+		}
+		catch (...) {
+			error = std::current_exception();
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_pendingSize = 0;
+			m_error = error;
+		}
+		m_pendingChanged.notify_all();
+
+		if (error) {
+			return;
+		}
+	}
+}
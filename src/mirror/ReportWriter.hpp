@@ -0,0 +1,103 @@
+/* mirror - a tool to make mirrors of files or directories and to check consistency of the existing mirrors.
+Copyright (C) 2017-2019 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#ifndef MIRROR_REPORTWRITER_HPP_
+#define MIRROR_REPORTWRITER_HPP_
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace mirror
+{
+	/*
+	 * Writes a report to a file descriptor through a large buffer so that each record costs a copy rather
+	 * than a system call. If threaded is true then full buffers are written by a dedicated thread while
+	 * the next one is being filled.
+	 *
+	 * Write errors are thrown as std::runtime_error by the call that finds them, which is either the one
+	 * that hands a full buffer over or close(). The writer is not thread-safe.
+	 */
+	class ReportWriter
+	{
+	public:
+		static constexpr std::size_t defaultBufferSize = 1024 * 1024;
+
+		// The file descriptor is not owned and must remain open until close() is called.
+		ReportWriter(int fd, bool threaded, std::size_t bufferSize = defaultBufferSize);
+		// Discards the data that is not handed over to be written if close() is not called.
+		~ReportWriter();
+
+		ReportWriter(const ReportWriter &) = delete;
+		ReportWriter(ReportWriter &&) = delete;
+		ReportWriter &operator=(const ReportWriter &) = delete;
+		ReportWriter &operator=(ReportWriter &&) = delete;
+
+		/*
+		 * Returns the place for n more bytes in the buffer, flushing it first if there is not enough room.
+		 * Must be followed by commit() with the end of the bytes actually written. n must not exceed the
+		 * buffer size.
+		 */
+		char *reserve(std::size_t n)
+		{
+			if (m_buf.size() - m_size < n) {
+				flush();
+			}
+			return m_buf.data() + m_size;
+		}
+
+		void commit(const char * const end) noexcept { m_size = end - m_buf.data(); }
+
+		void append(const char c)
+		{
+			*reserve(1) = c;
+			++m_size;
+		}
+
+		void append(const char *data, std::size_t n);
+
+		// Appends the text as a JSON string literal.
+		void appendJsonString(const char *text, std::size_t n);
+
+		void appendNumber(std::int64_t val);
+
+		// Hands the buffer over to be written.
+		void flush();
+		// Writes all the data appended and waits for it to reach the file descriptor.
+		void close();
+	private:
+		void writeBuffer(const std::vector<char> &buf, std::size_t size);
+		void work();
+
+		const int m_fd;
+		std::vector<char> m_buf;
+		std::size_t m_size;
+
+		// The buffer that is being written by the thread, if there is one.
+		std::vector<char> m_pending;
+		std::size_t m_pendingSize;
+		std::mutex m_mutex;
+		std::condition_variable m_pendingChanged;
+		std::exception_ptr m_error;
+		bool m_stop;
+		std::thread m_thread;
+	};
+}
+
+#endif // MIRROR_REPORTWRITER_HPP_
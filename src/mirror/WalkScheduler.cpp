@@ -0,0 +1,152 @@
+/* mirror - a tool to make mirrors of files or directories and to check consistency of the existing mirrors.
+Copyright (C) 2017-2019 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#include "WalkScheduler.hpp"
+#include <cassert>
+#include <unistd.h>
+#include <utility>
+
+mirror::_helper::SharedDir::~SharedDir()
+{
+	// TODO handle error.
+	close(m_fd);
+}
+
+mirror::_helper::WalkScheduler::WalkScheduler(const unsigned walkerCount)
+		: m_queues(), m_pending(0), m_queued(0), m_idle(0), m_aborted(false), m_mutex(), m_stateChanged(), m_error()
+{
+	assert(walkerCount > 0);
+
+	m_queues.reserve(walkerCount);
+	for (unsigned i = 0; i < walkerCount; ++i) {
+		m_queues.emplace_back(new WalkerQueue());
+	}
+}
+
+mirror::_helper::WalkScheduler::~WalkScheduler()
+{
+	for (auto &queue : m_queues) {
+		for (DirTask &task : queue->tasks) {
+			if (task.fd != -1) {
+				// TODO handle error.
+				close(task.fd);
+			}
+		}
+	}
+}
+
+void mirror::_helper::WalkScheduler::push(const unsigned walker, DirTask &&task)
+{
+	assert(walker < m_queues.size());
+
+	++m_pending;
+	{
+		WalkerQueue &queue = *m_queues[walker];
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		queue.tasks.emplace_back(std::move(task));
+	}
+	++m_queued;
+
+	/* Either an idle walker sees the task queued when it checks m_queued after incrementing m_idle,
+	 * or it is seen idle here and is woken up.
+	 */
+	if (m_idle.load() > 0) {
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+		}
+		m_stateChanged.notify_one();
+	}
+}
+
+bool mirror::_helper::WalkScheduler::take(const unsigned walker, DirTask &dest)
+{
+	{
+		WalkerQueue &own = *m_queues[walker];
+		std::lock_guard<std::mutex> lock(own.mutex);
+		if (!own.tasks.empty()) {
+			dest = std::move(own.tasks.back());
+			own.tasks.pop_back();
+			--m_queued;
+			return true;
+		}
+	}
+
+	const std::size_t walkerCount = m_queues.size();
+	for (std::size_t i = 1; i < walkerCount; ++i) {
+		WalkerQueue &victim = *m_queues[(walker + i) % walkerCount];
+		std::lock_guard<std::mutex> lock(victim.mutex);
+		if (!victim.tasks.empty()) {
+			dest = std::move(victim.tasks.front());
+			victim.tasks.pop_front();
+			--m_queued;
+			return true;
+		}
+	}
+	return false;
+}
+
+bool mirror::_helper::WalkScheduler::next(const unsigned walker, DirTask &dest)
+{
+	assert(walker < m_queues.size());
+
+	for (;;) {
+		if (m_aborted.load()) {
+			return false;
+		}
+		if (take(walker, dest)) {
+			return true;
+		}
+
+		std::unique_lock<std::mutex> lock(m_mutex);
+		++m_idle;
+		while (m_queued.load() == 0 && m_pending.load() != 0 && !m_aborted.load()) {
+			m_stateChanged.wait(lock);
+		}
+		--m_idle;
+		if (m_pending.load() == 0) {
+			return false;
+		}
+	}
+}
+
+void mirror::_helper::WalkScheduler::taskDone()
+{
+	assert(m_pending.load() > 0);
+
+	if (--m_pending == 0) {
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+		}
+		m_stateChanged.notify_all();
+	}
+}
+
+void mirror::_helper::WalkScheduler::abort(const std::exception_ptr error)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (!m_error) {
+			m_error = error;
+		}
+		m_aborted = true;
+	}
+	m_stateChanged.notify_all();
+}
+
+std::exception_ptr mirror::_helper::WalkScheduler::error()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_error;
+}
@@ -0,0 +1,133 @@
+/* mirror - a tool to make mirrors of files or directories and to check consistency of the existing mirrors.
+Copyright (C) 2017-2019 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#ifndef MIRROR_WALKSCHEDULER_HPP_
+#define MIRROR_WALKSCHEDULER_HPP_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/types.h>
+#include <vector>
+
+namespace mirror
+{
+	namespace _helper
+	{
+		// A directory that is kept open for the tasks of its subdirectories. It is closed with the last of them.
+		class SharedDir
+		{
+		public:
+			explicit SharedDir(const int fd) noexcept : m_fd(fd) {}
+			~SharedDir();
+
+			SharedDir(const SharedDir &) = delete;
+			SharedDir(SharedDir &&) = delete;
+			SharedDir &operator=(const SharedDir &) = delete;
+			SharedDir &operator=(SharedDir &&) = delete;
+
+			int fd() const noexcept { return m_fd; }
+		private:
+			const int m_fd;
+		};
+
+		// A directory that is yet to be scanned by the parallel walk.
+		struct DirTask
+		{
+			DirTask() : fd(-1), path(), parent(), dev(0), ino(0), link(false) {}
+			DirTask(const int fd, const char * const path, const std::size_t pathSize)
+					: fd(fd), path(path, pathSize), parent(), dev(0), ino(0), link(false) {}
+
+			// -1 if the directory is not opened yet.
+			int fd;
+			std::string path;
+			/*
+			 * If not null then the directory is opened by its name relative to the parent directory rather
+			 * than by path, which is too long to be opened.
+			 */
+			std::shared_ptr<SharedDir> parent;
+			/*
+			 * The directory as it is listed, so that it is not walked if it is replaced by the time it is
+			 * opened. Not used if fd is set.
+			 */
+			dev_t dev;
+			ino_t ino;
+			// True if the directory could be listed as a symbolic link to it, which is followed then.
+			bool link;
+		};
+
+		/*
+		 * Distributes directories between walker threads. Each walker has its own deque of tasks. It pushes
+		 * subdirectories it finds to the back of its deque and takes tasks back from there, so that it
+		 * walks its part of the tree depth-first. A walker whose deque is empty steals the oldest task of
+		 * another walker, which is usually the largest subtree that walker has not started yet.
+		 */
+		class WalkScheduler
+		{
+		public:
+			explicit WalkScheduler(unsigned walkerCount);
+			// Closes the directories of the tasks that are left after an abort.
+			~WalkScheduler();
+
+			WalkScheduler(const WalkScheduler &) = delete;
+			WalkScheduler(WalkScheduler &&) = delete;
+			WalkScheduler &operator=(const WalkScheduler &) = delete;
+			WalkScheduler &operator=(WalkScheduler &&) = delete;
+
+			void push(unsigned walker, DirTask &&task);
+
+			/*
+			 * Takes the next task for the walker, waiting while there are none available but other walkers
+			 * are still scanning directories (and therefore can produce more tasks). Returns false if there
+			 * is nothing left to scan or the walk is aborted.
+			 */
+			bool next(unsigned walker, DirTask &dest);
+
+			// Must be called each time a walker finishes the task it has taken with next().
+			void taskDone();
+
+			// Stops all the walkers. Only the first error reported is kept.
+			void abort(std::exception_ptr error);
+
+			// Null unless the walk is aborted.
+			std::exception_ptr error();
+		private:
+			struct WalkerQueue
+			{
+				std::mutex mutex;
+				std::deque<DirTask> tasks;
+			};
+
+			bool take(unsigned walker, DirTask &dest);
+
+			std::vector<std::unique_ptr<WalkerQueue>> m_queues;
+			// The number of tasks pushed but not done yet, both queued and being scanned.
+			std::atomic<std::size_t> m_pending;
+			std::atomic<std::size_t> m_queued;
+			std::atomic<unsigned> m_idle;
+			std::atomic<bool> m_aborted;
+			std::mutex m_mutex;
+			std::condition_variable m_stateChanged;
+			std::exception_ptr m_error;
+		};
+	}
+}
+
+#endif // MIRROR_WALKSCHEDULER_HPP_
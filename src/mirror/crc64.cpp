@@ -0,0 +1,430 @@
+/* mirror - a tool to make mirrors of files or directories and to check consistency of the existing mirrors.
+Copyright (C) 2017-2019 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#include "crc64.hpp"
+#include <afc/crc.hpp>
+#include <afc/logger.hpp>
+#include <cassert>
+#include <cstring>
+#include "log.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+	#define MIRROR_CRC64_CLMUL
+	#include <cpuid.h>
+	#include <immintrin.h>
+#elif defined(__aarch64__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	#define MIRROR_CRC64_PMULL
+	#include <arm_neon.h>
+	#include <asm/hwcap.h>
+	#include <sys/auxv.h>
+#endif
+
+using afc::operator"" _s;
+
+namespace
+{
+	// The reflected form of the polynomial afc::crc64ReversedUpdate() is based on (ECMA-182).
+	constexpr std::uint64_t reflectedPoly = 0xc96c5795d7870f42;
+
+	/*
+	 * Tables for the slicing-by-N algorithms. table[0] is the classic byte-at-a-time table;
+	 * table[k][i] is the CRC of the byte i followed by k zero bytes.
+	 */
+	std::uint64_t table[16][256];
+
+	/*
+	 * Constants to fold a 128-bit chunk D bits forward with carry-less multiplication
+	 * (see foldConstants()). The first element multiplies the first 64 bits of the chunk.
+	 */
+	std::uint64_t fold128[2];
+	std::uint64_t fold512[2];
+
+	// x^(2^k) mod P in the reflected bit order, so that x is raised to large powers in a few multiplications.
+	std::uint64_t xPow2k[64];
+
+	const char *selectedName = nullptr;
+	bool combineSupported = false;
+
+	inline std::uint64_t load64(const unsigned char * const p) noexcept
+	{
+		std::uint64_t val;
+		std::memcpy(&val, p, sizeof(val));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+		val = __builtin_bswap64(val);
+#endif
+		return val;
+	}
+
+	std::uint64_t reverseBits(std::uint64_t val) noexcept
+	{
+		std::uint64_t result = 0;
+		for (int i = 0; i < 64; ++i) {
+			result = (result << 1) | (val & 1);
+			val >>= 1;
+		}
+		return result;
+	}
+
+	// x^n mod P in the reflected bit order.
+	std::uint64_t xPowMod(const unsigned n) noexcept
+	{
+		const std::uint64_t poly = reverseBits(reflectedPoly);
+		std::uint64_t val = 1;
+		for (unsigned i = 0; i < n; ++i) {
+			const bool carry = (val >> 63) != 0;
+			val <<= 1;
+			if (carry) {
+				val ^= poly;
+			}
+		}
+		return reverseBits(val);
+	}
+
+	/*
+	 * A 128-bit chunk Q0:Q1 followed by D bits of data contributes Q0 * x^(D+64) + Q1 * x^D to the
+	 * digest. Since a carry-less product of two reflected 64-bit values is one bit short of the reflected
+	 * 128-bit product, the constants are x^(D+63) mod P and x^(D-1) mod P.
+	 */
+	void foldConstants(const unsigned distance, std::uint64_t (&dest)[2]) noexcept
+	{
+		dest[0] = xPowMod(distance + 63);
+		dest[1] = xPowMod(distance - 1);
+	}
+
+	// a * b mod P in the reflected bit order, where the highest bit is the coefficient of x^0.
+	std::uint64_t multiplyMod(const std::uint64_t a, std::uint64_t b) noexcept
+	{
+		std::uint64_t product = 0;
+		for (std::uint64_t m = std::uint64_t(1) << 63; m != 0; m >>= 1) {
+			if ((a & m) != 0) {
+				product ^= b;
+			}
+			b = (b & 1) != 0 ? (b >> 1) ^ reflectedPoly : b >> 1;
+		}
+		return product;
+	}
+
+	// x^(8n) mod P in the reflected bit order, i.e. the factor that shifts a digest over n zero bytes.
+	std::uint64_t xPowBytes(std::uint64_t n) noexcept
+	{
+		std::uint64_t result = std::uint64_t(1) << 63;
+		// 8n is 2^3 * n, so the bits of n are the powers of two from x^(2^3) on.
+		for (unsigned k = 3; n != 0 && k < 64; n >>= 1, ++k) {
+			if ((n & 1) != 0) {
+				result = multiplyMod(xPow2k[k], result);
+			}
+		}
+		return result;
+	}
+
+	void initTables() noexcept
+	{
+		for (unsigned i = 0; i < 256; ++i) {
+			std::uint64_t crc = i;
+			for (int j = 0; j < 8; ++j) {
+				crc = (crc & 1) != 0 ? (crc >> 1) ^ reflectedPoly : crc >> 1;
+			}
+			table[0][i] = crc;
+		}
+		for (unsigned i = 0; i < 256; ++i) {
+			for (unsigned k = 1; k < 16; ++k) {
+				const std::uint64_t prev = table[k - 1][i];
+				table[k][i] = (prev >> 8) ^ table[0][prev & 0xff];
+			}
+		}
+
+		foldConstants(128, fold128);
+		foldConstants(512, fold512);
+
+		xPow2k[0] = std::uint64_t(1) << 62;
+		for (unsigned k = 1; k < 64; ++k) {
+			xPow2k[k] = multiplyMod(xPow2k[k - 1], xPow2k[k - 1]);
+		}
+	}
+
+	inline std::uint64_t updateBytewise(std::uint64_t crc, const unsigned char *buf, std::size_t n) noexcept
+	{
+		for (; n > 0; --n) {
+			crc = table[0][(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+		}
+		return crc;
+	}
+
+	std::uint_fast64_t updateSlicing8(const std::uint_fast64_t initialCrc, const unsigned char *buf,
+			std::size_t n) noexcept
+	{
+		std::uint64_t crc = initialCrc;
+		for (; n >= 8; n -= 8, buf += 8) {
+			const std::uint64_t v = crc ^ load64(buf);
+			crc = table[7][v & 0xff] ^ table[6][(v >> 8) & 0xff] ^
+					table[5][(v >> 16) & 0xff] ^ table[4][(v >> 24) & 0xff] ^
+					table[3][(v >> 32) & 0xff] ^ table[2][(v >> 40) & 0xff] ^
+					table[1][(v >> 48) & 0xff] ^ table[0][v >> 56];
+		}
+		return updateBytewise(crc, buf, n);
+	}
+
+	std::uint_fast64_t updateSlicing16(const std::uint_fast64_t initialCrc, const unsigned char *buf,
+			std::size_t n) noexcept
+	{
+		std::uint64_t crc = initialCrc;
+		for (; n >= 16; n -= 16, buf += 16) {
+			const std::uint64_t v1 = crc ^ load64(buf);
+			const std::uint64_t v2 = load64(buf + 8);
+			crc = table[15][v1 & 0xff] ^ table[14][(v1 >> 8) & 0xff] ^
+					table[13][(v1 >> 16) & 0xff] ^ table[12][(v1 >> 24) & 0xff] ^
+					table[11][(v1 >> 32) & 0xff] ^ table[10][(v1 >> 40) & 0xff] ^
+					table[9][(v1 >> 48) & 0xff] ^ table[8][v1 >> 56] ^
+					table[7][v2 & 0xff] ^ table[6][(v2 >> 8) & 0xff] ^
+					table[5][(v2 >> 16) & 0xff] ^ table[4][(v2 >> 24) & 0xff] ^
+					table[3][(v2 >> 32) & 0xff] ^ table[2][(v2 >> 40) & 0xff] ^
+					table[1][(v2 >> 48) & 0xff] ^ table[0][v2 >> 56];
+		}
+		return updateSlicing8(crc, buf, n);
+	}
+
+	std::uint_fast64_t updateAfc(const std::uint_fast64_t crc, const unsigned char * const buf, const std::size_t n)
+	{
+		return afc::crc64ReversedUpdate(crc, buf, n);
+	}
+
+	/*
+	 * Both the carry-less multiplication kernels below fold the input into four 128-bit accumulators,
+	 * 64 bytes per iteration, then fold the accumulators into one and the remaining 16-byte blocks into
+	 * it. The final 128-bit remainder and the tail are reduced with the tables, which avoids Barrett
+	 * reduction and keeps the digest bit-identical to the table-driven algorithm.
+	 */
+#ifdef MIRROR_CRC64_CLMUL
+	__attribute__((target("pclmul,sse2")))
+	inline __m128i foldClmul(const __m128i acc, const __m128i k, const __m128i data) noexcept
+	{
+		return _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(acc, k, 0x00), _mm_clmulepi64_si128(acc, k, 0x11)),
+				data);
+	}
+
+	__attribute__((target("pclmul,sse2")))
+	inline __m128i load128(const unsigned char * const p) noexcept
+	{
+		return _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+	}
+
+	__attribute__((target("pclmul,sse2")))
+	std::uint_fast64_t updateClmul(const std::uint_fast64_t crc, const unsigned char *buf, std::size_t n) noexcept
+	{
+		if (n < 64) {
+			return updateSlicing8(crc, buf, n);
+		}
+
+		const __m128i k512 = _mm_set_epi64x(static_cast<long long>(fold512[1]), static_cast<long long>(fold512[0]));
+		const __m128i k128 = _mm_set_epi64x(static_cast<long long>(fold128[1]), static_cast<long long>(fold128[0]));
+
+		__m128i x0 = _mm_xor_si128(load128(buf), _mm_set_epi64x(0, static_cast<long long>(crc)));
+		__m128i x1 = load128(buf + 16);
+		__m128i x2 = load128(buf + 32);
+		__m128i x3 = load128(buf + 48);
+		buf += 64;
+		n -= 64;
+
+		for (; n >= 64; n -= 64, buf += 64) {
+			x0 = foldClmul(x0, k512, load128(buf));
+			x1 = foldClmul(x1, k512, load128(buf + 16));
+			x2 = foldClmul(x2, k512, load128(buf + 32));
+			x3 = foldClmul(x3, k512, load128(buf + 48));
+		}
+
+		__m128i x = foldClmul(x0, k128, x1);
+		x = foldClmul(x, k128, x2);
+		x = foldClmul(x, k128, x3);
+
+		for (; n >= 16; n -= 16, buf += 16) {
+			x = foldClmul(x, k128, load128(buf));
+		}
+
+		unsigned char remainder[16];
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(remainder), x);
+
+		return updateSlicing8(updateSlicing8(0, remainder, sizeof(remainder)), buf, n);
+	}
+
+	bool clmulSupported() noexcept
+	{
+		unsigned eax, ebx, ecx, edx;
+		return __get_cpuid(1, &eax, &ebx, &ecx, &edx) != 0 && (ecx & bit_PCLMUL) != 0 && (edx & bit_SSE2) != 0;
+	}
+#endif
+
+#ifdef MIRROR_CRC64_PMULL
+	__attribute__((target("+crypto")))
+	inline uint64x2_t foldPmull(const uint64x2_t acc, const poly64_t k0, const poly64_t k1,
+			const uint64x2_t data) noexcept
+	{
+		const poly128_t lo = vmull_p64(static_cast<poly64_t>(vgetq_lane_u64(acc, 0)), k0);
+		const poly128_t hi = vmull_p64(static_cast<poly64_t>(vgetq_lane_u64(acc, 1)), k1);
+		return veorq_u64(veorq_u64(vreinterpretq_u64_p128(lo), vreinterpretq_u64_p128(hi)), data);
+	}
+
+	inline uint64x2_t load128(const unsigned char * const p) noexcept
+	{
+		return vreinterpretq_u64_u8(vld1q_u8(p));
+	}
+
+	__attribute__((target("+crypto")))
+	std::uint_fast64_t updatePmull(const std::uint_fast64_t crc, const unsigned char *buf, std::size_t n) noexcept
+	{
+		if (n < 64) {
+			return updateSlicing8(crc, buf, n);
+		}
+
+		const poly64_t k512lo = static_cast<poly64_t>(fold512[0]);
+		const poly64_t k512hi = static_cast<poly64_t>(fold512[1]);
+		const poly64_t k128lo = static_cast<poly64_t>(fold128[0]);
+		const poly64_t k128hi = static_cast<poly64_t>(fold128[1]);
+
+		uint64x2_t x0 = veorq_u64(load128(buf), vcombine_u64(vcreate_u64(crc), vcreate_u64(0)));
+		uint64x2_t x1 = load128(buf + 16);
+		uint64x2_t x2 = load128(buf + 32);
+		uint64x2_t x3 = load128(buf + 48);
+		buf += 64;
+		n -= 64;
+
+		for (; n >= 64; n -= 64, buf += 64) {
+			x0 = foldPmull(x0, k512lo, k512hi, load128(buf));
+			x1 = foldPmull(x1, k512lo, k512hi, load128(buf + 16));
+			x2 = foldPmull(x2, k512lo, k512hi, load128(buf + 32));
+			x3 = foldPmull(x3, k512lo, k512hi, load128(buf + 48));
+		}
+
+		uint64x2_t x = foldPmull(x0, k128lo, k128hi, x1);
+		x = foldPmull(x, k128lo, k128hi, x2);
+		x = foldPmull(x, k128lo, k128hi, x3);
+
+		for (; n >= 16; n -= 16, buf += 16) {
+			x = foldPmull(x, k128lo, k128hi, load128(buf));
+		}
+
+		unsigned char remainder[16];
+		vst1q_u8(remainder, vreinterpretq_u8_u64(x));
+
+		return updateSlicing8(updateSlicing8(0, remainder, sizeof(remainder)), buf, n);
+	}
+
+	bool pmullSupported() noexcept
+	{
+		return (getauxval(AT_HWCAP) & HWCAP_PMULL) != 0;
+	}
+#endif
+
+	// Checks the implementation against afc::crc64ReversedUpdate() on inputs of various sizes and alignments.
+	bool matchesAfc(const mirror::crc64Updater update)
+	{
+		unsigned char buf[1031];
+		std::uint32_t seed = 2017;
+		for (unsigned char &c : buf) {
+			seed = seed * 1103515245 + 12345;
+			c = static_cast<unsigned char>(seed >> 16);
+		}
+
+		const std::size_t sizes[] = {0, 1, 7, 8, 15, 16, 17, 63, 64, 65, 127, 128, 200, 1000};
+		const std::uint_fast64_t initialCrcs[] = {0, 0x0123456789abcdef};
+		for (const std::uint_fast64_t crc : initialCrcs) {
+			for (const std::size_t size : sizes) {
+				for (std::size_t offset = 0; offset < sizeof(buf) - size && offset < 16; offset += 5) {
+					if (update(crc, buf + offset, size) != afc::crc64ReversedUpdate(crc, buf + offset, size)) {
+						return false;
+					}
+				}
+			}
+		}
+		return true;
+	}
+}
+
+namespace mirror
+{
+	crc64Updater crc64Update = nullptr;
+}
+
+void mirror::initCRC64()
+{
+	using mirror::logger::logDebug;
+
+	initTables();
+
+	if (!matchesAfc(updateSlicing8)) {
+		// Should never happen but the digests must remain compatible with the existing DBs anyway.
+		logDebug("The built-in CRC64 implementation does not match afc. Falling back to afc..."_s);
+		crc64Update = updateAfc;
+		selectedName = "afc";
+		return;
+	}
+	// The digest is a plain CRC then (no initial or final inversion), so it is linear in the data.
+	combineSupported = true;
+
+	crc64Update = updateSlicing16;
+	selectedName = "slice-by-16";
+
+#ifdef MIRROR_CRC64_CLMUL
+	if (clmulSupported() && matchesAfc(updateClmul)) {
+		crc64Update = updateClmul;
+		selectedName = "pclmulqdq";
+	}
+#endif
+#ifdef MIRROR_CRC64_PMULL
+	if (pmullSupported() && matchesAfc(updatePmull)) {
+		crc64Update = updatePmull;
+		selectedName = "pmull";
+	}
+#endif
+
+	logDebug("CRC64 implementation: "_s, selectedName);
+}
+
+bool mirror::crc64CombineSupported() noexcept
+{
+	return combineSupported;
+}
+
+std::uint_fast64_t mirror::crc64Combine(const std::uint_fast64_t crc1, const std::uint_fast64_t crc2,
+		const std::uint64_t size2) noexcept
+{
+	assert(combineSupported);
+	assert(size2 < (std::uint64_t(1) << 61));
+
+	return multiplyMod(xPowBytes(size2), crc1) ^ crc2;
+}
+
+const char *mirror::crc64ImplementationName() noexcept
+{
+	return selectedName;
+}
+
+std::size_t mirror::crc64Implementations(CRC64Implementation (&dest)[8]) noexcept
+{
+	std::size_t n = 0;
+	dest[n++] = CRC64Implementation{"afc", updateAfc};
+	dest[n++] = CRC64Implementation{"slice-by-8", updateSlicing8};
+	dest[n++] = CRC64Implementation{"slice-by-16", updateSlicing16};
+#ifdef MIRROR_CRC64_CLMUL
+	if (clmulSupported()) {
+		dest[n++] = CRC64Implementation{"pclmulqdq", updateClmul};
+	}
+#endif
+#ifdef MIRROR_CRC64_PMULL
+	if (pmullSupported()) {
+		dest[n++] = CRC64Implementation{"pmull", updatePmull};
+	}
+#endif
+	return n;
+}
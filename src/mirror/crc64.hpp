@@ -0,0 +1,69 @@
+/* mirror - a tool to make mirrors of files or directories and to check consistency of the existing mirrors.
+Copyright (C) 2017-2019 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#ifndef MIRROR_CRC64_HPP_
+#define MIRROR_CRC64_HPP_
+
+#include <cstddef>
+#include <cstdint>
+
+namespace mirror
+{
+	/*
+	 * Updates the reflected CRC64 digest with n bytes from buf. The result is bit-identical to
+	 * afc::crc64ReversedUpdate() for any input, so digests stored in existing DBs remain valid.
+	 */
+	typedef std::uint_fast64_t (*crc64Updater)(std::uint_fast64_t crc, const unsigned char *buf, std::size_t n);
+
+	// The fastest implementation supported by the CPU. Available after initCRC64() is called.
+	extern crc64Updater crc64Update;
+
+	struct CRC64Implementation
+	{
+		const char *name;
+		crc64Updater update;
+	};
+
+	/*
+	 * Builds lookup tables and chooses the fastest CRC64 implementation the CPU supports (using CPUID
+	 * on x86 and hardware capabilities on ARM). Must be called before any thread uses crc64Update.
+	 */
+	void initCRC64();
+
+	/*
+	 * Returns the digest of the concatenation of two blocks of data given the digest of each of them
+	 * (both calculated from zero) and the size of the second one, so that the ranges of a file can be
+	 * hashed independently. Takes O(log(size2)) multiplications. Must be called only if
+	 * crc64CombineSupported() returns true.
+	 */
+	std::uint_fast64_t crc64Combine(std::uint_fast64_t crc1, std::uint_fast64_t crc2, std::uint64_t size2) noexcept;
+
+	/*
+	 * Returns false if the afc digest turned out not to be a plain CRC at initCRC64() (see crc64Update),
+	 * in which case digests cannot be combined.
+	 */
+	bool crc64CombineSupported() noexcept;
+
+	// The name of the implementation crc64Update refers to.
+	const char *crc64ImplementationName() noexcept;
+
+	/*
+	 * Fills dest with all the implementations usable on this CPU, the afc one included. Returns the number
+	 * of entries filled. Intended for benchmarking and self-testing. Must be called after initCRC64().
+	 */
+	std::size_t crc64Implementations(CRC64Implementation (&dest)[8]) noexcept;
+}
+
+#endif // MIRROR_CRC64_HPP_
@@ -1,5 +1,5 @@
 /* mirror - a tool to make mirrors of files or directories and to check consistency of the existing mirrors.
-Copyright (C) 2017 Dźmitry Laŭčuk
+Copyright (C) 2017-2019 Dźmitry Laŭčuk
 
 This program is free software: you can redistribute it and/or modify
 it under the terms of the GNU General Public License as published by
@@ -14,9 +14,99 @@ GNU General Public License for more details.
 You should have received a copy of the GNU General Public License
 along with this program.  If not, see <http://www.gnu.org/licenses/>. */
 #include "encoding.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iconv.h>
+#include <stdexcept>
+#include "stats.hpp"
+
+namespace
+{
+	/*
+	 * A conversion descriptor is not thread-safe, and opening one for each conversion is what makes
+	 * conversions slow, so each thread keeps its own descriptors open.
+	 */
+	class Iconv
+	{
+	public:
+		Iconv(const char * const to, const char * const from) noexcept : m_cd(iconv_open(to, from)) {}
+		~Iconv() { if (m_cd != invalid()) { iconv_close(m_cd); } }
+
+		Iconv(const Iconv &) = delete;
+		Iconv &operator=(const Iconv &) = delete;
+
+		mirror::TextView convert(const char * const src, const std::size_t srcSize, std::string &buf);
+	private:
+		static iconv_t invalid() noexcept { return reinterpret_cast<iconv_t>(-1); }
+
+		iconv_t m_cd;
+	};
+
+	mirror::TextView Iconv::convert(const char * const src, const std::size_t srcSize, std::string &buf)
+	{
+		if (m_cd == invalid()) {
+			throw std::runtime_error("Unable to convert text between the system charset and UTF-8.");
+		}
+
+		// Resetting the shift state that a failed conversion could leave.
+		iconv(m_cd, nullptr, nullptr, nullptr, nullptr);
+
+		if (buf.size() < srcSize + 16) {
+			buf.resize(std::max(buf.capacity(), srcSize * 2 + 16));
+		}
+
+		char *in = const_cast<char *>(src);
+		std::size_t inLeft = srcSize;
+		std::size_t outSize = 0;
+		// Once the input is converted, a call with no input writes the sequence that resets the shift state.
+		bool flushing = false;
+		for (;;) {
+			char *out = &buf[outSize];
+			std::size_t outLeft = buf.size() - outSize;
+			const std::size_t result = flushing ? iconv(m_cd, nullptr, nullptr, &out, &outLeft) :
+					iconv(m_cd, &in, &inLeft, &out, &outLeft);
+			outSize = buf.size() - outLeft;
+
+			if (result == static_cast<std::size_t>(-1)) {
+				if (errno != E2BIG) {
+					throw std::runtime_error("Unable to convert text between the system charset and UTF-8.");
+				}
+				buf.resize(buf.size() * 2);
+			} else if (flushing) {
+				break;
+			} else {
+				flushing = true;
+			}
+		}
+
+		return mirror::TextView{buf.data(), outSize};
+	}
+}
 
 namespace mirror
 {
-	convert convertToUtf8 = nullptr;
-	convert convertFromUtf8 = nullptr;
+	afc::String systemEncoding;
+	bool systemEncodingIsUtf8 = true;
+}
+
+void mirror::initConverters()
+{
+	systemEncoding = afc::systemCharset();
+	systemEncodingIsUtf8 = std::strcmp("UTF-8", systemEncoding.c_str()) == 0;
+}
+
+mirror::TextView mirror::_helper::convertToUtf8(const char * const src, const std::size_t srcSize, std::string &buf)
+{
+	static thread_local Iconv converter("UTF-8", systemEncoding.c_str());
+	const mirror::stats::PhaseTimer timer(mirror::stats::Phase::convert);
+	return converter.convert(src, srcSize, buf);
+}
+
+mirror::TextView mirror::_helper::convertFromUtf8(const char * const src, const std::size_t srcSize,
+		std::string &buf)
+{
+	static thread_local Iconv converter(systemEncoding.c_str(), "UTF-8");
+	const mirror::stats::PhaseTimer timer(mirror::stats::Phase::convert);
+	return converter.convert(src, srcSize, buf);
 }
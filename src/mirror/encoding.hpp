@@ -1,5 +1,5 @@
 /* mirror - a tool to make mirrors of files or directories and to check consistency of the existing mirrors.
-Copyright (C) 2017 Dźmitry Laŭčuk
+Copyright (C) 2017-2019 Dźmitry Laŭčuk
 
 This program is free software: you can redistribute it and/or modify
 it under the terms of the GNU General Public License as published by
@@ -18,80 +18,71 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>. */
 
 #include <afc/logger.hpp>
 #include <afc/utils.h>
-#include <cassert>
 #include <cstddef>
-#include <cstdlib>
-#include <cstring>
+#include <string>
 
 namespace mirror
 {
-	// TODO think of caching C string directry so save a few CPU ticks.
-	static afc::String systemEncoding;
+	// The charset of file names. Set by initConverters().
+	extern afc::String systemEncoding;
+	extern bool systemEncodingIsUtf8;
 
-	struct TextHolder
+	// Text that is either a part of the source of a conversion or stored in a buffer of the caller.
+	struct TextView
 	{
-		TextHolder(const char * const text, const std::size_t n, const bool isOwner) noexcept
-				: value(text), size(n), owner(isOwner) {}
-		TextHolder(const TextHolder &) = delete;
-		TextHolder(TextHolder &&o) : value(o.value), size(o.size), owner(o.owner) { o.owner = false; }
-
-		TextHolder &operator=(const TextHolder &) = delete;
-		TextHolder &operator=(TextHolder &&o)
-		{
-			value = o.value;
-			size = o.size;
-			owner = o.owner;
-			o.owner = false;
-			return *this;
-		}
-
-		~TextHolder() { if (owner) { std::free(const_cast<char *>(value)); } }
-
 		const char *value;
 		std::size_t size;
-		bool owner;
 	};
 
-	// TODO implement conversion to mirror::PathKey to minimise copying/moving data.
-	typedef TextHolder (*convert)(const char *src, std::size_t srcSize);
-
-	extern convert convertToUtf8;
-	extern convert convertFromUtf8;
-
-	inline TextHolder nopConverter(const char * const src, std::size_t srcSize)
+	namespace _helper
 	{
-		assert(std::strcmp("UTF-8", systemEncoding.c_str()) == 0);
-		return TextHolder(src, srcSize, false);
+		TextView convertToUtf8(const char *src, std::size_t srcSize, std::string &buf);
+		TextView convertFromUtf8(const char *src, std::size_t srcSize, std::string &buf);
 	}
 
-	inline TextHolder trueConvertToUtf8(const char * const src, std::size_t srcSize)
+	/*
+	 * Converts the text in the system charset to UTF-8. The result is written to buf which is reused by
+	 * the caller, so that no memory is allocated once buf has grown to the size of the longest text
+	 * converted. If the system charset is UTF-8 then the source itself is returned and buf is not touched.
+	 *
+	 * The result is valid until buf is changed or, if no conversion is made, as long as the source is.
+	 */
+	inline TextView toUtf8(const char * const src, const std::size_t srcSize, std::string &buf)
 	{
-		afc::U8String result(afc::convertToUtf8(src, srcSize, systemEncoding.c_str()));
-		const std::size_t size = result.size();
-
-		return TextHolder(result.detach(), size, true);
+		if (systemEncodingIsUtf8) {
+			return TextView{src, srcSize};
+		}
+		return mirror::_helper::convertToUtf8(src, srcSize, buf);
 	}
 
-	inline TextHolder trueConvertFromUtf8(const char * const src, std::size_t srcSize)
+	// Converts the UTF-8 text to the system charset. The same as toUtf8() otherwise.
+	inline TextView fromUtf8(const char * const src, const std::size_t srcSize, std::string &buf)
 	{
-		afc::String result(afc::convertFromUtf8(src, srcSize, systemEncoding.c_str()));
-		const std::size_t size = result.size();
-
-		return TextHolder(result.detach(), size, true);
+		if (systemEncodingIsUtf8) {
+			return TextView{src, srcSize};
+		}
+		return mirror::_helper::convertFromUtf8(src, srcSize, buf);
 	}
 
-	inline void initConverters()
+	// Replaces the contents of dest with the UTF-8 form of the text in the system charset.
+	inline void assignUtf8(std::string &dest, const char * const src, const std::size_t srcSize)
 	{
-		systemEncoding = afc::systemCharset();
-		if (std::strcmp("UTF-8", systemEncoding.c_str()) == 0) {
-			convertToUtf8 = nopConverter;
-			convertFromUtf8 = nopConverter;
+		const TextView result = toUtf8(src, srcSize, dest);
+		if (result.value == dest.data()) {
+			dest.resize(result.size);
 		} else {
-			convertToUtf8 = trueConvertToUtf8;
-			convertFromUtf8 = trueConvertFromUtf8;
+			dest.assign(result.value, result.size);
 		}
 	}
 
+	void initConverters();
+
+	// True if file names are in UTF-8 already so they are not converted. Valid after initConverters() is called.
+	inline bool isSystemEncodingUtf8() noexcept
+	{
+		return systemEncodingIsUtf8;
+	}
+
 	struct Utf8ToSystemView
 	{
 		Utf8ToSystemView(const char * const strU8, std::size_t n) noexcept : text(strU8), size(n) {}
@@ -109,7 +100,10 @@ namespace afc
 		inline bool logPrint<const mirror::Utf8ToSystemView &>(const mirror::Utf8ToSystemView &val,
 				std::FILE * const dest)
 		{
-			const mirror::TextHolder data = mirror::convertFromUtf8(val.text, val.size);
+			// Messages can be logged by any thread.
+			static thread_local std::string buf;
+
+			const mirror::TextView data = mirror::fromUtf8(val.text, val.size, buf);
 
 			return logText(data.value, data.size, dest);
 		}
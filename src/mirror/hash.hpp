@@ -0,0 +1,110 @@
+/* mirror - a tool to make mirrors of files or directories and to check consistency of the existing mirrors.
+Copyright (C) 2017-2019 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#ifndef MIRROR_HASH_HPP_
+#define MIRROR_HASH_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace mirror
+{
+	namespace _helper
+	{
+		inline std::uint64_t hashMix(const std::uint64_t a, const std::uint64_t b) noexcept
+		{
+			const unsigned __int128 product = static_cast<unsigned __int128>(a) * b;
+			return static_cast<std::uint64_t>(product) ^ static_cast<std::uint64_t>(product >> 64);
+		}
+
+		inline std::uint64_t read64(const unsigned char * const p) noexcept
+		{
+			std::uint64_t result;
+			std::memcpy(&result, p, sizeof(result));
+			return result;
+		}
+
+		inline std::uint64_t read32(const unsigned char * const p) noexcept
+		{
+			std::uint32_t result;
+			std::memcpy(&result, p, sizeof(result));
+			return result;
+		}
+	}
+
+	/*
+	 * A fast non-cryptographic hash of the bytes (wyhash). Each input byte affects all the bits of the
+	 * result, so that hash tables keyed by long paths that differ in a few characters do not cluster.
+	 * The result is the same within a process only (it depends on the byte order).
+	 */
+	inline std::uint64_t hashBytes(const void * const data, const std::size_t n) noexcept
+	{
+		using mirror::_helper::hashMix;
+		using mirror::_helper::read64;
+		using mirror::_helper::read32;
+
+		constexpr std::uint64_t s0 = 0xa0761d6478bd642f;
+		constexpr std::uint64_t s1 = 0xe7037ed1a0b428db;
+		constexpr std::uint64_t s2 = 0x8ebc6af09c88c6e3;
+		constexpr std::uint64_t s3 = 0x589965cc75374cc3;
+
+		const unsigned char *p = static_cast<const unsigned char *>(data);
+		std::uint64_t seed = hashMix(s0, s1);
+		std::uint64_t a, b;
+
+		if (n <= 16) {
+			if (n >= 4) {
+				const std::size_t shift = (n >> 3) << 2;
+				a = (read32(p) << 32) | read32(p + shift);
+				b = (read32(p + n - 4) << 32) | read32(p + n - 4 - shift);
+			} else if (n > 0) {
+				a = (static_cast<std::uint64_t>(p[0]) << 16) | (static_cast<std::uint64_t>(p[n >> 1]) << 8) | p[n - 1];
+				b = 0;
+			} else {
+				a = b = 0;
+			}
+		} else {
+			std::size_t i = n;
+			if (i > 48) {
+				std::uint64_t seed1 = seed, seed2 = seed;
+				do {
+					seed = hashMix(read64(p) ^ s1, read64(p + 8) ^ seed);
+					seed1 = hashMix(read64(p + 16) ^ s2, read64(p + 24) ^ seed1);
+					seed2 = hashMix(read64(p + 32) ^ s3, read64(p + 40) ^ seed2);
+					p += 48;
+					i -= 48;
+				} while (i > 48);
+				seed ^= seed1 ^ seed2;
+			}
+			while (i > 16) {
+				seed = hashMix(read64(p) ^ s1, read64(p + 8) ^ seed);
+				i -= 16;
+				p += 16;
+			}
+			a = read64(p + i - 16);
+			b = read64(p + i - 8);
+		}
+
+		a ^= s1;
+		b ^= seed;
+		const unsigned __int128 product = static_cast<unsigned __int128>(a) * b;
+		a = static_cast<std::uint64_t>(product);
+		b = static_cast<std::uint64_t>(product >> 64);
+		return hashMix(a ^ s0 ^ n, b ^ s1);
+	}
+}
+
+#endif // MIRROR_HASH_HPP_
@@ -0,0 +1,66 @@
+/* mirror - a tool to make mirrors of files or directories and to check consistency of the existing mirrors.
+Copyright (C) 2017-2019 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#ifndef MIRROR_LOG_HPP_
+#define MIRROR_LOG_HPP_
+
+#include <afc/logger.hpp>
+#include <utility>
+
+/*
+ * The lowest level of messages compiled in: 0 for trace, 1 for debug, 2 for errors only. Messages of lower
+ * levels are removed at compile time together with the views of their arguments, so that the paths taken
+ * for each file do not pay for checking the log level at run time.
+ */
+#ifndef MIRROR_LOG_LEVEL
+	#define MIRROR_LOG_LEVEL 0
+#endif
+
+namespace mirror
+{
+	namespace logger
+	{
+		constexpr bool traceEnabled = MIRROR_LOG_LEVEL <= 0;
+		constexpr bool debugEnabled = MIRROR_LOG_LEVEL <= 1;
+
+		struct TraceLogger
+		{
+			template<typename... Args>
+			bool operator()(Args &&...args) const
+			{
+				return traceEnabled ? afc::logger::logTrace(std::forward<Args>(args)...) : true;
+			}
+		};
+
+		struct DebugLogger
+		{
+			template<typename... Args>
+			bool operator()(Args &&...args) const
+			{
+				return debugEnabled ? afc::logger::logDebug(std::forward<Args>(args)...) : true;
+			}
+		};
+
+		/*
+		 * The same as afc::logger::logTrace() and afc::logger::logDebug() if their messages are compiled in;
+		 * no-ops otherwise. They are objects rather than functions so that argument-dependent lookup does not
+		 * make calls ambiguous with the afc ones when arguments are afc types.
+		 */
+		constexpr TraceLogger logTrace{};
+		constexpr DebugLogger logDebug{};
+	}
+}
+
+#endif // MIRROR_LOG_HPP_
@@ -0,0 +1,243 @@
+/* mirror - a tool to make mirrors of files or directories and to check consistency of the existing mirrors.
+Copyright (C) 2017-2019 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#include "stats.hpp"
+#include <cstdio>
+#include <mutex>
+
+namespace
+{
+	using mirror::stats::_helper::Counters;
+
+	// The counters of the running threads and the sum of the counters of the threads already finished.
+	std::mutex registryMutex;
+	Counters *registryHead = nullptr;
+	mirror::stats::Snapshot retired = {};
+
+	std::uint64_t startTime = 0;
+
+	const char * const phaseNames[mirror::stats::phaseCount] = {
+		"readdir", "stat", "open", "read", "crc64", "copy", "db read", "db write", "convert"
+	};
+
+	void addTo(mirror::stats::Snapshot &dest, const Counters &src) noexcept
+	{
+		using std::memory_order_relaxed;
+
+		dest.dirs += src.dirs.load(memory_order_relaxed);
+		dest.files += src.files.load(memory_order_relaxed);
+		dest.bytes += src.bytes.load(memory_order_relaxed);
+		for (std::size_t i = 0; i < mirror::stats::phaseCount; ++i) {
+			dest.calls[i] += src.calls[i].load(memory_order_relaxed);
+			dest.nanos[i] += src.nanos[i].load(memory_order_relaxed);
+			for (std::size_t j = 0; j < mirror::stats::histogramSize; ++j) {
+				dest.histogram[i][j] += src.histogram[i][j].load(memory_order_relaxed);
+			}
+		}
+	}
+
+	// Formats the duration with a unit that keeps it readable.
+	void formatDuration(char (&dest)[16], const double nanos)
+	{
+		if (nanos < 1e3) {
+			std::snprintf(dest, sizeof(dest), "%.0f ns", nanos);
+		} else if (nanos < 1e6) {
+			std::snprintf(dest, sizeof(dest), "%.1f us", nanos / 1e3);
+		} else if (nanos < 1e9) {
+			std::snprintf(dest, sizeof(dest), "%.1f ms", nanos / 1e6);
+		} else {
+			std::snprintf(dest, sizeof(dest), "%.2f s", nanos / 1e9);
+		}
+	}
+
+	// The upper bound of the histogram bucket the given fraction of the calls falls into.
+	double percentile(const std::uint64_t (&histogram)[mirror::stats::histogramSize], const std::uint64_t calls,
+			const double fraction) noexcept
+	{
+		const double target = calls * fraction;
+		std::uint64_t seen = 0;
+		for (std::size_t i = 0; i < mirror::stats::histogramSize; ++i) {
+			seen += histogram[i];
+			if (seen >= target) {
+				return static_cast<double>(std::uint64_t(2) << i);
+			}
+		}
+		return static_cast<double>(std::uint64_t(2) << (mirror::stats::histogramSize - 1));
+	}
+
+	void printRates(std::ostream &out, const mirror::stats::Snapshot &stats, const double elapsed)
+	{
+		char line[256];
+		const double seconds = elapsed > 0 ? elapsed : 1e-9;
+		std::snprintf(line, sizeof(line), "%.1f s, %llu dirs, %llu files (%.1f files/s), %.1f MiB read (%.1f MiB/s)",
+				elapsed, static_cast<unsigned long long>(stats.dirs), static_cast<unsigned long long>(stats.files),
+				stats.files / seconds, stats.bytes / (1024.0 * 1024.0), stats.bytes / (1024.0 * 1024.0) / seconds);
+		out << line;
+	}
+}
+
+namespace mirror
+{
+	namespace stats
+	{
+		namespace _helper
+		{
+			bool enabled = false;
+		}
+	}
+}
+
+mirror::stats::_helper::Counters::Counters() noexcept : next(nullptr), prev(nullptr)
+{
+	dirs.store(0, std::memory_order_relaxed);
+	files.store(0, std::memory_order_relaxed);
+	bytes.store(0, std::memory_order_relaxed);
+	for (std::size_t i = 0; i < phaseCount; ++i) {
+		calls[i].store(0, std::memory_order_relaxed);
+		nanos[i].store(0, std::memory_order_relaxed);
+		for (std::size_t j = 0; j < histogramSize; ++j) {
+			histogram[i][j].store(0, std::memory_order_relaxed);
+		}
+	}
+
+	std::lock_guard<std::mutex> lock(registryMutex);
+	next = registryHead;
+	if (registryHead != nullptr) {
+		registryHead->prev = this;
+	}
+	registryHead = this;
+}
+
+mirror::stats::_helper::Counters::~Counters()
+{
+	std::lock_guard<std::mutex> lock(registryMutex);
+	addTo(retired, *this);
+	if (prev != nullptr) {
+		prev->next = next;
+	} else {
+		registryHead = next;
+	}
+	if (next != nullptr) {
+		next->prev = prev;
+	}
+}
+
+mirror::stats::_helper::Counters &mirror::stats::_helper::threadCounters()
+{
+	static thread_local Counters counters;
+	return counters;
+}
+
+void mirror::stats::_helper::record(const Phase phase, const std::uint64_t nanos) noexcept
+{
+	const std::size_t i = static_cast<std::size_t>(phase);
+	std::size_t bucket = nanos < 2 ? 0 : 63 - static_cast<std::size_t>(__builtin_clzll(nanos));
+	if (bucket >= histogramSize) {
+		bucket = histogramSize - 1;
+	}
+
+	Counters &counters = threadCounters();
+	Counters::add(counters.calls[i], 1);
+	Counters::add(counters.nanos[i], nanos);
+	Counters::add(counters.histogram[i][bucket], 1);
+}
+
+void mirror::stats::enable()
+{
+	_helper::enabled = true;
+	startTime = _helper::now();
+}
+
+double mirror::stats::elapsedSeconds() noexcept
+{
+	return startTime == 0 ? 0 : (_helper::now() - startTime) / 1e9;
+}
+
+void mirror::stats::snapshot(Snapshot &dest)
+{
+	std::lock_guard<std::mutex> lock(registryMutex);
+	dest = retired;
+	for (const _helper::Counters *counters = registryHead; counters != nullptr; counters = counters->next) {
+		addTo(dest, *counters);
+	}
+}
+
+void mirror::stats::printSummary(std::ostream &out)
+{
+	Snapshot stats;
+	snapshot(stats);
+
+	out << "Run statistics: ";
+	printRates(out, stats, elapsedSeconds());
+	out << "\nPercentiles are the upper bounds of power-of-two buckets; total time is summed over threads.\n";
+
+	char line[256];
+	std::snprintf(line, sizeof(line), "%-10s %12s %10s %10s %10s %10s %10s\n", "phase", "calls", "total",
+			"avg", "p50", "p90", "p99");
+	out << line;
+	for (std::size_t i = 0; i < phaseCount; ++i) {
+		const std::uint64_t calls = stats.calls[i];
+		if (calls == 0) {
+			continue;
+		}
+		char total[16], avg[16], p50[16], p90[16], p99[16];
+		formatDuration(total, static_cast<double>(stats.nanos[i]));
+		formatDuration(avg, static_cast<double>(stats.nanos[i]) / calls);
+		formatDuration(p50, percentile(stats.histogram[i], calls, 0.5));
+		formatDuration(p90, percentile(stats.histogram[i], calls, 0.9));
+		formatDuration(p99, percentile(stats.histogram[i], calls, 0.99));
+		std::snprintf(line, sizeof(line), "%-10s %12llu %10s %10s %10s %10s %10s\n", phaseNames[i],
+				static_cast<unsigned long long>(calls), total, avg, p50, p90, p99);
+		out << line;
+	}
+	out.flush();
+}
+
+void mirror::stats::printProgress(std::ostream &out)
+{
+	Snapshot stats;
+	snapshot(stats);
+
+	out << "Progress: ";
+	printRates(out, stats, elapsedSeconds());
+	out << std::endl;
+}
+
+mirror::stats::ProgressPrinter::ProgressPrinter(const unsigned intervalSeconds, std::ostream &out)
+		: m_interval(intervalSeconds), m_out(out), m_mutex(), m_stopRequested(), m_stop(false),
+		  m_thread(&ProgressPrinter::run, this)
+{
+}
+
+mirror::stats::ProgressPrinter::~ProgressPrinter()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+	}
+	m_stopRequested.notify_one();
+	m_thread.join();
+}
+
+void mirror::stats::ProgressPrinter::run()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	for (;;) {
+		if (m_stopRequested.wait_for(lock, m_interval, [this] { return m_stop; })) {
+			return;
+		}
+		printProgress(m_out);
+	}
+}
@@ -0,0 +1,181 @@
+/* mirror - a tool to make mirrors of files or directories and to check consistency of the existing mirrors.
+Copyright (C) 2017-2019 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#ifndef MIRROR_STATS_HPP_
+#define MIRROR_STATS_HPP_
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <thread>
+
+namespace mirror
+{
+	/*
+	 * Run statistics: counters and per-phase timers that the scanning, hashing, DB and conversion code
+	 * updates as it goes. Each thread accumulates into its own counters, which only that thread writes,
+	 * so the hot path takes no locks. Everything is a no-op (a single predictable branch) unless
+	 * enable() is called before the threads that do the work are started.
+	 */
+	namespace stats
+	{
+		enum class Phase : unsigned
+		{
+			readDir, stat, open, read, crc64, copy, dbRead, dbWrite, convert
+		};
+
+		constexpr std::size_t phaseCount = 9;
+
+		// Latencies are counted in buckets of powers of two nanoseconds: [0, 2), [2, 4), [4, 8)...
+		constexpr std::size_t histogramSize = 40;
+
+		struct Snapshot
+		{
+			std::uint64_t dirs;
+			std::uint64_t files;
+			std::uint64_t bytes;
+			std::uint64_t calls[phaseCount];
+			std::uint64_t nanos[phaseCount];
+			std::uint64_t histogram[phaseCount][histogramSize];
+		};
+
+		namespace _helper
+		{
+			// Written once by enable(), before the worker threads start.
+			extern bool enabled;
+
+			struct Counters
+			{
+				Counters() noexcept;
+				~Counters();
+
+				Counters(const Counters &) = delete;
+				Counters &operator=(const Counters &) = delete;
+
+				// Only the owner thread writes, so the read-modify-writes need not be atomic.
+				static void add(std::atomic<std::uint64_t> &counter, const std::uint64_t n) noexcept
+				{
+					counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+				}
+
+				std::atomic<std::uint64_t> dirs;
+				std::atomic<std::uint64_t> files;
+				std::atomic<std::uint64_t> bytes;
+				std::atomic<std::uint64_t> calls[phaseCount];
+				std::atomic<std::uint64_t> nanos[phaseCount];
+				std::atomic<std::uint64_t> histogram[phaseCount][histogramSize];
+				// The threads registered are linked together.
+				Counters *next;
+				Counters *prev;
+			};
+
+			// The counters of the calling thread. Registered on the first access.
+			Counters &threadCounters();
+
+			void record(Phase phase, std::uint64_t nanos) noexcept;
+
+			inline std::uint64_t now() noexcept
+			{
+				return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+						std::chrono::steady_clock::now().time_since_epoch()).count());
+			}
+		}
+
+		// Turns collection on and starts the run clock. Must be called before any work is started.
+		void enable();
+
+		inline bool enabled() noexcept { return _helper::enabled; }
+
+		inline void countDir() noexcept
+		{
+			if (_helper::enabled) {
+				_helper::Counters::add(_helper::threadCounters().dirs, 1);
+			}
+		}
+
+		inline void countFile() noexcept
+		{
+			if (_helper::enabled) {
+				_helper::Counters::add(_helper::threadCounters().files, 1);
+			}
+		}
+
+		inline void countBytes(const std::uint64_t n) noexcept
+		{
+			if (_helper::enabled) {
+				_helper::Counters::add(_helper::threadCounters().bytes, n);
+			}
+		}
+
+		// Times the scope it lives in as the given phase.
+		class PhaseTimer
+		{
+		public:
+			explicit PhaseTimer(const Phase phase) noexcept
+					: m_phase(phase), m_active(_helper::enabled), m_start(m_active ? _helper::now() : 0) {}
+			~PhaseTimer()
+			{
+				if (m_active) {
+					_helper::record(m_phase, _helper::now() - m_start);
+				}
+			}
+
+			PhaseTimer(const PhaseTimer &) = delete;
+			PhaseTimer &operator=(const PhaseTimer &) = delete;
+		private:
+			const Phase m_phase;
+			const bool m_active;
+			const std::uint64_t m_start;
+		};
+
+		// Sums the counters of all the threads, both running and finished. Can be called at any time.
+		void snapshot(Snapshot &dest);
+
+		// The seconds passed since enable() was called.
+		double elapsedSeconds() noexcept;
+
+		// Prints the summary of the run: the rates and the latencies of each phase.
+		void printSummary(std::ostream &out);
+
+		// Prints a single line with the progress made so far.
+		void printProgress(std::ostream &out);
+
+		// Prints the progress line periodically in a thread of its own while it exists.
+		class ProgressPrinter
+		{
+		public:
+			ProgressPrinter(unsigned intervalSeconds, std::ostream &out);
+			~ProgressPrinter();
+
+			ProgressPrinter(const ProgressPrinter &) = delete;
+			ProgressPrinter &operator=(const ProgressPrinter &) = delete;
+		private:
+			void run();
+
+			const std::chrono::seconds m_interval;
+			std::ostream &m_out;
+			std::mutex m_mutex;
+			std::condition_variable m_stopRequested;
+			bool m_stop;
+			std::thread m_thread;
+		};
+	}
+}
+
+#endif // MIRROR_STATS_HPP_
@@ -14,15 +14,31 @@ GNU General Public License for more details.
 You should have received a copy of the GNU General Public License
 along with this program.  If not, see <http://www.gnu.org/licenses/>. */
 #include "utils.hpp"
-#include <afc/crc.hpp>
+#include "crc64.hpp"
+#include "DirWatcher.hpp"
 #include <afc/number.h>
 #include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
 #include <fcntl.h>
+#include <linux/fs.h>
+#include <new>
+#include <set>
+#include <signal.h>
 #include <stdexcept>
+#include <string>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <thread>
+#include <unistd.h>
 
 using afc::operator"" _s;
-using afc::logger::logDebug;
+using mirror::logger::logDebug;
+using afc::logger::logError;
 
 namespace
 {
@@ -39,6 +55,57 @@ namespace
 
 		throw std::runtime_error(msgBuf);
 	}
+
+	// A regular file whose digest is being calculated by the hash pipeline before it is added to the DB.
+	struct PendingFile
+	{
+		PendingFile(const char * const fileNameU8, const std::size_t fileNameSize,
+				const char * const relDirU8, const std::size_t relDirSize)
+				: fileNameU8(fileNameU8, fileNameSize), relDirU8(relDirU8, relDirSize) {}
+
+		std::string fileNameU8;
+		std::string relDirU8;
+	};
+
+	struct AddFileOp
+	{
+		void operator()(PendingFile &file, const mirror::FileRecord &fileRecord)
+		{
+			db.addFile(file.fileNameU8.data(), file.fileNameU8.size(),
+					file.relDirU8.data(), file.relDirU8.size(), fileRecord);
+			if (checkpoints != nullptr) {
+				checkpoints->fileDelivered();
+			}
+		}
+
+		mirror::FileDB &db;
+		// Null if the directories done are not recorded.
+		mirror::_helper::DirCheckpoints *checkpoints;
+	};
+}
+
+volatile std::sig_atomic_t mirror::_helper::interruptionRequested = 0;
+
+namespace
+{
+	extern "C" void requestInterruption(int)
+	{
+		mirror::_helper::interruptionRequested = 1;
+	}
+}
+
+void mirror::handleInterruptions()
+{
+	struct sigaction action;
+	std::memset(&action, 0, sizeof(action));
+	action.sa_handler = requestInterruption;
+	sigemptyset(&action.sa_mask);
+	// Reads are not failed with EINTR, and the default action is restored for the signal to be repeated.
+	action.sa_flags = SA_RESTART | SA_RESETHAND;
+
+	// TODO handle error.
+	sigaction(SIGINT, &action, nullptr);
+	sigaction(SIGTERM, &action, nullptr);
 }
 
 [[noreturn]]
@@ -178,93 +245,1104 @@ throw_static_msg:
 	throw std::runtime_error(msg);
 }
 
-void mirror::_helper::fillRegularFileRecord(const struct stat &fileStat, const int fd, const char * const filePath,
-		mirror::FileRecord &dest)
+void mirror::_helper::fillRegularFileMetadata(const struct stat &fileStat, mirror::FileRecord &dest) noexcept
 {
 	dest.type = FileType::file;
 	dest.fileSize = fileStat.st_size;
 	dest.lastModifiedTS.setMillis(static_cast<afc::Timestamp::time_type>(fileStat.st_mtime) * 1000);
+}
+
+namespace
+{
+	struct ReadBuffer
+	{
+		ReadBuffer() noexcept : data(nullptr), size(0) {}
+		~ReadBuffer() { std::free(data); }
+
+		void *data;
+		std::size_t size;
+	};
+
+	thread_local ReadBuffer threadBuf;
+}
+
+unsigned char *mirror::_helper::threadReadBuffer(const std::size_t size)
+{
+	ReadBuffer &buf = threadBuf;
+
+	if (buf.size < size) {
+		void *data;
+		const int result = posix_memalign(&data, static_cast<std::size_t>(sysconf(_SC_PAGESIZE)), size);
+		if (result != 0) {
+			throw std::bad_alloc();
+		}
+		std::free(buf.data);
+		buf.data = data;
+		buf.size = size;
+	}
+	return static_cast<unsigned char *>(buf.data);
+}
+
+void mirror::_helper::abandonThreadReadBuffer() noexcept
+{
+	// The buffer is leaked.
+	threadBuf.data = nullptr;
+	threadBuf.size = 0;
+}
+
+void mirror::_helper::fillRegularFileRecord(const struct stat &fileStat, const int fd, const char * const filePath,
+		mirror::FileRecord &dest, const ReadOptions &options, mirror::DigestCache * const digests)
+{
+	fillRegularFileMetadata(fileStat, dest);
+
+	if (digests != nullptr && digests->find(fileStat, dest.crc64)) {
+		return;
+	}
 
 	std::uint_fast64_t crc64 = 0;
 	auto calcCRC64 = [&crc64] (const unsigned char buf[], const std::size_t n)
 	{
-		crc64 = afc::crc64ReversedUpdate(crc64, buf, n);
+		const mirror::stats::PhaseTimer timer(mirror::stats::Phase::crc64);
+		crc64 = mirror::crc64Update(crc64, buf, n);
 	};
 
-	mirror::_helper::processFile(fd, filePath, calcCRC64);
+	mirror::_helper::processFile(fd, filePath, calcCRC64, options);
+
+	storeCRC64(crc64, dest.crc64);
+	if (digests != nullptr) {
+		digests->add(fileStat, dest.crc64);
+	}
+}
+
+std::size_t mirror::_helper::maxPendingTasks(const unsigned jobs)
+{
+	const std::size_t result = jobs * pendingTasksPerJob;
+
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) != 0 || limit.rlim_cur == RLIM_INFINITY) {
+		return result;
+	}
+	// At least a single file is hashed at a time even if reservedDescriptors is not left.
+	const rlim_t budget = limit.rlim_cur > reservedDescriptors ? limit.rlim_cur - reservedDescriptors : 1;
+	return budget < result ? static_cast<std::size_t>(budget) : result;
+}
 
-	for (int i = 0; i < 8; ++i) {
-		dest.crc64[i] = crc64 & 0xff;
+void mirror::_helper::storeCRC64(std::uint_fast64_t crc64,
+		unsigned char (&dest)[sizeof(mirror::FileRecord::crc64)]) noexcept
+{
+	for (std::size_t i = 0; i < sizeof(dest); ++i) {
+		dest[i] = crc64 & 0xff;
 		crc64 >>= 8;
 	}
 }
 
-void mirror::createDB(const char * const rootDir, const std::size_t rootDirSize, mirror::FileDB &db)
+void mirror::_helper::listDir(const afc::FastStringBuffer<char> &path, const int fd, DirListing &listing,
+		const DirOrder order)
+{
+	logDebug("Scanning '"_s, path, "'..."_s);
+
+	int result;
+	{
+		const mirror::stats::PhaseTimer timer(mirror::stats::Phase::readDir);
+		result = readDir(fd, listing, order);
+	}
+	if (result != 0) {
+		const int errorCode = errno;
+		// TODO handle error.
+		close(fd);
+		switch (errorCode) {
+		case EACCES:
+			// TODO make the behaviour configurable (ignorable).
+			logDebug("No access to '"_s, path, '\'');
+			throw errorCode;
+		case ENOENT:
+			logError("Directory not found: '"_s, path, '\'');
+			throw errorCode;
+		default:
+			// TODO handle error
+			throw errorCode;
+		}
+	}
+	mirror::stats::countDir();
+}
+
+bool mirror::_helper::statDirEntry(const int dirFd, const DirListing::Entry &entry, const char * const name,
+		const afc::FastStringBuffer<char> &path, struct stat &dest)
+{
+	switch (entry.type) {
+	case DT_DIR:
+		// Nothing but the type is needed for directories and it is known already.
+		std::memset(&dest, 0, sizeof(dest));
+		dest.st_mode = S_IFDIR;
+		return true;
+	case DT_REG:
+	case DT_LNK:
+	case DT_UNKNOWN:
+		if (statFile(dirFd, name, dest) != 0) {
+			switch (errno) {
+			case EACCES:
+				// TODO make the behaviour configurable.
+				logDebug("No access to '"_s, path, '\'');
+				return false;
+			default:
+				// TODO handle error
+				logDebug(errno);
+				throw errno;
+			}
+		}
+		if (S_ISREG(dest.st_mode)) {
+			mirror::stats::countFile();
+			return true;
+		}
+		if (S_ISDIR(dest.st_mode)) {
+			return true;
+		}
+		break;
+	default:
+		// Device files, FIFOs and sockets are not even stat'ed.
+		break;
+	}
+
+	// TODO support non-regular and non-directory files.
+	logDebug("The file '"_s, name, "' is neither a directory or a regular file. Skipping it..."_s);
+	return false;
+}
+
+int mirror::_helper::FileRef::open() const
+{
+	int fd;
+	{
+		const mirror::stats::PhaseTimer timer(mirror::stats::Phase::open);
+		fd = openat(m_dirFd, m_name, O_RDONLY);
+	}
+	if (fd == -1) {
+		mirror::_helper::handleOpenFileError(errno);
+	}
+	return fd;
+}
+
+int mirror::_helper::statFile(const int dirFd, const char * const name, struct stat &dest)
+{
+	const mirror::stats::PhaseTimer timer(mirror::stats::Phase::stat);
+#ifdef STATX_TYPE
+	struct statx fileStat;
+	if (statx(dirFd, name, AT_STATX_DONT_SYNC, STATX_TYPE | STATX_MODE | STATX_NLINK | STATX_INO |
+			STATX_SIZE | STATX_MTIME, &fileStat) == 0) {
+		std::memset(&dest, 0, sizeof(dest));
+		dest.st_mode = fileStat.stx_mode;
+		dest.st_nlink = fileStat.stx_nlink;
+		dest.st_ino = fileStat.stx_ino;
+		dest.st_dev = makedev(fileStat.stx_dev_major, fileStat.stx_dev_minor);
+		dest.st_size = static_cast<off_t>(fileStat.stx_size);
+		dest.st_mtim.tv_sec = fileStat.stx_mtime.tv_sec;
+		dest.st_mtim.tv_nsec = fileStat.stx_mtime.tv_nsec;
+		return 0;
+	}
+	if (errno != ENOSYS) {
+		return -1;
+	}
+	// The kernel is older than the C library.
+#endif
+	return fstatat(dirFd, name, &dest, 0);
+}
+
+void mirror::createDB(const char * const rootDir, const std::size_t rootDirSize, mirror::FileDB &db,
+		const ScanOptions &options)
 {
 	struct EventHandler
 	{
-		EventHandler(mirror::FileDB &db) noexcept : m_db(db) {}
+		EventHandler(mirror::FileDB &db, const ScanOptions &options, const bool resumed)
+				: m_db(db), m_checkpoints(db, options.checkpointInterval != 0), m_addFileOp{db, &m_checkpoints},
+				  m_pipeline(mirror::_helper::createHashPipeline<PendingFile>(options)),
+				  m_readOptions(options.read), m_digests(), m_resumed(resumed),
+				  m_subtrees(options.walk.walkers <= 1), m_nameBuf() {}
+
+		struct DirCtx
+		{
+			DirCtx() : relDirU8(), done(false) {}
+
+			// Converted once for all the files of the directory.
+			std::string relDirU8;
+			// True if the files of the directory are added by the walk resumed.
+			bool done;
+		};
+
+		void dirStart(DirCtx &ctx, afc::FastStringBuffer<char> &path, const std::size_t relDirOffset)
+		{
+			mirror::_helper::checkInterruption();
+
+			mirror::assignUtf8(ctx.relDirU8, path.begin() + relDirOffset, path.size() - relDirOffset);
+
+			if (m_resumed) {
+				ctx.done = m_db.getDirProgress(ctx.relDirU8.data(), ctx.relDirU8.size()) !=
+						mirror::FileDB::DirProgress::none;
+				if (!ctx.done) {
+					// Some of the files could be added before the walk was interrupted.
+					m_db.removeDir(ctx.relDirU8.data(), ctx.relDirU8.size());
+				}
+			}
+		}
 
-		void dirStart(afc::FastStringBuffer<char> &path, const std::size_t relDirOffset) const noexcept {}
-		void dirEnd(afc::FastStringBuffer<char> &path, const std::size_t relDirOffset) const noexcept {}
+		void dirEnd(DirCtx &ctx, afc::FastStringBuffer<char> &path, const std::size_t relDirOffset)
+		{
+			// The single walker leaves a directory only after all its subdirectories.
+			m_checkpoints.dirDone(ctx.relDirU8.data(), ctx.relDirU8.size(), m_subtrees);
+		}
 
-		bool file(const struct stat &fileStat, const int fd, const afc::FastStringBuffer<char> &path,
-				const std::size_t relDirOffset, const std::size_t fileNameOffset) const
+		bool file(DirCtx &ctx, const struct stat &fileStat, mirror::_helper::FileRef &fileRef,
+				const afc::FastStringBuffer<char> &path, const std::size_t relDirOffset,
+				const std::size_t fileNameOffset)
 		{
+			mirror::_helper::checkInterruption();
+
 			const char * const relPath = path.begin() + relDirOffset;
 
+			assert(S_ISREG(fileStat.st_mode) || S_ISDIR(fileStat.st_mode));
+			if (ctx.done) {
+				return S_ISDIR(fileStat.st_mode) && !isSubtreeDone(relPath, path.end());
+			}
+
 			logDebug("Adding the file '"_s, std::make_pair(relPath, path.end()), "' to the DB..."_s);
 
+			const char * const fileName = path.begin() + fileNameOffset;
+			const std::size_t fileNameSize = path.size() - fileNameOffset;
+			const TextView fileNameU8 = mirror::toUtf8(fileName, fileNameSize, m_nameBuf);
+			const std::string &relDirU8 = ctx.relDirU8;
+
 			mirror::FileRecord fileRecord;
 
-			assert(S_ISREG(fileStat.st_mode) || S_ISDIR(fileStat.st_mode));
 			if (S_ISREG(fileStat.st_mode)) {
-				mirror::_helper::fillRegularFileRecord(fileStat, fd, path.c_str(), fileRecord);
+				if (m_pipeline) {
+					// The file is added to the DB when its digest is ready.
+					m_checkpoints.fileSubmitted();
+					m_pipeline->submit(fileRef.release(), fileStat, path.c_str(), path.size(),
+							PendingFile(fileNameU8.value, fileNameU8.size, relDirU8.data(), relDirU8.size()),
+							m_addFileOp);
+					return true;
+				}
+				mirror::_helper::fillRegularFileRecord(fileStat, fileRef.fd(), path.c_str(), fileRecord, m_readOptions,
+						&m_digests);
 			} else {
 				fileRecord.type = FileType::dir;
 			}
 
+			m_db.addFile(fileNameU8.value, fileNameU8.size, relDirU8.data(), relDirU8.size(), fileRecord);
+
+			return S_ISREG(fileStat.st_mode) || !isSubtreeDone(relPath, path.end());
+		}
+
+		void finish()
+		{
+			if (m_pipeline) {
+				m_pipeline->finish(m_addFileOp);
+			}
+		}
+	private:
+		// Subtrees that the walk resumed is done with are not descended into.
+		bool isSubtreeDone(const char * const relPath, const char * const relPathEnd)
+		{
+			if (!m_resumed) {
+				return false;
+			}
+			const TextView relPathU8 = mirror::toUtf8(relPath, relPathEnd - relPath, m_nameBuf);
+			return m_db.getDirProgress(relPathU8.value, relPathU8.size) == mirror::FileDB::DirProgress::subtree;
+		}
+
+		mirror::FileDB &m_db;
+		mirror::_helper::DirCheckpoints m_checkpoints;
+		AddFileOp m_addFileOp;
+		std::unique_ptr<mirror::HashPipeline<PendingFile>> m_pipeline;
+		const ReadOptions &m_readOptions;
+		// Used if files are hashed by this thread rather than by m_pipeline.
+		mirror::DigestCache m_digests;
+		// True if the walk is resumed from the checkpoints in the DB.
+		const bool m_resumed;
+		const bool m_subtrees;
+		// Shared by all the directories since the handler is never called concurrently.
+		std::string m_nameBuf;
+	};
+
+	assert(!options.resume || options.checkpointInterval != 0);
+
+	// The walk is recorded even if the directories it is done with are not.
+	std::string rootDirU8;
+	mirror::assignUtf8(rootDirU8, rootDir, rootDirSize);
+	const bool resumed = db.beginCheckpoints(u8"create-db", rootDirU8.data(), rootDirU8.size(),
+			std::chrono::seconds(options.checkpointInterval), options.resume);
+	if (options.resume && !resumed) {
+		throw std::runtime_error("There is no interrupted create-db of this directory to resume.");
+	}
+
+	EventHandler eventHandler(db, options, resumed);
+
+	db.beginBulkLoad();
+	try {
+		mirror::_helper::scanFiles(rootDir, rootDirSize, eventHandler, options.walk);
+		eventHandler.finish();
+		mirror::updateDirDigests(db);
+	}
+	catch (const mirror::Interrupted &) {
+		// What is done is kept for the walk to be resumed.
+		db.endBulkLoad();
+		db.endCheckpoints(false);
+		throw;
+	}
+	catch (...) {
+		db.abortBulkLoad();
+		db.endCheckpoints(false);
+		throw;
+	}
+	db.endBulkLoad();
+	db.endCheckpoints(true);
+}
+
+namespace
+{
+	/*
+	 * The subtree walked by updateDB() is not reported by the walk as an entry of its parent directory,
+	 * so it is added to the parent in case it is new, and so are the ancestors of it that are not in the DB.
+	 */
+	void addSubtreeDir(mirror::FileDB &db, const std::string &subtreeU8)
+	{
+		// From the subtree up to the first ancestor which is already in the DB as a directory.
+		std::size_t size = subtreeU8.size();
+		while (size != 0) {
+			const std::size_t slash = subtreeU8.rfind('/', size - 1);
+			const std::size_t nameOffset = slash == std::string::npos ? 0 : slash + 1;
+			const std::size_t parentSize = slash == std::string::npos ? 0 : slash;
+			const char * const name = subtreeU8.data() + nameOffset;
+			const std::size_t nameSize = size - nameOffset;
+
+			mirror::FileRecord record;
+			if (db.getFile(name, nameSize, subtreeU8.data(), parentSize, record) &&
+					record.type == mirror::FileType::dir) {
+				return;
+			}
+			record.type = mirror::FileType::dir;
+			db.addFile(name, nameSize, subtreeU8.data(), parentSize, record);
+
+			size = parentSize;
+		}
+	}
+}
+
+void mirror::updateDB(const char * const rootDir, const std::size_t rootDirSize, mirror::FileDB &db,
+		const ScanOptions &options)
+{
+	struct EventHandler
+	{
+		struct DirCtx
+		{
+			DirCtx() : files(), relDirU8() {}
+
+			mirror::DirFileMap files;
+			std::string relDirU8;
+		};
+
+		EventHandler(mirror::FileDB &db, const ScanOptions &options)
+				: m_db(db), m_addFileOp{db, nullptr},
+				  m_pipeline(mirror::_helper::createHashPipeline<PendingFile>(options)), m_readOptions(options.read),
+				  m_digests(), m_nameBuf() {}
+
+		void dirStart(DirCtx &ctx, afc::FastStringBuffer<char> &path, const std::size_t relDirOffset)
+		{
+			const char * const relDir = path.begin() + relDirOffset;
+			logDebug("Entering '"_s, std::pair<const char *, const char *>(relDir, path.end()), "'..."_s);
+
+			mirror::assignUtf8(ctx.relDirU8, relDir, path.size() - relDirOffset);
+
+			m_db.markDirVisited(ctx.relDirU8.data(), ctx.relDirU8.size());
+			m_db.getFiles(ctx.relDirU8.data(), ctx.relDirU8.size(), ctx.files);
+		}
+
+		void dirEnd(DirCtx &ctx, afc::FastStringBuffer<char> &path, const std::size_t relDirOffset)
+		{
+			for (auto &e : ctx.files) {
+				logDebug("Removing the file '"_s, Utf8ToSystemView(e.first.data, e.first.size),
+						"' from the DB..."_s);
+				m_db.removeFile(e.first.data, e.first.size, ctx.relDirU8.data(), ctx.relDirU8.size());
+			}
+		}
+
+		bool file(DirCtx &ctx, const struct stat &fileStat, mirror::_helper::FileRef &fileRef,
+				const afc::FastStringBuffer<char> &path, const std::size_t relPathOffset,
+				const std::size_t fileNameOffset)
+		{
+			assert(S_ISREG(fileStat.st_mode) || S_ISDIR(fileStat.st_mode));
+
+			const char * const relPath = path.begin() + relPathOffset;
 			const char * const fileName = path.begin() + fileNameOffset;
 			const std::size_t fileNameSize = path.size() - fileNameOffset;
-			const TextHolder fileNameU8 = mirror::convertToUtf8(fileName, fileNameSize);
+			const TextView fileNameU8 = mirror::toUtf8(fileName, fileNameSize, m_nameBuf);
+
+			const auto dbEntry = ctx.files.find(PathKey(fileNameU8.value, fileNameU8.size, true));
+			const bool found = dbEntry != ctx.files.end();
+
+			mirror::FileRecord fileRecord;
 
-			std::size_t relDirSize = fileNameOffset - relDirOffset;
-			if (relDirSize > 0) {
-				--relDirSize; // removing separator between dir and file.
+			if (S_ISDIR(fileStat.st_mode)) {
+				const bool upToDate = found && dbEntry->second.type == FileType::dir;
+				if (found) {
+					ctx.files.erase(dbEntry);
+				}
+				if (upToDate) {
+					return true;
+				}
+				fileRecord.type = FileType::dir;
+			} else {
+				if (found) {
+					const mirror::FileRecord &dbRecord = dbEntry->second;
+					const bool upToDate = dbRecord.type == FileType::file && dbRecord.fileSize == fileStat.st_size &&
+							dbRecord.lastModifiedTS.millis() ==
+									static_cast<afc::Timestamp::time_type>(fileStat.st_mtime) * 1000;
+					ctx.files.erase(dbEntry);
+					if (upToDate) {
+						// The digest stored is reused.
+						return true;
+					}
+				}
+
+				if (m_pipeline) {
+					logDebug("Updating the file '"_s, std::make_pair(relPath, path.end()), "' in the DB..."_s);
+					// The file is added to the DB when its digest is ready.
+					m_pipeline->submit(fileRef.release(), fileStat, path.c_str(), path.size(),
+							PendingFile(fileNameU8.value, fileNameU8.size, ctx.relDirU8.data(), ctx.relDirU8.size()),
+							m_addFileOp);
+					return true;
+				}
+				mirror::_helper::fillRegularFileRecord(fileStat, fileRef.fd(), path.c_str(), fileRecord, m_readOptions,
+						&m_digests);
 			}
-			// TODO do not convert relative dir again and again for every file in the directory.
-			const TextHolder relDirU8 = mirror::convertToUtf8(relPath, relDirSize);
 
-			m_db.addFile(fileNameU8.value, fileNameU8.size, relDirU8.value, relDirU8.size, fileRecord);
+			logDebug("Updating the file '"_s, std::make_pair(relPath, path.end()), "' in the DB..."_s);
+
+			m_db.addFile(fileNameU8.value, fileNameU8.size, ctx.relDirU8.data(), ctx.relDirU8.size(), fileRecord);
 
 			return true;
 		}
+
+		void finish()
+		{
+			if (m_pipeline) {
+				m_pipeline->finish(m_addFileOp);
+			}
+
+			// Directories that are not found in the file system are removed together with their files.
+			const char *missingDirU8;
+			std::size_t missingDirSize;
+			while (m_db.nextUnvisitedDir(missingDirU8, missingDirSize)) {
+				logDebug("Removing the directory '"_s, Utf8ToSystemView(missingDirU8, missingDirSize),
+						"' from the DB..."_s);
+			}
+			m_db.removeUnvisitedDirs();
+		}
 	private:
 		mirror::FileDB &m_db;
-	} eventHandler(db);
+		AddFileOp m_addFileOp;
+		std::unique_ptr<mirror::HashPipeline<PendingFile>> m_pipeline;
+		const ReadOptions &m_readOptions;
+		// Used if files are hashed by this thread rather than by m_pipeline.
+		mirror::DigestCache m_digests;
+		// Shared by all the directories since the handler is never called concurrently.
+		std::string m_nameBuf;
+	} eventHandler(db, options);
 
+	std::string subtreeU8;
+	if (options.walk.subtreeSize != 0) {
+		mirror::assignUtf8(subtreeU8, options.walk.subtree, options.walk.subtreeSize);
+	}
+
+	db.beginDirTracking(subtreeU8.data(), subtreeU8.size());
 	db.beginTransaction();
 	try {
-		mirror::_helper::scanFiles(rootDir, rootDirSize, eventHandler);
+		if (!subtreeU8.empty()) {
+			addSubtreeDir(db, subtreeU8);
+		}
+		mirror::_helper::scanFiles(rootDir, rootDirSize, eventHandler, options.walk);
+		eventHandler.finish();
+		mirror::updateDirDigests(db);
 	}
 	catch (...) {
 		db.rollback();
+		// TODO handle error.
+		db.endDirTracking();
 		throw;
 	}
 	db.commit();
+	db.endDirTracking();
+}
+
+void mirror::updateDirDigests(mirror::FileDB &db)
+{
+	mirror::SortedDirFiles files;
+	std::string subdirU8;
+
+	std::vector<std::string> dirs;
+	db.getDirsWithoutDigest(dirs);
+
+	for (const std::string &dir : dirs) {
+		const char * const dirU8 = dir.data();
+		const std::size_t dirSize = dir.size();
+
+		files.entries.clear();
+		files.names.clear();
+		db.getFiles(dirU8, dirSize, files);
+
+		// The names are hashed together with their terminating '\0' so that they cannot run into each other.
+		std::uint_fast64_t crc64 = 0;
+		for (const mirror::SortedDirFiles::Entry &entry : files.entries) {
+			crc64 = mirror::crc64Update(crc64, reinterpret_cast<const unsigned char *>(entry.nameU8),
+					entry.nameSize + 1);
+
+			// The type followed by the size and the digest of a file, or by the digest of a subdirectory.
+			const unsigned char type = static_cast<unsigned char>(entry.record.type);
+			unsigned char size[sizeof(std::uint64_t)] = {};
+			unsigned char digest[sizeof(mirror::FileRecord::crc64)] = {};
+			if (entry.record.type == mirror::FileType::file) {
+				mirror::_helper::storeCRC64(static_cast<std::uint64_t>(entry.record.fileSize), size);
+				std::copy_n(entry.record.crc64, sizeof(digest), digest);
+			} else {
+				subdirU8.assign(dirU8, dirSize);
+				if (dirSize != 0) {
+					subdirU8 += '/';
+				}
+				subdirU8.append(entry.nameU8, entry.nameSize);
+				// Empty directories have no digests, which is the same as the digest of nothing.
+				db.getDirDigest(subdirU8.data(), subdirU8.size(), digest);
+			}
+			crc64 = mirror::crc64Update(crc64, &type, 1);
+			crc64 = mirror::crc64Update(crc64, size, sizeof(size));
+			crc64 = mirror::crc64Update(crc64, digest, sizeof(digest));
+		}
+
+		unsigned char digest[sizeof(mirror::FileRecord::crc64)];
+		mirror::_helper::storeCRC64(crc64, digest);
+		db.setDirDigest(dirU8, dirSize, digest);
+	}
+	logDebug("Directory digests calculated: "_s, dirs.size(), '.');
+}
+
+namespace
+{
+	// Limits the rate files are read at to recalculate their digests.
+	class RateLimiter
+	{
+	public:
+		explicit RateLimiter(const std::uint64_t bytesPerSecond)
+				: m_rate(static_cast<double>(bytesPerSecond)), m_allowance(m_rate),
+				  m_last(std::chrono::steady_clock::now()) {}
+
+		// Waits until n bytes can be read. Bursts of up to a second worth of bytes are not delayed.
+		void acquire(const std::uint64_t n)
+		{
+			if (m_rate == 0) {
+				return;
+			}
+
+			const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+			m_allowance = std::min(m_rate, m_allowance + std::chrono::duration<double>(now - m_last).count() * m_rate);
+			m_allowance -= static_cast<double>(n);
+			m_last = now;
+
+			if (m_allowance >= 0) {
+				return;
+			}
+			// The debt is paid off by the time that passes until the next call.
+			std::chrono::duration<double> left(-m_allowance / m_rate);
+			const std::chrono::duration<double> slice(0.2);
+			while (left.count() > 0) {
+				std::this_thread::sleep_for(std::min(left, slice));
+				left -= slice;
+				mirror::_helper::checkInterruption();
+			}
+		}
+	private:
+		const double m_rate;
+		double m_allowance;
+		std::chrono::steady_clock::time_point m_last;
+	};
+
+	// Appends the relative path of the entry to the relative path of its directory.
+	inline void joinRelPath(std::string &dest, const std::string &relDir, const char * const name,
+			const std::size_t nameSize)
+	{
+		dest.assign(relDir);
+		if (!dest.empty() && nameSize != 0) {
+			dest += '/';
+		}
+		dest.append(name, nameSize);
+	}
+
+	// Watches all the directories of the tree with the watcher.
+	void watchTree(const std::string &rootDir, mirror::DirWatcher &watcher, const mirror::WalkOptions &options)
+	{
+		struct EventHandler
+		{
+			struct DirCtx {};
+
+			void dirStart(DirCtx &, afc::FastStringBuffer<char> &, const std::size_t)
+			{
+				mirror::_helper::checkInterruption();
+			}
+
+			void dirEnd(DirCtx &, afc::FastStringBuffer<char> &, const std::size_t) const noexcept {}
+
+			bool file(DirCtx &, const struct stat &fileStat, mirror::_helper::FileRef &,
+					const afc::FastStringBuffer<char> &path, const std::size_t relPathOffset, const std::size_t)
+			{
+				if (!S_ISDIR(fileStat.st_mode)) {
+					return false;
+				}
+				watcher.addDir(path.c_str(), path.begin() + relPathOffset, path.size() - relPathOffset);
+				return true;
+			}
+
+			mirror::DirWatcher &watcher;
+		} eventHandler{watcher};
+
+		mirror::_helper::scanFiles(rootDir.data(), rootDir.size(), eventHandler, options);
+	}
+
+	/*
+	 * Rescans the directories given by their paths relative to the root. Their subdirectories are descended
+	 * into only if they are new to the DB, in which case they are scanned entirely and watched.
+	 */
+	void updateDirs(const std::string &rootDir, const std::set<std::string> &relDirs, mirror::FileDB &db,
+			mirror::DirWatcher &watcher, RateLimiter &rateLimiter, const mirror::ScanOptions &options)
+	{
+		struct EventHandler
+		{
+			struct DirCtx
+			{
+				DirCtx() : files(), relDirU8() {}
+
+				mirror::DirFileMap files;
+				std::string relDirU8;
+			};
+
+			EventHandler(mirror::FileDB &db, mirror::DirWatcher &watcher, RateLimiter &rateLimiter,
+					const mirror::ScanOptions &options)
+					: m_db(db), m_watcher(watcher), m_rateLimiter(rateLimiter), m_addFileOp{db, nullptr},
+					  m_pipeline(mirror::_helper::createHashPipeline<PendingFile>(options)),
+					  m_readOptions(options.read), m_digests(), m_relDir(nullptr), m_pathBuf(), m_nameBuf() {}
+
+			// Sets the directory the next walk starts at, by its path relative to the root.
+			void setRelDir(const std::string &relDir) noexcept
+			{
+				m_relDir = &relDir;
+			}
+
+			void dirStart(DirCtx &ctx, afc::FastStringBuffer<char> &path, const std::size_t relDirOffset)
+			{
+				mirror::_helper::checkInterruption();
+
+				joinRelPath(m_pathBuf, *m_relDir, path.begin() + relDirOffset, path.size() - relDirOffset);
+				logDebug("Rescanning '"_s, m_pathBuf.c_str(), "'..."_s);
+
+				mirror::assignUtf8(ctx.relDirU8, m_pathBuf.data(), m_pathBuf.size());
+				m_db.getFiles(ctx.relDirU8.data(), ctx.relDirU8.size(), ctx.files);
+			}
+
+			void dirEnd(DirCtx &ctx, afc::FastStringBuffer<char> &, const std::size_t)
+			{
+				for (auto &e : ctx.files) {
+					logDebug("Removing the file '"_s, mirror::Utf8ToSystemView(e.first.data, e.first.size),
+							"' from the DB..."_s);
+					m_db.removeFile(e.first.data, e.first.size, ctx.relDirU8.data(), ctx.relDirU8.size());
+					if (e.second.type == mirror::FileType::dir) {
+						joinRelPath(m_pathBuf, ctx.relDirU8, e.first.data, e.first.size);
+						m_db.removeSubtree(m_pathBuf.data(), m_pathBuf.size());
+					}
+				}
+			}
+
+			bool file(DirCtx &ctx, const struct stat &fileStat, mirror::_helper::FileRef &fileRef,
+					const afc::FastStringBuffer<char> &path, const std::size_t relPathOffset,
+					const std::size_t fileNameOffset)
+			{
+				assert(S_ISREG(fileStat.st_mode) || S_ISDIR(fileStat.st_mode));
+
+				const char * const relPath = path.begin() + relPathOffset;
+				const char * const fileName = path.begin() + fileNameOffset;
+				const std::size_t fileNameSize = path.size() - fileNameOffset;
+				const mirror::TextView fileNameU8 = mirror::toUtf8(fileName, fileNameSize, m_nameBuf);
+
+				const auto dbEntry = ctx.files.find(mirror::PathKey(fileNameU8.value, fileNameU8.size, true));
+				const bool found = dbEntry != ctx.files.end();
+				const bool wasDir = found && dbEntry->second.type == mirror::FileType::dir;
+
+				mirror::FileRecord fileRecord;
+
+				if (S_ISDIR(fileStat.st_mode)) {
+					if (found) {
+						ctx.files.erase(dbEntry);
+					}
+					if (wasDir) {
+						// It is rescanned when its own entries change.
+						return false;
+					}
+					fileRecord.type = mirror::FileType::dir;
+
+					logDebug("Adding the dir '"_s, std::make_pair(relPath, path.end()), "' to the DB..."_s);
+					m_db.addFile(fileNameU8.value, fileNameU8.size, ctx.relDirU8.data(), ctx.relDirU8.size(),
+							fileRecord);
+
+					joinRelPath(m_pathBuf, *m_relDir, relPath, path.end() - relPath);
+					m_watcher.addDir(path.c_str(), m_pathBuf.data(), m_pathBuf.size());
+					return true;
+				}
+
+				if (found) {
+					const mirror::FileRecord &dbRecord = dbEntry->second;
+					const bool upToDate = dbRecord.type == mirror::FileType::file &&
+							dbRecord.fileSize == fileStat.st_size &&
+							dbRecord.lastModifiedTS.millis() ==
+									static_cast<afc::Timestamp::time_type>(fileStat.st_mtime) * 1000;
+					ctx.files.erase(dbEntry);
+					if (upToDate) {
+						return true;
+					}
+				}
+				if (wasDir) {
+					joinRelPath(m_pathBuf, ctx.relDirU8, fileNameU8.value, fileNameU8.size);
+					m_db.removeSubtree(m_pathBuf.data(), m_pathBuf.size());
+				}
+
+				logDebug("Updating the file '"_s, std::make_pair(relPath, path.end()), "' in the DB..."_s);
+
+				m_rateLimiter.acquire(static_cast<std::uint64_t>(fileStat.st_size));
+				if (m_pipeline) {
+					// The file is added to the DB when its digest is ready.
+					m_pipeline->submit(fileRef.release(), fileStat, path.c_str(), path.size(),
+							PendingFile(fileNameU8.value, fileNameU8.size, ctx.relDirU8.data(), ctx.relDirU8.size()),
+							m_addFileOp);
+					return true;
+				}
+				mirror::_helper::fillRegularFileRecord(fileStat, fileRef.fd(), path.c_str(), fileRecord, m_readOptions,
+						&m_digests);
+				m_db.addFile(fileNameU8.value, fileNameU8.size, ctx.relDirU8.data(), ctx.relDirU8.size(), fileRecord);
+
+				return true;
+			}
+
+			void finish()
+			{
+				if (m_pipeline) {
+					m_pipeline->finish(m_addFileOp);
+				}
+			}
+		private:
+			mirror::FileDB &m_db;
+			mirror::DirWatcher &m_watcher;
+			RateLimiter &m_rateLimiter;
+			AddFileOp m_addFileOp;
+			std::unique_ptr<mirror::HashPipeline<PendingFile>> m_pipeline;
+			const mirror::ReadOptions &m_readOptions;
+			// Used if files are hashed by this thread rather than by m_pipeline.
+			mirror::DigestCache m_digests;
+			const std::string *m_relDir;
+			// Shared by all the directories since the handler is never called concurrently.
+			std::string m_pathBuf;
+			std::string m_nameBuf;
+		};
+
+		// Returns false if a directory cannot be updated, in which case the transaction is rolled back.
+		auto update = [&](const std::set<std::string>::const_iterator first,
+				const std::set<std::string>::const_iterator last) -> bool
+		{
+			EventHandler eventHandler(db, watcher, rateLimiter, options);
+			db.beginTransaction();
+			try {
+				for (auto it = first; it != last; ++it) {
+					afc::FastStringBuffer<char> path(rootDir.size() + 1 + it->size());
+					path.append(rootDir.data(), rootDir.size());
+					if (!it->empty()) {
+						path.append('/');
+						path.append(it->data(), it->size());
+					}
+
+					const int dirFd = open(path.c_str(), O_RDONLY | O_DIRECTORY);
+					if (dirFd == -1) {
+						if (errno == ENOENT || errno == ENOTDIR) {
+							// Its parent is notified of it being gone.
+							continue;
+						}
+						mirror::_helper::handleOpenFileError(errno);
+					}
+
+					eventHandler.setRelDir(*it);
+					mirror::_helper::scanFiles(path, dirFd, eventHandler, options.walk); // dirFd is closed here.
+				}
+				eventHandler.finish();
+				mirror::updateDirDigests(db);
+			}
+			catch (const mirror::Interrupted &) {
+				db.rollback();
+				throw;
+			}
+			catch (const std::exception &ex) {
+				db.rollback();
+				logDebug("Unable to update the dirs: "_s, ex.what());
+				return false;
+			}
+			catch (const int errorCode) {
+				db.rollback();
+				logDebug("Unable to update the dirs: "_s, std::strerror(errorCode));
+				return false;
+			}
+			catch (...) {
+				db.rollback();
+				throw;
+			}
+			db.commit();
+			return true;
+		};
+
+		if (update(relDirs.begin(), relDirs.end())) {
+			return;
+		}
+
+		// Files come and go while they are scanned, so only the directories that fail are skipped.
+		for (auto it = relDirs.begin(); it != relDirs.end(); ++it) {
+			auto next = it;
+			++next;
+			if (!update(it, next)) {
+				logError("Unable to update the directory '"_s, it->c_str(),
+						"'. It is left as is until it changes again."_s);
+			}
+		}
+	}
+}
+
+void mirror::watchDB(const char * const rootDir, const std::size_t rootDirSize, mirror::FileDB &db,
+		const WatchOptions &options)
+{
+	// Interruptions are checked at least this often while waiting for events.
+	constexpr int pollMillis = 500;
+
+	const std::string root(rootDir, rootDirSize);
+	// It is set up before the tree is scanned so that no change is missed in between.
+	mirror::DirWatcher watcher(root.c_str(), options.fanotify);
+	logDebug("Watching the directory '"_s, root.c_str(), "' with "_s, watcher.backendName(), "..."_s);
+
+	auto rescan = [&]()
+	{
+		if (!watcher.recursive()) {
+			watchTree(root, watcher, options.scan.walk);
+		}
+		mirror::updateDB(rootDir, rootDirSize, db, options.scan);
+	};
+
+	RateLimiter rateLimiter(options.rehashRate);
+	std::set<std::string> relDirs;
+	try {
+		rescan();
+
+		for (;;) {
+			mirror::_helper::checkInterruption();
+
+			bool complete = watcher.readEvents(pollMillis, relDirs);
+			if (complete && !relDirs.empty()) {
+				const std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() +
+						std::chrono::seconds(options.delay);
+				for (;;) {
+					mirror::_helper::checkInterruption();
+					const std::chrono::steady_clock::duration left = deadline - std::chrono::steady_clock::now();
+					if (!complete || left.count() <= 0) {
+						break;
+					}
+					const int timeoutMillis = static_cast<int>(std::min<std::chrono::milliseconds::rep>(pollMillis,
+							std::chrono::duration_cast<std::chrono::milliseconds>(left).count() + 1));
+					complete = watcher.readEvents(timeoutMillis, relDirs);
+				}
+			}
+
+			if (!complete) {
+				logDebug("File system events are lost, updating the whole tree..."_s);
+				relDirs.clear();
+				rescan();
+				continue;
+			}
+			if (!relDirs.empty()) {
+				updateDirs(root, relDirs, db, watcher, rateLimiter, options.scan);
+				relDirs.clear();
+			}
+		}
+	}
+	catch (const mirror::Interrupted &) {
+		logDebug("Watching is stopped."_s);
+	}
+}
+
+bool mirror::_helper::writeFully(const int fd, const unsigned char *buf, std::size_t n, off_t offset)
+{
+	while (n > 0) {
+		const ssize_t m = pwrite(fd, buf, n, offset);
+		if (m == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		buf += m;
+		n -= static_cast<std::size_t>(m);
+		offset += m;
+	}
+	return true;
+}
+
+namespace
+{
+	enum class CopyStatus
+	{
+		// All the data is copied.
+		done,
+		/*
+		 * The method is not supported for this pair of files. The copy offset points to the first byte
+		 * not copied yet so that the next method can carry on from there.
+		 */
+		unsupported,
+		failed
+	};
+
+	// Errors copy_file_range() and sendfile() return if they cannot handle this pair of files at all.
+	inline bool isUnsupported(const int errorCode) noexcept
+	{
+		return errorCode == ENOSYS || errorCode == EXDEV || errorCode == EINVAL ||
+				errorCode == EOPNOTSUPP || errorCode == ENOTSUP;
+	}
+
+	// Makes the destination file share the extents of the source one (Btrfs, XFS, OCFS2, ...).
+	CopyStatus cloneFile(const int srcFd, const int destFd) noexcept
+	{
+#ifdef FICLONE
+		if (ioctl(destFd, FICLONE, srcFd) == 0) {
+			return CopyStatus::done;
+		}
+		// EXDEV, EOPNOTSUPP, EINVAL etc. all mean that the file systems cannot share extents.
+		return CopyStatus::unsupported;
+#else
+		return CopyStatus::unsupported;
+#endif
+	}
+
+	// Copies data within the kernel, possibly with server-side copy (NFS 4.2, SMB) or reflinks.
+	CopyStatus copyFileRange(const int srcFd, const int destFd, off_t &offset) noexcept
+	{
+		constexpr std::size_t chunkSize = 1 << 30;
+
+		for (;;) {
+			loff_t inOffset = offset;
+			loff_t outOffset = offset;
+			const ssize_t n = copy_file_range(srcFd, &inOffset, destFd, &outOffset, chunkSize, 0);
+			if (n == 0) {
+				return CopyStatus::done;
+			} else if (n == -1) {
+				if (errno == EINTR) {
+					continue;
+				}
+				return isUnsupported(errno) ? CopyStatus::unsupported : CopyStatus::failed;
+			}
+			offset += n;
+		}
+	}
+
+	CopyStatus sendFile(const int srcFd, const int destFd, off_t &offset) noexcept
+	{
+		constexpr std::size_t chunkSize = 1 << 30;
+
+		// sendfile() writes at the current offset of the destination file.
+		if (lseek(destFd, offset, SEEK_SET) == -1) {
+			return CopyStatus::failed;
+		}
+		for (;;) {
+			off_t inOffset = offset;
+			const ssize_t n = sendfile(destFd, srcFd, &inOffset, chunkSize);
+			if (n == 0) {
+				return CopyStatus::done;
+			} else if (n == -1) {
+				if (errno == EINTR) {
+					continue;
+				}
+				return isUnsupported(errno) ? CopyStatus::unsupported : CopyStatus::failed;
+			}
+			offset += n;
+		}
+	}
+
+	// If crc64 is not null then it is updated with the data copied.
+	bool copyBuffered(const int srcFd, const int destFd, off_t offset, std::uint_fast64_t * const crc64)
+	{
+		const std::size_t bufSize = mirror::ReadOptions::defaultBlockSize;
+		unsigned char * const buf = mirror::_helper::threadReadBuffer(bufSize);
+		for (;;) {
+			const ssize_t n = pread(srcFd, buf, bufSize, offset);
+			if (n == 0) {
+				return true;
+			} else if (n == -1) {
+				if (errno == EINTR) {
+					continue;
+				}
+				return false;
+			}
+			if (!mirror::_helper::writeFully(destFd, buf, static_cast<std::size_t>(n), offset)) {
+				return false;
+			}
+			if (crc64 != nullptr) {
+				*crc64 = mirror::crc64Update(*crc64, buf, static_cast<std::size_t>(n));
+			}
+			offset += n;
+		}
+	}
 }
 
-bool mirror::copyFile(const int srcDirFd, const int destDirFd, const char * const relPath)
+bool mirror::_helper::copyFileData(const int srcFd, const int destFd, std::uint_fast64_t * const crc64)
+{
+	using mirror::logger::logTrace;
+
+	if (crc64 != nullptr) {
+		// Zero-copy methods never expose the data so it is moved through memory to calculate the digest.
+		posix_fadvise(srcFd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		*crc64 = 0;
+		return copyBuffered(srcFd, destFd, 0, crc64);
+	}
+
+	CopyStatus status = cloneFile(srcFd, destFd);
+	if (status == CopyStatus::done) {
+		logTrace("Cloned."_s);
+		return true;
+	}
+
+	off_t offset = 0;
+
+	status = copyFileRange(srcFd, destFd, offset);
+	if (status != CopyStatus::unsupported) {
+		logTrace("Copied with copy_file_range()."_s);
+		return status == CopyStatus::done;
+	}
+
+	status = sendFile(srcFd, destFd, offset);
+	if (status != CopyStatus::unsupported) {
+		logTrace("Copied with sendfile()."_s);
+		return status == CopyStatus::done;
+	}
+
+	logTrace("Copying through the buffer..."_s);
+	return copyBuffered(srcFd, destFd, offset, nullptr);
+}
+
+bool mirror::copyFile(const int srcDirFd, const char * const srcRelPath, const int destDirFd,
+		const char * const destRelPath, mirror::FileRecord * const copiedFileRecord)
 {
 	// TODO support fsync
 	// TODO support copying symlinks
-	const int srcFd = openat(srcDirFd, relPath, O_NOFOLLOW | O_RDONLY);
+	const int srcFd = openat(srcDirFd, srcRelPath, O_NOFOLLOW | O_RDONLY);
 	if (srcFd == -1) {
 		// TODO log error.
 		return false;
 	}
 	// TODO preserve timestamps, sticky flags, permissions, ownership
-	const int destFd = openat(destDirFd, relPath, O_CREAT | O_EXCL | O_RDWR, S_IRWXU);
+	const int destFd = openat(destDirFd, destRelPath, O_CREAT | O_EXCL | O_RDWR, S_IRWXU);
 	if (destFd == -1) {
 		if (close(srcFd) == -1) {
 			// TODO log error.
@@ -273,29 +1351,22 @@ bool mirror::copyFile(const int srcDirFd, const int destDirFd, const char * cons
 		return false;
 	}
 
-	bool success = true;
-
-	constexpr std::size_t bufSize = 4096;
-	unsigned char buf[bufSize];
-	for (;;) {
-		const ssize_t n = read(srcFd, buf, bufSize);
-		if (n == 0) {
-			break;
-		} else if (n == -1) {
-			// TODO handle error.
-			success = false;
-			goto end;
-		} else {
-			const ssize_t m = write(destFd, buf, n);
-			if (m < n) {
-				// TODO handle error
-				success = false;
-				goto end;
-			}
+	const mirror::stats::PhaseTimer timer(mirror::stats::Phase::copy);
+	bool success;
+	if (copiedFileRecord == nullptr) {
+		// TODO log error.
+		success = mirror::_helper::copyFileData(srcFd, destFd);
+	} else {
+		struct stat srcStat;
+		std::uint_fast64_t crc64;
+		// TODO log error.
+		success = fstat(srcFd, &srcStat) == 0 && mirror::_helper::copyFileData(srcFd, destFd, &crc64);
+		if (success) {
+			mirror::_helper::fillRegularFileMetadata(srcStat, *copiedFileRecord);
+			mirror::_helper::storeCRC64(crc64, copiedFileRecord->crc64);
 		}
 	}
 
-end:
 	if (close(srcFd) == -1) {
 		// TODO log error.
 		success = false;
@@ -304,13 +1375,19 @@ end:
 		// TODO log error.
 		success = false;
 	}
+	if (!success) {
+		// Not leaving a partial copy behind so that the file is copied again next time.
+		unlinkat(destDirFd, destRelPath, 0);
+	}
 	return success;
 }
 
 // TODO get relPathSize, too.
 bool mirror::copyDir(const int srcDirFd, const char * const srcDir, const std::size_t srcDirSize,
 		const int destDirFd, const char * const destDir, const std::size_t destDirSize,
-		const char * const relPath, const std::size_t relPathSize)
+		const char * const relPath, const std::size_t relPathSize, mirror::CopyWorkers * const copyWorkers,
+		mirror::HardLinker * const hardLinker, mirror::LocalSource * const localSource,
+		std::size_t * const failedCopies)
 {
 	// TODO support fsync
 	// TODO support copying symlinks
@@ -321,7 +1398,7 @@ bool mirror::copyDir(const int srcDirFd, const char * const srcDir, const std::s
 	}
 
 	// TODO close srcFd.
-	CopyDirHandler handler(dirToCopyFd, destDirFd, relPath, relPathSize);
+	CopyDirHandler handler(dirToCopyFd, destDirFd, relPath, relPathSize, copyWorkers, hardLinker, localSource);
 
 	afc::FastStringBuffer<char> dirToCopyBuf(srcDirSize + 1 + relPathSize);
 	dirToCopyBuf.append(srcDir, srcDirSize);
@@ -330,5 +1407,8 @@ bool mirror::copyDir(const int srcDirFd, const char * const srcDir, const std::s
 
 	mirror::_helper::scanFiles(dirToCopyBuf, dirToCopyFd, handler);
 
+	if (failedCopies != nullptr) {
+		*failedCopies += handler.failedCopies;
+	}
 	return true;
 }
@@ -22,37 +22,266 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>. */
 #include <afc/logger.hpp>
 #include <afc/number.h>
 #include <afc/StringRef.hpp>
+#include <algorithm>
 #include <cassert>
 #include <cerrno>
+#include <chrono>
+#include <climits>
+#include "CopyWorkers.hpp"
+#include <csignal>
 #include <cstddef>
+#include <cstdint>
 #include <cstdio>
+#include <cstring>
+#include <deque>
 #include <dirent.h>
+#include "DirReader.hpp"
 #include "encoding.hpp"
+#include <exception>
 #include <fcntl.h>
 #include "FileDB.hpp"
-#include <stack>
+#include "HashPipeline.hpp"
+#include "IoUring.hpp"
+#include "LocalSource.hpp"
+#include "log.hpp"
+#include <memory>
+#include <mutex>
+#include <random>
+#include "ReportWriter.hpp"
+#include <stdexcept>
+#include "stats.hpp"
+#include <string>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <thread>
+#include <unistd.h>
 #include <utility>
+#include <vector>
+#include "WalkScheduler.hpp"
 
 namespace mirror
 {
-	void createDB(const char *rootDir, std::size_t rootDirSize, mirror::FileDB &db);
+	// Settings of how contents of regular files are read.
+	struct ReadOptions
+	{
+		// Large enough to make syscall overhead negligible but still to fit into L2 caches of most CPUs.
+		static constexpr std::size_t defaultBlockSize = 1024 * 1024;
+
+		static constexpr std::size_t defaultQueueDepth = 16;
+
+		static constexpr std::uint64_t defaultSplitThreshold = std::uint64_t(1) << 30;
+		static constexpr std::uint64_t defaultRangeSize = std::uint64_t(64) << 20;
+
+		ReadOptions() noexcept : blockSize(defaultBlockSize), dropCache(true), queueDepth(defaultQueueDepth),
+				splitThreshold(defaultSplitThreshold), rangeSize(defaultRangeSize) {}
+
+		// The number of bytes requested by each read(). Must be a positive multiple of the page size.
+		std::size_t blockSize;
+		/*
+		 * If true then the kernel is advised to drop pages of each file from the page cache once it is read
+		 * so that scanning a large tree does not evict the data other applications work with.
+		 */
+		bool dropCache;
+		/*
+		 * The number of files each hashing worker reads at the same time when mirror is built with io_uring
+		 * support (MIRROR_IO_URING). Each of them takes a buffer of blockSize bytes.
+		 */
+		std::size_t queueDepth;
+		/*
+		 * Regular files of at least this size are split into ranges of rangeSize bytes that are hashed
+		 * by different workers at once if there are several of them (see ScanOptions::jobs). The
+		 * digests of the ranges are combined, so the result is the same as if the file were hashed
+		 * as a whole. Zero disables splitting.
+		 */
+		std::uint64_t splitThreshold;
+		// Must be positive.
+		std::uint64_t rangeSize;
+	};
+
+	// Settings of how directory trees are walked.
+	struct WalkOptions
+	{
+		WalkOptions() noexcept : walkers(1), sortByInode(false), sortByName(false), subtree(nullptr), subtreeSize(0) {}
+
+		/*
+		 * The number of threads that scan directories. If it is greater than 1 then different directories
+		 * are listed and stat'ed in parallel, which hides the latency of network file systems.
+		 */
+		unsigned walkers;
+		// If true then the entries of each directory are visited in the order of their inode numbers.
+		bool sortByInode;
+		/*
+		 * If true then the entries of each directory are visited in the bytewise order of their names.
+		 * Takes precedence over sortByInode. It is set by the tools that need this order themselves.
+		 */
+		bool sortByName;
+		/*
+		 * The directory (relative to the root, without leading or trailing slashes) that is walked instead
+		 * of the whole tree. The paths reported are still relative to the root, so they match the DB. Not
+		 * used if subtreeSize is zero.
+		 */
+		const char *subtree;
+		std::size_t subtreeSize;
+	};
+
+	// Settings shared by all the tools that scan file systems.
+	struct ScanOptions
+	{
+		ScanOptions() noexcept : jobs(1), quick(false), samplePercent(0), mergeJoin(false), checkpointInterval(0),
+				resume(false), walk(), read() {}
+
+		/*
+		 * The number of threads that calculate digests of files while the file system is being scanned.
+		 * If it is 1 then digests are calculated by the scanning thread itself, unless there are several
+		 * walkers (see WalkOptions::walkers): a single hashing thread is used then, since the walkers report
+		 * files one at a time and would wait for each other while a file is being hashed.
+		 */
+		unsigned jobs;
+		/*
+		 * If true then regular files are compared with the DB by size and last modification time only.
+		 * Their digests are not calculated unless they are chosen by sampling.
+		 */
+		bool quick;
+		// The percentage of regular files (0..100) that are chosen randomly to be fully checked in the quick mode.
+		double samplePercent;
+		/*
+		 * If true then checkFileSystem() visits the entries of each directory in the order of their names
+		 * and merges them with the DB records read in the same order, instead of looking each entry up in
+		 * a hash map. It is used only if file names are in UTF-8 since other charsets order names differently.
+		 */
+		bool mergeJoin;
+		/*
+		 * If it is not zero then createDB() and checkFileSystem() record in the DB the directories they are
+		 * done with (see FileDB::beginCheckpoints()) and commit them at least this often (in seconds).
+		 */
+		unsigned checkpointInterval;
+		/*
+		 * If true then the walk that is recorded by the checkpoints in the DB is resumed: the directories
+		 * it is done with are skipped. Requires checkpointInterval to be set.
+		 */
+		bool resume;
+		WalkOptions walk;
+		ReadOptions read;
+	};
+
+	// Thrown by createDB() and checkFileSystem() if they are stopped by a signal (see handleInterruptions()).
+	class Interrupted : public std::runtime_error
+	{
+	public:
+		Interrupted() : std::runtime_error("Interrupted.") {}
+	};
+
+	/*
+	 * Makes SIGINT and SIGTERM stop createDB() and checkFileSystem() at the next file they come to, so that
+	 * they commit what they are done with and throw Interrupted. Repeating the signal terminates the process.
+	 */
+	void handleInterruptions();
+
+	/*
+	 * Adds the files of the tree to the DB. The files are committed in batches (see FileDB::beginBulkLoad()),
+	 * so the walk is recorded in the DB as a checkpoint even if options.checkpointInterval is zero, and it is
+	 * dropped only once the DB is complete. If the walk fails then the DB is left with the files committed
+	 * so far and the checkpoint which tells it is incomplete; create-db --resume completes it.
+	 */
+	void createDB(const char *rootDir, std::size_t rootDirSize, mirror::FileDB &db,
+			const ScanOptions &options = ScanOptions());
+
+	/*
+	 * Brings the DB in line with the file system. Digests are recalculated only for files that are
+	 * new or that have their size or last modification time changed. Entries that are no longer
+	 * in the file system are removed from the DB.
+	 */
+	void updateDB(const char *rootDir, std::size_t rootDirSize, mirror::FileDB &db,
+			const ScanOptions &options = ScanOptions());
 
 	template<typename MismatchHandler>
 	void checkFileSystem(const char *rootDir, std::size_t rootDirSize, mirror::FileDB &db,
-			MismatchHandler &mismatchHandler);
+			MismatchHandler &mismatchHandler, const ScanOptions &options = ScanOptions());
+
+	/*
+	 * Calculates the digests of the directories of the DB that have none (see FileDB::getDirDigest())
+	 * from the names, types, sizes and digests of their entries. Last modification times are left out
+	 * so that the mirrors which are made without keeping them have the same digests. Called by the tools
+	 * that change the DB once they are done, so only the directories changed and their ancestors are
+	 * read (see FileDB::getDirsWithoutDigest()); must be called within a transaction.
+	 */
+	void updateDirDigests(mirror::FileDB &db);
+
+	/*
+	 * Reports the differences between the DBs to the mismatch handler as if the tree the actual DB
+	 * describes were checked against the expected one. Only the subtrees whose digests differ are read,
+	 * so the DBs that are the same are compared in O(1). Neither DB is changed, so both must have their
+	 * digests already (see FileDB::hasDirDigests()); otherwise std::runtime_error is thrown. Last
+	 * modification times are not compared since they are not a part of the digests.
+	 */
+	template<typename MismatchHandler>
+	void compareDBs(mirror::FileDB &expected, mirror::FileDB &actual, MismatchHandler &mismatchHandler);
 
-	bool copyFile(int srcDirFd, int destDirFd, const char *relPath);
+	// Settings of watchDB().
+	struct WatchOptions
+	{
+		WatchOptions() noexcept : delay(2), rehashRate(0), fanotify(true), scan() {}
+
+		/*
+		 * The number of seconds changes are collected for once the first of them is reported, so that
+		 * a burst of changes causes a single rescan of each directory.
+		 */
+		unsigned delay;
+		// The number of bytes per second that are read at most to recalculate digests. Zero if unlimited.
+		std::uint64_t rehashRate;
+		// If false then inotify is used even if fanotify is available (see DirWatcher).
+		bool fanotify;
+		ScanOptions scan;
+	};
+
+	/*
+	 * Keeps the DB in line with the file system until SIGINT or SIGTERM is caught (see handleInterruptions()).
+	 * The DB is brought up to date by updateDB() first. Afterwards only the directories whose entries change
+	 * are rescanned, without descending into their subdirectories unless these are new. The directories
+	 * changed are rescanned in batches, each within a transaction. If file system events are lost then
+	 * the whole tree is updated again.
+	 */
+	void watchDB(const char *rootDir, std::size_t rootDirSize, mirror::FileDB &db,
+			const WatchOptions &options = WatchOptions());
+
+	/*
+	 * Copies the regular file. If copiedFileRecord is not null then the file is copied through memory
+	 * and the digest of the data copied is calculated on the way; the record is filled in with it and
+	 * with the size and the last modification time of the source file.
+	 */
+	bool copyFile(int srcDirFd, const char *srcRelPath, int destDirFd, const char *destRelPath,
+			mirror::FileRecord *copiedFileRecord = nullptr);
+
+	// Copies the regular file to the same path relative to the destination directory.
+	inline bool copyFile(const int srcDirFd, const int destDirFd, const char * const relPath,
+			mirror::FileRecord * const copiedFileRecord = nullptr)
+	{
+		return copyFile(srcDirFd, relPath, destDirFd, relPath, copiedFileRecord);
+	}
+	/*
+	 * Copies the directory tree. Directories are created by the calling thread. If copyWorkers is not null
+	 * then the regular files are queued to them rather than copied before this function returns; the
+	 * workers must be set up with srcDirFd and destDirFd.
+	 *
+	 * If hardLinker is not null then hard links to the files copied are recreated rather than the files
+	 * copied again. It must be set up with destDirFd, and the results of the copies queued must be passed
+	 * to it. If localSource is not null then the files are copied from the local files with the same
+	 * contents where possible. It must be set up with destDirFd, too.
+	 *
+	 * If failedCopies is not null then the number of files that are not copied or linked by the calling
+	 * thread is added to it. The failures of the copies queued are reported to the workers' callback.
+	 */
 	bool copyDir(int srcDirFd, const char *srcDir, std::size_t srcDirSize,
 			int destDirFd, const char *destDir, std::size_t destDirSize,
-			const char *relPath, std::size_t relPathSize);
+			const char *relPath, std::size_t relPathSize, mirror::CopyWorkers *copyWorkers = nullptr,
+			mirror::HardLinker *hardLinker = nullptr, mirror::LocalSource *localSource = nullptr,
+			std::size_t *failedCopies = nullptr);
 
 	namespace _helper
 	{
 		using afc::operator"" _s;
-		using afc::logger::logDebug;
+		using mirror::logger::logDebug;
 		using afc::logger::logError;
 
 		[[noreturn]]
@@ -63,59 +292,303 @@ namespace mirror
 		void handleReadDirError(int errorCode);
 
 		template<typename ChunkOp>
-		void processFile(int fd, const char * const path, ChunkOp &chunkOp);
+		void processFile(int fd, const char * const path, ChunkOp &chunkOp, const ReadOptions &options);
 
-		template<typename EventHandler>
-		inline DIR *startDirScanning(afc::FastStringBuffer<char> &path, std::size_t relPathOffset,
-				const int fd, EventHandler &eventHandler)
+		/*
+		 * Like processFile() but reads at most size bytes starting at the given offset with pread(),
+		 * so that different ranges of the file can be read at the same time.
+		 */
+		template<typename ChunkOp>
+		void processFileRange(int fd, off_t offset, std::uint64_t size, ChunkOp &chunkOp, const ReadOptions &options);
+
+		/*
+		 * Returns a page-aligned buffer of at least the given size that belongs to the calling thread.
+		 * The buffer is reused by subsequent calls made by the same thread.
+		 */
+		unsigned char *threadReadBuffer(std::size_t size);
+		/*
+		 * Makes the calling thread forget its buffer without freeing it, for the writes to it that are
+		 * still pending. The next call to threadReadBuffer() allocates another one.
+		 */
+		void abandonThreadReadBuffer() noexcept;
+
+		/*
+		 * A regular file or a directory that scanFiles() reports to the event handler. The file is opened
+		 * only when its descriptor is asked for, so that handlers which need nothing but the metadata do
+		 * not pay for opening it. The reference is valid only within the event handler call.
+		 */
+		class FileRef
 		{
-			logDebug("Scanning '"_s, path, "'..."_s);
+		public:
+			FileRef(const int dirFd, const char * const name) noexcept : m_dirFd(dirFd), m_name(name), m_fd(-1) {}
+			~FileRef()
+			{
+				if (m_fd != -1) {
+					// TODO handle error.
+					close(m_fd);
+				}
+			}
 
-			DIR * const dir = fdopendir(fd);
+			FileRef(const FileRef &) = delete;
+			FileRef(FileRef &&) = delete;
+			FileRef &operator=(const FileRef &) = delete;
+			FileRef &operator=(FileRef &&) = delete;
 
-			if (dir == nullptr) {
-				switch (errno) {
-				case EACCES:
-					// TODO make the behaviour configurable (ignorable).
-					logDebug("No access to '"_s, path, '\'');
-					throw errno;
-				case ENOENT:
-					logError("Directory not found: '"_s, path, '\'');
-					throw errno;
-				default:
-					// TODO handle error
-					throw errno;
+			// Opens the file if it is not opened yet. The descriptor remains owned by this reference.
+			int fd()
+			{
+				if (m_fd == -1) {
+					m_fd = open();
 				}
+				return m_fd;
 			}
 
-			eventHandler.dirStart(path, relPathOffset);
+			// Passes the ownership of the descriptor (the file is opened if needed) to the caller.
+			int release()
+			{
+				const int result = fd();
+				m_fd = -1;
+				return result;
+			}
+		private:
+			int open() const;
+
+			const int m_dirFd;
+			const char * const m_name;
+			int m_fd;
+		};
+
+		/*
+		 * Like fstatat() without AT_SYMLINK_NOFOLLOW but uses statx() where available, asking for the fields
+		 * mirror needs only and allowing file systems not to synchronise attributes with the server.
+		 * Returns zero on success and -1 on error with errno set.
+		 */
+		int statFile(int dirFd, const char *name, struct stat &dest);
+
+		// Lists the directory. The directory is closed if it cannot be read.
+		void listDir(const afc::FastStringBuffer<char> &path, int fd, DirListing &listing, DirOrder order);
+
+		/*
+		 * Fills in the metadata of the directory entry which is appended to path already. Returns false
+		 * if the entry is to be skipped.
+		 */
+		bool statDirEntry(int dirFd, const DirListing::Entry &entry, const char *name,
+				const afc::FastStringBuffer<char> &path, struct stat &dest);
+
+		inline DirOrder dirOrder(const WalkOptions &options) noexcept
+		{
+			return options.sortByName ? DirOrder::name : options.sortByInode ? DirOrder::inode : DirOrder::fileSystem;
+		}
+
+		template<typename EventHandler>
+		inline void startDirScanning(afc::FastStringBuffer<char> &path, const std::size_t relPathOffset,
+				const int fd, DirListing &listing, const DirOrder order, EventHandler &eventHandler,
+				typename EventHandler::DirCtx &dirCtx)
+		{
+			listDir(path, fd, listing, order);
+
+			eventHandler.dirStart(dirCtx, path, relPathOffset);
 
 			path.reserveForOne();
 			path.append('/');
-
-			return dir;
 		}
 
+		/*
+		 * Walks the directory tree, reporting regular files and directories (symbolic links to them are
+		 * followed) to the event handler:
+		 *
+		 *     void dirStart(DirCtx &ctx, FastStringBuffer<char> &path, std::size_t relDirOffset);
+		 *     void dirEnd(DirCtx &ctx, FastStringBuffer<char> &path, std::size_t relDirOffset);
+		 *     bool file(DirCtx &ctx, const struct stat &fileStat, FileRef &file,
+		 *             const FastStringBuffer<char> &path, std::size_t relPathOffset, std::size_t fileNameOffset);
+		 *
+		 * EventHandler::DirCtx is a default-constructible type that holds the state the handler needs for
+		 * a single directory. The walker creates one for each directory, passes it to dirStart(), to file()
+		 * for each entry of the directory and finally to dirEnd(); the handler must not keep directory state
+		 * anywhere else.
+		 *
+		 * For directories whose type is reported by the file system only st_mode is filled in. A directory
+		 * is entered only if file() returns true for it. Other types of files are skipped without being
+		 * opened.
+		 *
+		 * Each directory is listed in full before its entries are reported, in the order options define
+		 * (see dirOrder() and readDir()).
+		 *
+		 * With a single walker the tree is walked depth-first, so the directories are nested: all the
+		 * subdirectories of a directory are ended before the directory itself. Otherwise they are scanned
+		 * by options.walkers threads (see WalkScheduler) and a directory is ended as soon as its own entries
+		 * are reported, before its subdirectories are scanned. The handler calls for different directories
+		 * are interleaved then but never concurrent, so the handler need not be thread-safe.
+		 *
+		 * If options.subtreeSize is not zero then path must end with slash and options.subtree, which is
+		 * the part of path the relative paths reported start with.
+		 */
+		template<typename EventHandler>
+		void scanFiles(afc::FastStringBuffer<char> &path, EventHandler &eventHandler,
+				const WalkOptions &options = WalkOptions());
+
 		template<typename EventHandler>
-		void scanFiles(afc::FastStringBuffer<char> &path, EventHandler &eventHandler);
+		void scanFiles(afc::FastStringBuffer<char> &path, int dirFd, EventHandler &eventHandler,
+				const WalkOptions &options = WalkOptions());
 
 		template<typename EventHandler>
-		void scanFiles(afc::FastStringBuffer<char> &path, int dirFd, EventHandler &eventHandler);
+		void scanFilesInParallel(afc::FastStringBuffer<char> &path, int dirFd, EventHandler &eventHandler,
+				const WalkOptions &options);
 
 		template<typename EventHandler>
-		inline void scanFiles(const char * const rootDir, const std::size_t rootDirSize, EventHandler &eventHandler)
+		inline void scanFiles(const char * const rootDir, const std::size_t rootDirSize, EventHandler &eventHandler,
+				const WalkOptions &options = WalkOptions())
 		{
 			std::size_t normalisedSize = rootDirSize;
 			if (rootDir[rootDirSize - 1] == '/') {
 				--normalisedSize;
 			}
-			afc::FastStringBuffer<char> dirBuf(normalisedSize);
+			afc::FastStringBuffer<char> dirBuf(normalisedSize + 1 + options.subtreeSize);
 			dirBuf.append(rootDir, normalisedSize);
-			scanFiles(dirBuf, eventHandler);
+			if (options.subtreeSize != 0) {
+				dirBuf.append('/');
+				dirBuf.append(options.subtree, options.subtreeSize);
+			}
+			scanFiles(dirBuf, eventHandler, options);
 		}
 
+		/*
+		 * If digests is not null then the digest of a file with several hard links is taken from there
+		 * if it is calculated for another link already, and is stored there otherwise.
+		 */
 		void fillRegularFileRecord(const struct stat &fileStat, const int fd, const char * const filePath,
-				mirror::FileRecord &dest);
+				mirror::FileRecord &dest, const ReadOptions &options, mirror::DigestCache *digests = nullptr);
+		// Fills in everything but the digest.
+		void fillRegularFileMetadata(const struct stat &fileStat, mirror::FileRecord &dest) noexcept;
+
+		// Chooses randomly which files are to be fully checked in the quick mode.
+		class FileSampler
+		{
+		public:
+			explicit FileSampler(const double percent) : m_percent(percent), m_random(), m_distribution(0, 100)
+			{
+				if (percent > 0) {
+					m_random.seed(std::random_device()());
+				}
+			}
+
+			bool next()
+			{
+				return m_percent > 0 && m_distribution(m_random) < m_percent;
+			}
+		private:
+			const double m_percent;
+			std::mt19937_64 m_random;
+			std::uniform_real_distribution<double> m_distribution;
+		};
+
+		// Set by the signal handler that handleInterruptions() installs.
+		extern volatile std::sig_atomic_t interruptionRequested;
+
+		inline void checkInterruption()
+		{
+			if (interruptionRequested) {
+				throw Interrupted();
+			}
+		}
+
+		/*
+		 * Marks directories done in the DB once all the regular files (and events) of them that are submitted
+		 * to the hash pipeline are delivered, so that a checkpoint never covers a file whose result could be lost.
+		 */
+		class DirCheckpoints
+		{
+		public:
+			DirCheckpoints(mirror::FileDB &db, const bool enabled)
+					: m_db(db), m_enabled(enabled), m_submitted(0), m_delivered(0), m_pending() {}
+
+			bool enabled() const noexcept { return m_enabled; }
+
+			void fileSubmitted() noexcept { ++m_submitted; }
+
+			void fileDelivered()
+			{
+				++m_delivered;
+				while (!m_pending.empty() && m_pending.front().files <= m_delivered) {
+					const PendingDir &dir = m_pending.front();
+					m_db.markDirDone(dir.relDirU8.data(), dir.relDirU8.size(), dir.subtree);
+					m_pending.pop_front();
+				}
+			}
+
+			// The directory is marked done once the files submitted so far are delivered.
+			void dirDone(const char * const relDirU8, const std::size_t relDirSize, const bool subtree)
+			{
+				if (!m_enabled) {
+					return;
+				}
+				if (m_delivered == m_submitted) {
+					m_db.markDirDone(relDirU8, relDirSize, subtree);
+				} else {
+					m_pending.push_back(PendingDir{m_submitted, std::string(relDirU8, relDirSize), subtree});
+				}
+			}
+		private:
+			struct PendingDir
+			{
+				std::uint64_t files;
+				std::string relDirU8;
+				bool subtree;
+			};
+
+			mirror::FileDB &m_db;
+			const bool m_enabled;
+			std::uint64_t m_submitted;
+			std::uint64_t m_delivered;
+			std::deque<PendingDir> m_pending;
+		};
+
+		// Writes all n bytes at the given offset, retrying after short writes. Returns false on error.
+		bool writeFully(int fd, const unsigned char *buf, std::size_t n, off_t offset);
+
+		/*
+		 * Copies the contents of the source file into the empty destination one. Tries in turn reflinking
+		 * (FICLONE), copy_file_range(), sendfile() and falls back to copying through a buffer. Returns false
+		 * on error.
+		 *
+		 * If crc64 is not null then the data is always copied through the buffer and its digest is
+		 * calculated while it is copied.
+		 */
+		bool copyFileData(int srcFd, int destFd, std::uint_fast64_t *crc64 = nullptr);
+
+		void storeCRC64(std::uint_fast64_t crc64, unsigned char (&dest)[sizeof(mirror::FileRecord::crc64)]) noexcept;
+
+		// The number of hashing tasks each worker can have queued before the scanning thread waits for them.
+		constexpr std::size_t pendingTasksPerJob = 64;
+		/*
+		 * The number of file descriptors that are not given to the pending hashing tasks (see maxPendingTasks())
+		 * but are left for the directories being walked, the DB, the copies and the like.
+		 */
+		constexpr std::size_t reservedDescriptors = 128;
+
+		/*
+		 * The number of hashing tasks that can be pending at a time for the given number of workers. Each of
+		 * them holds an open file so they are limited by RLIMIT_NOFILE less reservedDescriptors, too.
+		 */
+		std::size_t maxPendingTasks(unsigned jobs);
+
+		template<typename Payload>
+		inline std::unique_ptr<HashPipeline<Payload>> createHashPipeline(const ScanOptions &options)
+		{
+			std::unique_ptr<HashPipeline<Payload>> result;
+			// The walkers call the event handlers one at a time, so files are never hashed by the walkers themselves.
+			const bool parallelWalk = options.walk.walkers > 1;
+#ifdef MIRROR_IO_URING
+			// Even a single worker keeps many reads in flight with io_uring.
+			const bool pipelined = options.jobs > 1 || parallelWalk || ioUringSupported();
+#else
+			const bool pipelined = options.jobs > 1 || parallelWalk;
+#endif
+			if (pipelined) {
+				result.reset(new HashPipeline<Payload>(options.jobs, maxPendingTasks(options.jobs), options.read));
+			}
+			return result;
+		}
 	}
 
 	struct RelPathView
@@ -130,9 +603,18 @@ namespace mirror
 		std::size_t fileSize;
 	};
 
+	/*
+	 * A mismatch handler is notified by checkFileSystem() of every discrepancy between the DB and
+	 * the file system:
+	 * - fileNotFound(type, path, pathSize, expectedFileRecord) for DB entries missing from the file system;
+	 * - newFileFound(type, path, pathSize) for file system entries missing from the DB;
+	 * - checkFileMismatch(path, pathSize, expectedFileRecord, actualFileRecord) for entries found in both.
+	 * Paths are relative to the root directory and are in the system encoding.
+	 */
 	struct VerifyDirMismatchHandler
 	{
-		void fileNotFound(const mirror::FileType type, const char * const path, const std::size_t pathSize)
+		void fileNotFound(const mirror::FileType type, const char * const path, const std::size_t pathSize,
+				const mirror::FileRecord &expectedFileRecord)
 		{
 			using afc::operator"" _s;
 			afc::logger::logError(type, " not found in the file system: '"_s,
@@ -194,12 +676,163 @@ namespace mirror
 		}
 	};
 
+	/*
+	 * Reports the discrepancies found by checkFileSystem() as a stream of JSON objects, one per line, to be
+	 * processed by other tools. Paths are in UTF-8. Each object has the member "event", which is one of:
+	 *
+	 *     {"event":"missing","type":"file","path":"a/b"}
+	 *     {"event":"new","type":"dir","path":"a/c"}
+	 *     {"event":"mismatch","path":"a/d","db":{"size":1,"mtime":1500000000000,"crc64":"00ff..."},"fs":{...}}
+	 *
+	 * A mismatch lists only the properties that differ: either "type", or any of "size", "mtime"
+	 * (milliseconds since the epoch) and "crc64" (the digest bytes in hex).
+	 */
+	struct ReportMismatchHandler
+	{
+		explicit ReportMismatchHandler(mirror::ReportWriter &writer) : writer(writer), textBuf() {}
+
+		void fileNotFound(const mirror::FileType type, const char * const path, const std::size_t pathSize,
+				const mirror::FileRecord &expectedFileRecord)
+		{
+			using afc::operator"" _s;
+
+			constexpr auto head = "{\"event\":\"missing\",\"type\":"_s;
+			writer.append(head.value(), head.size());
+			appendType(type);
+			appendPath(path, pathSize);
+			writer.append("}\n", 2);
+		}
+
+		void newFileFound(const mirror::FileType type, const char * const path, const std::size_t pathSize)
+		{
+			using afc::operator"" _s;
+
+			constexpr auto head = "{\"event\":\"new\",\"type\":"_s;
+			writer.append(head.value(), head.size());
+			appendType(type);
+			appendPath(path, pathSize);
+			writer.append("}\n", 2);
+		}
+
+		bool checkFileMismatch(const char * const path, const std::size_t pathSize,
+				const mirror::FileRecord expectedFileRecord, const mirror::FileRecord actualFileRecord)
+		{
+			using afc::operator"" _s;
+
+			const bool typeMismatch = expectedFileRecord.type != actualFileRecord.type;
+			bool sizeMismatch = false;
+			bool lastModMismatch = false;
+			bool digestMismatch = false;
+			if (!typeMismatch && actualFileRecord.type == mirror::FileType::file) {
+				sizeMismatch = expectedFileRecord.fileSize != actualFileRecord.fileSize;
+				lastModMismatch =
+						expectedFileRecord.lastModifiedTS.millis() != actualFileRecord.lastModifiedTS.millis();
+				digestMismatch = !std::equal(actualFileRecord.crc64,
+						actualFileRecord.crc64 + sizeof(actualFileRecord.crc64), expectedFileRecord.crc64);
+			}
+
+			if (!typeMismatch && !sizeMismatch && !lastModMismatch && !digestMismatch) {
+				return true;
+			}
+
+			constexpr auto head = "{\"event\":\"mismatch\""_s;
+			writer.append(head.value(), head.size());
+			appendPath(path, pathSize);
+			writer.append(",\"db\":", 6);
+			appendRecord(expectedFileRecord, typeMismatch, sizeMismatch, lastModMismatch, digestMismatch);
+			writer.append(",\"fs\":", 6);
+			appendRecord(actualFileRecord, typeMismatch, sizeMismatch, lastModMismatch, digestMismatch);
+			writer.append("}\n", 2);
+
+			return false;
+		}
+	private:
+		void appendType(const mirror::FileType type)
+		{
+			using afc::operator"" _s;
+
+			constexpr auto file = "\"file\""_s;
+			constexpr auto dir = "\"dir\""_s;
+			if (type == mirror::FileType::file) {
+				writer.append(file.value(), file.size());
+			} else {
+				writer.append(dir.value(), dir.size());
+			}
+		}
+
+		void appendPath(const char * const path, const std::size_t pathSize)
+		{
+			const TextView pathU8 = mirror::toUtf8(path, pathSize, textBuf);
+			writer.append(",\"path\":", 8);
+			writer.appendJsonString(pathU8.value, pathU8.size);
+		}
+
+		void appendRecord(const mirror::FileRecord &record, const bool type, const bool size, const bool lastMod,
+				const bool digest)
+		{
+			static const char hexDigits[] = "0123456789abcdef";
+
+			char separator = '{';
+			if (type) {
+				writer.append(separator);
+				writer.append("\"type\":", 7);
+				appendType(record.type);
+				separator = ',';
+			}
+			if (size) {
+				writer.append(separator);
+				writer.append("\"size\":", 7);
+				writer.appendNumber(record.fileSize);
+				separator = ',';
+			}
+			if (lastMod) {
+				writer.append(separator);
+				writer.append("\"mtime\":", 8);
+				writer.appendNumber(record.lastModifiedTS.millis());
+				separator = ',';
+			}
+			if (digest) {
+				writer.append(separator);
+				writer.append("\"crc64\":\"", 9);
+				char * const dest = writer.reserve(2 * sizeof(record.crc64) + 1);
+				char *p = dest;
+				for (const unsigned char b : record.crc64) {
+					*p++ = hexDigits[b >> 4];
+					*p++ = hexDigits[b & 0xf];
+				}
+				*p++ = '"';
+				writer.commit(p);
+			}
+			writer.append('}');
+		}
+
+		mirror::ReportWriter &writer;
+		std::string textBuf;
+	};
+
 	struct MergeDirMismatchHandler
 	{
+		/*
+		 * If verifyCopies is true then the digest of each file copied is calculated while the data is copied
+		 * and is checked against the DB.
+		 *
+		 * Files are copied by copyJobs workers in the background while the destination is being checked.
+		 * finish() must be called once the check is over to wait for the copies and to report failures.
+		 *
+		 * If hardLinks is true then the files of the source that are hard links to the same file are
+		 * copied once and linked to each other in the destination.
+		 *
+		 * If localDB is not null then the files missing are made from the files of the destination with
+		 * the same contents where possible (see LocalSource), with the DB to look the contents up in. The
+		 * files are copied once the check is over then, since their local copies can be found anywhere in
+		 * the destination.
+		 */
 		MergeDirMismatchHandler(const char * const srcDirRef, const std::size_t srcDirSize,
-				const char * const destDirRef, const std::size_t destDirSize) :
+				const char * const destDirRef, const std::size_t destDirSize, const bool verifyCopies = false,
+				const unsigned copyJobs = 1, const bool hardLinks = false, mirror::FileDB * const localDB = nullptr) :
 						srcDirRef(srcDirRef), srcDirSize(srcDirSize),
-						destDirRef(destDirRef), destDirSize(destDirSize)
+						destDirRef(destDirRef), destDirSize(destDirSize), verifyCopies(verifyCopies),
+						failedCopies(0), localCopies(0), missingFiles()
 		{
 			// TODO avoid copying relpath into a buffer
 			srcDirFd = open(std::string(srcDirRef, srcDirSize).c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
@@ -212,36 +845,47 @@ namespace mirror
 				closeDir(srcDirRef, srcDirSize, srcDirFd);
 				// TODO handle error
 			}
+			copyWorkers.reset(new mirror::CopyWorkers(srcDirFd, destDirFd, copyJobs,
+					[this](mirror::CopyTask &task) { copyDone(task); }));
+			if (hardLinks) {
+				hardLinker.reset(new mirror::HardLinker(destDirFd));
+			}
+			if (localDB != nullptr) {
+				localDB->beginContentLookups();
+				localSource.reset(new mirror::LocalSource(*localDB, destDirFd));
+			}
 		}
 
 		~MergeDirMismatchHandler()
 		{
+			// The workers refer to the directories.
+			copyWorkers.reset();
 			closeDir(destDirRef, destDirSize, destDirFd);
 			closeDir(srcDirRef, srcDirSize, srcDirFd);
 		}
 
-		void fileNotFound(const mirror::FileType type, const char * const path, const std::size_t pathSize)
+		void fileNotFound(const mirror::FileType type, const char * const path, const std::size_t pathSize,
+				const mirror::FileRecord &expectedFileRecord)
 		{
 			using afc::operator"" _s;
 
 			// TODO Add verbose info logging
 			switch (type) {
 			case mirror::FileType::file:
-				afc::logger::logError(type, " not found in the destination file system: '"_s,
-										std::make_pair(path, path + pathSize), "'!"_s);
-				afc::logger::logDebug("Copying '", std::make_pair(path, path + pathSize), "'..."_s);
-				// TODO avoid copying relpath into a buffer
-				mirror::copyFile(srcDirFd, destDirFd, std::string(path, pathSize).c_str());
-				return;
 			case mirror::FileType::dir:
 				afc::logger::logError(type, " not found in the destination file system: '"_s,
 										std::make_pair(path, path + pathSize), "'!"_s);
-				afc::logger::logDebug("Copying directory '", std::make_pair(path, path + pathSize), "'..."_s);
-				mirror::copyDir(srcDirFd, srcDirRef, srcDirSize, destDirFd, destDirRef, destDirSize, path, pathSize);
-				return;
+				break;
 			default:
 				assert(false);
 			}
+
+			if (localSource) {
+				// Local copies are looked for once all the new files of the destination are known.
+				missingFiles.push_back(MissingFile{type, std::string(path, pathSize), expectedFileRecord});
+				return;
+			}
+			copyMissingFile(type, path, pathSize, expectedFileRecord);
 		}
 
 		void newFileFound(const mirror::FileType type, const char * const path, const std::size_t pathSize)
@@ -251,6 +895,13 @@ namespace mirror
 			// TODO think of adding an option to wipe new files out.
 			afc::logger::logError("New "_s, type == mirror::FileType::file ? "file"_s : "dir"_s,
 					" found in the destination file system: '"_s, std::make_pair(path, path + pathSize), "'!"_s);
+			if (localSource) {
+				if (type == mirror::FileType::file) {
+					localSource->addCandidate(path, pathSize);
+				} else {
+					localSource->addCandidateDir(path, pathSize);
+				}
+			}
 		}
 
 		bool checkFileMismatch(const char * const path, const std::size_t pathSize,
@@ -259,7 +910,135 @@ namespace mirror
 			// TODO implement me
 			return true;
 		}
+
+		// Waits for the copies queued and reports the files that could not be copied. Returns false if there are any.
+		bool finish()
+		{
+			using afc::operator"" _s;
+
+			for (const MissingFile &file : missingFiles) {
+				copyMissingFile(file.type, file.path.data(), file.path.size(), file.expectedFileRecord);
+			}
+			missingFiles.clear();
+
+			copyWorkers->finish();
+			if (localCopies != 0) {
+				mirror::logger::logDebug("Files copied within the destination: "_s, localCopies, '.');
+			}
+			if (failedCopies != 0) {
+				afc::logger::logError("Files failed to be copied: "_s, failedCopies, '.');
+			}
+			return failedCopies == 0;
+		}
 	private:
+		// A file or a directory reported missing which is copied by finish().
+		struct MissingFile
+		{
+			mirror::FileType type;
+			std::string path;
+			mirror::FileRecord expectedFileRecord;
+		};
+
+		void copyMissingFile(const mirror::FileType type, const char * const path, const std::size_t pathSize,
+				const mirror::FileRecord &expectedFileRecord)
+		{
+			using afc::operator"" _s;
+
+			if (type == mirror::FileType::dir) {
+				mirror::logger::logDebug("Copying directory '", std::make_pair(path, path + pathSize), "'..."_s);
+				mirror::copyDir(srcDirFd, srcDirRef, srcDirSize, destDirFd, destDirRef, destDirSize, path, pathSize,
+						copyWorkers.get(), hardLinker.get(), localSource.get(), &failedCopies);
+				return;
+			}
+
+			std::unique_ptr<mirror::CopyTask> task(new mirror::CopyTask(path, pathSize,
+					static_cast<std::uint64_t>(expectedFileRecord.fileSize)));
+			if (hardLinker && !linkFile(*task)) {
+				return;
+			}
+			if (localSource && localSource->copy(path, pathSize, expectedFileRecord)) {
+				++localCopies;
+				if (task->srcInode.valid()) {
+					failedCopies += hardLinker->copyDone(task->srcInode, true);
+				}
+				return;
+			}
+			mirror::logger::logDebug("Copying '", std::make_pair(path, path + pathSize), "'..."_s);
+			task->verify = verifyCopies;
+			task->expectedFileRecord = expectedFileRecord;
+			copyWorkers->submit(std::move(task));
+		}
+
+		void copyDone(const mirror::CopyTask &task)
+		{
+			using afc::operator"" _s;
+
+			const char * const path = task.relPath.data();
+			const std::size_t pathSize = task.relPath.size();
+			bool matched = true;
+			if (!task.success) {
+				// TODO report the cause of the error.
+				afc::logger::logError("Unable to copy the file '"_s, std::make_pair(path, path + pathSize), "'!"_s);
+				++failedCopies;
+			} else if (task.verify && !checkCopy(path, pathSize, task.expectedFileRecord, task.copiedFileRecord)) {
+				++failedCopies;
+				matched = false;
+			}
+			if (task.srcInode.valid()) {
+				// The links are not made to a copy that does not match the DB.
+				failedCopies += hardLinker->copyDone(task.srcInode, task.success && matched);
+			}
+		}
+
+		// Returns true if the file of the task is to be copied rather than linked to a copy made already.
+		bool linkFile(mirror::CopyTask &task)
+		{
+			struct stat srcStat;
+			if (mirror::_helper::statFile(srcDirFd, task.relPath.c_str(), srcStat) != 0) {
+				// The copy fails and is reported.
+				return true;
+			}
+			switch (hardLinker->link(srcStat, task.relPath.data(), task.relPath.size())) {
+			case mirror::HardLinker::LinkResult::linked:
+				return false;
+			case mirror::HardLinker::LinkResult::firstLink:
+				task.srcInode = mirror::InodeKey(srcStat);
+				return true;
+			default:
+				return true;
+			}
+		}
+
+		/*
+		 * Returns false if the copy does not match the DB. The copy is not touched then since it is the source
+		 * that is to be blamed.
+		 */
+		static bool checkCopy(const char * const path, const std::size_t pathSize,
+				const mirror::FileRecord &expectedFileRecord, const mirror::FileRecord &copiedFileRecord)
+		{
+			using afc::operator"" _s;
+			using CRC64View = afc::logger::HexEncodedN<sizeof(mirror::FileRecord::crc64)>;
+			using afc::logger::logError;
+
+			const bool sizeMismatch = expectedFileRecord.fileSize != copiedFileRecord.fileSize;
+			const bool digestMismatch = !std::equal(copiedFileRecord.crc64,
+					copiedFileRecord.crc64 + sizeof(copiedFileRecord.crc64), expectedFileRecord.crc64);
+
+			if (sizeMismatch || digestMismatch) {
+				logError("Mismatch for the copied file '"_s, std::make_pair(path, path + pathSize), "':"_s);
+				if (sizeMismatch) {
+					logError("\tDB size: "_s, expectedFileRecord.fileSize,
+							"\n\tCopied size: "_s, copiedFileRecord.fileSize);
+				}
+				if (digestMismatch) {
+					logError("\tDB CRC64 digest: '"_s, CRC64View(expectedFileRecord.crc64),
+							"'\n\tCopied CRC64 digest: '"_s, CRC64View(copiedFileRecord.crc64), '\'');
+				}
+				return false;
+			}
+			return true;
+		}
+
 		static void closeDir(const char * const path, const std::size_t pathSize, const int fd)
 		{
 			using afc::operator"" _s;
@@ -278,6 +1057,16 @@ namespace mirror
 		std::size_t destDirSize;
 		int srcDirFd;
 		int destDirFd;
+		bool verifyCopies;
+		std::size_t failedCopies;
+		std::size_t localCopies;
+		// Deferred until finish() if local copies are looked for.
+		std::vector<MissingFile> missingFiles;
+		std::unique_ptr<mirror::CopyWorkers> copyWorkers;
+		// Null unless hard links are recreated.
+		std::unique_ptr<mirror::HardLinker> hardLinker;
+		// Null unless files are copied from the destination itself where possible.
+		std::unique_ptr<mirror::LocalSource> localSource;
 	};
 
 	// TODO make logging readable (especially make paths absolute and relative to src and dest parent dirs)
@@ -285,8 +1074,11 @@ namespace mirror
 	{
 		// TODO don't use srcDirFd
 		CopyDirHandler(const int dirToCopyFd, const int destDirFd, const char * const relPath,
-				const std::size_t relPathSize) : srcFd(dirToCopyFd), destFd(-1), destDirFd(destDirFd),
-						destPath(relPath), destPathSize(relPathSize) {}
+				const std::size_t relPathSize, mirror::CopyWorkers * const copyWorkers,
+				mirror::HardLinker * const hardLinker, mirror::LocalSource * const localSource)
+				: srcFd(dirToCopyFd), destFd(-1), destDirFd(destDirFd), destPath(relPath), destPathSize(relPathSize),
+				  copyWorkers(copyWorkers), hardLinker(hardLinker), localSource(localSource), failedCopies(0),
+				  destRelPath() {}
 
 		~CopyDirHandler() = default;
 
@@ -295,10 +1087,12 @@ namespace mirror
 		CopyDirHandler &operator=(const CopyDirHandler &) = delete;
 		CopyDirHandler &operator=(CopyDirHandler &&) = delete;
 
+		struct DirCtx {};
+
 		// TODO calculate active dir fd to avoid recalc of the dest dir repeatedly.
-		void dirStart(afc::FastStringBuffer<char> &path, const std::size_t relDirOffset)
+		void dirStart(DirCtx &, afc::FastStringBuffer<char> &path, const std::size_t relDirOffset)
 		{
-			using afc::logger::logDebug;
+			using mirror::logger::logDebug;
 			using afc::operator"" _s;
 
 			// Ensuring also that the string is terminated with '\0'.
@@ -326,9 +1120,9 @@ namespace mirror
 			}
 		}
 
-		void dirEnd(afc::FastStringBuffer<char> &path, const std::size_t relDirOffset)
+		void dirEnd(DirCtx &, afc::FastStringBuffer<char> &path, const std::size_t relDirOffset)
 		{
-			using afc::logger::logDebug;
+			using mirror::logger::logDebug;
 			using afc::operator"" _s;
 
 			const char * const relDir = path.begin() + relDirOffset;
@@ -337,10 +1131,11 @@ namespace mirror
 		}
 
 		// TODO support symbolic links.
-		bool file(const struct stat &fileStat, const int fd, const afc::FastStringBuffer<char> &path,
-				const std::size_t relPathOffset, const std::size_t fileNameOffset)
+		bool file(DirCtx &, const struct stat &fileStat, mirror::_helper::FileRef &fileRef,
+				const afc::FastStringBuffer<char> &path, const std::size_t relPathOffset,
+				const std::size_t fileNameOffset)
 		{
-			using afc::logger::logDebug;
+			using mirror::logger::logDebug;
 			using afc::operator"" _s;
 
 			assert(S_ISREG(fileStat.st_mode) || S_ISDIR(fileStat.st_mode));
@@ -353,9 +1148,53 @@ namespace mirror
 			// Ensuring also that the string is terminated with '\0'.
 			const char * const relPath = path.c_str() + relPathOffset;
 
+			const std::size_t relPathSize = path.end() - relPath;
+			if (hardLinker != nullptr || localSource != nullptr) {
+				// Both resolve paths against the directory copyDir() is called with.
+				destRelPath.assign(destPath, destPathSize);
+				destRelPath += '/';
+				destRelPath.append(relPath, relPathSize);
+			}
+			mirror::HardLinker::LinkResult linkResult = mirror::HardLinker::LinkResult::notLinked;
+			if (hardLinker != nullptr) {
+				linkResult = hardLinker->link(fileStat, destRelPath.data(), destRelPath.size());
+				if (linkResult == mirror::HardLinker::LinkResult::linked) {
+					return true;
+				}
+			}
+			if (localSource != nullptr && localSource->copy(destRelPath.data(), destRelPath.size(), fileStat)) {
+				if (linkResult == mirror::HardLinker::LinkResult::firstLink) {
+					failedCopies += hardLinker->copyDone(mirror::InodeKey(fileStat), true);
+				}
+				return true;
+			}
+
 			logDebug("Copying the file '"_s, std::make_pair(relPath, path.end()), "'..."_s);
 
-			return mirror::copyFile(srcFd, destFd, relPath);
+			if (copyWorkers == nullptr) {
+				const bool success = mirror::copyFile(srcFd, destFd, relPath);
+				if (!success) {
+					// TODO report the cause of the error.
+					afc::logger::logError("Unable to copy the file '"_s, std::make_pair(relPath, path.end()), "'!"_s);
+					++failedCopies;
+				}
+				if (linkResult == mirror::HardLinker::LinkResult::firstLink) {
+					failedCopies += hardLinker->copyDone(mirror::InodeKey(fileStat), success);
+				}
+				return success;
+			}
+
+			// The workers resolve paths against the directories copyDir() is called with.
+			std::unique_ptr<mirror::CopyTask> task(new mirror::CopyTask(destPath, destPathSize,
+					static_cast<std::uint64_t>(fileStat.st_size)));
+			task->relPath.reserve(destPathSize + 1 + relPathSize);
+			task->relPath += '/';
+			task->relPath.append(relPath, relPathSize);
+			if (linkResult == mirror::HardLinker::LinkResult::firstLink) {
+				task->srcInode = mirror::InodeKey(fileStat);
+			}
+			copyWorkers->submit(std::move(task));
+			return true;
 		}
 
 		int srcFd;
@@ -363,6 +1202,13 @@ namespace mirror
 		int destDirFd;
 		const char *destPath;
 		std::size_t destPathSize;
+		mirror::CopyWorkers *copyWorkers;
+		mirror::HardLinker *hardLinker;
+		mirror::LocalSource *localSource;
+		// The files that are not copied or linked by this handler itself.
+		std::size_t failedCopies;
+		// Shared by all the files since the handler is never called concurrently.
+		std::string destRelPath;
 	};
 }
 
@@ -387,130 +1233,582 @@ namespace afc
 
 template<typename MismatchHandler>
 void mirror::checkFileSystem(const char * const rootDir, const std::size_t rootDirSize, mirror::FileDB &db,
-		MismatchHandler &mismatchHandler)
+		MismatchHandler &mismatchHandler, const ScanOptions &options)
 {
 	using afc::operator"" _s;
-	using afc::logger::logDebug;
+	using mirror::logger::logDebug;
 
-	struct EventHandler
+	/*
+	 * An event for the mismatch handler that is delivered by the hash pipeline, so that the events are
+	 * reported in the order of the walk even though the digests of regular files are calculated later.
+	 */
+	struct PendingEvent
 	{
-		EventHandler(mirror::FileDB &db, MismatchHandler &mismatchHandler)
-				: dbDirs(), ctxs(), dbRef(db), handler(mismatchHandler) { db.getDirs(dbDirs); }
+		enum class Kind { check, fileNotFound, newFileFound };
+
+		PendingEvent(const Kind kind, const char * const relPath, const std::size_t relPathSize,
+				const mirror::FileRecord &expected)
+				: kind(kind), relPath(relPath, relPathSize), expectedFileRecord(expected) {}
 
-		void dirStart(afc::FastStringBuffer<char> &path, const std::size_t relDirOffset)
+		Kind kind;
+		std::string relPath;
+		// Not used for new files.
+		mirror::FileRecord expectedFileRecord;
+	};
+
+	struct CheckOp
+	{
+		void operator()(PendingEvent &event, const mirror::FileRecord &actualFileRecord)
+		{
+			const char * const path = event.relPath.data();
+			const std::size_t pathSize = event.relPath.size();
+			switch (event.kind) {
+			case PendingEvent::Kind::check:
+				handler.checkFileMismatch(path, pathSize, event.expectedFileRecord, actualFileRecord);
+				break;
+			case PendingEvent::Kind::fileNotFound:
+				handler.fileNotFound(event.expectedFileRecord.type, path, pathSize, event.expectedFileRecord);
+				break;
+			case PendingEvent::Kind::newFileFound:
+				handler.newFileFound(actualFileRecord.type, path, pathSize);
+				break;
+			}
+			checkpoints.fileDelivered();
+		}
+
+		MismatchHandler &handler;
+		mirror::_helper::DirCheckpoints &checkpoints;
+	};
+
+	struct EventHandler
+	{
+		EventHandler(mirror::FileDB &db, MismatchHandler &mismatchHandler, const ScanOptions &options,
+				const bool mergeJoin, const bool resumed)
+				: dbRef(db), handler(mismatchHandler), checkpoints(db, options.checkpointInterval != 0),
+				  checkOp{mismatchHandler, checkpoints},
+				  pipeline(mirror::_helper::createHashPipeline<PendingEvent>(options)), quick(options.quick),
+				  mergeJoin(mergeJoin), resumed(resumed), subtrees(options.walk.walkers <= 1),
+				  sampler(options.samplePercent), readOptions(options.read), digests(), textBuf() {}
+
+		struct DirCtx
+		{
+			DirCtx() : files(), sortedFiles(), next(0), missing(), relDirU8(), done(false) {}
+
+			// The DB records of the files of the directory that are not found in the file system yet.
+			mirror::DirFileMap files;
+			/*
+			 * All the DB records of the directory if they are merged with the file system entries. The ones
+			 * before next are either matched or listed in missing.
+			 */
+			mirror::SortedDirFiles sortedFiles;
+			std::size_t next;
+			std::vector<std::size_t> missing;
+			// Kept only if the directories done are recorded.
+			std::string relDirU8;
+			// True if the directory is checked by the walk resumed.
+			bool done;
+		};
+
+		void dirStart(DirCtx &ctx, afc::FastStringBuffer<char> &path, const std::size_t relDirOffset)
 		{
 			const char * const relDir = path.begin() + relDirOffset;
 			logDebug("Entering '"_s, std::pair<const char *, const char *>(relDir, path.end()), "'..."_s);
 
-			const TextHolder relDirU8 = mirror::convertToUtf8(relDir, path.size() - relDirOffset);
+			mirror::_helper::checkInterruption();
+
+			const TextView relDirU8 = mirror::toUtf8(relDir, path.size() - relDirOffset, textBuf);
 
-			dbDirs.erase(PathKey(relDirU8.value, relDirU8.size, true));
+			dbRef.markDirVisited(relDirU8.value, relDirU8.size);
 
-			ctxs.emplace();
-			dbRef.getFiles(relDirU8.value, relDirU8.size, ctxs.top());
+			if (checkpoints.enabled()) {
+				ctx.relDirU8.assign(relDirU8.value, relDirU8.size);
+			}
+			if (resumed && dbRef.getDirProgress(relDirU8.value, relDirU8.size) != mirror::FileDB::DirProgress::none) {
+				ctx.done = true;
+				return;
+			}
+
+			if (mergeJoin) {
+				dbRef.getFiles(relDirU8.value, relDirU8.size, ctx.sortedFiles);
+			} else {
+				dbRef.getFiles(relDirU8.value, relDirU8.size, ctx.files);
+			}
 		}
 
-		void dirEnd(afc::FastStringBuffer<char> &path, const std::size_t relDirOffset)
+		void dirEnd(DirCtx &ctx, afc::FastStringBuffer<char> &path, const std::size_t relDirOffset)
 		{
-			const auto &ctx = ctxs.top();
-			if (!ctx.empty()) {
-				const std::size_t pathSize = path.size();
-
-				if (pathSize == 0) {
-					path.reserveForOne();
-					path.append('/');
-				}
+			reportMissingFiles(ctx, path, relDirOffset);
+			// The single walker leaves a directory only after all its subdirectories.
+			checkpoints.dirDone(ctx.relDirU8.data(), ctx.relDirU8.size(), subtrees);
+		}
 
-				for (auto &e : ctx) {
-					const TextHolder buf = mirror::convertFromUtf8(e.first.data, e.first.size);
-					path.reserve(path.size() + buf.size);
-					path.append(buf.value, buf.size);
+		void reportMissingFiles(DirCtx &ctx, afc::FastStringBuffer<char> &path, const std::size_t relDirOffset)
+		{
+			const std::vector<mirror::SortedDirFiles::Entry> &sortedFiles = ctx.sortedFiles.entries;
+			if (ctx.files.empty() && ctx.missing.empty() && ctx.next == sortedFiles.size()) {
+				return;
+			}
 
-					const char * const relPath = path.data() + relDirOffset;
-					handler.fileNotFound(e.second.type, relPath, path.end() - relPath);
+			const std::size_t pathSize = path.size();
 
-					path.resize(path.size() - buf.size);
-				}
+			if (pathSize == 0) {
+				path.reserveForOne();
+				path.append('/');
+			}
 
-				path.resize(pathSize);
+			for (auto &e : ctx.files) {
+				fileNotFound(path, relDirOffset, e.first.data, e.first.size, e.second);
 			}
-			ctxs.pop();
+			for (const std::size_t i : ctx.missing) {
+				fileNotFound(path, relDirOffset, sortedFiles[i].nameU8, sortedFiles[i].nameSize, sortedFiles[i].record);
+			}
+			for (std::size_t i = ctx.next; i < sortedFiles.size(); ++i) {
+				fileNotFound(path, relDirOffset, sortedFiles[i].nameU8, sortedFiles[i].nameSize, sortedFiles[i].record);
+			}
+
+			path.resize(pathSize);
 		}
 
-		bool file(const struct stat &fileStat, const int fd, const afc::FastStringBuffer<char> &path,
-				const std::size_t relPathOffset, const std::size_t fileNameOffset)
+		bool file(DirCtx &ctx, const struct stat &fileStat, mirror::_helper::FileRef &fileRef,
+				const afc::FastStringBuffer<char> &path, const std::size_t relPathOffset,
+				const std::size_t fileNameOffset)
 		{
 			assert(S_ISREG(fileStat.st_mode) || S_ISDIR(fileStat.st_mode));
 
+			mirror::_helper::checkInterruption();
+
 			const char * const relPath = path.begin() + relPathOffset;
 
+			if (ctx.done) {
+				return S_ISDIR(fileStat.st_mode) && !isSubtreeDone(relPath, path.end());
+			}
+
 			logDebug("Checking the file '"_s, std::make_pair(relPath, path.end()), "'..."_s);
 
 			const char * const fileName = path.begin() + fileNameOffset;
 			const std::size_t fileNameSize = path.size() - fileNameOffset;
 
-			const TextHolder buf = mirror::convertToUtf8(fileName, fileNameSize);
-			const auto dbEntry = ctxs.top().find(PathKey(buf.value, buf.size, true));
+			if (mergeJoin) {
+				const mirror::FileRecord * const expectedFileRecord = mergeFile(ctx, fileName, fileNameSize);
+				if (expectedFileRecord == nullptr) {
+					return newFileFound(fileStat, path, relPath);
+				}
+				return check(fileStat, fileRef, path, relPath, *expectedFileRecord) &&
+						!isSubtreeDone(relPath, path.end());
+			}
 
-			if (dbEntry == ctxs.top().end()) {
-				const FileType type = S_ISDIR(fileStat.st_mode) ? FileType::dir : FileType::file;
-				handler.newFileFound(type, relPath, path.end() - relPath);
+			const TextView fileNameU8 = mirror::toUtf8(fileName, fileNameSize, textBuf);
+			const auto dbEntry = ctx.files.find(PathKey(fileNameU8.value, fileNameU8.size, true));
+
+			if (dbEntry == ctx.files.end()) {
+				return newFileFound(fileStat, path, relPath);
+			}
+
+			const bool result = check(fileStat, fileRef, path, relPath, dbEntry->second);
+			ctx.files.erase(dbEntry);
+			return result && !isSubtreeDone(relPath, path.end());
+		}
+
+		// Subtrees that the walk resumed is done with are not descended into.
+		bool isSubtreeDone(const char * const relPath, const char * const relPathEnd)
+		{
+			if (!resumed) {
 				return false;
 			}
+			const TextView relPathU8 = mirror::toUtf8(relPath, relPathEnd - relPath, textBuf);
+			return dbRef.getDirProgress(relPathU8.value, relPathU8.size) == mirror::FileDB::DirProgress::subtree;
+		}
+
+		/*
+		 * Advances the merge to the entry given, which follows the ones already merged in the order of names.
+		 * The DB records skipped are missing in the file system. Returns null if the entry is new.
+		 */
+		static const mirror::FileRecord *mergeFile(DirCtx &ctx, const char * const fileNameU8,
+				const std::size_t fileNameSize)
+		{
+			const std::vector<mirror::SortedDirFiles::Entry> &sortedFiles = ctx.sortedFiles.entries;
+			while (ctx.next < sortedFiles.size()) {
+				const mirror::SortedDirFiles::Entry &dbEntry = sortedFiles[ctx.next];
+				int order = std::memcmp(dbEntry.nameU8, fileNameU8, std::min(dbEntry.nameSize, fileNameSize));
+				if (order == 0) {
+					order = dbEntry.nameSize < fileNameSize ? -1 : dbEntry.nameSize > fileNameSize ? 1 : 0;
+				}
+
+				if (order > 0) {
+					return nullptr;
+				}
+				if (order == 0) {
+					++ctx.next;
+					return &dbEntry.record;
+				}
+				ctx.missing.push_back(ctx.next++);
+			}
+			return nullptr;
+		}
 
-			const mirror::FileRecord &expectedFileRecord = dbEntry->second;
+		void fileNotFound(afc::FastStringBuffer<char> &path, const std::size_t relDirOffset,
+				const char * const fileNameU8, const std::size_t fileNameSize, const mirror::FileRecord &record)
+		{
+			const TextView fileName = mirror::fromUtf8(fileNameU8, fileNameSize, textBuf);
+			path.reserve(path.size() + fileName.size);
+			path.append(fileName.value, fileName.size);
+
+			const char * const relPath = path.data() + relDirOffset;
+			if (pipeline) {
+				post(PendingEvent(PendingEvent::Kind::fileNotFound, relPath, path.end() - relPath, record), record);
+			} else {
+				handler.fileNotFound(record.type, relPath, path.end() - relPath, record);
+			}
+
+			path.resize(path.size() - fileName.size);
+		}
+
+		bool newFileFound(const struct stat &fileStat, const afc::FastStringBuffer<char> &path,
+				const char * const relPath)
+		{
+			const FileType type = S_ISDIR(fileStat.st_mode) ? FileType::dir : FileType::file;
+			if (pipeline) {
+				mirror::FileRecord fileRecord;
+				fileRecord.type = type;
+				post(PendingEvent(PendingEvent::Kind::newFileFound, relPath, path.end() - relPath, fileRecord),
+						fileRecord);
+			} else {
+				handler.newFileFound(type, relPath, path.end() - relPath);
+			}
+			return false;
+		}
+
+		// Reports the event once the results of the files submitted to the pipeline earlier are reported.
+		void post(PendingEvent &&event, const mirror::FileRecord &actualFileRecord)
+		{
+			checkpoints.fileSubmitted();
+			pipeline->post(std::move(event), actualFileRecord, checkOp);
+		}
+
+		// Compares the file with its DB record. The record may be gone once this function returns.
+		bool check(const struct stat &fileStat, mirror::_helper::FileRef &fileRef,
+				const afc::FastStringBuffer<char> &path, const char * const relPath,
+				const mirror::FileRecord &expectedFileRecord)
+		{
 			mirror::FileRecord fileRecord;
 
-			if (S_ISREG(fileStat.st_mode)) {
-				mirror::_helper::fillRegularFileRecord(fileStat, fd, path.c_str(), fileRecord);
+			if (S_ISREG(fileStat.st_mode) && quick && !sampler.next()) {
+				// Only the metadata is compared so the digest from the DB is reported as the actual one.
+				mirror::_helper::fillRegularFileMetadata(fileStat, fileRecord);
+				std::copy_n(expectedFileRecord.crc64, sizeof(fileRecord.crc64), fileRecord.crc64);
+			} else if (S_ISREG(fileStat.st_mode) && pipeline) {
+				// The result is reported to the mismatch handler when the digest is ready.
+				checkpoints.fileSubmitted();
+				pipeline->submit(fileRef.release(), fileStat, path.c_str(), path.size(),
+						PendingEvent(PendingEvent::Kind::check, relPath, path.end() - relPath, expectedFileRecord),
+						checkOp);
+				return true;
+			} else if (S_ISREG(fileStat.st_mode)) {
+				mirror::_helper::fillRegularFileRecord(fileStat, fileRef.fd(), path.c_str(), fileRecord, readOptions,
+						&digests);
 			} else {
 				fileRecord.type = FileType::dir;
 			}
 
-			const bool fullMatch = handler.checkFileMismatch(
-					relPath, path.end() - relPath, expectedFileRecord, fileRecord);
-
-			ctxs.top().erase(dbEntry);
+			if (pipeline) {
+				/*
+				 * The result matters only for a directory whose DB record is not a directory, so the events
+				 * pending are delivered to get it only then.
+				 */
+				if (fileRecord.type == expectedFileRecord.type) {
+					post(PendingEvent(PendingEvent::Kind::check, relPath, path.end() - relPath, expectedFileRecord),
+							fileRecord);
+					return true;
+				}
+				pipeline->finish(checkOp);
+			}
 
-			return fullMatch;
+			return handler.checkFileMismatch(relPath, path.end() - relPath, expectedFileRecord, fileRecord);
 		}
 
-		mirror::DirSet dbDirs;
-		std::stack<mirror::DirFileMap> ctxs;
 		mirror::FileDB &dbRef;
 		MismatchHandler &handler;
-	} eventHandler(db, mismatchHandler);
+		mirror::_helper::DirCheckpoints checkpoints;
+		CheckOp checkOp;
+		std::unique_ptr<mirror::HashPipeline<PendingEvent>> pipeline;
+		const bool quick;
+		const bool mergeJoin;
+		// True if the walk is resumed from the checkpoints in the DB.
+		const bool resumed;
+		const bool subtrees;
+		mirror::_helper::FileSampler sampler;
+		const ReadOptions &readOptions;
+		// Used if files are hashed by this thread rather than by pipeline.
+		mirror::DigestCache digests;
+		// Shared by all the directories since the handler is never called concurrently.
+		std::string textBuf;
+	};
+
+	// Names in other charsets are not ordered the same way as their UTF-8 forms in the DB.
+	const bool mergeJoin = options.mergeJoin && mirror::isSystemEncodingUtf8();
+	if (options.mergeJoin && !mergeJoin) {
+		logDebug("File names are not in UTF-8, matching them with the DB through a hash map..."_s);
+	}
+
+	assert(!options.resume || options.checkpointInterval != 0);
+
+	std::string subtreeU8;
+	if (options.walk.subtreeSize != 0) {
+		mirror::assignUtf8(subtreeU8, options.walk.subtree, options.walk.subtreeSize);
+	}
+
+	bool resumed = false;
+	if (options.checkpointInterval != 0) {
+		std::string rootDirU8;
+		mirror::assignUtf8(rootDirU8, rootDir, rootDirSize);
+		// A check of a subtree is resumed only by the check of the same subtree.
+		if (!subtreeU8.empty()) {
+			rootDirU8 += '/';
+			rootDirU8 += subtreeU8;
+		}
+		resumed = db.beginCheckpoints(u8"check", rootDirU8.data(), rootDirU8.size(),
+				std::chrono::seconds(options.checkpointInterval), options.resume);
+		if (options.resume && !resumed) {
+			throw std::runtime_error("There is no interrupted check of this directory to resume.");
+		}
+	}
+
+	EventHandler eventHandler(db, mismatchHandler, options, mergeJoin, resumed);
+
+	WalkOptions walkOptions = options.walk;
+	walkOptions.sortByName = mergeJoin;
+
+	// The checkpoints are committed within the transaction by FileDB::markDirDone().
+	bool transaction = false;
+	db.beginDirTracking(subtreeU8.data(), subtreeU8.size());
+	try {
+		if (resumed) {
+			db.markDoneDirsVisited();
+		}
+		if (options.checkpointInterval != 0) {
+			db.beginTransaction();
+			transaction = true;
+		}
+
+		mirror::_helper::scanFiles(rootDir, rootDirSize, eventHandler, walkOptions);
+
+		if (eventHandler.pipeline) {
+			eventHandler.pipeline->finish(eventHandler.checkOp);
+		}
+
+		// TODO pass errors to the caller.
+		const char *missingDirU8;
+		std::size_t missingDirSize;
+		while (db.nextUnvisitedDir(missingDirU8, missingDirSize)) {
+			logDebug("DB dir not found in the file system: '"_s, Utf8ToSystemView(missingDirU8, missingDirSize),
+					"'..."_s);
+		}
+	}
+	catch (const mirror::Interrupted &) {
+		if (transaction) {
+			// The directories that are checked are kept for the walk to be resumed.
+			db.commit();
+		}
+		if (options.checkpointInterval != 0) {
+			db.endCheckpoints(false);
+		}
+		db.endDirTracking();
+		throw;
+	}
+	catch (...) {
+		// The error the check has failed with is the one reported, whatever happens to the DB afterwards.
+		try {
+			if (transaction) {
+				// Nothing is committed since the DB itself could be the cause of the error.
+				db.rollback();
+			}
+			if (options.checkpointInterval != 0) {
+				db.endCheckpoints(false);
+			}
+			db.endDirTracking();
+		}
+		catch (...) {
+			// TODO handle error.
+		}
+		throw;
+	}
+	if (options.checkpointInterval != 0) {
+		db.commit();
+		db.endCheckpoints(true);
+	}
+	db.endDirTracking();
+}
 
-	mirror::_helper::scanFiles(rootDir, rootDirSize, eventHandler);
+template<typename MismatchHandler>
+void mirror::compareDBs(mirror::FileDB &expected, mirror::FileDB &actual, MismatchHandler &mismatchHandler)
+{
+	using afc::operator"" _s;
+	using mirror::logger::logDebug;
 
-	// TODO pass errors to the caller.
-	for (const PathKey &missingDir : eventHandler.dbDirs) {
-		logDebug("DB dir not found in the file system: '"_s,
-				Utf8ToSystemView(missingDir.data, missingDir.size), "'..."_s);
+	// Neither DB is written to, so that they can be read-only.
+	if (!expected.hasDirDigests()) {
+		throw std::runtime_error("The DB has no directory digests. update-db calculates them.");
+	}
+	if (!actual.hasDirDigests()) {
+		throw std::runtime_error("The DB to compare with has no directory digests. update-db calculates them.");
 	}
 
-	assert(eventHandler.ctxs.empty());
+	unsigned char expectedDigest[sizeof(mirror::FileRecord::crc64)];
+	unsigned char actualDigest[sizeof(mirror::FileRecord::crc64)];
+	auto sameDigests = [&](const std::string &dirU8) -> bool
+	{
+		return expected.getDirDigest(dirU8.data(), dirU8.size(), expectedDigest) &&
+				actual.getDirDigest(dirU8.data(), dirU8.size(), actualDigest) &&
+				std::equal(expectedDigest, expectedDigest + sizeof(expectedDigest), actualDigest);
+	};
+
+	// The directories to compare, the root being the empty path.
+	std::vector<std::string> dirs(1);
+	if (sameDigests(dirs.back())) {
+		logDebug("The DBs are the same."_s);
+		return;
+	}
+
+	mirror::SortedDirFiles expectedFiles;
+	mirror::SortedDirFiles actualFiles;
+	std::vector<std::string> subdirs;
+	std::string pathU8;
+	std::string textBuf;
+	while (!dirs.empty()) {
+		const std::string dirU8 = std::move(dirs.back());
+		dirs.pop_back();
+		logDebug("Comparing the dir '"_s, Utf8ToSystemView(dirU8.data(), dirU8.size()), "'..."_s);
+
+		expectedFiles.entries.clear();
+		expectedFiles.names.clear();
+		actualFiles.entries.clear();
+		actualFiles.names.clear();
+		expected.getFiles(dirU8.data(), dirU8.size(), expectedFiles);
+		actual.getFiles(dirU8.data(), dirU8.size(), actualFiles);
+
+		// Both listings are in the order of names so they are merged.
+		const std::vector<mirror::SortedDirFiles::Entry> &e = expectedFiles.entries;
+		const std::vector<mirror::SortedDirFiles::Entry> &a = actualFiles.entries;
+		std::size_t i = 0, j = 0;
+		while (i < e.size() || j < a.size()) {
+			int order;
+			if (i == e.size()) {
+				order = 1;
+			} else if (j == a.size()) {
+				order = -1;
+			} else {
+				order = std::memcmp(e[i].nameU8, a[j].nameU8, std::min(e[i].nameSize, a[j].nameSize));
+				if (order == 0) {
+					order = e[i].nameSize < a[j].nameSize ? -1 : e[i].nameSize > a[j].nameSize ? 1 : 0;
+				}
+			}
+
+			const mirror::SortedDirFiles::Entry &entry = order <= 0 ? e[i] : a[j];
+			pathU8.assign(dirU8);
+			if (!dirU8.empty()) {
+				pathU8 += '/';
+			}
+			pathU8.append(entry.nameU8, entry.nameSize);
+			const TextView path = mirror::fromUtf8(pathU8.data(), pathU8.size(), textBuf);
+
+			if (order < 0) {
+				mismatchHandler.fileNotFound(e[i].record.type, path.value, path.size, e[i].record);
+				++i;
+				continue;
+			}
+			if (order > 0) {
+				mismatchHandler.newFileFound(a[j].record.type, path.value, path.size);
+				++j;
+				continue;
+			}
+
+			if (e[i].record.type == mirror::FileType::dir && a[j].record.type == mirror::FileType::dir) {
+				if (!sameDigests(pathU8)) {
+					subdirs.push_back(pathU8);
+				}
+			} else {
+				// Only the timestamp from the expected DB is reported so that it is never a mismatch.
+				mirror::FileRecord actualRecord = a[j].record;
+				actualRecord.lastModifiedTS = e[i].record.lastModifiedTS;
+				mismatchHandler.checkFileMismatch(path.value, path.size, e[i].record, actualRecord);
+			}
+			++i;
+			++j;
+		}
+
+		// The subdirectories are compared in the order of their names.
+		for (auto it = subdirs.rbegin(); it != subdirs.rend(); ++it) {
+			dirs.push_back(std::move(*it));
+		}
+		subdirs.clear();
+	}
 }
 
 template<typename ChunkOp>
-inline void mirror::_helper::processFile(const int fd, const char * const path, ChunkOp &chunkOp)
+inline void mirror::_helper::processFile(const int fd, const char * const path, ChunkOp &chunkOp,
+		const ReadOptions &options)
 {
-	unsigned char buf[4096];
+	// Hints are advisory so their failures are ignored.
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	const std::size_t bufSize = options.blockSize;
+	unsigned char * const buf = threadReadBuffer(bufSize);
 	for (;;) {
-		const ssize_t n = read(fd, buf, 4096);
+		ssize_t n;
+		{
+			const mirror::stats::PhaseTimer timer(mirror::stats::Phase::read);
+			n = read(fd, buf, bufSize);
+		}
+		if (n == 0) {
+			break;
+		} else if (n == -1) {
+			handleReadFileError(errno);
+		} else {
+			mirror::stats::countBytes(static_cast<std::uint64_t>(n));
+			chunkOp(buf, n);
+		}
+	}
+
+	if (options.dropCache) {
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	}
+}
+
+template<typename ChunkOp>
+inline void mirror::_helper::processFileRange(const int fd, const off_t offset, std::uint64_t size, ChunkOp &chunkOp,
+		const ReadOptions &options)
+{
+	const std::size_t bufSize = options.blockSize;
+	unsigned char * const buf = threadReadBuffer(bufSize);
+	off_t pos = offset;
+	while (size > 0) {
+		const std::size_t toRead = size < bufSize ? static_cast<std::size_t>(size) : bufSize;
+		ssize_t n;
+		{
+			const mirror::stats::PhaseTimer timer(mirror::stats::Phase::read);
+			n = pread(fd, buf, toRead, pos);
+		}
 		if (n == 0) {
 			break;
 		} else if (n == -1) {
 			handleReadFileError(errno);
 		} else {
+			mirror::stats::countBytes(static_cast<std::uint64_t>(n));
 			chunkOp(buf, n);
+			pos += n;
+			size -= static_cast<std::uint64_t>(n);
 		}
 	}
+
+	if (options.dropCache) {
+		posix_fadvise(fd, offset, pos - offset, POSIX_FADV_DONTNEED);
+	}
 }
 
 // TODO think of using char[PATH_MAX] for path instead of dynamic buffer
 template<typename EventHandler>
-void mirror::_helper::scanFiles(afc::FastStringBuffer<char> &path, EventHandler &eventHandler)
+void mirror::_helper::scanFiles(afc::FastStringBuffer<char> &path, EventHandler &eventHandler,
+		const WalkOptions &options)
 {
 	int dirFd = open(path.c_str(), O_RDONLY | O_NOFOLLOW | O_DIRECTORY);
 	if (dirFd == -1) {
@@ -518,118 +1816,285 @@ void mirror::_helper::scanFiles(afc::FastStringBuffer<char> &path, EventHandler
 		throw errno;
 	}
 
-	scanFiles(path, dirFd, eventHandler); // dirFd is closed here.
+	scanFiles(path, dirFd, eventHandler, options); // dirFd is closed here.
 }
 
 // TODO think of using char[PATH_MAX] for path instead of dynamic buffer
 template<typename EventHandler>
-void mirror::_helper::scanFiles(afc::FastStringBuffer<char> &path, const int fd, EventHandler &eventHandler)
+void mirror::_helper::scanFiles(afc::FastStringBuffer<char> &path, const int fd, EventHandler &eventHandler,
+		const WalkOptions &options)
 {
+	if (options.walkers > 1) {
+		scanFilesInParallel(path, fd, eventHandler, options);
+		return;
+	}
+
 	struct Ctx
 	{
-		Ctx(DIR * const dir, const int fd, const std::size_t dirNameSize) : dir(dir), fd(fd), dirNameSize(dirNameSize) {}
+		Ctx(const int fd, const std::size_t dirNameSize) : fd(fd), dirNameSize(dirNameSize), next(0), dirCtx() {}
 
-		DIR *dir;
 		int fd;
 		std::size_t dirNameSize;
+		// The index of the next entry in the listing of this dir to report.
+		std::size_t next;
+		typename EventHandler::DirCtx dirCtx;
 	};
 
-	std::stack<Ctx> ctxs;
+	const DirOrder order = dirOrder(options);
+	std::vector<Ctx> ctxs;
+	/* The listing of each dir in ctxs, at the same index. Listings are kept when dirs are left so that
+	 * their memory is reused by sibling dirs at the same depth.
+	 */
+	std::vector<DirListing> listings;
 
-	int dirFd = fd;
-	DIR *dir = startDirScanning(path, path.size(), dirFd, eventHandler);
-	std::size_t dirNameSize;
+	listings.emplace_back();
+	ctxs.emplace_back(fd, 0);
+	startDirScanning(path, path.size() - options.subtreeSize, fd, listings[0], order, eventHandler, ctxs[0].dirCtx);
 
 	// Must follow the first invocation of startDirScanning() to skip slash this function appends to path.
-	const std::size_t relPathOffset = path.size();
+	const std::size_t relPathOffset = options.subtreeSize == 0 ? path.size() : path.size() - 1 - options.subtreeSize;
 
-	dirStart: for (;;) {
-		dirent file;
-		dirent *readdirEnd;
-		int status;
-		while ((status = readdir_r(dir, &file, &readdirEnd)) == 0) {
-			if (readdirEnd == nullptr) {
-				goto end;
-			}
+	while (!ctxs.empty()) {
+		Ctx &ctx = ctxs.back();
+		const DirListing &listing = listings[ctxs.size() - 1];
 
-			register const char * const name = file.d_name;
+		if (ctx.next == listing.size()) {
+			// TODO call close even if an error occurs.
+			close(ctx.fd);
 
-			if (name[0] == '.') {
-				if (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')) {
-					// Either the current dir or the parent dir. Skipping it.
-					continue;
-				}
-			}
+			eventHandler.dirEnd(ctx.dirCtx, path, relPathOffset);
 
-			const int fd = openat(dirFd, name, O_RDONLY);
-			if (fd == -1) {
-				mirror::_helper::handleOpenFileError(errno);
+			const std::size_t dirNameSize = ctx.dirNameSize;
+			ctxs.pop_back();
+			if (!ctxs.empty()) {
+				// Removing the dir name together with the trailing slash.
+				path.resize(path.size() - dirNameSize - 1);
 			}
-			const std::size_t nameSize = std::strlen(name);
-			path.reserve(path.size() + nameSize);
-			path.append(name, nameSize);
+			continue;
+		}
+
+		const DirListing::Entry &entry = listing[ctx.next++];
+		const int dirFd = ctx.fd;
+		const char * const name = listing.name(entry);
+		const std::size_t nameSize = entry.nameSize;
 
-			struct stat fileStat;
-			const int result = fstat(fd, &fileStat);
-			if (result != 0) {
-				switch (errno) {
-				case EACCES:
-					// TODO make the behaviour configurable.
-					logDebug("No access to '"_s, path, '\'');
+		path.reserve(path.size() + nameSize);
+		path.append(name, nameSize);
+
+		struct stat fileStat;
+		if (statDirEntry(dirFd, entry, name, path, fileStat)) {
+			FileRef fileRef(dirFd, name);
+			// TODO handle error
+			const bool success = eventHandler.file(ctx.dirCtx, fileStat, fileRef, path, relPathOffset,
+					path.size() - nameSize);
+
+			if (S_ISDIR(fileStat.st_mode)) {
+				if (success) { // If the dir is invalid for some reason then there's no need to go deeper.
+					const int subdirFd = fileRef.release();
+					if (listings.size() == ctxs.size()) {
+						listings.emplace_back();
+					}
+					// ctx and listing are not valid after this point.
+					ctxs.emplace_back(subdirFd, nameSize);
+					startDirScanning(path, relPathOffset, subdirFd, listings[ctxs.size() - 1], order,
+							eventHandler, ctxs.back().dirCtx);
 					continue;
-				default:
-					// TODO handle error
-					logDebug(errno);
-					throw errno;
 				}
 			}
+		}
 
-			if (S_ISREG(fileStat.st_mode) || S_ISDIR(fileStat.st_mode)) {
-				// TODO handle error
-				const bool success = eventHandler.file(fileStat, fd, path, relPathOffset, path.size() - nameSize);
+		// Rolling back the dir path buffer to the current dir with slash.
+		path.resize(path.size() - nameSize);
+	}
+}
+
+template<typename EventHandler>
+void mirror::_helper::scanFilesInParallel(afc::FastStringBuffer<char> &rootPath, const int fd,
+		EventHandler &eventHandler, const WalkOptions &options)
+{
+	using afc::operator"" _s;
+	using afc::logger::logError;
+
+	assert(options.walkers > 1);
+
+	WalkScheduler scheduler(options.walkers);
+	// Serialises the calls to the event handler.
+	std::mutex eventMutex;
+	const std::size_t rootPathSize = rootPath.size();
+	const std::size_t relPathOffset = options.subtreeSize == 0 ? rootPathSize + 1 : rootPathSize - options.subtreeSize;
 
-				if (S_ISDIR(fileStat.st_mode)) {
-					if (success) { // If the dir is invalid for some reason then there's no need to go deeper.
-						ctxs.emplace(dir, dirFd, dirNameSize);
+	scheduler.push(0, DirTask(fd, rootPath.data(), rootPathSize));
 
-						dir = startDirScanning(path, relPathOffset, fd, eventHandler);
-						dirFd = fd;
-						dirNameSize = nameSize;
+	auto walk = [&](const unsigned walker)
+	{
+		try {
+			afc::FastStringBuffer<char> path(relPathOffset);
+			DirListing listing;
+			DirTask task;
+
+			while (scheduler.next(walker, task)) {
+				path.resize(0);
+				path.reserve(task.path.size());
+				path.append(task.path.data(), task.path.size());
+
+				int dirFd = task.fd;
+				if (dirFd == -1) {
+					const int flags = O_RDONLY | O_DIRECTORY | (task.link ? 0 : O_NOFOLLOW);
+					if (task.parent) {
+						const char * const name = task.path.data() + task.path.rfind('/') + 1;
+						dirFd = openat(task.parent->fd(), name, flags);
+					} else {
+						dirFd = open(path.c_str(), flags);
+					}
+					task.parent.reset();
+
+					// The directory could be gone or replaced with another file since it is listed.
+					bool replaced;
+					if (dirFd == -1) {
+						if (errno != ENOENT && errno != ENOTDIR && errno != ELOOP) {
+							mirror::_helper::handleOpenFileError(errno);
+						}
+						replaced = true;
+					} else {
+						struct stat dirStat;
+						if (fstat(dirFd, &dirStat) != 0) {
+							const int errorCode = errno;
+							// TODO handle error.
+							close(dirFd);
+							throw errorCode;
+						}
+						replaced = dirStat.st_dev != task.dev || dirStat.st_ino != task.ino;
+						if (replaced) {
+							// TODO handle error.
+							close(dirFd);
+						}
+					}
+					if (replaced) {
+						logError("The directory '"_s, path, "' is changed since it is listed. Skipping it..."_s);
+						scheduler.taskDone();
+						continue;
+					}
+				}
+				task.fd = -1;
+				task.parent.reset();
+
+				typename EventHandler::DirCtx dirCtx;
+				// Set once the directory is to be kept open for the tasks of its subdirectories.
+				std::shared_ptr<SharedDir> sharedDir;
+
+				listDir(path, dirFd, listing, dirOrder(options));
+				try {
+					{
+						std::lock_guard<std::mutex> lock(eventMutex);
+						// The root dir is reported with the empty relative path, or with the subtree walked.
+						eventHandler.dirStart(dirCtx, path, std::min(path.size(), relPathOffset));
+					}
+					path.reserveForOne();
+					path.append('/');
+
+					for (const DirListing::Entry &entry : listing) {
+						const char * const name = listing.name(entry);
+						const std::size_t nameSize = entry.nameSize;
+
+						path.reserve(path.size() + nameSize);
+						path.append(name, nameSize);
+
+						struct stat fileStat;
+						if (statDirEntry(dirFd, entry, name, path, fileStat)) {
+							FileRef fileRef(dirFd, name);
+							bool success;
+							{
+								std::lock_guard<std::mutex> lock(eventMutex);
+								// TODO handle error
+								success = eventHandler.file(dirCtx, fileStat, fileRef, path, relPathOffset,
+										path.size() - nameSize);
+							}
+
+							if (S_ISDIR(fileStat.st_mode) && success) {
+								/*
+								 * Subdirectories are opened by path when they are scanned so that queued
+								 * tasks do not hold file descriptors. The ones whose paths are too long for
+								 * this are opened relative to this directory, which is kept open for them.
+								 */
+								DirTask subdirTask(-1, path.data(), path.size());
+								// A link to a directory is stat'ed through already; a directory itself is not.
+								struct stat dirStat = fileStat;
+								subdirTask.link = entry.type != DT_DIR;
+								if (!subdirTask.link && fstatat(dirFd, name, &dirStat, AT_SYMLINK_NOFOLLOW) != 0) {
+									if (errno != ENOENT) {
+										// TODO handle error
+										throw errno;
+									}
+									logError("The directory '"_s, path, "' is gone since it is listed. "
+											"Skipping it..."_s);
+									path.resize(path.size() - nameSize);
+									continue;
+								}
+								subdirTask.dev = dirStat.st_dev;
+								subdirTask.ino = dirStat.st_ino;
+								if (path.size() >= PATH_MAX) {
+									if (!sharedDir) {
+										sharedDir = std::make_shared<SharedDir>(dirFd);
+									}
+									subdirTask.parent = sharedDir;
+								}
+								scheduler.push(walker, std::move(subdirTask));
+							}
+						}
+
+						// Rolling back the dir path buffer to the current dir with slash.
+						path.resize(path.size() - nameSize);
+					}
 
-						goto dirStart;
+					{
+						std::lock_guard<std::mutex> lock(eventMutex);
+						eventHandler.dirEnd(dirCtx, path, relPathOffset);
 					}
 				}
-			} else {
-				// TODO support non-regular and non-directory files.
-				logDebug("The file '"_s, name, "' is neither a directory or a regular file. Skipping it..."_s);
-			}
+				catch (...) {
+					if (!sharedDir) {
+						// TODO handle error.
+						close(dirFd);
+					}
+					throw;
+				}
 
-			if (close(fd) != 0) { // directory file descriptors are closed by closedir().
-				// TODO handle error.
-				throw errno;
+				if (!sharedDir) {
+					// TODO handle error.
+					close(dirFd);
+				}
+				// Otherwise the directory is closed by the last of the tasks that refer to it.
+				sharedDir.reset();
+				scheduler.taskDone();
 			}
-
-			// Rolling back the dir path buffer to the current dir with slash.
-			path.resize(path.size() - nameSize);
 		}
+		catch (...) {
+			scheduler.abort(std::current_exception());
+		}
+	};
 
-	end:
-		// TODO call closedir even if an error occurs.
-		closedir(dir); // closes the file descriptor, too.
-
-		eventHandler.dirEnd(path, relPathOffset);
-
-		if (ctxs.empty()) {
-			break;
+	std::vector<std::thread> walkers;
+	walkers.reserve(options.walkers - 1);
+	try {
+		for (unsigned i = 1; i < options.walkers; ++i) {
+			walkers.emplace_back(walk, i);
 		}
+	}
+	catch (...) {
+		scheduler.abort(std::current_exception());
+	}
+	walk(0);
+	for (std::thread &walker : walkers) {
+		walker.join();
+	}
 
-		// Removing the trailing slash.
-		path.resize(path.size() - dirNameSize - 1);
+	// The path is left as scanFiles() leaves it: the root dir with slash.
+	rootPath.reserveForOne();
+	rootPath.append('/');
 
-		dir = ctxs.top().dir;
-		dirFd = ctxs.top().fd;
-		dirNameSize = ctxs.top().dirNameSize;
-		ctxs.pop();
+	const std::exception_ptr error = scheduler.error();
+	if (error) {
+		std::rethrow_exception(error);
 	}
 }
 